@@ -268,6 +268,7 @@ static inline struct block_device *blkdev_get_by_path(const char *path, fmode_t
 #define end_unaligned_free(B,E) end_unaligned_free(B)
 #define eio_split_endio(B,E) eio_split_endio(B)
 #define eio_bio_end_empty_barrier(B,E) eio_bio_end_empty_barrier(B)
+#define eio_prefetch_endio(B,E) eio_prefetch_endio(B)
 #define EIO_ENDIO_FN_START int error __maybe_unused = bio->bi_error
 #else
 #define EIO_BIO_ENDIO(B,E) do { bio_endio(B,E); } while (0)
@@ -55,10 +55,13 @@
 #include <linux/device-mapper.h>
 #include <linux/dm-kcopyd.h>
 #include <linux/sort.h>         /* required for eio_subr.c */
+#include <linux/list_sort.h>    /* required for md update batching */
 #include <linux/kthread.h>
 #include <linux/jiffies.h>
 #include <linux/vmalloc.h>      /* for sysinfo (mem) variables */
 #include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/seqlock.h>      /* for the lockless read hits */
 #include <scsi/scsi_device.h>   /* required for SSD failure handling */
 /* resolve conflict with scsi/scsi_device.h */
 #include "compat.h"
@@ -219,12 +222,17 @@ extern mempool_t *_job_pool;
 #define CACHE_MD_STATE_FASTCLEAN        0xcafebabf
 #define CACHE_MD_STATE_UNSTABLE         0xdeaddeee
 
-/* Do we have a read cache or a read-write cache */
+/*
+ * Do we have a read cache or a read-write cache. Read-only caches are
+ * write-around: writes go to HDD and invalidate the blocks they hit.
+ * Update-on-hit caches write to SSD too the writes hitting cached blocks.
+ */
 #define CACHE_MODE_WB           1
 #define CACHE_MODE_RO           2
 #define CACHE_MODE_WT           3
+#define CACHE_MODE_UH           4
 #define CACHE_MODE_FIRST        CACHE_MODE_WB
-#define CACHE_MODE_LAST         CACHE_MODE_WT
+#define CACHE_MODE_LAST         CACHE_MODE_UH
 #define CACHE_MODE_DEFAULT      CACHE_MODE_WT
 
 #define DEV_PATHLEN             128
@@ -239,8 +247,11 @@ extern mempool_t *_job_pool;
 #define EIO_BAD_MAGIC           0xBADCAC6E
 
 /* EIO version */
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          5       /* kernel superblock version */
 #define EIO_SB_MAGIC_VERSION    3       /* version in which magic number was introduced */
+#define EIO_SB_RANK_VERSION     4       /* version in which the policy ranks were introduced */
+#define EIO_SB_STRIPE_VERSION   5       /* version in which caches got striped over SSDs */
+#define EIO_SB_COMPAT_VERSION   3       /* oldest version with the current md layout */
 
 union eio_superblock {
 	struct superblock_fields {
@@ -269,6 +280,10 @@ union eio_superblock {
 		__le32 cache_wronly;
 		__le32 time_based_clean_interval;
 		__le32 autoclean_threshold;
+		__le64 cache_rank_start_sect;   /* policy ranks start (4K aligned), 0 if none */
+		__le32 cache_rank_saved;        /* ranks written at the last shutdown */
+		__le32 cache_nr_ssds;           /* SSDs the cache is striped over */
+		__le32 cache_ssd_index;         /* index of this SSD among them */
 	} sbf;
 	u_int8_t padding[EIO_SUPERBLOCK_SIZE];
 };
@@ -284,7 +299,10 @@ union eio_superblock {
  * +--------+--+--------+---------+---+--------+---------+
  * | unused |SB| align1 |metadata | Z | align2 | data... |
  * +--------+--+--------+---------+---+--------+---------+
- * <------------- dmc->md_sectors ------------>
+ * <--------- ssd->ssd_data_start_sect ------->
+ *
+ * A cache striped over several SSDs has this layout on each of them,
+ * for the sets it holds (see eio_set_ssd()).
  */
 #define EIO_UNUSED_SECTORS              128
 #define EIO_SUPERBLOCK_SECTORS          8
@@ -302,6 +320,16 @@ union eio_superblock {
 						 EIO_REDZONE_SECTORS + \
 						 EIO_ALIGN2_SECTORS(md_sects))
 
+/*
+ * Caches created without CACHE_FLAGS_NO_POLICY_RANKS keep a byte per
+ * block after the metadata, the rank of the block in the eviction order
+ * of its set (see eio_policy.h). It is written at shutdown with the md,
+ * and restored on a reload after a clean shutdown.
+ *
+ * | metadata | align | ranks | Z | align2 | data... |
+ */
+#define EIO_RANK_SECTORS(nr_blocks)             (EIO_DIV((nr_blocks) + 4095, 4096) * 8)
+
 /*
  * We do metadata updates only when a block trasitions from DIRTY -> CLEAN
  * or from CLEAN -> DIRTY. Consequently, on an unclean shutdown, we only
@@ -348,6 +376,7 @@ struct flash_cacheblock {
 #define MD_BLOCKS_PER_PAGE                      ((PAGE_SIZE) / sizeof(struct flash_cacheblock))
 #define INDEX_TO_MD_PAGE(INDEX)                 ((INDEX) / MD_BLOCKS_PER_PAGE)
 #define INDEX_TO_MD_PAGE_OFFSET(INDEX)          ((INDEX) % MD_BLOCKS_PER_PAGE)
+#define EIO_MD_PAGES_MAX                        IO_PAGE_COUNT(EIO_MAX_ASSOC * sizeof(struct flash_cacheblock))
 
 #define MD_BLOCKS_PER_SECTOR                    (512 / (sizeof(struct flash_cacheblock)))
 #define INDEX_TO_MD_SECTOR(INDEX)               (EIO_DIV((INDEX), MD_BLOCKS_PER_SECTOR))
@@ -356,6 +385,7 @@ struct flash_cacheblock {
 
 #define METADATA_IO_BLOCKSIZE                   (256 * 1024)
 #define METADATA_IO_BLOCKSIZE_SECT              (METADATA_IO_BLOCKSIZE / 512)
+#define MD_LOAD_CHUNKS                          8       /* md chunks in flight during md load */
 #define SECTORS_PER_PAGE                        ((PAGE_SIZE) / 512)
 
 /* In bytes: */
@@ -379,8 +409,9 @@ struct flash_cacheblock {
 #define CACHE_REPL_FIFO         1
 #define CACHE_REPL_LRU          2
 #define CACHE_REPL_RANDOM       3
+#define CACHE_REPL_2Q           4
 #define CACHE_REPL_FIRST        CACHE_REPL_FIFO
-#define CACHE_REPL_LAST         CACHE_REPL_RANDOM
+#define CACHE_REPL_LAST         CACHE_REPL_2Q
 #define CACHE_REPL_DEFAULT      CACHE_REPL_FIFO
 
 struct eio_policy_and_name {
@@ -393,6 +424,7 @@ static const struct eio_policy_and_name eio_policy_names[] = {
 	{ CACHE_REPL_FIFO,   "fifo" },
 	{ CACHE_REPL_LRU,    "lru"  },
 	{ CACHE_REPL_RANDOM, "rand" },
+	{ CACHE_REPL_2Q,     "2q"   },
 };
 
 
@@ -432,12 +464,21 @@ static const struct eio_policy_and_name eio_policy_names[] = {
 #define CACHE_FLAGS_SHUTDOWN_INPROG     (1 << 8)
 #define CACHE_FLAGS_MOD_INPROG          (1 << 9)        /* cache modification such as edit/delete in progress */
 #define CACHE_FLAGS_DELETED             (1 << 10)
+#define CACHE_FLAGS_MD_LOADING          (1 << 11)       /* md being loaded in the background */
+#define CACHE_FLAGS_MD6                 (1 << 12)       /* using 6-byte metadata (instead of 4-byte md) */
+#define CACHE_FLAGS_LAZY_MD_LOAD        (1 << 13)       /* clean reloads load the md in the background */
+#define CACHE_FLAGS_MD_MEM_LOCAL        (1 << 14)       /* EIO_MEM_LOCAL in-core md */
+#define CACHE_FLAGS_MD_MEM_INTERLEAVE   (1 << 15)       /* EIO_MEM_INTERLEAVE in-core md */
+#define CACHE_FLAGS_NO_POLICY_RANKS     (1 << 16)       /* no space for the policy ranks */
+#define CACHE_FLAGS_SUB_BLOCK           (1 << 17)       /* valid sectors of the blocks kept in sub_valid */
 #define CACHE_FLAGS_INCORE_ONLY         (CACHE_FLAGS_DEGRADED |		\
 					 CACHE_FLAGS_SSD_ADD_INPROG |	\
 					 CACHE_FLAGS_FAILED |		\
 					 CACHE_FLAGS_SHUTDOWN_INPROG |	\
 					 CACHE_FLAGS_MOD_INPROG |	\
 					 CACHE_FLAGS_STALE |		\
+					 CACHE_FLAGS_MD_LOADING |	\
+					 CACHE_FLAGS_MD6 |		\
 					 CACHE_FLAGS_DELETED)   /* need a proper definition */
 
 /* flags that govern cold/warm enable after reboot */
@@ -464,7 +505,7 @@ enum dev_notifier {
  * Subsection 3.1: Definitions.
  */
 
-#define EIO_SB_VERSION          3       /* kernel superblock version */
+#define EIO_SB_VERSION          5       /* kernel superblock version */
 
 /* kcached/pending job states */
 #define READCACHE               1
@@ -500,6 +541,35 @@ enum dev_notifier {
 #define AUTOCLEAN_THRESH_DEF            128     /* Number of I/Os which puts a hold on time based cleaning */
 #define AUTOCLEAN_THRESH_MAX            1024    /* Number of I/Os which puts a hold on time based cleaning */
 
+#define SEQ_IO_THRESHOLD_KB_DEF         0       /* Contiguous KB after which a stream bypasses the cache, 0 => off */
+#define SEQ_IO_THRESHOLD_KB_MAX         (1024 * 1024)
+#define EIO_SEQ_STREAMS                 16      /* Number of sequential streams tracked per cache */
+
+#define EIO_READFILL_BATCH_MAX          256     /* Fills sorted and issued under one plug */
+
+#define FAST_READ_DEF                   1       /* Look clean read hits up without the set lock */
+
+#define HEAT_SAMPLE_DEF                 64      /* One lookup in this many counted in the heat map, 0 => off */
+#define HEAT_SAMPLE_MAX                 (1024 * 1024)
+
+#define ADMIT_THRESHOLD_DEF             0       /* Read misses of a block before it is filled, 0 => fill every miss */
+#define ADMIT_THRESHOLD_MAX             15
+#define EIO_ADMIT_COUNTERS_MIN          (1 << 12)
+#define EIO_ADMIT_COUNTERS_MAX          (1 << 24)
+
+#define MD_BATCH_DELAY_MS_DEF           0       /* Max delay of a md update to batch it with others, 0 => off */
+#define MD_BATCH_DELAY_MS_MAX           100
+#define EIO_MD_BATCH_MAX                64      /* Pending md updates that force a batch out */
+
+#define CLEAN_TARGET_LAT_US_DEF         0       /* Foreground latency the cleaner adapts to, 0 => off */
+#define CLEAN_TARGET_LAT_US_MAX         (1000 * 1000)
+#define CLEAN_DEPTH_MAX                 32      /* Max hdd writes in flight per adaptive set clean */
+#define CLEAN_BATCH_MAX                 16      /* Max sets cleaned between two rate adjustments */
+#define CLEAN_BACKOFF_MS                10      /* Cleaner pause above target at the minimum rate */
+#define CLEAN_SORT_SETS_DEF             0       /* Sets flushed together in disk sector order, 0 or 1 => off */
+#define CLEAN_SORT_SETS_MAX             16
+#define EIO_LAT_EWMA_SHIFT              3       /* fg_lat_ewma weight of a new sample is 1/8 */
+
 /* Inject a 5s delay between cleaning blocks and metadata */
 #define CLEAN_REMOVE_DELAY      5000
 
@@ -563,6 +633,48 @@ struct cacheblock_md8 {
 #define EIO_MD8_INVALID                 (((u_int64_t)INVALID) << EIO_MD8_DBN_BITS)
 #define EIO_MD8(dmc)                    CACHE_MD8_IS_SET(dmc)
 
+/*
+ * 6-byte metadata support, for sources too big for the 4-byte md.
+ * It holds a 40-bit shrunk dbn, see eio_shrink_dbn().
+ */
+struct cacheblock_md6 {
+	u_int32_t dbn_lo;
+	u_int8_t dbn_hi;
+	u_int8_t cache_state;
+} __attribute__ ((packed));
+
+#define EIO_MD6_DBN_BITS                (48 - 8)        /* 8 bits for state */
+#define EIO_MD6_DBN_MASK                ((((u_int64_t)1) << EIO_MD6_DBN_BITS) - 1)
+#define EIO_MD6(dmc)                    CACHE_MD6_IS_SET(dmc)
+
+#define EIO_MD_ENTRY_SIZE(dmc)          (EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) : \
+					 EIO_MD6(dmc) ? sizeof(struct cacheblock_md6) : \
+					 sizeof(struct cacheblock))
+
+/*
+ * Allocation modes of the in-core block md, see eio_md_alloc(). The
+ * mode of a cache is a create option, kept in the CACHE_FLAGS_MD_MEM_*.
+ * Chunked modes put the md in physically contiguous chunks of up to
+ * EIO_MD_CHUNK_SIZE, served by the huge page kernel mapping.
+ */
+#define EIO_MEM_VMALLOC                 0       /* a single vmalloc area */
+#define EIO_MEM_LOCAL                   1       /* chunks on the node creating the cache */
+#define EIO_MEM_INTERLEAVE              2       /* chunks spread over the nodes with cpus */
+#define EIO_MD_CHUNK_ORDER              min(10, MAX_ORDER - 1)
+#define EIO_MD_CHUNK_SIZE               (PAGE_SIZE << EIO_MD_CHUNK_ORDER)
+
+/*
+ * Per-block lookup tags. Each cache block has a one byte tag, laid out
+ * in index order right after the in-core md array, so the tags of a set
+ * are contiguous. The tag is EIO_TAG_INVALID when the block state is
+ * exactly INVALID, else a non zero fingerprint of the block's dbn.
+ * Lookups scan the tags and only decode md entries whose tag matches.
+ */
+#define EIO_TAG_INVALID                 0
+
+/* Valid sectors of a block, see eio_sub_valid_set() */
+#define EIO_SUB_FULL(dmc)               ((u_int16_t)((1U << (dmc)->block_size) - 1))
+
 /* Structure used for metadata update on-disk and in-core for writeback cache */
 struct mdupdate_request {
 	struct list_head list;          /* to build mdrequest chain */
@@ -580,6 +692,8 @@ struct mdupdate_request {
 
 #define SETFLAG_CLEAN_INPROG    0x00000001      /* clean in progress on a set */
 #define SETFLAG_CLEAN_WHOLE     0x00000002      /* clean the set fully */
+#define SETFLAG_MD_UNLOADED     0x00000004      /* md of the set not loaded yet */
+#define SETFLAG_MD_STALE        0x00000008      /* set written while unloaded, drop its md */
 
 /* Structure used for doing operations and storing cache set level info */
 struct cache_set {
@@ -589,6 +703,13 @@ struct cache_set {
 	struct rw_semaphore rw_lock;    /* lock for cache set clean */
 	unsigned int flags;             /* misc cache set specific flags */
 	struct mdupdate_request *mdreq; /* metadata update request pointer */
+	seqcount_t cs_seq;              /* bumped as a clean block of the set changes, see EIO_CACHE_STATE_SET() */
+};
+
+/* A block to clean in a multi-set flush, sorted by dbn */
+struct eio_clean_ent {
+	sector_t dbn;
+	index_t index;
 };
 
 struct eio_errors {
@@ -602,51 +723,119 @@ struct eio_errors {
 };
 
 /*
- * Stats. Note that everything should be "atomic64_t" as
- * code relies on it.
+ * Stats. These are per-cpu counters, updated with this_cpu_*() and
+ * summed up by eio_stats_sum() when read. Note that everything should
+ * be "u_int64_t" as code relies on it.
  */
 #define SECTOR_STATS(statval, io_size)	\
-	atomic64_add(eio_to_sector(io_size), &statval);
+	this_cpu_add(statval, eio_to_sector(io_size));
 
 struct eio_stats {
-	atomic64_t reads;               /* Number of reads */
-	atomic64_t writes;              /* Number of writes */
-	atomic64_t read_hits;           /* Number of cache hits */
-	atomic64_t write_hits;          /* Number of write hits (includes dirty write hits) */
-	atomic64_t dirty_write_hits;    /* Number of "dirty" write hits */
-	atomic64_t cached_blocks;       /* Number of cached blocks */
-	atomic64_t rd_replace;          /* Number of read cache replacements. TBD modify def doc */
-	atomic64_t wr_replace;          /* Number of write cache replacements. TBD modify def doc */
-	atomic64_t noroom;              /* No room in set */
-	atomic64_t cleanings;           /* blocks cleaned TBD modify def doc */
-	atomic64_t md_write_dirty;      /* Metadata sector writes dirtying block */
-	atomic64_t md_write_clean;      /* Metadata sector writes cleaning block */
-	atomic64_t md_ssd_writes;       /* How many md ssd writes did we do ? */
-	atomic64_t uncached_reads;
-	atomic64_t uncached_writes;
-	atomic64_t uncached_map_size;
-	atomic64_t uncached_map_uncacheable;
-	atomic64_t disk_reads;
-	atomic64_t disk_writes;
-	atomic64_t ssd_reads;
-	atomic64_t ssd_writes;
-	atomic64_t ssd_readfills;
-	atomic64_t ssd_readfill_unplugs;
-	atomic64_t readdisk;
-	atomic64_t writedisk;
-	atomic64_t readcache;
-	atomic64_t readfill;
-	atomic64_t writecache;
-	atomic64_t wrtime_ms;   /* total write time in ms */
-	atomic64_t rdtime_ms;   /* total read time in ms */
-	atomic64_t readcount;   /* total reads received so far */
-	atomic64_t writecount;  /* total writes received so far */
-	atomic64_t unaligned_ios;
+	u_int64_t reads;                /* Number of reads */
+	u_int64_t writes;               /* Number of writes */
+	u_int64_t read_hits;            /* Number of cache hits */
+	u_int64_t write_hits;           /* Number of write hits (includes dirty write hits) */
+	u_int64_t dirty_write_hits;     /* Number of "dirty" write hits */
+	u_int64_t rd_replace;           /* Number of read cache replacements. TBD modify def doc */
+	u_int64_t wr_replace;           /* Number of write cache replacements. TBD modify def doc */
+	u_int64_t noroom;               /* No room in set */
+	u_int64_t cleanings;            /* blocks cleaned TBD modify def doc */
+	u_int64_t md_write_dirty;       /* Metadata sector writes dirtying block */
+	u_int64_t md_write_clean;       /* Metadata sector writes cleaning block */
+	u_int64_t md_ssd_writes;        /* How many md ssd writes did we do ? */
+	u_int64_t md_batch_writes;      /* md ssd writes covering several sets */
+	u_int64_t md_batch_sets;        /* sets written by md_batch_writes */
+	u_int64_t clean_backoffs;       /* pauses of the adaptive cleaner */
+	u_int64_t clean_sorted_writes;  /* hdd writes of multi-set flushes */
+	u_int64_t clean_sorted_blocks;  /* blocks cleaned by multi-set flushes */
+	u_int64_t uncached_reads;
+	u_int64_t uncached_writes;
+	u_int64_t uncached_map_size;
+	u_int64_t uncached_map_uncacheable;
+	u_int64_t disk_reads;
+	u_int64_t disk_writes;
+	u_int64_t ssd_reads;
+	u_int64_t ssd_writes;
+	u_int64_t ssd_readfills;
+	u_int64_t ssd_readfill_unplugs;
+	u_int64_t ssd_readfill_merges;  /* fills sent as part of the previous fill's write */
+	u_int64_t ssd_readfill_batches; /* plugged batches of fills issued */
+	u_int64_t ssd_readfill_batch_fills;     /* fills issued in these batches */
+	u_int64_t readdisk;
+	u_int64_t writedisk;
+	u_int64_t readcache;
+	u_int64_t readfill;
+	u_int64_t writecache;
+	u_int64_t wrtime_ms;    /* total write time in ms */
+	u_int64_t rdtime_ms;    /* total read time in ms */
+	u_int64_t readcount;    /* total reads received so far */
+	u_int64_t writecount;   /* total writes received so far */
+	u_int64_t unaligned_ios;
+	u_int64_t seq_bypass_reads;     /* reads of sequential streams sent to HDD */
+	u_int64_t seq_bypass_writes;    /* writes of sequential streams sent to HDD */
+	u_int64_t md_loading_uncached;  /* I/Os sent to HDD as their sets were not loaded */
+	u_int64_t ssd_offline_uncached; /* I/Os sent to HDD as their SSD was offline */
+	u_int64_t discards;             /* discard bios received */
+	u_int64_t flushes;              /* empty flush bios received */
+	u_int64_t flush_rounds;         /* device flushes they were merged into */
+	u_int64_t ssd_flushes_skipped;  /* SSD flushes left out, nothing written since */
+	u_int64_t discard_dirty_inval;  /* dirty blocks dropped by discards */
+	u_int64_t ssd_trims;            /* discards issued to ssd for freed cache blocks */
+	u_int64_t admit_fills;          /* read misses the admission filter let fill */
+	u_int64_t admit_rejects;        /* read misses the admission filter kept off the ssd */
+	u_int64_t prefetch_reads;       /* sectors read from HDD by the prefetcher */
+	u_int64_t prefetch_skipped;     /* blocks the prefetcher found already cached */
+	u_int64_t read_fast_hits;       /* read hits found without the set lock */
+	u_int64_t read_fast_retries;    /* of which the block changed and HDD was read */
+	u_int64_t sub_block_writes;     /* partial write misses cached in a part of a block */
+	u_int64_t sub_block_read_hits;  /* read hits on partially valid blocks */
+	u_int64_t uh_write_misses;      /* write misses of update-on-hit caches sent to HDD only */
 };
 
 #define PENDING_JOB_HASH_SIZE                   32
 #define PENDING_JOB_HASH(index)                 ((index) % PENDING_JOB_HASH_SIZE)
 #define SIZE_HIST                               (128 + 1)
+
+/* Per-cpu histogram of I/O sizes in sectors */
+struct eio_size_hist {
+	u_int64_t sh_count[SIZE_HIST];
+};
+
+/* Latency histogram classes, by how the bio was served */
+enum eio_lat_class {
+	EIO_LAT_READ_HIT = 0,   /* read served from SSD */
+	EIO_LAT_READ_MISS,      /* read served from HDD, without readfill */
+	EIO_LAT_READFILL,       /* read served from HDD, followed by readfill */
+	EIO_LAT_UNCACHED,       /* I/O bypassing the cache */
+	EIO_LAT_WRITE,          /* write to HDD, and to SSD for write through */
+	EIO_LAT_DIRTY_WRITE,    /* writeback write to SSD only */
+	EIO_LAT_NR_CLASSES
+};
+
+/*
+ * Per-cpu latency histograms. Bucket i counts the I/Os which took
+ * [2^(i-1), 2^i) usecs, bucket 0 is for < 1 usec and the last bucket
+ * is open ended.
+ */
+#define EIO_LAT_HIST_BUCKETS                    26
+struct eio_lat_hist {
+	u_int64_t lh_count[EIO_LAT_NR_CLASSES][EIO_LAT_HIST_BUCKETS];
+};
+
+/*
+ * Heat map of the source device, in regions of 2^heat_shift sectors, at
+ * most EIO_HEAT_BUCKETS. One cache lookup in heat_sample is counted.
+ */
+#define EIO_HEAT_BUCKETS                        1024
+struct eio_heat_bucket {
+	atomic64_t hb_reads;
+	atomic64_t hb_writes;
+	atomic64_t hb_hits;
+	atomic64_t hb_evictions;  /* valid blocks replaced to cache the region */
+	atomic64_t hb_noroom;     /* lookups finding no block to use in their set */
+	atomic64_t hb_dirty;      /* writes cached dirty */
+};
+
 #define EIO_COPY_PAGES                          1024    /* Number of pages for I/O */
 #define MIN_JOBS                                1024
 #define MIN_EIO_IO                              4096
@@ -677,9 +866,42 @@ struct eio_sysctl {
 	int32_t mem_limit_pct;
 	int32_t control;
 	int32_t cache_wronly;
+	int32_t seq_io_threshold_kb;
+	int32_t md_batch_delay_ms;
+	int32_t clean_target_lat_us;
+	int32_t clean_sort_sets;
+	int32_t ssd_trim;
+	int32_t admit_threshold;
+	int32_t fast_read;
+	int32_t heat_sample;
 	u_int64_t invalidate;
 };
 
+/*
+ * Sequential stream detection. A stream is a run of contiguous bios
+ * in the same direction. Once it has moved seq_io_threshold_kb, the
+ * rest of the stream bypasses the cache.
+ */
+struct eio_seq_stream {
+	sector_t ss_next;               /* sector expected next on this stream */
+	u_int64_t ss_bytes;             /* contiguous bytes seen so far */
+	unsigned long ss_jiffies;       /* last use, to recycle the oldest stream */
+	int ss_dir;                     /* READ or WRITE */
+};
+
+/*
+ * Read miss admission filter. A counting Bloom filter of the blocks
+ * which missed recently, with two counters per block. The counters are
+ * halved once as many misses as counters went in, so that old misses
+ * fade out. Updates are lockless, a lost update only delays a fill.
+ */
+struct eio_admit_filter {
+	u_int32_t af_mask;              /* number of counters - 1 */
+	atomic_t af_inserts;            /* misses counted since the last aging */
+	struct work_struct af_age_work; /* halves the counters */
+	u_int8_t af_counts[0];
+};
+
 /* forward declaration */
 struct lru_ls;
 
@@ -690,6 +912,25 @@ struct eio_bdev {
 	char name[16];
 };
 
+/*
+ * One of the SSDs a cache is striped over. Each has its own superblock,
+ * md and data areas, for the sets it holds.
+ */
+struct eio_ssd {
+	struct eio_bdev *ssd_dev;
+	char ssd_devname[DEV_PATHLEN];
+	char ssd_gendisk_name[DEV_PATHLEN];     /* Used for SSD failure checks */
+	sector_t ssd_size;                      /* device size in 512b sectors */
+	sector_t ssd_start_sect;                /* starting sector of the device */
+	u_int64_t ssd_md_start_sect;            /* Sector no. at which Metadata starts */
+	u_int64_t ssd_data_start_sect;          /* Numbers of metadata sectors, including header */
+	u_int64_t ssd_rank_start_sect;          /* Sector no. at which policy ranks start, 0 if none */
+	struct workqueue_struct *ssd_mdupdate_q; /* md updates of its sets */
+	struct workqueue_struct *ssd_callback_q; /* io callbacks of its blocks */
+	int ssd_offline;                        /* removed, its sets are not cached */
+	int ssd_written;                        /* data written since its last flush */
+};
+
 /* Replacement for 'struct dm_io_region */
 struct eio_io_region {
 	struct block_device *bdev;
@@ -709,12 +950,28 @@ struct cache_c {
 	sector_t dev_end_sect;          /* HDD */
 	int cache_rdonly;               /* protected by ttc_write lock */
 	struct eio_bdev *disk_dev;      /* Source device */
-	struct eio_bdev *cache_dev;     /* Cache device */
-	struct cacheblock *cache;       /* Hash table for cache blocks */
+	struct eio_ssd ssds[EIO_MAX_SSDS];      /* Cache devices, see eio_set_ssd() */
+	u_int32_t nr_ssds;
+	u_int32_t nr_ssds_offline;      /* protected by cache_spin_lock */
+	void **md_chunks;               /* in-core block md, EIO_MD_ENTRY_SIZE per block */
+	u_int8_t **tag_chunks;          /* per-block lookup tags, see EIO_TAG_INVALID */
+	u_int32_t md_chunk_shift;       /* log2 of the blocks per md and tag chunk */
+	unsigned long *md_changed;      /* sets whose md changed since it was last persisted */
+	unsigned long *read_hits;       /* blocks of lockless read hits not yet told to the policy */
+	unsigned long *read_hit_sets;   /* sets with such blocks */
+	u_int16_t *sub_valid;           /* valid sectors of partially valid blocks, 0 if whole */
+	u_int32_t md_nr_chunks;
 	struct cache_set *cache_sets;
 	struct cache_c *next_cache;
 	struct kcached_job *readfill_queue;
 	struct work_struct readfill_wq;
+	spinlock_t discard_lock;        /* protects discard_bios */
+	struct bio_list discard_bios;   /* writeback discards waiting for discard_work */
+	struct work_struct discard_work;
+	spinlock_t flush_lock;          /* protects flush_bios and flush_inprog */
+	struct bio_list flush_bios;     /* empty flushes waiting for the next device flushes */
+	int flush_inprog;               /* device flushes in flight, see eio_flush_submit() */
+	struct work_struct flush_work;
 
 	struct list_head cleanq;        /* queue of sets to awaiting clean */
 	struct eio_event clean_event;   /* event to wait for, when cleanq is empty */
@@ -724,13 +981,14 @@ struct cache_c {
 	atomic64_t clean_pendings;      /* Number of sets pending to be cleaned */
 	struct bio_vec *clean_dbvecs;   /* Data bvecs for clean set */
 	struct page **clean_mdpages;    /* Metadata pages for clean set */
+	int clean_defer_md;             /* set md is left to the next md store */
 	int dbvec_count;
 	int mdpage_count;
 	int clean_excess_dirty;         /* Clean in progress to bring cache dirty blocks in limits */
 	atomic_t clean_index;           /* set being cleaned, in case of force clean */
 
-	u_int64_t md_start_sect;        /* Sector no. at which Metadata starts */
-	u_int64_t md_sectors;           /* Numbers of metadata sectors, including header */
+	int rank_saved;                 /* Ranks saved by eio_md_store() */
+	int rank_restore;               /* Ranks to restore once the policy is set up */
 	u_int64_t disk_size;            /* Source size in 512b sectors*/
 	u_int64_t size;                 /* Cache size in block_size blocks */
 	u_int32_t assoc;                /* Cache associativity */
@@ -739,7 +997,7 @@ struct cache_c {
 	u_int32_t block_mask;           /* Cache block mask */
 	u_int32_t consecutive_shift;    /* Consecutive blocks size in bits */
 	u_int32_t persistence;          /* Create | Force create | Reload */
-	u_int32_t mode;                 /* CACHE_MODE_{WB, RO, WT} */
+	u_int32_t mode;                 /* CACHE_MODE_{WB, RO, WT, UH} */
 	u_int32_t cold_boot;            /* Cache should be started as cold after boot */
 	u_int32_t bio_nr_pages;         /* number of hardware sectors supported by SSD in terms of PAGE_SIZE */
 
@@ -752,12 +1010,17 @@ struct cache_c {
 	u_int32_t sb_version;   /* Superblock version */
 
 	int readfill_in_prog;
-	struct eio_stats eio_stats;     /* Run time stats */
+	struct eio_stats __percpu *eio_stats;   /* Run time stats */
 	struct eio_errors eio_errors;   /* Error stats */
 	int clean_inprog;
 	atomic64_t nr_dirty;
 	atomic64_t nr_ios;
-	atomic64_t size_hist[SIZE_HIST];
+	struct eio_size_hist __percpu *size_hist;
+	struct eio_lat_hist __percpu *lat_hist;
+	struct eio_heat_bucket *heat_map;               /* EIO_HEAT_BUCKETS regions */
+	unsigned int __percpu *heat_tick;               /* lookups since the last sampled one */
+	unsigned int heat_shift;                        /* log2 of the sectors per region */
+	atomic64_t cached_blocks;       /* Number of cached blocks */
 
 	void *sysctl_handle_common;
 	void *sysctl_handle_writeback;
@@ -766,16 +1029,12 @@ struct cache_c {
 	struct eio_sysctl sysctl_pending;       /* sysctl values pending to become active */
 	struct eio_sysctl sysctl_active;        /* sysctl currently active */
 
-	char cache_devname[DEV_PATHLEN];
 	char disk_devname[DEV_PATHLEN];
 	char cache_name[DEV_PATHLEN];
-	char cache_gendisk_name[DEV_PATHLEN];   /* Used for SSD failure checks */
 	char cache_srcdisk_name[DEV_PATHLEN];   /* Used for SRC failure checks */
 	char ssd_uuid[DEV_PATHLEN];
 
-	struct cacheblock_md8 *cache_md8;
-	sector_t cache_size;                            /* Cache size passed to ctr() in 512b sectors */
-	sector_t cache_dev_start_sect;                  /* starting sector of cache device */
+	sector_t cache_size;                            /* Size of the cache devices in 512b sectors */
 	u_int64_t index_zero;                           /* index of cache block with starting sector 0 */
 	u_int32_t num_sets;                             /* number of cache sets */
 	u_int32_t num_sets_bits;                        /* number of bits to encode "num_sets" */
@@ -790,8 +1049,23 @@ struct cache_c {
 	spinlock_t dirty_set_lru_lock;                  /* spinlock for dirty set lru */
 	struct delayed_work clean_aged_sets_work;       /* work item for clean_aged_sets */
 	int is_clean_aged_sets_sched;                   /* to know whether clean aged sets is scheduled */
-	struct workqueue_struct *mdupdate_q;            /* Workqueue to handle md updates */
-	struct workqueue_struct *callback_q;            /* Workqueue to handle io callbacks */
+	spinlock_t md_batch_lock;                       /* protects md_batch_list */
+	struct list_head md_batch_list;                 /* md updates waiting to be written as a batch */
+	int md_batch_count;                             /* number of entries on md_batch_list */
+	struct delayed_work md_batch_work;              /* work item writing out md_batch_list */
+	atomic_t fg_lat_ewma;                           /* foreground latency EWMA, usecs << EIO_LAT_EWMA_SHIFT */
+	int clean_depth;                                /* adaptive hdd writes in flight per set clean */
+	int clean_batch;                                /* adaptive sets cleaned per rate adjustment */
+	struct eio_clean_ent *clean_sort_ents;          /* sorted blocks of a multi-set flush */
+	struct work_struct md_load_work;                /* background md load, see CACHE_FLAGS_LAZY_MD_LOAD */
+	struct work_struct prefetch_work;               /* background warm-up, see eio_prefetch.c */
+	struct eio_prefetch *prefetch;                  /* warm-up in progress, under cache_spin_lock */
+	spinlock_t job_lock;                            /* protects the job lists */
+	struct list_head disk_read_jobs;                /* jobs to reissue on disk after ssd read failure */
+	struct work_struct disk_read_work;              /* work item to process disk_read_jobs */
+	spinlock_t seq_lock;                            /* protects seq_streams */
+	struct eio_seq_stream seq_streams[EIO_SEQ_STREAMS];
+	struct eio_admit_filter *admit_filter;          /* allocated when admit_threshold is first set */
 };
 
 #define EIO_CACHE_IOSIZE                0
@@ -808,8 +1082,10 @@ struct cache_c {
 #define CACHE_DEGRADED_IS_SET(dmc)              (((dmc)->cache_flags & CACHE_FLAGS_DEGRADED) ? 1 : 0)
 #define CACHE_SSD_ADD_INPROG_IS_SET(dmc)        (((dmc)->cache_flags & CACHE_FLAGS_SSD_ADD_INPROG) ? 1 : 0)
 #define CACHE_MD8_IS_SET(dmc)                   (((dmc)->cache_flags & CACHE_FLAGS_MD8) ? 1 : 0)
+#define CACHE_MD6_IS_SET(dmc)                   (((dmc)->cache_flags & CACHE_FLAGS_MD6) ? 1 : 0)
 #define CACHE_FAILED_IS_SET(dmc)                (((dmc)->cache_flags & CACHE_FLAGS_FAILED) ? 1 : 0)
 #define CACHE_STALE_IS_SET(dmc)                 (((dmc)->cache_flags & CACHE_FLAGS_STALE) ? 1 : 0)
+#define CACHE_MD_LOADING_IS_SET(dmc)            (((dmc)->cache_flags & CACHE_FLAGS_MD_LOADING) ? 1 : 0)
 
 /* Device failure handling.  */
 #define CACHE_SRC_IS_ABSENT(dmc)                (((dmc)->eio_errors.no_source_dev == 1) ? 1 : 0)
@@ -818,6 +1094,18 @@ struct cache_c {
 	((atomic64_read(&(dmc)->nr_ios) > (int64_t)(dmc)->sysctl_active.autoclean_threshold) ||	\
 	 ((dmc)->sysctl_active.autoclean_threshold == 0))
 
+#define CLEAN_ADAPTIVE(dmc)	\
+	((dmc)->sysctl_active.clean_target_lat_us != 0)
+
+/*
+ * The adaptive cleaner throttles instead of pausing,
+ * autoclean_threshold 0 still disables it.
+ */
+#define AUTOCLEAN_PAUSED(dmc)	\
+	(CLEAN_ADAPTIVE(dmc) ?	\
+	 ((dmc)->sysctl_active.autoclean_threshold == 0) :	\
+	 AUTOCLEAN_THRESHOLD_CROSSED(dmc))
+
 #define DIRTY_CACHE_THRESHOLD_CROSSED(dmc)	\
 	((atomic64_read(&(dmc)->nr_dirty) - atomic64_read(&(dmc)->clean_pendings)) >= \
 	 (int64_t)((dmc)->sysctl_active.dirty_high_threshold * EIO_DIV((dmc)->size, 100)) && \
@@ -844,6 +1132,7 @@ struct job_io_regions {
 #define EB_MAIN_IO 1          /* I/O errors are propagated only if eio_bio type is EB_MAIN_IO*/
 #define EB_SUBORDINATE_IO 2
 #define EB_INVAL 4
+#define EB_FAST_READ 8        /* read hit found without the set lock, see eio_read_fast() */
 
 struct eio_bio {
 	int eb_iotype;
@@ -857,6 +1146,7 @@ struct eio_bio {
 	struct eio_bio *eb_next;        /*used for splitting reads*/
 	index_t eb_index;               /*for read bios - sector number in block_size sectors*/
 	atomic_t eb_holdcount;          /* ebio hold count, currently used only for dirty block I/O */
+	unsigned eb_seq;                /* cs_seq of the set for EB_FAST_READ */
 	struct bio_vec eb_rbv[0];
 };
 
@@ -886,7 +1176,10 @@ struct bio_container {
 	enum eio_io_dir bc_dir;                 /* bc I/O direction */
 	int bc_error;                           /* error encountered during processing bc */
 	unsigned long bc_iotime;                /* maintains i/o time in jiffies */
+	ktime_t bc_iostart;                     /* i/o start time, for latency histograms */
 	struct bio_container *bc_next;          /* next bc in the chain */
+	int bc_seq_bypass;                      /* part of a sequential stream, don't fill cache */
+	int bc_prefetch;                        /* read of the prefetcher, always fill cache */
 };
 
 /* structure used as callback context during synchronous I/O */
@@ -912,6 +1205,7 @@ struct kcached_job {
 
 struct ssd_rm_list {
 	struct cache_c *dmc;
+	struct eio_ssd *ssd;            /* NULL for the source device */
 	int action;
 	dev_t devt;
 	enum dev_notifier note;
@@ -981,7 +1275,8 @@ int dm_io_async_bvec(unsigned int num_regions, struct eio_io_region *where,
 		     int rw, struct bio_vec *bvec, eio_notify_fn fn,
 		     void *context);
 void eio_put_cache_device(struct cache_c *dmc);
-void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note);
+void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note,
+			 struct eio_ssd *ssd);
 void eio_resume_caching(struct cache_c *dmc, char *dev);
 int eio_ctr_ssd_add(struct cache_c *dmc, char *dev);
 
@@ -1010,10 +1305,16 @@ void eio_wait_thread_exit(void *thrdptr, int *notifier);
 
 /* eio_main.c */
 extern int eio_map(struct cache_c *, struct request_queue *, struct bio *);
+extern int eio_io_async_bvec(struct cache_c *dmc, struct eio_io_region *where,
+			     unsigned op, unsigned op_flags,
+			     struct bio_vec *pages, unsigned nr_bvecs,
+			     eio_notify_fn fn, void *context, int hddio);
 extern void eio_md_write_done(struct kcached_job *job);
 extern void eio_ssderror_diskread(struct kcached_job *job);
 extern void eio_md_write(struct kcached_job *job);
 extern void eio_md_write_kickoff(struct kcached_job *job);
+extern void eio_do_mdupdate_batch(struct work_struct *work);
+extern void eio_md_batch_drain(struct cache_c *dmc);
 extern void eio_do_readfill(struct work_struct *work);
 extern void eio_check_dirty_thresholds(struct cache_c *dmc, index_t set);
 extern void eio_clean_all(struct cache_c *dmc);
@@ -1021,6 +1322,9 @@ extern int eio_clean_thread_proc(void *context);
 extern void eio_touch_set_lru(struct cache_c *dmc, index_t set);
 extern void eio_inval_range(struct cache_c *dmc, sector_t iosector,
 			    unsigned iosize);
+extern void eio_do_discard(struct work_struct *work);
+extern int eio_admit_filter_alloc(struct cache_c *dmc);
+extern void eio_admit_filter_free(struct cache_c *dmc);
 extern int eio_invalidate_sanity_check(struct cache_c *dmc, u_int64_t iosector,
 				       u_int64_t *iosize);
 /*
@@ -1032,12 +1336,22 @@ extern int eio_invalidate_cache(struct cache_c *dmc);
 /* eio_mem.c */
 extern int eio_mem_init(struct cache_c *dmc);
 extern u_int32_t eio_hash_block(struct cache_c *dmc, sector_t dbn);
-extern unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn);
+extern u_int64_t eio_shrink_dbn(struct cache_c *dmc, sector_t dbn);
 extern sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index);
 extern void eio_invalidate_md(struct cache_c *dmc, u_int64_t index);
 extern void eio_md4_dbn_set(struct cache_c *dmc, u_int64_t index,
 			    u_int32_t dbn_24);
+extern void eio_md6_dbn_set(struct cache_c *dmc, u_int64_t index,
+			    u_int64_t dbn_40);
 extern void eio_md8_dbn_set(struct cache_c *dmc, u_int64_t index, sector_t dbn);
+extern sector_t eio_md_size(struct cache_c *dmc);
+extern int eio_md_alloc(struct cache_c *dmc);
+extern void eio_md_free(struct cache_c *dmc);
+extern void *eio_sets_alloc(struct cache_c *dmc, size_t size);
+
+/* eio_prefetch.c */
+extern void eio_prefetch_work(struct work_struct *work);
+extern void eio_prefetch_endio(struct bio *bio, int error);
 
 /* eio_procfs.c */
 extern void eio_module_procfs_init(void);
@@ -1049,6 +1363,7 @@ extern int eio_version_query(size_t buf_sz, char *bufp);
 /* eio_subr.c */
 extern void eio_free_cache_job(struct kcached_job *job);
 extern void eio_do_work(struct work_struct *unused);
+extern void eio_do_disk_read_jobs(struct work_struct *work);
 extern struct kcached_job *eio_new_job(struct cache_c *dmc, struct eio_bio *bio,
 				       index_t index);
 extern void eio_push_ssdread_failures(struct kcached_job *job);
@@ -1060,47 +1375,243 @@ extern int eio_io_sync_vm(struct cache_c *dmc, struct eio_io_region *where,
 			  unsigned op, unsigned op_flags, struct bio_vec *bvec, int nbvec);
 extern void eio_unplug_cache_device(struct cache_c *dmc);
 extern void eio_put_cache_device(struct cache_c *dmc);
-extern void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note);
+extern void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note,
+				struct eio_ssd *ssd);
 extern void eio_resume_caching(struct cache_c *dmc, char *dev);
+extern void eio_stats_sum(struct cache_c *dmc, struct eio_stats *stats);
+extern u_int64_t eio_size_hist_sum(struct cache_c *dmc, int index);
+extern void eio_stats_zero(struct cache_c *dmc);
+extern void eio_lat_hist_sum(struct cache_c *dmc, struct eio_lat_hist *hist);
 
-static inline void
-EIO_DBN_SET(struct cache_c *dmc, u_int64_t index, sector_t dbn)
+static inline u_int8_t eio_dbn_tag(sector_t dbn)
 {
-	if (EIO_MD8(dmc))
-		eio_md8_dbn_set(dmc, index, dbn);
-	else
-		eio_md4_dbn_set(dmc, index, eio_shrink_dbn(dmc, dbn));
-	if (dbn == 0)
-		dmc->index_zero = index;
+	u_int8_t tag = (u_int8_t)hash_64((u64)dbn, 8);
+
+	return (tag == EIO_TAG_INVALID) ? 1 : tag;
+}
+
+/* In-core md and lookup tag of a block, a set never spans two chunks */
+static inline struct cacheblock *EIO_MD4_BLK(struct cache_c *dmc,
+					     u_int64_t index)
+{
+	return (struct cacheblock *)dmc->md_chunks[index >> dmc->md_chunk_shift] +
+	       (index & ((1ULL << dmc->md_chunk_shift) - 1));
+}
+
+static inline struct cacheblock_md6 *EIO_MD6_BLK(struct cache_c *dmc,
+						 u_int64_t index)
+{
+	return (struct cacheblock_md6 *)
+	       dmc->md_chunks[index >> dmc->md_chunk_shift] +
+	       (index & ((1ULL << dmc->md_chunk_shift) - 1));
+}
+
+static inline u_int64_t EIO_MD6_DBN(struct cacheblock_md6 *md6)
+{
+	return ((u_int64_t)md6->dbn_hi << 32) | md6->dbn_lo;
+}
+
+static inline struct cacheblock_md8 *EIO_MD8_BLK(struct cache_c *dmc,
+						 u_int64_t index)
+{
+	return (struct cacheblock_md8 *)
+	       dmc->md_chunks[index >> dmc->md_chunk_shift] +
+	       (index & ((1ULL << dmc->md_chunk_shift) - 1));
+}
+
+static inline u_int8_t *EIO_TAG(struct cache_c *dmc, u_int64_t index)
+{
+	return dmc->tag_chunks[index >> dmc->md_chunk_shift] +
+	       (index & ((1ULL << dmc->md_chunk_shift) - 1));
 }
 
 static inline u_int64_t EIO_DBN_GET(struct cache_c *dmc, u_int64_t index)
 {
 	if (EIO_MD8(dmc))
-		return dmc->cache_md8[index].md8_u.u_i_md8 & EIO_MD8_DBN_MASK;
+		return EIO_MD8_BLK(dmc, index)->md8_u.u_i_md8 &
+		       EIO_MD8_DBN_MASK;
 
 	return eio_expand_dbn(dmc, index);
 }
 
+static inline u_int8_t
+EIO_CACHE_STATE_GET(struct cache_c *dmc, u_int64_t index)
+{
+	u_int8_t cache_state;
+
+	if (EIO_MD8(dmc))
+		cache_state = EIO_MD8_BLK(dmc, index)->md8_u.u_s_md8.cache_state;
+	else if (EIO_MD6(dmc))
+		cache_state = EIO_MD6_BLK(dmc, index)->cache_state;
+	else
+		cache_state = EIO_MD4_BLK(dmc, index)->md4_u.u_s_md4.cache_state;
+	return cache_state;
+}
+
+/*
+ * The sets of a cache are striped over its SSDs, set s being set
+ * s / nr_ssds of SSD s % nr_ssds. Consecutive sets, which cache
+ * consecutive source extents, are on different SSDs.
+ */
+static inline struct eio_ssd *eio_set_ssd(struct cache_c *dmc, index_t set)
+{
+	if (dmc->nr_ssds == 1)
+		return &dmc->ssds[0];
+	return &dmc->ssds[(u_int32_t)set % dmc->nr_ssds];
+}
+
+static inline struct eio_ssd *eio_index_ssd(struct cache_c *dmc, index_t index)
+{
+	return eio_set_ssd(dmc, index >> dmc->consecutive_shift);
+}
+
+/* Index of a cache block among the blocks of its SSD */
+static inline index_t eio_ssd_index(struct cache_c *dmc, index_t index)
+{
+	index_t set;
+
+	if (dmc->nr_ssds == 1)
+		return index;
+	set = (u_int32_t)(index >> dmc->consecutive_shift) / dmc->nr_ssds;
+	return (set << dmc->consecutive_shift) | (index & (dmc->assoc - 1));
+}
+
+/* Number of sets on each SSD */
+static inline index_t eio_ssd_nr_sets(struct cache_c *dmc)
+{
+	return (index_t)EIO_DIV(dmc->size >> dmc->consecutive_shift,
+				dmc->nr_ssds);
+}
+
+/* Set of the cache which is set ssd_set of the SSD */
+static inline index_t
+eio_ssd_set(struct cache_c *dmc, struct eio_ssd *ssd, index_t ssd_set)
+{
+	return ssd_set * dmc->nr_ssds + (ssd - dmc->ssds);
+}
+
+/* Cache block which is block ssd_index of the SSD */
+static inline index_t
+eio_ssd_block(struct cache_c *dmc, struct eio_ssd *ssd, index_t ssd_index)
+{
+	if (dmc->nr_ssds == 1)
+		return ssd_index;
+	return (eio_ssd_set(dmc, ssd, ssd_index >> dmc->consecutive_shift) <<
+		dmc->consecutive_shift) | (ssd_index & (dmc->assoc - 1));
+}
+
+/* Sector of the data of a cache block on its SSD */
+static inline sector_t eio_ssd_data_sector(struct cache_c *dmc, index_t index)
+{
+	return ((sector_t)eio_ssd_index(dmc, index) << dmc->block_shift) +
+	       eio_index_ssd(dmc, index)->ssd_data_start_sect;
+}
+
+/* Sector of the md of a cache block on its SSD */
+static inline sector_t eio_ssd_md_sector(struct cache_c *dmc, index_t index)
+{
+	return eio_index_ssd(dmc, index)->ssd_md_start_sect +
+	       INDEX_TO_MD_SECTOR(eio_ssd_index(dmc, index));
+}
+
+/*
+ * Note a change of what eio_md_store() writes for a block, so that only
+ * the sets changed since the md was last written out are written again.
+ */
+static inline void eio_md_changed(struct cache_c *dmc, u_int64_t index)
+{
+	index_t set = (index_t)(index >> dmc->consecutive_shift);
+
+	if (!test_bit(set, dmc->md_changed))
+		set_bit(set, dmc->md_changed);
+}
+
+/* Whether only some sectors of a VALID block are valid */
+static inline int eio_sub_partial(struct cache_c *dmc, u_int64_t index)
+{
+	return dmc->sub_valid && READ_ONCE(dmc->sub_valid[index]);
+}
+
+/*
+ * Set the valid sectors of a block, under the set lock. A partially valid
+ * block is told to be INVALID by eio_md_store(), its sectors are not
+ * persisted.
+ */
 static inline void
-EIO_CACHE_STATE_SET(struct cache_c *dmc, u_int64_t index, u_int8_t cache_state)
+eio_sub_valid_set(struct cache_c *dmc, u_int64_t index, u_int16_t valid)
+{
+	if (valid == EIO_SUB_FULL(dmc))
+		valid = 0;
+	if (dmc->sub_valid[index] != valid) {
+		eio_md_changed(dmc, index);
+		WRITE_ONCE(dmc->sub_valid[index], valid);
+	}
+}
+
+static inline void
+EIO_DBN_SET(struct cache_c *dmc, u_int64_t index, sector_t dbn)
 {
+	eio_md_changed(dmc, index);
+	if (dmc->sub_valid)
+		WRITE_ONCE(dmc->sub_valid[index], 0);
 	if (EIO_MD8(dmc))
-		dmc->cache_md8[index].md8_u.u_s_md8.cache_state = cache_state;
+		eio_md8_dbn_set(dmc, index, dbn);
+	else if (EIO_MD6(dmc))
+		eio_md6_dbn_set(dmc, index, eio_shrink_dbn(dmc, dbn));
 	else
-		dmc->cache[index].md4_u.u_s_md4.cache_state = cache_state;
+		eio_md4_dbn_set(dmc, index, eio_shrink_dbn(dmc, dbn));
+	if (dbn == 0)
+		dmc->index_zero = index;
+	if (EIO_CACHE_STATE_GET(dmc, index) != INVALID)
+		*EIO_TAG(dmc, index) = eio_dbn_tag(dbn);
 }
 
-static inline u_int8_t
-EIO_CACHE_STATE_GET(struct cache_c *dmc, u_int64_t index)
+/* States of a block a lockless read hit may be reading from the SSD */
+static inline int eio_state_readable(u_int8_t cache_state)
 {
-	u_int8_t cache_state;
+	return (cache_state & ~CACHEREADINPROG) == VALID;
+}
+
+static inline void
+EIO_CACHE_STATE_SET(struct cache_c *dmc, u_int64_t index, u_int8_t cache_state)
+{
+	u_int8_t old_state = EIO_CACHE_STATE_GET(dmc, index);
+	seqcount_t *seq = NULL;
+
+	if ((old_state ^ cache_state) & (INVALID | VALID | DIRTY))
+		eio_md_changed(dmc, index);
+
+	/*
+	 * A clean block about to be reclaimed, written or invalidated
+	 * fails the lockless read hits in flight on its set. The writers
+	 * hold the set lock, the md loaders only touch sets not read yet.
+	 */
+	if (eio_state_readable(old_state) && !eio_state_readable(cache_state) &&
+	    dmc->cache_sets) {
+		seq = &dmc->cache_sets[index >> dmc->consecutive_shift].cs_seq;
+		raw_write_seqcount_begin(seq);
+	}
 
 	if (EIO_MD8(dmc))
-		cache_state = dmc->cache_md8[index].md8_u.u_s_md8.cache_state;
+		EIO_MD8_BLK(dmc, index)->md8_u.u_s_md8.cache_state = cache_state;
+	else if (EIO_MD6(dmc))
+		EIO_MD6_BLK(dmc, index)->cache_state = cache_state;
 	else
-		cache_state = dmc->cache[index].md4_u.u_s_md4.cache_state;
-	return cache_state;
+		EIO_MD4_BLK(dmc, index)->md4_u.u_s_md4.cache_state = cache_state;
+
+	/*
+	 * A block leaving the INVALID state gets the tag of the dbn it
+	 * holds; callers setting a new dbn refresh it in EIO_DBN_SET().
+	 */
+	if (cache_state == INVALID)
+		*EIO_TAG(dmc, index) = EIO_TAG_INVALID;
+	else if (*EIO_TAG(dmc, index) == EIO_TAG_INVALID)
+		*EIO_TAG(dmc, index) = eio_dbn_tag(EIO_DBN_GET(dmc, index));
+	if (!(cache_state & VALID) && dmc->sub_valid)
+		WRITE_ONCE(dmc->sub_valid[index], 0);
+
+	if (seq)
+		raw_write_seqcount_end(seq);
 }
 
 static inline void
@@ -1121,6 +1632,20 @@ EIO_CACHE_STATE_ON(struct cache_c *dmc, index_t index, u_int8_t bitmask)
 	EIO_CACHE_STATE_SET(dmc, index, cache_state);
 }
 
+static inline const char *eio_mode_name(u_int32_t mode)
+{
+	switch (mode) {
+	case CACHE_MODE_WB:
+		return "write back";
+	case CACHE_MODE_RO:
+		return "read only";
+	case CACHE_MODE_UH:
+		return "update on hit";
+	default:
+		return "write through";
+	}
+}
+
 void eio_set_warm_boot(void);
 #endif                          /* defined(__KERNEL__) */
 
@@ -1170,6 +1695,5 @@ extern sector_t eio_get_device_start_sect(struct eio_bdev *);
 
 #include "eio_setlru.h"
 #include "eio_policy.h"
-#define EIO_CACHE(dmc)          (EIO_MD8(dmc) ? (void *)dmc->cache_md8 : (void *)dmc->cache)
 
 #endif                          /* !EIO_INC_H */
@@ -0,0 +1,435 @@
+/*
+ *  eio_2q.c
+ *
+ *  Simplified 2Q replacement policy for EnhanceIO.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "eio.h"
+/* Generic policy functions prototyes */
+int eio_2q_init(struct cache_c *);
+void eio_2q_exit(void);
+int eio_2q_cache_sets_init(struct eio_policy *);
+int eio_2q_cache_blk_init(struct eio_policy *);
+void eio_2q_find_reclaim_dbn(struct eio_policy *, index_t, index_t *);
+int eio_2q_clean_set(struct eio_policy *, index_t, int);
+void eio_2q_rank_get(struct eio_policy *, index_t, u_int8_t *);
+void eio_2q_rank_set(struct eio_policy *, index_t, const u_int8_t *,
+		     const u_int16_t *);
+/* Per policy instance initialization */
+struct eio_policy *eio_2q_instance_init(void);
+
+/* 2Q specific policy functions prototype */
+void eio_2q_pushblks(struct eio_policy *);
+void eio_2q_touch(struct cache_c *, index_t, struct eio_policy *);
+
+/*
+ * Each set keeps two queues. New blocks enter A1, a probation FIFO.
+ * A block hit while on A1 is promoted to Am, an LRU of blocks
+ * referenced at least twice. Blocks are reclaimed from A1 as long as
+ * it holds more than EIO_2Q_KIN of the set, so a burst of blocks that
+ * are touched once only cycles through A1 and leaves Am alone.
+ *
+ * Like LRU, the links are set-relative offsets. The top bit of q_next
+ * tells the queue of the block, which keeps the per block state at 4
+ * bytes and limits the associativity to EIO_2Q_NULL blocks.
+ */
+#define EIO_2Q_NULL             0x7FFF
+#define EIO_2Q_AM               0x8000
+#define EIO_2Q_KIN(assoc)       ((assoc) >> 2)
+
+#define EIO_2Q_NEXT(blk)        ((blk)->q_next & EIO_2Q_NULL)
+#define EIO_2Q_ON_AM(blk)       ((blk)->q_next & EIO_2Q_AM)
+#define EIO_2Q_SET_NEXT(blk, n) \
+	((blk)->q_next = ((blk)->q_next & EIO_2Q_AM) | (n))
+
+/* Per cache set data structure */
+struct eio_2q_cache_set {
+	u_int16_t a1_head, a1_tail;
+	u_int16_t am_head, am_tail;
+	u_int16_t a1_count;
+};
+
+/* Per cache block data structure */
+struct eio_2q_cache_block {
+	u_int16_t q_prev, q_next;
+};
+
+/* 2Q uses the recency hooks of LRU */
+static struct eio_lru eio_2q = {
+	.sl_lru_pushblks		= eio_2q_pushblks,
+	.sl_reclaim_lru_movetail	= eio_2q_touch,
+};
+
+/*
+ * Context that captures the 2Q replacement policy
+ */
+static struct eio_policy_header eio_2q_ops = {
+	.sph_name		= CACHE_REPL_2Q,
+	.sph_instance_init	= eio_2q_instance_init,
+};
+
+/*
+ * Intialize 2Q. Called from ctr.
+ */
+int eio_2q_init(struct cache_c *dmc)
+{
+	return 0;
+}
+
+/*
+ * Initialize per set 2Q data structures.
+ */
+int eio_2q_cache_sets_init(struct eio_policy *p_ops)
+{
+	sector_t order;
+	int i;
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_2q_cache_set *cache_sets;
+
+	if (dmc->assoc >= EIO_2Q_NULL) {
+		pr_err("2q_cache_sets_init: associativity %u is too large",
+		       dmc->assoc);
+		return -EINVAL;
+	}
+
+	order =
+		(dmc->size >> dmc->consecutive_shift) *
+		sizeof(struct eio_2q_cache_set);
+
+	dmc->sp_cache_set = vmalloc((size_t)order);
+	if (dmc->sp_cache_set == NULL)
+		return -ENOMEM;
+
+	cache_sets = (struct eio_2q_cache_set *)dmc->sp_cache_set;
+
+	for (i = 0; i < (int)(dmc->size >> dmc->consecutive_shift); i++) {
+		cache_sets[i].a1_head = EIO_2Q_NULL;
+		cache_sets[i].a1_tail = EIO_2Q_NULL;
+		cache_sets[i].am_head = EIO_2Q_NULL;
+		cache_sets[i].am_tail = EIO_2Q_NULL;
+		cache_sets[i].a1_count = 0;
+	}
+	pr_info("Initialized %d sets in 2Q", i);
+
+	return 0;
+}
+
+/*
+ * Initialize per block 2Q data structures
+ */
+int eio_2q_cache_blk_init(struct eio_policy *p_ops)
+{
+	sector_t order;
+	struct cache_c *dmc = p_ops->sp_dmc;
+
+	order = dmc->size * sizeof(struct eio_2q_cache_block);
+
+	dmc->sp_cache_blk = vmalloc((size_t)order);
+	if (dmc->sp_cache_blk == NULL)
+		return -ENOMEM;
+
+	return 0;
+}
+
+/*
+ * Allocate a new instance of eio_policy per dmc
+ */
+struct eio_policy *eio_2q_instance_init(void)
+{
+	struct eio_policy *new_instance;
+
+	new_instance = vmalloc(sizeof(struct eio_policy));
+	if (new_instance == NULL) {
+		pr_err("eio_2q_instance_init: vmalloc failed");
+		return NULL;
+	}
+
+	/* Initialize the 2Q specific functions and variables */
+	new_instance->sp_name = CACHE_REPL_2Q;
+	new_instance->sp_policy.lru = &eio_2q;
+	new_instance->sp_repl_init = eio_2q_init;
+	new_instance->sp_repl_exit = eio_2q_exit;
+	new_instance->sp_repl_sets_init = eio_2q_cache_sets_init;
+	new_instance->sp_repl_blk_init = eio_2q_cache_blk_init;
+	new_instance->sp_find_reclaim_dbn = eio_2q_find_reclaim_dbn;
+	new_instance->sp_clean_set = eio_2q_clean_set;
+	new_instance->sp_rank_get = eio_2q_rank_get;
+	new_instance->sp_rank_set = eio_2q_rank_set;
+	new_instance->sp_dmc = NULL;
+
+	try_module_get(THIS_MODULE);
+
+	pr_info("eio_2q_instance_init: created new instance of 2Q");
+
+	return new_instance;
+}
+
+/*
+ * Cleanup an instance of eio_policy (called from dtr).
+ */
+void eio_2q_exit(void)
+{
+	module_put(THIS_MODULE);
+}
+
+/* Remove a block from the queue it is on */
+static void eio_2q_unlink(struct cache_c *dmc, index_t index)
+{
+	index_t set = index / dmc->assoc;
+	index_t start_index = set * dmc->assoc;
+	struct eio_2q_cache_set *qset;
+	struct eio_2q_cache_block *blkptr;
+	struct eio_2q_cache_block *cacheblk;
+	u_int16_t prev, next;
+
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	blkptr = (struct eio_2q_cache_block *)dmc->sp_cache_blk + start_index;
+	cacheblk = blkptr + (index - start_index);
+	prev = cacheblk->q_prev;
+	next = EIO_2Q_NEXT(cacheblk);
+
+	if (prev != EIO_2Q_NULL)
+		EIO_2Q_SET_NEXT(&blkptr[prev], next);
+	else if (EIO_2Q_ON_AM(cacheblk))
+		qset->am_head = next;
+	else
+		qset->a1_head = next;
+
+	if (next != EIO_2Q_NULL)
+		blkptr[next].q_prev = prev;
+	else if (EIO_2Q_ON_AM(cacheblk))
+		qset->am_tail = prev;
+	else
+		qset->a1_tail = prev;
+
+	if (!EIO_2Q_ON_AM(cacheblk)) {
+		EIO_ASSERT(qset->a1_count > 0);
+		qset->a1_count--;
+	}
+}
+
+/* Append a block that is on no queue to the tail of A1 or Am */
+static void eio_2q_add_tail(struct cache_c *dmc, index_t index, int am)
+{
+	index_t set = index / dmc->assoc;
+	index_t start_index = set * dmc->assoc;
+	u_int16_t my_index = (u_int16_t)(index - start_index);
+	struct eio_2q_cache_set *qset;
+	struct eio_2q_cache_block *blkptr;
+	struct eio_2q_cache_block *cacheblk;
+	u_int16_t *head, *tail;
+
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	blkptr = (struct eio_2q_cache_block *)dmc->sp_cache_blk + start_index;
+	cacheblk = blkptr + my_index;
+	head = am ? &qset->am_head : &qset->a1_head;
+	tail = am ? &qset->am_tail : &qset->a1_tail;
+
+	cacheblk->q_prev = *tail;
+	cacheblk->q_next = EIO_2Q_NULL | (am ? EIO_2Q_AM : 0);
+	if (*tail == EIO_2Q_NULL)
+		*head = my_index;
+	else
+		EIO_2Q_SET_NEXT(&blkptr[*tail], my_index);
+	*tail = my_index;
+
+	if (!am)
+		qset->a1_count++;
+}
+
+/*
+ * Find a victim block to evict and return it in index. The victim is
+ * the oldest clean block of A1 while A1 is above its share of the set,
+ * of Am otherwise. It is requeued on A1 for the block replacing it.
+ */
+void
+eio_2q_find_reclaim_dbn(struct eio_policy *p_ops,
+			index_t start_index, index_t *index)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_2q_cache_set *qset;
+	struct eio_2q_cache_block *blkptr;
+	index_t set;
+	u_int16_t rel_index;
+	int from_a1;
+	int pass;
+
+	set = start_index / dmc->assoc;
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	blkptr = (struct eio_2q_cache_block *)dmc->sp_cache_blk + start_index;
+
+	from_a1 = (qset->a1_count > EIO_2Q_KIN(dmc->assoc)) ||
+		  (qset->am_head == EIO_2Q_NULL);
+
+	/* Fall back to the other queue if all blocks of one are busy */
+	for (pass = 0; pass < 2; pass++, from_a1 = !from_a1) {
+		rel_index = from_a1 ? qset->a1_head : qset->am_head;
+		while (rel_index != EIO_2Q_NULL) {
+			if (EIO_CACHE_STATE_GET(dmc, rel_index + start_index) ==
+			    VALID) {
+				*index = rel_index + start_index;
+				eio_2q_unlink(dmc, *index);
+				eio_2q_add_tail(dmc, *index, 0);
+				return;
+			}
+			rel_index = EIO_2Q_NEXT(&blkptr[rel_index]);
+		}
+	}
+}
+
+/*
+ * Go through the entire set and clean, coldest blocks first.
+ */
+int eio_2q_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_2q_cache_set *qset;
+	struct eio_2q_cache_block *blkptr;
+	index_t start_index;
+	index_t dmc_idx;
+	u_int16_t rel_index;
+	int nr_writes = 0;
+	int pass;
+
+	start_index = set * dmc->assoc;
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	blkptr = (struct eio_2q_cache_block *)dmc->sp_cache_blk + start_index;
+
+	for (pass = 0; pass < 2; pass++) {
+		rel_index = pass ? qset->am_head : qset->a1_head;
+		while ((rel_index != EIO_2Q_NULL) && (nr_writes < to_clean)) {
+			dmc_idx = rel_index + start_index;
+			if ((EIO_CACHE_STATE_GET(dmc, dmc_idx) &
+			     (DIRTY | BLOCK_IO_INPROG)) == DIRTY) {
+				EIO_CACHE_STATE_ON(dmc, dmc_idx,
+						   DISKWRITEINPROG);
+				nr_writes++;
+			}
+			rel_index = EIO_2Q_NEXT(&blkptr[rel_index]);
+		}
+	}
+
+	return nr_writes;
+}
+
+/*
+ * Rank the blocks of a set, A1 in the lower half of the ranks and Am in
+ * the upper half, each by its place from the head of its queue.
+ */
+void eio_2q_rank_get(struct eio_policy *p_ops, index_t set, u_int8_t *ranks)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_2q_cache_set *qset;
+	struct eio_2q_cache_block *blkptr;
+	index_t start_index = set * dmc->assoc;
+	u_int16_t rel_index;
+	u_int32_t pos;
+	int am;
+
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	blkptr = (struct eio_2q_cache_block *)dmc->sp_cache_blk + start_index;
+
+	memset(ranks, 0, dmc->assoc);
+	for (am = 0; am < 2; am++) {
+		pos = 0;
+		rel_index = am ? qset->am_head : qset->a1_head;
+		while (rel_index != EIO_2Q_NULL) {
+			ranks[rel_index] = (am ? 0x80 : 0) |
+					   (EIO_RANK(pos, dmc->assoc) >> 1);
+			pos++;
+			rel_index = EIO_2Q_NEXT(&blkptr[rel_index]);
+		}
+	}
+}
+
+/*
+ * Rebuild the queues of a set, order holds its blocks coldest first so
+ * that those of A1 come before those of Am.
+ */
+void eio_2q_rank_set(struct eio_policy *p_ops, index_t set,
+		     const u_int8_t *ranks, const u_int16_t *order)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_2q_cache_set *qset;
+	index_t start_index = set * dmc->assoc;
+	u_int32_t i;
+
+	qset = (struct eio_2q_cache_set *)dmc->sp_cache_set + set;
+	qset->a1_head = EIO_2Q_NULL;
+	qset->a1_tail = EIO_2Q_NULL;
+	qset->am_head = EIO_2Q_NULL;
+	qset->am_tail = EIO_2Q_NULL;
+	qset->a1_count = 0;
+	for (i = 0; i < dmc->assoc; i++)
+		eio_2q_add_tail(dmc, start_index + order[i],
+				ranks[order[i]] & 0x80);
+}
+
+/*
+ * 2Q specific functions.
+ */
+
+/*
+ * Called on the allocation of an invalid block and on cache hits.
+ * A newly allocated block goes to the tail of A1, a hit block to
+ * the tail of Am.
+ */
+void eio_2q_touch(struct cache_c *dmc, index_t index, struct eio_policy *p_ops)
+{
+	eio_2q_unlink(dmc, index);
+	eio_2q_add_tail(dmc, index,
+			EIO_CACHE_STATE_GET(dmc, index) != INVALID);
+}
+
+/* Queue all the blocks on A1, loaded blocks have to earn their place */
+void eio_2q_pushblks(struct eio_policy *p_ops)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	int i;
+
+	for (i = 0; i < (int)dmc->size; i++)
+		eio_2q_add_tail(dmc, i, 0);
+	return;
+}
+
+static
+int __init q2_register(void)
+{
+	int ret;
+
+	ret = eio_register_policy(&eio_2q_ops);
+	if (ret != 0)
+		pr_info("eio_2q already registered");
+
+	return ret;
+}
+
+static
+void __exit q2_unregister(void)
+{
+	int ret;
+
+	ret = eio_unregister_policy(&eio_2q_ops);
+	if (ret != 0)
+		pr_err("eio_2q unregister failed");
+}
+
+module_init(q2_register);
+module_exit(q2_unregister);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("2Q policy for EnhanceIO");
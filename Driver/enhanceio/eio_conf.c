@@ -230,6 +230,9 @@ static int eio_kcached_init(struct cache_c *dmc)
 
 	/* init_waitqueue_head(&dmc->destroyq); */
 	atomic_set(&dmc->nr_jobs, 0);
+	spin_lock_init(&dmc->job_lock);
+	INIT_LIST_HEAD(&dmc->disk_read_jobs);
+	INIT_WORK(&dmc->disk_read_work, eio_do_disk_read_jobs);
 	return 0;
 }
 
@@ -238,14 +241,21 @@ static void eio_kcached_client_destroy(struct cache_c *dmc)
 
 	/* Wait for all IOs
 	   /wait_event(dmc->destroyq, !atomic_read(&dmc->nr_jobs));*/
+
+	/* Wait for any pending ssd read failure reissue */
+	flush_work(&dmc->disk_read_work);
+	EIO_ASSERT(list_empty(&dmc->disk_read_jobs));
 }
 
-/* Store the cache superblock on ssd */
+/* Store the cache superblock on the ssds */
 int eio_sb_store(struct cache_c *dmc)
 {
 	union eio_superblock *sb = NULL;
 	struct eio_io_region where;
-	int error;
+	struct eio_ssd *ssd;
+	int error = 0;
+	int ret;
+	u_int32_t m;
 
 	struct bio_vec *sb_pages;
 	int nr_pages;
@@ -279,12 +289,8 @@ int eio_sb_store(struct cache_c *dmc)
 	sb->sbf.block_size = cpu_to_le32(dmc->block_size);
 	sb->sbf.size = cpu_to_le32(dmc->size);
 	sb->sbf.assoc = cpu_to_le32(dmc->assoc);
-	sb->sbf.cache_md_start_sect = cpu_to_le64(dmc->md_start_sect);
-	sb->sbf.cache_data_start_sect = cpu_to_le64(dmc->md_sectors);
 	strncpy(sb->sbf.disk_devname, dmc->disk_devname, DEV_PATHLEN);
-	strncpy(sb->sbf.cache_devname, dmc->cache_devname, DEV_PATHLEN);
 	strncpy(sb->sbf.ssd_uuid, dmc->ssd_uuid, DEV_PATHLEN - 1);
-	sb->sbf.cache_devsize = cpu_to_le64(eio_to_sector(eio_get_device_size(dmc->cache_dev)));
 	sb->sbf.disk_devsize = cpu_to_le64(eio_to_sector(eio_get_device_size(dmc->disk_dev)));
 	sb->sbf.cache_version = cpu_to_le32(dmc->sb_version);
 	strncpy(sb->sbf.cache_name, dmc->cache_name, DEV_PATHLEN);
@@ -315,16 +321,40 @@ int eio_sb_store(struct cache_c *dmc)
 		cpu_to_le32(dmc->sysctl_active.time_based_clean_interval);
 	sb->sbf.autoclean_threshold = cpu_to_le32(dmc->sysctl_active.autoclean_threshold);
 	sb->sbf.cache_wronly = cpu_to_le32(dmc->sysctl_active.cache_wronly);
+	sb->sbf.cache_rank_saved = cpu_to_le32(dmc->rank_saved);
+	sb->sbf.cache_nr_ssds = cpu_to_le32(dmc->nr_ssds);
 
-	/* write out to ssd */
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = EIO_SUPERBLOCK_START;
-	where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
-	error = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, sb_pages, nr_pages);
-	if (error) {
-		pr_err
-			("sb_store: Could not write out superblock to sector %llu (error %d) for cache \"%s\".\n",
-			(unsigned long long)where.sector, error, dmc->cache_name);
+	/*
+	 * Write out to each ssd, with its own layout. An ssd which is
+	 * offline gets its superblock when it is added back.
+	 */
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		if (ssd->ssd_offline)
+			continue;
+		sb->sbf.cache_md_start_sect = cpu_to_le64(ssd->ssd_md_start_sect);
+		sb->sbf.cache_data_start_sect =
+			cpu_to_le64(ssd->ssd_data_start_sect);
+		sb->sbf.cache_rank_start_sect =
+			cpu_to_le64(ssd->ssd_rank_start_sect);
+		strncpy(sb->sbf.cache_devname, ssd->ssd_devname, DEV_PATHLEN);
+		sb->sbf.cache_devsize =
+			cpu_to_le64(eio_to_sector(eio_get_device_size(ssd->ssd_dev)));
+		sb->sbf.cache_ssd_index = cpu_to_le32(m);
+
+		where.bdev = ssd->ssd_dev->bdev;
+		where.sector = EIO_SUPERBLOCK_START;
+		where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
+		ret = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, sb_pages,
+				     nr_pages);
+		if (ret) {
+			pr_err
+				("sb_store: Could not write out superblock to sector %llu of %s (error %d) for cache \"%s\".\n",
+				(unsigned long long)where.sector,
+				ssd->ssd_devname, ret, dmc->cache_name);
+			if (!error)
+				error = ret;
+		}
 	}
 
 	/* free the allocated pages here */
@@ -340,26 +370,217 @@ int eio_sb_store(struct cache_c *dmc)
 }
 
 /*
- * Write out the metadata one sector at a time.
- * Then dump out the superblock.
+ * Write out or read back the policy ranks, as many sets per I/O as
+ * fit in the md pages. Each SSD holds the ranks of its sets. Ranks are
+ * read into the policy after its lists are built by
+ * eio_policy_lru_pushblks().
  */
-int eio_md_store(struct cache_c *dmc)
+static int eio_rank_io(struct cache_c *dmc, unsigned op)
+{
+	struct eio_io_region where;
+	struct bio_vec *pages;
+	void **pg_virt_addr = NULL;
+	u_int8_t *ranks = NULL;
+	u_int16_t *order;
+	struct eio_ssd *ssd = &dmc->ssds[0];
+	index_t nr_sets = eio_ssd_nr_sets(dmc);
+	index_t sets_per_io;
+	index_t set, k;
+	u_int32_t offset;
+	u_int32_t m;
+	u_int32_t nr_bytes;
+	unsigned long flags;
+	int page_count = 0;
+	int nr_pages, io_pages;
+	int error = 0;
+	u_int32_t j;
+	int i;
+
+	pages = eio_alloc_pages(dmc->bio_nr_pages, &page_count);
+	if (pages == NULL)
+		return -ENOMEM;
+	nr_pages = page_count;
+	sets_per_io = ((index_t)nr_pages * PAGE_SIZE) >> dmc->consecutive_shift;
+	where.sector = 0;
+
+	ranks = vmalloc(dmc->assoc * (sizeof(u_int8_t) + sizeof(u_int16_t)));
+	pg_virt_addr = kmalloc(nr_pages * sizeof(void *), GFP_KERNEL);
+	if (sets_per_io == 0 || ranks == NULL || pg_virt_addr == NULL) {
+		error = -ENOMEM;
+		goto out;
+	}
+	order = (u_int16_t *)(ranks + dmc->assoc);
+
+	for (i = 0; i < nr_pages; i++)
+		pg_virt_addr[i] = kmap(pages[i].bv_page);
+
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		if (ssd->ssd_offline)
+			continue;
+		where.bdev = ssd->ssd_dev->bdev;
+		where.sector = ssd->ssd_rank_start_sect;
+		for (set = 0; set < nr_sets; set += sets_per_io) {
+			k = min_t(index_t, sets_per_io, nr_sets - set);
+			nr_bytes = (u_int32_t)(k << dmc->consecutive_shift);
+			where.count = eio_to_sector(roundup(nr_bytes, 512));
+			io_pages = DIV_ROUND_UP(nr_bytes, PAGE_SIZE);
+
+			if (op == REQ_OP_READ) {
+				error = eio_io_sync_vm(dmc, &where, op, 0, pages,
+						       io_pages);
+				if (error)
+					goto unmap;
+			}
+
+			for (offset = 0; offset < nr_bytes; offset += dmc->assoc) {
+				index_t cur = eio_ssd_set(dmc, ssd, set +
+							  (offset >> dmc->consecutive_shift));
+				u_int8_t *p;
+
+				if (op == REQ_OP_WRITE) {
+					spin_lock_irqsave(&dmc->cache_sets[cur].cs_lock,
+							  flags);
+					error = eio_policy_rank_get(dmc->policy_ops,
+								    cur, ranks);
+					spin_unlock_irqrestore(&dmc->cache_sets[cur].
+							       cs_lock, flags);
+					if (error)
+						goto unmap;
+				}
+				for (j = 0; j < dmc->assoc; j++) {
+					p = (u_int8_t *)pg_virt_addr[(offset + j) /
+								     PAGE_SIZE] +
+					    (offset + j) % PAGE_SIZE;
+					if (op == REQ_OP_WRITE)
+						*p = ranks[j];
+					else
+						ranks[j] = *p;
+				}
+				if (op == REQ_OP_READ) {
+					error = eio_policy_rank_set(dmc->policy_ops,
+								    cur, ranks, order);
+					if (error)
+						goto unmap;
+				}
+			}
+
+			if (op == REQ_OP_WRITE) {
+				error = eio_io_sync_vm(dmc, &where, op, 0, pages,
+						       io_pages);
+				if (error)
+					goto unmap;
+			}
+			where.sector += where.count;
+		}
+	}
+
+unmap:
+	for (i = 0; i < nr_pages; i++)
+		kunmap(pages[i].bv_page);
+out:
+	if (error)
+		pr_err("rank_io: Could not %s the policy ranks at sector %llu of %s (error %d)",
+		       op == REQ_OP_WRITE ? "write" : "read",
+		       (unsigned long long)where.sector, ssd->ssd_devname,
+		       error);
+	kfree(pg_virt_addr);
+	vfree(ranks);
+	for (i = 0; i < nr_pages; i++)
+		put_page(pages[i].bv_page);
+	kfree(pages);
+
+	return error;
+}
+
+/*
+ * Write out the md of the sets first_set to end_set - 1 of an SSD, as
+ * many blocks per I/O as fit in the md pages.
+ */
+static int
+eio_md_store_sets(struct cache_c *dmc, struct eio_ssd *ssd, index_t first_set,
+		  index_t end_set, struct bio_vec *pages, void **pg_virt_addr,
+		  int nr_pages, sector_t *sectors_written)
 {
 	struct flash_cacheblock *next_ptr;
 	struct eio_io_region where;
-	sector_t i;
-	int j, k;
+	index_t per_io = (index_t)MD_BLOCKS_PER_PAGE * nr_pages;
+	index_t first, end;
+	index_t i, n, k, index;
+	int error;
+
+	/* Blocks of the SSD, from an md sector boundary */
+	first = first_set * dmc->assoc;
+	first -= first % MD_BLOCKS_PER_SECTOR;
+	end = min_t(index_t, roundup(end_set * dmc->assoc, MD_BLOCKS_PER_SECTOR),
+		    eio_ssd_nr_sets(dmc) * dmc->assoc);
+
+	where.bdev = ssd->ssd_dev->bdev;
+	for (i = first; i < end; i += n) {
+		n = min_t(index_t, per_io, end - i);
+		for (k = 0; k < n; k++) {
+			next_ptr = (struct flash_cacheblock *)
+				   pg_virt_addr[k / MD_BLOCKS_PER_PAGE] +
+				   k % MD_BLOCKS_PER_PAGE;
+			index = eio_ssd_block(dmc, ssd, i + k);
+			next_ptr->dbn = cpu_to_le64(EIO_DBN_GET(dmc, index));
+			if (eio_sub_partial(dmc, index))
+				next_ptr->cache_state = cpu_to_le64(INVALID);
+			else
+				next_ptr->cache_state =
+					cpu_to_le64(EIO_CACHE_STATE_GET(dmc,
+									index) &
+						    (INVALID | VALID | DIRTY));
+		}
+		/* Zero out the rest of the last sector */
+		for (; k % MD_BLOCKS_PER_SECTOR; k++) {
+			next_ptr = (struct flash_cacheblock *)
+				   pg_virt_addr[k / MD_BLOCKS_PER_PAGE] +
+				   k % MD_BLOCKS_PER_PAGE;
+			memset(next_ptr, 0, sizeof(*next_ptr));
+		}
+
+		where.sector = ssd->ssd_md_start_sect + INDEX_TO_MD_SECTOR(i);
+		where.count = k / MD_BLOCKS_PER_SECTOR;
+		error = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, pages,
+				       DIV_ROUND_UP(k, MD_BLOCKS_PER_PAGE));
+		if (error) {
+			pr_err
+				("md_store: Could not write out metadata to sector %llu of %s (error %d)",
+				(unsigned long long)where.sector,
+				ssd->ssd_devname, error);
+			return error;
+		}
+		*sectors_written += where.count;
+	}
+
+	return 0;
+}
+
+/*
+ * Write out the metadata of the sets changed since it was last written,
+ * consecutive changed sets at once. Then dump out the superblock.
+ */
+int eio_md_store(struct cache_c *dmc)
+{
+	struct eio_ssd *ssd;
+	index_t nr_sets = eio_ssd_nr_sets(dmc);
+	index_t set, end_set;
+	u_int32_t m;
+	int k;
 	int num_valid = 0, num_dirty = 0;
 	int error;
 	int write_errors = 0;
-	sector_t sectors_written = 0, sectors_expected = 0;     /* debug */
-	int slots_written = 0;                                  /* How many cache slots did we fill in this MD io block ? */
+	sector_t sectors_written = 0;
 
 	struct bio_vec *pages;
 	int nr_pages;
-	int page_count, page_index;
+	int page_count;
 	void **pg_virt_addr;
 
+	/* The in-core md must be complete before it is written out */
+	flush_work(&dmc->md_load_work);
+
 	if (unlikely(CACHE_FAILED_IS_SET(dmc))
 	    || unlikely(CACHE_DEGRADED_IS_SET(dmc))) {
 		pr_err
@@ -398,10 +619,6 @@ int eio_md_store(struct cache_c *dmc)
 
 	/* get the exact number of pages allocated */
 	nr_pages = page_count;
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = dmc->md_start_sect;
-	slots_written = 0;
-	page_index = 0;
 
 	pg_virt_addr = kmalloc(nr_pages * (sizeof(void *)), GFP_KERNEL);
 	if (pg_virt_addr == NULL) {
@@ -415,116 +632,50 @@ int eio_md_store(struct cache_c *dmc)
 	for (k = 0; k < nr_pages; k++)
 		pg_virt_addr[k] = kmap(pages[k].bv_page);
 
-	next_ptr = (struct flash_cacheblock *)pg_virt_addr[page_index];
-	j = MD_BLOCKS_PER_PAGE;
-
 	pr_info("Writing out metadata to cache device. Please wait...");
 
-	for (i = 0; i < dmc->size; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, (index_t)i) & VALID)
-			num_valid++;
-		if (EIO_CACHE_STATE_GET(dmc, (index_t)i) & DIRTY)
-			num_dirty++;
-		next_ptr->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
-		next_ptr->cache_state = cpu_to_le64(EIO_CACHE_STATE_GET(dmc, (index_t)i) &
-					(INVALID | VALID | DIRTY));
-
-		next_ptr++;
-		slots_written++;
-		j--;
-		if (j == 0) {
-			/*
-			 * Filled the page, goto the next page.
-			 */
-			page_index++;
-
-			if (slots_written ==
-			    (int)(MD_BLOCKS_PER_PAGE * nr_pages)) {
-				/*
-				 * Wrote out an entire metadata IO block, write the block to the ssd.
-				 */
-				where.count =
-					slots_written / MD_BLOCKS_PER_SECTOR;
-				slots_written = 0;
-				page_index = 0;
-				sectors_written += where.count; /* debug */
-
-				error =
-					eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, pages,
-						       nr_pages);
-
-				if (error) {
-					write_errors++;
-					pr_err
-						("md_store: Could not write out metadata to sector %llu (error %d)",
-						(unsigned long long)where.sector, error);
-				}
-				where.sector += where.count;    /* Advance offset */
+	/*
+	 * The changed bits are cleared before the md of their sets is read,
+	 * a set changing meanwhile is written again by the next md store.
+	 * The sets of an offline SSD keep their bits until it is added back.
+	 */
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		if (ssd->ssd_offline)
+			continue;
+		for (set = 0; set < nr_sets; set = end_set) {
+			while (set < nr_sets &&
+			       !test_bit(eio_ssd_set(dmc, ssd, set),
+					 dmc->md_changed))
+				set++;
+			if (set >= nr_sets)
+				break;
+			for (end_set = set; end_set < nr_sets &&
+			     test_bit(eio_ssd_set(dmc, ssd, end_set),
+				      dmc->md_changed); end_set++)
+				clear_bit(eio_ssd_set(dmc, ssd, end_set),
+					  dmc->md_changed);
+			smp_mb__after_atomic();
+
+			error = eio_md_store_sets(dmc, ssd, set, end_set, pages,
+						  pg_virt_addr, nr_pages,
+						  &sectors_written);
+			if (error) {
+				write_errors++;
+				for (k = set; k < end_set; k++)
+					set_bit(eio_ssd_set(dmc, ssd, k),
+						dmc->md_changed);
 			}
-			/* Move next slot pointer into next sector */
-			next_ptr =
-				(struct flash_cacheblock *)pg_virt_addr[page_index];
-			j = MD_BLOCKS_PER_PAGE;
 		}
 	}
 
-	if (next_ptr != (struct flash_cacheblock *)pg_virt_addr[0]) {
-		/* Write the remaining last page out */
-		EIO_ASSERT(slots_written > 0);
-
-		where.count = slots_written / MD_BLOCKS_PER_SECTOR;
-
-		if (slots_written % MD_BLOCKS_PER_SECTOR)
-			where.count++;
-
-		sectors_written += where.count;
-
-		/*
-		 * This may happen that we are at the beginning of the next page
-		 * and did not fill up any slots in this page. Verify this condition
-		 * and set page_index accordingly.
-		 */
-
-		if (next_ptr !=
-		    (struct flash_cacheblock *)pg_virt_addr[page_index]) {
-			unsigned offset;
-
-			slots_written = slots_written % MD_BLOCKS_PER_PAGE;
-
-			/*
-			 * We have some extra slots written at this page_index.
-			 * Let us try to zero out the remaining page size before submitting
-			 * this page.
-			 */
-			offset =
-				slots_written * (sizeof(struct flash_cacheblock));
-			memset(pg_virt_addr[page_index] + offset, 0,
-			       PAGE_SIZE - offset);
-
-			page_index++;
-		}
-
-		error = eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, pages, page_index);
-		/* XXX: should we call eio_sb_store() on error ?? */
-		if (error) {
-			write_errors++;
-			pr_err
-				("md_store: Could not write out metadata to sector %llu (error %d)",
-				(unsigned long long)where.sector, error);
-		}
-	}
-
-	/* Debug Tests */
-	sectors_expected = EIO_DIV(dmc->size, MD_BLOCKS_PER_SECTOR);
-	if (EIO_REM(dmc->size, MD_BLOCKS_PER_SECTOR))
-		sectors_expected++;
-	EIO_ASSERT(sectors_expected == sectors_written);
-	/* XXX: should we call eio_sb_store() on error ?? */
-	if (sectors_expected != sectors_written) {
-		pr_err
-			("md_store: Sector mismatch! sectors_expected=%llu, sectors_written=%llu\n",
-			(unsigned long long)sectors_expected, (unsigned long long)sectors_written);
-	}
+	num_valid = (int)atomic64_read(&dmc->cached_blocks);
+	num_dirty = (int)atomic64_read(&dmc->nr_dirty);
+	pr_info("md_store: Wrote %llu of %llu metadata sectors",
+		(unsigned long long)sectors_written,
+		(unsigned long long)dmc->nr_ssds *
+		INDEX_TO_MD_SECTOR(nr_sets * dmc->assoc +
+				   MD_BLOCKS_PER_SECTOR - 1));
 
 	for (k = 0; k < nr_pages; k++)
 		kunmap(pages[k].bv_page);
@@ -544,6 +695,12 @@ int eio_md_store(struct cache_c *dmc)
 	} else
 		dmc->sb_state = CACHE_MD_STATE_UNSTABLE;
 
+	/* The ranks are only worth saving with a loadable md */
+	dmc->rank_saved = 0;
+	if (write_errors == 0 && dmc->ssds[0].ssd_rank_start_sect &&
+	    dmc->policy_ops && dmc->policy_ops->sp_rank_get)
+		dmc->rank_saved = !eio_rank_io(dmc, REQ_OP_WRITE);
+
 sb_store:
 	error = eio_sb_store(dmc);
 	if (error) {
@@ -567,29 +724,52 @@ sb_store:
 	}
 
 	pr_info("Valid blocks: %d, Dirty blocks: %d, Metadata sectors: %llu",
-		num_valid, num_dirty, (long long unsigned int)dmc->md_sectors);
+		num_valid, num_dirty,
+		(long long unsigned int)dmc->ssds[0].ssd_data_start_sect);
 
 	return 0;
 }
 
+/*
+ * Sectors from the SSD start to the cache data for nr_blocks blocks,
+ * with the ranks region or not.
+ */
+static void
+eio_md_layout(struct cache_c *dmc, struct eio_ssd *ssd, sector_t nr_blocks,
+	      int ranks)
+{
+	ssd->ssd_data_start_sect = INDEX_TO_MD_SECTOR(nr_blocks);
+	ssd->ssd_rank_start_sect = 0;
+	if (ranks) {
+		ssd->ssd_data_start_sect = ALIGN(ssd->ssd_data_start_sect, 8);
+		ssd->ssd_rank_start_sect = ssd->ssd_md_start_sect +
+					   ssd->ssd_data_start_sect;
+		ssd->ssd_data_start_sect += EIO_RANK_SECTORS(nr_blocks);
+	}
+	ssd->ssd_data_start_sect +=
+		EIO_EXTRA_SECTORS(ssd->ssd_start_sect, ssd->ssd_data_start_sect);
+}
+
 static int eio_md_create(struct cache_c *dmc, int force, int cold)
 {
-	struct flash_cacheblock *next_ptr;
 	union eio_superblock *header;
 	struct eio_io_region where;
+	struct eio_ssd *ssd;
 	sector_t i;
-	int j, error;
+	int error;
 	uint64_t cache_size, dev_size;
 	sector_t order;
+	sector_t nr_sets, ssd_sets;
 	sector_t sectors_written = 0, sectors_expected = 0;     /* debug */
-	int slots_written = 0;                                  /* How many cache slots did we fill in this MD io block ? */
 
 	struct bio_vec *header_page = NULL;                     /* Header page */
 	struct bio_vec *pages = NULL;                           /* Metadata pages */
 	int nr_pages = 0;
-	int page_count, page_index;
+	int page_count;
 	int ret = 0, k;
 	void **pg_virt_addr = NULL;
+	int ranks;
+	u_int32_t m;
 
 	/* Allocate single page for superblock header.*/
 	page_count = 0;
@@ -619,26 +799,32 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 		goto free_header;
 	}
 
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = EIO_SUPERBLOCK_START;
-	where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
-	error = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0, header_page, 1);
-	if (error) {
-		pr_err
-			("md_create: Could not read superblock sector %llu error %d for cache \"%s\".\n",
-			(unsigned long long)where.sector, error, dmc->cache_name);
-		ret = -EINVAL;
-		goto free_header;
-	}
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		where.bdev = ssd->ssd_dev->bdev;
+		where.sector = EIO_SUPERBLOCK_START;
+		where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
+		error = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0,
+				       header_page, 1);
+		if (error) {
+			pr_err
+				("md_create: Could not read superblock sector %llu of %s error %d for cache \"%s\".\n",
+				(unsigned long long)where.sector,
+				ssd->ssd_devname, error, dmc->cache_name);
+			ret = -EINVAL;
+			goto free_header;
+		}
 
-	if (!force &&
-	    ((le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_DIRTY) ||
-	     (le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_CLEAN) ||
-	     (le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_FASTCLEAN))) {
-		pr_err
-			("md_create: Existing cache detected, use force to re-create.\n");
-		ret = -EINVAL;
-		goto free_header;
+		if (!force &&
+		    ((le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_DIRTY) ||
+		     (le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_CLEAN) ||
+		     (le32_to_cpu(header->sbf.cache_sb_state) == CACHE_MD_STATE_FASTCLEAN))) {
+			pr_err
+				("md_create: Existing cache detected on %s, use force to re-create.\n",
+				ssd->ssd_devname);
+			ret = -EINVAL;
+			goto free_header;
+		}
 	}
 
 	/*
@@ -646,20 +832,33 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	 * and here we also are making sure that metadata and userdata
 	 * on SSD is aligned at 8K boundary.
 	 *
-	 * Note dmc->size is in raw sectors
+	 * Every SSD holds as many sets, as many as fit on the smallest one.
 	 */
-	dmc->md_start_sect = EIO_METADATA_START(dmc->cache_dev_start_sect);
-	dmc->md_sectors =
-		INDEX_TO_MD_SECTOR(EIO_DIV(dmc->size, (sector_t)dmc->block_size));
-	dmc->md_sectors +=
-		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
-	dmc->size -= dmc->md_sectors;   /* total sectors available for cache */
-	do_div(dmc->size, dmc->block_size);
-	dmc->size = EIO_DIV(dmc->size, dmc->assoc) * (sector_t)dmc->assoc;
+	/* An SSD added back keeps the layout of its cache */
+	ranks = CACHE_SSD_ADD_INPROG_IS_SET(dmc) ?
+		(dmc->ssds[0].ssd_rank_start_sect != 0) :
+		!(dmc->cache_flags & CACHE_FLAGS_NO_POLICY_RANKS);
+	nr_sets = 0;
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		ssd->ssd_md_start_sect = EIO_METADATA_START(ssd->ssd_start_sect);
+		eio_md_layout(dmc, ssd,
+			      EIO_DIV(ssd->ssd_size, (sector_t)dmc->block_size),
+			      ranks);
+		ssd_sets = 0;
+		if (ssd->ssd_size > ssd->ssd_data_start_sect)
+			ssd_sets = EIO_DIV(EIO_DIV(ssd->ssd_size -
+						   ssd->ssd_data_start_sect,
+						   (sector_t)dmc->block_size),
+					   dmc->assoc);
+		if (m == 0 || ssd_sets < nr_sets)
+			nr_sets = ssd_sets;
+	}
+	dmc->size = nr_sets * dmc->assoc * dmc->nr_ssds;
 	/* Recompute since dmc->size was possibly trunc'ed down */
-	dmc->md_sectors = INDEX_TO_MD_SECTOR(dmc->size);
-	dmc->md_sectors +=
-		EIO_EXTRA_SECTORS(dmc->cache_dev_start_sect, dmc->md_sectors);
+	for (m = 0; m < dmc->nr_ssds; m++)
+		eio_md_layout(dmc, &dmc->ssds[m], nr_sets * dmc->assoc, ranks);
+	dmc->rank_saved = 0;
 
 	error = eio_mem_init(dmc);
 	if (error == -1) {
@@ -675,28 +874,31 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 		ret = -ENODEV;
 		goto free_header;
 	}
-	dev_size = eio_to_sector(eio_get_device_size(dmc->cache_dev));
-	cache_size = dmc->md_sectors + (dmc->size * dmc->block_size);
-	if (cache_size > dev_size) {
-		pr_err
-			("md_create: Requested cache size exceeds the cache device's capacity (%llu > %llu)",
-			(unsigned long long)cache_size, (unsigned long long)dev_size);
-		ret = -EINVAL;
-		goto free_header;
+	cache_size = 0;
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		dev_size = eio_to_sector(eio_get_device_size(ssd->ssd_dev));
+		i = ssd->ssd_data_start_sect +
+		    (nr_sets * dmc->assoc * dmc->block_size);
+		if (i > dev_size || nr_sets == 0) {
+			pr_err
+				("md_create: Requested cache size exceeds the cache device's capacity (%llu > %llu) on %s",
+				(unsigned long long)i, (unsigned long long)dev_size,
+				ssd->ssd_devname);
+			ret = -EINVAL;
+			goto free_header;
+		}
+		cache_size += i;
 	}
 
-	order =
-		dmc->size *
-		(EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) :
-		 sizeof(struct cacheblock));
-	i = EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) : sizeof(struct
-								  cacheblock);
+	order = eio_md_size(dmc);
+	i = EIO_MD_ENTRY_SIZE(dmc);
 	pr_info("Allocate %lluKB (%lluB per) mem for %llu-entry cache "	\
-		"(capacity:%lluMB, associativity:%u, block size:%u bytes)",
+		"(capacity:%lluMB, associativity:%u, block size:%u bytes, ssds:%u)",
 		(unsigned long long)order >> 10, (unsigned long long)i,
 		(long long unsigned int)dmc->size,
 		(unsigned long long)(cache_size >> (20 - SECTOR_SHIFT)), dmc->assoc,
-		dmc->block_size << SECTOR_SHIFT);
+		dmc->block_size << SECTOR_SHIFT, dmc->nr_ssds);
 
 	if (!eio_mem_available(dmc, order) && !CACHE_SSD_ADD_INPROG_IS_SET(dmc)) {
 		pr_err
@@ -710,12 +912,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	 * as part of cache creation (i.e., eio_ctr()) in the past.
 	 */
 	if (!CACHE_SSD_ADD_INPROG_IS_SET(dmc)) {
-		if (EIO_MD8(dmc))
-			dmc->cache_md8 = vmalloc((size_t)order);
-		else
-			dmc->cache = vmalloc((size_t)order);
-		if ((EIO_MD8(dmc) && !dmc->cache_md8)
-		    || (!EIO_MD8(dmc) && !dmc->cache)) {
+		if (eio_md_alloc(dmc)) {
 			pr_err
 				("md_create: Unable to allocate cache md for cache \"%s\".\n",
 				dmc->cache_name);
@@ -772,11 +969,6 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 		/* nr_pages is used for freeing the pages */
 		nr_pages = page_count;
 
-		where.bdev = dmc->cache_dev->bdev;
-		where.sector = dmc->md_start_sect;
-		slots_written = 0;
-		page_index = 0;
-
 		pg_virt_addr = kmalloc(nr_pages * (sizeof(void *)), GFP_KERNEL);
 		if (pg_virt_addr == NULL) {
 			pr_err("md_create: System memory too low.\n");
@@ -790,107 +982,26 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 		for (k = 0; k < nr_pages; k++)
 			pg_virt_addr[k] = kmap(pages[k].bv_page);
 
-		next_ptr = (struct flash_cacheblock *)pg_virt_addr[page_index];
-		j = MD_BLOCKS_PER_PAGE;
-
-		for (i = 0; i < dmc->size; i++) {
-			next_ptr->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
-			next_ptr->cache_state = 
-				cpu_to_le64(EIO_CACHE_STATE_GET(dmc,
-				(index_t)i) & (INVALID | VALID | DIRTY));
-			next_ptr++;
-			slots_written++;
-			j--;
-
-			if (j == 0) {
-
-				page_index++;
-
-				if ((unsigned)slots_written ==
-				    MD_BLOCKS_PER_PAGE * nr_pages) {
-
-					where.count =
-						slots_written /
-						MD_BLOCKS_PER_SECTOR;
-					slots_written = 0;
-					page_index = 0;
-					sectors_written += where.count; /* debug */
-					error =
-						eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0,
-							       pages, nr_pages);
-
-					if (error) {
-						if (!CACHE_SSD_ADD_INPROG_IS_SET
-							    (dmc))
-							vfree(EIO_CACHE(dmc));
-						pr_err
-							("md_create: Could not write cache metadata sector %llu error %d.\n for cache \"%s\".\n",
-							(unsigned long long)where.sector, error,
-							dmc->cache_name);
-						ret = -EIO;
-						goto free_md;
-					}
-					where.sector += where.count;    /* Advance offset */
-				}
-
-				/* Move next slot pointer into next page */
-				next_ptr =
-					(struct flash_cacheblock *)
-					pg_virt_addr[page_index];
-				j = MD_BLOCKS_PER_PAGE;
-			}
-		}
-
-		if (next_ptr != (struct flash_cacheblock *)pg_virt_addr[0]) {
-			/* Write the remaining last page out */
-			EIO_ASSERT(slots_written > 0);
-
-			where.count = slots_written / MD_BLOCKS_PER_SECTOR;
-
-			if (slots_written % MD_BLOCKS_PER_SECTOR)
-				where.count++;
-
-			sectors_written += where.count;
-
-			if (next_ptr !=
-			    (struct flash_cacheblock *)pg_virt_addr[page_index]) {
-				unsigned offset;
-
-				slots_written =
-					slots_written % MD_BLOCKS_PER_PAGE;
-
-				/*
-				 * We have some extra slots written at this page_index.
-				 * Let us try to zero out the remaining page size before submitting
-				 * this page.
-				 */
-				offset =
-					slots_written *
-					(sizeof(struct flash_cacheblock));
-				memset(pg_virt_addr[page_index] + offset, 0,
-				       PAGE_SIZE - offset);
-
-				page_index = page_index + 1;
-			}
-
-			error =
-				eio_io_sync_vm(dmc, &where, REQ_OP_WRITE, 0, pages,
-					       page_index);
+		for (m = 0; m < dmc->nr_ssds; m++) {
+			error = eio_md_store_sets(dmc, &dmc->ssds[m], 0, nr_sets,
+						  pages, pg_virt_addr, nr_pages,
+						  &sectors_written);
 			if (error) {
 				if (!CACHE_SSD_ADD_INPROG_IS_SET(dmc))
-					vfree((void *)EIO_CACHE(dmc));
+					eio_md_free(dmc);
 				pr_err
-					("md_create: Could not write cache metadata sector %llu error %d for cache \"%s\".\n",
-					(unsigned long long)where.sector, error, dmc->cache_name);
+					("md_create: Could not write cache metadata of %s error %d for cache \"%s\".\n",
+					dmc->ssds[m].ssd_devname, error,
+					dmc->cache_name);
 				ret = -EIO;
 				goto free_md;
 			}
 		}
 
 		/* Debug Tests */
-		sectors_expected = EIO_DIV(dmc->size, MD_BLOCKS_PER_SECTOR);
-		if (EIO_REM(dmc->size, MD_BLOCKS_PER_SECTOR))
-			sectors_expected++;
+		sectors_expected = INDEX_TO_MD_SECTOR(nr_sets * dmc->assoc +
+						      MD_BLOCKS_PER_SECTOR - 1) *
+				   dmc->nr_ssds;
 		if (sectors_expected != sectors_written) {
 			pr_err
 				("md_create: Sector mismatch! sectors_expected=%llu, sectors_written=%llu for cache \"%s\".\n",
@@ -899,6 +1010,8 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 			ret = -EIO;
 			goto free_md;
 		}
+		/* The SSD now holds the md as it is in core */
+		bitmap_zero(dmc->md_changed, dmc->size >> dmc->consecutive_shift);
 	}
 
 	/* if cold ends here */
@@ -909,7 +1022,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 		pr_err
 			("md_create: Cannot write metadata in failed/degraded mode for cache \"%s\".\n",
 			dmc->cache_name);
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		ret = -ENODEV;
 		goto free_md;
 	}
@@ -919,7 +1032,7 @@ static int eio_md_create(struct cache_c *dmc, int force, int cold)
 	error = eio_sb_store(dmc);
 	if (error) {
 		if (!CACHE_SSD_ADD_INPROG_IS_SET(dmc))
-			vfree((void *)EIO_CACHE(dmc));
+			eio_md_free(dmc);
 		pr_err
 			("md_create: Could not write cache superblock sector(error %d) for cache \"%s\"\n",
 			error, dmc->cache_name);
@@ -952,13 +1065,343 @@ free_header:
 	return ret;
 }
 
+/*
+ * A chunk of on-disk md being loaded. Chunks are read asynchronously,
+ * MD_LOAD_CHUNKS at a time, and each one is parsed into the in-core md
+ * on an unbound workqueue as soon as its read completes.
+ */
+struct eio_md_load_chunk {
+	struct cache_c *dmc;
+	struct work_struct work;
+	struct completion done;
+	struct bio_vec *pages;
+	void **pg_virt_addr;
+	int nr_pages;
+	int busy;                       /* read or parse in progress */
+	int clean_shutdown;
+	struct eio_ssd *ssd;            /* SSD the chunk is read from */
+	index_t start_index;            /* first block of the SSD in the chunk */
+	index_t nr_slots;               /* cache blocks in the chunk */
+	int error;
+	int num_valid;
+	int dirty_loaded;
+};
+
+static void eio_md_load_parse(struct work_struct *work)
+{
+	struct eio_md_load_chunk *chunk;
+	struct cache_c *dmc;
+	struct flash_cacheblock *next_ptr = NULL;
+	index_t i, j;
+	int page_index;
+
+	chunk = container_of(work, struct eio_md_load_chunk, work);
+	dmc = chunk->dmc;
+	if (chunk->error)
+		goto out;
+
+	for (j = 0, page_index = 0; j < chunk->nr_slots; j++) {
+
+		if ((j % MD_BLOCKS_PER_PAGE) == 0)
+			next_ptr =
+				(struct flash_cacheblock *)
+				chunk->pg_virt_addr[page_index++];
+		i = eio_ssd_block(dmc, chunk->ssd, chunk->start_index + j);
+
+		/* If unclean shutdown, only the DIRTY blocks are loaded.*/
+		if (chunk->clean_shutdown || (next_ptr->cache_state & DIRTY)) {
+
+			if (next_ptr->cache_state & DIRTY)
+				chunk->dirty_loaded++;
+
+			EIO_CACHE_STATE_SET(dmc, i,
+				(u_int8_t)le64_to_cpu(next_ptr->
+				cache_state) & ~QUEUED);
+
+			EIO_ASSERT((EIO_CACHE_STATE_GET(dmc, i) &
+				    (VALID | INVALID))
+				   != (VALID | INVALID));
+
+			if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
+				chunk->num_valid++;
+			EIO_DBN_SET(dmc, i, le64_to_cpu(next_ptr->dbn));
+		} else
+			eio_invalidate_md(dmc, i);
+		next_ptr++;
+	}
+
+out:
+	complete(&chunk->done);
+}
+
+/* Callback function for md chunk reads, parse the chunk off interrupt */
+static void eio_md_load_callback(int error, void *context)
+{
+	struct eio_md_load_chunk *chunk = (struct eio_md_load_chunk *)context;
+
+	chunk->error = error;
+	INIT_WORK(&chunk->work, eio_md_load_parse);
+	queue_work(system_unbound_wq, &chunk->work);
+}
+
+/* Wait for a chunk to be read and parsed, and account its blocks */
+static int
+eio_md_load_reap(struct eio_md_load_chunk *chunk, int *num_valid,
+		 int *dirty_loaded)
+{
+
+	wait_for_completion(&chunk->done);
+	chunk->busy = 0;
+	if (chunk->error) {
+		pr_err("md_load: Could not read cache metadata of blocks %llu-%llu of %s error %d",
+		       (unsigned long long)chunk->start_index,
+		       (unsigned long long)(chunk->start_index +
+					    chunk->nr_slots - 1),
+		       chunk->ssd->ssd_devname, chunk->error);
+		return -EIO;
+	}
+	*num_valid += chunk->num_valid;
+	*dirty_loaded += chunk->dirty_loaded;
+	return 0;
+}
+
+/*
+ * Load the on-disk md of all the cache blocks into the in-core md,
+ * an SSD after the other, keeping up to MD_LOAD_CHUNKS chunk reads in
+ * flight.
+ */
+static int
+eio_md_load_blocks(struct cache_c *dmc, int clean_shutdown, int *num_valid,
+		   int *dirty_loaded, sector_t *sectors_read)
+{
+	struct eio_md_load_chunk *chunks;
+	struct eio_md_load_chunk *chunk;
+	struct eio_io_region where;
+	struct eio_ssd *ssd;
+	index_t slots_read;
+	index_t index;
+	sector_t size;
+	int page_count;
+	int ret = 0;
+	int error;
+	int i, k;
+	u_int32_t m;
+
+	chunks = kzalloc(MD_LOAD_CHUNKS * sizeof(*chunks), GFP_KERNEL);
+	if (chunks == NULL) {
+		pr_err("md_load: System memory too low.");
+		return -ENOMEM;
+	}
+
+	for (k = 0; k < MD_LOAD_CHUNKS; k++) {
+		chunk = &chunks[k];
+		chunk->dmc = dmc;
+		chunk->clean_shutdown = clean_shutdown;
+		init_completion(&chunk->done);
+
+		/* Allocate pages of the order dmc->bio_nr_pages */
+		page_count = 0;
+		chunk->pages = eio_alloc_pages(dmc->bio_nr_pages, &page_count);
+		if (!chunk->pages) {
+			pr_err("md_load: unable to allocate pages");
+			ret = -ENOMEM;
+			goto free_chunks;
+		}
+		/* nr_pages is used for freeing the pages */
+		chunk->nr_pages = page_count;
+
+		chunk->pg_virt_addr = kmalloc(chunk->nr_pages * (sizeof(void *)),
+					      GFP_KERNEL);
+		if (chunk->pg_virt_addr == NULL) {
+			pr_err("md_load: System memory too low.");
+			ret = -ENOMEM;
+			goto free_chunks;
+		}
+		for (i = 0; i < chunk->nr_pages; i++)
+			chunk->pg_virt_addr[i] = kmap(chunk->pages[i].bv_page);
+	}
+
+	k = 0;
+	for (m = 0; m < dmc->nr_ssds && !ret; m++) {
+		ssd = &dmc->ssds[m];
+		where.bdev = ssd->ssd_dev->bdev;
+		where.sector = ssd->ssd_md_start_sect;
+		size = eio_ssd_nr_sets(dmc) * dmc->assoc;
+		index = 0;
+		while (size > 0) {
+			chunk = &chunks[k];
+			k = (k + 1) % MD_LOAD_CHUNKS;
+
+			/* Reuse the oldest chunk once it has been parsed */
+			if (chunk->busy) {
+				ret = eio_md_load_reap(chunk, num_valid, dirty_loaded);
+				if (ret)
+					break;
+			}
+
+			slots_read =
+				min((long)size, ((long)MD_BLOCKS_PER_PAGE * chunk->nr_pages));
+
+			if (slots_read % MD_BLOCKS_PER_SECTOR)
+				where.count = 1 + (slots_read / MD_BLOCKS_PER_SECTOR);
+			else
+				where.count = slots_read / MD_BLOCKS_PER_SECTOR;
+
+			if (slots_read % MD_BLOCKS_PER_PAGE)
+				page_count = 1 + (slots_read / MD_BLOCKS_PER_PAGE);
+			else
+				page_count = slots_read / MD_BLOCKS_PER_PAGE;
+
+			chunk->ssd = ssd;
+			chunk->start_index = index;
+			chunk->nr_slots = slots_read;
+			chunk->error = 0;
+			chunk->num_valid = 0;
+			chunk->dirty_loaded = 0;
+			reinit_completion(&chunk->done);
+			chunk->busy = 1;
+
+			*sectors_read += where.count;    /* Debug */
+			error = eio_io_async_bvec(dmc, &where, REQ_OP_READ, EIO_REQ_SYNC,
+						  chunk->pages, page_count,
+						  eio_md_load_callback, chunk, 0);
+			if (error) {
+				chunk->busy = 0;
+				pr_err
+					("md_load: Could not read cache metadata sector %llu of %s error %d",
+					(unsigned long long)where.sector,
+					ssd->ssd_devname, error);
+				ret = -EIO;
+				break;
+			}
+
+			where.sector += where.count;
+			index += slots_read;
+			size -= slots_read;
+		}
+	}
+
+	/* Wait for the chunks still in flight */
+	for (k = 0; k < MD_LOAD_CHUNKS; k++) {
+		if (!chunks[k].busy)
+			continue;
+		error = eio_md_load_reap(&chunks[k], num_valid, dirty_loaded);
+		if (error && !ret)
+			ret = error;
+	}
+
+free_chunks:
+	for (k = 0; k < MD_LOAD_CHUNKS; k++) {
+		chunk = &chunks[k];
+		if (chunk->pg_virt_addr) {
+			for (i = 0; i < chunk->nr_pages; i++)
+				kunmap(chunk->pages[i].bv_page);
+			kfree(chunk->pg_virt_addr);
+		}
+		if (chunk->pages) {
+			for (i = 0; i < chunk->nr_pages; i++)
+				put_page(chunk->pages[i].bv_page);
+			kfree(chunk->pages);
+		}
+	}
+	kfree(chunks);
+
+	return ret;
+}
+
+/*
+ * Check the superblocks of the SSDs after the first one of a striped
+ * cache against the first one, sb, and take their layout. An unclean
+ * shutdown of any of them is one of the cache.
+ */
+static int
+eio_md_load_stripe(struct cache_c *dmc, union eio_superblock *sb,
+		   int *clean_shutdown)
+{
+	union eio_superblock *header;
+	struct eio_io_region where;
+	struct bio_vec *header_page;
+	struct eio_ssd *ssd;
+	int page_count = 0;
+	int ret = 0;
+	u_int32_t m;
+
+	header_page = eio_alloc_pages(1, &page_count);
+	if (header_page == NULL) {
+		pr_err("md_load: Unable to allocate memory");
+		return -ENOMEM;
+	}
+	header = (union eio_superblock *)kmap(header_page[0].bv_page);
+
+	for (m = 1; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		where.bdev = ssd->ssd_dev->bdev;
+		where.sector = EIO_SUPERBLOCK_START;
+		where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
+		ret = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0, header_page, 1);
+		if (ret) {
+			pr_err
+				("md_load: Could not read cache superblock of %s error %d",
+				ssd->ssd_devname, ret);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (le32_to_cpu(header->sbf.magic) != EIO_MAGIC ||
+		    header->sbf.cache_version != sb->sbf.cache_version ||
+		    strncmp(header->sbf.cache_name, sb->sbf.cache_name,
+			    DEV_PATHLEN) ||
+		    header->sbf.cache_nr_ssds != sb->sbf.cache_nr_ssds ||
+		    le32_to_cpu(header->sbf.cache_ssd_index) != m ||
+		    header->sbf.size != sb->sbf.size ||
+		    header->sbf.assoc != sb->sbf.assoc ||
+		    header->sbf.block_size != sb->sbf.block_size) {
+			pr_err
+				("md_load: %s is not SSD %u of cache \"%s\"",
+				ssd->ssd_devname, m, dmc->cache_name);
+			ret = -EINVAL;
+			break;
+		}
+
+		if (le32_to_cpu(header->sbf.cache_sb_state) ==
+		    CACHE_MD_STATE_DIRTY) {
+			pr_info("Unclean shutdown detected on %s",
+				ssd->ssd_devname);
+			*clean_shutdown = 0;
+			dmc->rank_restore = 0;
+		} else if (!(le32_to_cpu(header->sbf.cache_sb_state) ==
+			     CACHE_MD_STATE_CLEAN ||
+			     le32_to_cpu(header->sbf.cache_sb_state) ==
+			     CACHE_MD_STATE_FASTCLEAN)) {
+			pr_err("md_load: Corrupt cache superblock on %s",
+			       ssd->ssd_devname);
+			ret = -EINVAL;
+			break;
+		}
+		if (!le32_to_cpu(header->sbf.cache_rank_saved))
+			dmc->rank_restore = 0;
+
+		ssd->ssd_md_start_sect =
+			le64_to_cpu(header->sbf.cache_md_start_sect);
+		ssd->ssd_data_start_sect =
+			le64_to_cpu(header->sbf.cache_data_start_sect);
+		ssd->ssd_rank_start_sect =
+			le64_to_cpu(header->sbf.cache_rank_start_sect);
+		dmc->cache_size += le64_to_cpu(header->sbf.cache_devsize);
+	}
+
+	kunmap(header_page[0].bv_page);
+	put_page(header_page[0].bv_page);
+	kfree(header_page);
+
+	return ret;
+}
+
 static int eio_md_load(struct cache_c *dmc)
 {
-	struct flash_cacheblock *meta_data_cacheblock, *next_ptr;
 	union eio_superblock *header;
 	struct eio_io_region where;
 	int i;
-	index_t j, slots_read;
 	sector_t size;
 	int clean_shutdown;
 	int dirty_loaded = 0;
@@ -967,11 +1410,14 @@ static int eio_md_load(struct cache_c *dmc)
 	int error;
 	sector_t sectors_read = 0, sectors_expected = 0;        /* Debug */
 	int force_warm_boot = 0;
+	ktime_t start_time;
+	s64 elapsed_ms;
+	index_t index;
+	u_int32_t nr_ssds, ssd_index;
 
-	struct bio_vec *header_page, *pages;
-	int nr_pages, page_count, page_index;
+	struct bio_vec *header_page;
+	int page_count;
 	int ret = 0;
-	void **pg_virt_addr;
 
 	page_count = 0;
 	header_page = eio_alloc_pages(1, &page_count);
@@ -990,7 +1436,7 @@ static int eio_md_load(struct cache_c *dmc)
 		goto free_header;
 	}
 
-	where.bdev = dmc->cache_dev->bdev;
+	where.bdev = dmc->ssds[0].ssd_dev->bdev;
 	where.sector = EIO_SUPERBLOCK_START;
 	where.count = eio_to_sector(EIO_SUPERBLOCK_SIZE);
 	error = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0, header_page, 1);
@@ -1003,7 +1449,8 @@ static int eio_md_load(struct cache_c *dmc)
 	}
 
 	/* check ondisk superblock version */
-	if (le32_to_cpu(header->sbf.cache_version) != EIO_SB_VERSION) {
+	if (le32_to_cpu(header->sbf.cache_version) < EIO_SB_COMPAT_VERSION ||
+	    le32_to_cpu(header->sbf.cache_version) > EIO_SB_VERSION) {
 		pr_info("md_load: Cache superblock mismatch detected." \
 			" (current: %u, ondisk: %u)", EIO_SB_VERSION,
 			header->sbf.cache_version);
@@ -1030,7 +1477,8 @@ static int eio_md_load(struct cache_c *dmc)
 			ret = 1;
 			goto free_header;
 		} else if ((le32_to_cpu(header->sbf.mode) == CACHE_MODE_RO) ||
-			   (le32_to_cpu(header->sbf.mode) == CACHE_MODE_WT)) {
+			   (le32_to_cpu(header->sbf.mode) == CACHE_MODE_WT) ||
+			   (le32_to_cpu(header->sbf.mode) == CACHE_MODE_UH)) {
 			dmc->persistence = CACHE_FORCECREATE;
 			pr_info("md_load: Can't enable cache, recreating" \
 				" cache %s with newer superblock version.",
@@ -1051,6 +1499,21 @@ static int eio_md_load(struct cache_c *dmc)
 		goto free_header;
 	}
 
+	/* The SSDs must be given as the cache was striped over them */
+	nr_ssds = 1;
+	ssd_index = 0;
+	if (le32_to_cpu(header->sbf.cache_version) >= EIO_SB_STRIPE_VERSION) {
+		nr_ssds = le32_to_cpu(header->sbf.cache_nr_ssds);
+		ssd_index = le32_to_cpu(header->sbf.cache_ssd_index);
+	}
+	if (nr_ssds != dmc->nr_ssds || ssd_index != 0) {
+		pr_err("md_load: Cache %s is striped over %u SSDs, %s is SSD %u of them, %u SSDs given",
+		       header->sbf.cache_name, nr_ssds,
+		       dmc->ssds[0].ssd_devname, ssd_index, dmc->nr_ssds);
+		ret = -EINVAL;
+		goto free_header;
+	}
+
 	dmc->sb_version = EIO_SB_VERSION;
 
 	/*
@@ -1132,8 +1595,25 @@ static int eio_md_load(struct cache_c *dmc)
 	dmc->cache_size = le64_to_cpu(header->sbf.cache_devsize);
 	dmc->assoc = le32_to_cpu(header->sbf.assoc);
 	dmc->consecutive_shift = ffs(dmc->assoc) - 1;
-	dmc->md_start_sect = le64_to_cpu(header->sbf.cache_md_start_sect);
-	dmc->md_sectors = le64_to_cpu(header->sbf.cache_data_start_sect);
+	dmc->ssds[0].ssd_md_start_sect =
+		le64_to_cpu(header->sbf.cache_md_start_sect);
+	dmc->ssds[0].ssd_data_start_sect =
+		le64_to_cpu(header->sbf.cache_data_start_sect);
+	dmc->ssds[0].ssd_rank_start_sect = 0;
+	dmc->rank_saved = 0;
+	dmc->rank_restore = 0;
+	if (le32_to_cpu(header->sbf.cache_version) >= EIO_SB_RANK_VERSION) {
+		dmc->ssds[0].ssd_rank_start_sect =
+			le64_to_cpu(header->sbf.cache_rank_start_sect);
+		dmc->rank_restore = clean_shutdown &&
+				    dmc->ssds[0].ssd_rank_start_sect &&
+				    le32_to_cpu(header->sbf.cache_rank_saved);
+	}
+	if (dmc->nr_ssds > 1) {
+		ret = eio_md_load_stripe(dmc, header, &clean_shutdown);
+		if (ret)
+			goto free_header;
+	}
 	dmc->sysctl_active.dirty_high_threshold =
 		le32_to_cpu(header->sbf.dirty_high_threshold);
 	dmc->sysctl_active.dirty_low_threshold =
@@ -1155,190 +1635,104 @@ static int eio_md_load(struct cache_c *dmc)
 		goto free_header;
 	}
 
-	order =
-		dmc->size *
-		((i ==
-		  1) ? sizeof(struct cacheblock_md8) : sizeof(struct cacheblock));
+	order = eio_md_size(dmc);
 	data_size = dmc->size * dmc->block_size;
-	size =
-		EIO_MD8(dmc) ? sizeof(struct cacheblock_md8) : sizeof(struct
-								      cacheblock);
+	size = EIO_MD_ENTRY_SIZE(dmc);
 	pr_info("Allocate %lluKB (%lluB per) mem for %llu-entry cache "	\
 		"(capacity:%lluMB, associativity:%u, block size:%u bytes)",
 		(unsigned long long)order >> 10, (unsigned long long)size,
 		(long long unsigned int)dmc->size,
-		(long long unsigned int)(dmc->md_sectors + data_size) >> (20 -
-									  SECTOR_SHIFT),
-		dmc->assoc, dmc->block_size << SECTOR_SHIFT);
-
-	if (EIO_MD8(dmc))
-		dmc->cache_md8 = vmalloc((size_t)order);
-	else
-		dmc->cache = vmalloc((size_t)order);
+		(long long unsigned int)(dmc->ssds[0].ssd_data_start_sect *
+					 dmc->nr_ssds + data_size) >>
+		(20 - SECTOR_SHIFT),
+		dmc->assoc, dmc->block_size << SECTOR_SHIFT);
 
-	if ((EIO_MD8(dmc) && !dmc->cache_md8) || (!EIO_MD8(dmc) && !dmc->cache)) {
+	if (eio_md_alloc(dmc)) {
 		pr_err("md_load: Unable to allocate memory");
 		vfree((void *)header);
 		return 1;
 	}
 
 	if (eio_repl_blk_init(dmc->policy_ops) != 0) {
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		pr_err
 			("md_load: Unable to allocate memory for policy cache block");
 		ret = -EINVAL;
 		goto free_header;
 	}
 
-	/* Allocate pages of the order dmc->bio_nr_pages */
-	page_count = 0;
-	pages = eio_alloc_pages(dmc->bio_nr_pages, &page_count);
-	if (!pages) {
-		pr_err("md_create: unable to allocate pages");
-		pr_err("md_create: Could not write out cache metadata");
-		vfree((void *)EIO_CACHE(dmc));
-		ret = -ENOMEM;
-		goto free_header;
-	}
-
-	/* nr_pages is used for freeing the pages */
-	nr_pages = page_count;
-
-	pg_virt_addr = kmalloc(nr_pages * (sizeof(void *)), GFP_KERNEL);
-	if (pg_virt_addr == NULL) {
-		pr_err("eio_md_store: System memory too low.");
-		for (i = 0; i < nr_pages; i++)
-			put_page(pages[i].bv_page);
-		kfree(pages);
-		ret = -ENOMEM;
-		goto free_header;
-	}
-
-	for (i = 0; i < nr_pages; i++)
-		pg_virt_addr[i] = kmap(pages[i].bv_page);
-
 	/*
-	 * Read 1 PAGE of the metadata at a time and load up the
-	 * incore metadata struct.
+	 * A clean read-only or write-through cache has no dirty block, it
+	 * can start with an empty in-core md and be loaded once active.
 	 */
-
-	page_index = 0;
-	page_count = 0;
-	meta_data_cacheblock =
-		(struct flash_cacheblock *)pg_virt_addr[page_index];
-
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = dmc->md_start_sect;
-	size = dmc->size;
-	i = 0;
-	while (size > 0) {
-		slots_read =
-			min((long)size, ((long)MD_BLOCKS_PER_PAGE * nr_pages));
-
-		if (slots_read % MD_BLOCKS_PER_SECTOR)
-			where.count = 1 + (slots_read / MD_BLOCKS_PER_SECTOR);
-		else
-			where.count = slots_read / MD_BLOCKS_PER_SECTOR;
-
-		if (slots_read % MD_BLOCKS_PER_PAGE)
-			page_count = 1 + (slots_read / MD_BLOCKS_PER_PAGE);
-		else
-			page_count = slots_read / MD_BLOCKS_PER_PAGE;
-
-		sectors_read += where.count;    /* Debug */
-		error = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0, pages, page_count);
-		if (error) {
-			vfree((void *)EIO_CACHE(dmc));
-			pr_err
-				("md_load: Could not read cache metadata sector %llu error %d",
-				(unsigned long long)where.sector, error);
-			ret = -EIO;
-			goto free_md;
-		}
-
-		where.sector += where.count;
-		next_ptr = meta_data_cacheblock;
-
-		for (j = 0, page_index = 0; j < slots_read; j++) {
-
-			if ((j % MD_BLOCKS_PER_PAGE) == 0)
-				next_ptr =
-					(struct flash_cacheblock *)
-					pg_virt_addr[page_index++];
-
-			/* If unclean shutdown, only the DIRTY blocks are loaded.*/
-			if (clean_shutdown || (next_ptr->cache_state & DIRTY)) {
-
-				if (next_ptr->cache_state & DIRTY)
-					dirty_loaded++;
-
-				EIO_CACHE_STATE_SET(dmc, i,
-					(u_int8_t)le64_to_cpu(next_ptr->
-					cache_state) & ~QUEUED);
-
-				EIO_ASSERT((EIO_CACHE_STATE_GET(dmc, i) &
-					    (VALID | INVALID))
-					   != (VALID | INVALID));
-
-				if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
-					num_valid++;
-				EIO_DBN_SET(dmc, i, le64_to_cpu(next_ptr->dbn));
-			} else
-				eio_invalidate_md(dmc, i);
-			next_ptr++;
-			i++;
-		}
-		size -= slots_read;
+	if ((dmc->cache_flags & CACHE_FLAGS_LAZY_MD_LOAD) && clean_shutdown &&
+	    (dmc->mode != CACHE_MODE_WB) &&
+	    (le32_to_cpu(header->sbf.mode) != CACHE_MODE_WB)) {
+		for (index = 0; index < dmc->size; index++)
+			eio_invalidate_md(dmc, index);
+		dmc->cache_flags |= CACHE_FLAGS_MD_LOADING;
+		pr_info("md_load: Loading cache metadata in the background");
+		goto dirty_sb;
+	}
+
+	start_time = ktime_get();
+	ret = eio_md_load_blocks(dmc, clean_shutdown, &num_valid,
+				 &dirty_loaded, &sectors_read);
+	if (ret) {
+		eio_md_free(dmc);
+		goto free_header;
 	}
+	elapsed_ms = ktime_ms_delta(ktime_get(), start_time);
+	pr_info("md_load: Read %lluKB of metadata in %lldms (%lluKB/s)",
+		(unsigned long long)sectors_read >> 1, (long long)elapsed_ms,
+		(unsigned long long)EIO_DIV((sectors_read >> 1) * 1000,
+					    elapsed_ms ? elapsed_ms : 1));
 
 	/*
 	 * If the cache contains dirty data, the only valid mode is write back.
 	 */
 	if (dirty_loaded && dmc->mode != CACHE_MODE_WB) {
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		pr_err
 			("md_load: Cannot use %s mode because dirty data exists in the cache",
-			(dmc->mode ==
-			 CACHE_MODE_RO) ? "read only" : "write through");
+			eio_mode_name(dmc->mode));
 		ret = -EINVAL;
-		goto free_md;
+		goto free_header;
 	}
 
 	/* Debug Tests */
-	sectors_expected = EIO_DIV(dmc->size, MD_BLOCKS_PER_SECTOR);
-	if (EIO_REM(dmc->size, MD_BLOCKS_PER_SECTOR))
-		sectors_expected++;
+	sectors_expected = INDEX_TO_MD_SECTOR(eio_ssd_nr_sets(dmc) * dmc->assoc +
+					      MD_BLOCKS_PER_SECTOR - 1) *
+			   dmc->nr_ssds;
 	if (sectors_expected != sectors_read) {
 		pr_err
 			("md_load: Sector mismatch! sectors_expected=%llu, sectors_read=%llu\n",
 			(unsigned long long)sectors_expected, (unsigned long long)sectors_read);
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		ret = -EIO;
-		goto free_md;
+		goto free_header;
 	}
 
+	/*
+	 * After an unclean shutdown, the blocks dropped by the load still
+	 * have their old md on the SSD, so every set is written out again.
+	 */
+	if (clean_shutdown)
+		bitmap_zero(dmc->md_changed,
+			    dmc->size >> dmc->consecutive_shift);
+
+dirty_sb:
 	/* Before we finish loading, we need to dirty the superblock and write it out */
 	dmc->sb_state = CACHE_MD_STATE_DIRTY;
 	error = eio_sb_store(dmc);
 	if (error) {
-		vfree((void *)EIO_CACHE(dmc));
+		dmc->cache_flags &= ~CACHE_FLAGS_MD_LOADING;
+		eio_md_free(dmc);
 		pr_err
 			("md_load: Could not write cache superblock sector(error %d)",
 			error);
 		ret = 1;
-		goto free_md;
-	}
-
-free_md:
-	for (i = 0; i < nr_pages; i++)
-		kunmap(pages[i].bv_page);
-	kfree(pg_virt_addr);
-
-	if (pages) {
-		for (i = 0; i < nr_pages; i++)
-			put_page(pages[i].bv_page);
-		kfree(pages);
-		pages = NULL;
+		goto free_header;
 	}
 
 free_header:
@@ -1355,6 +1749,144 @@ free_header:
 	return ret;
 }
 
+/*
+ * Load the md of consecutive sets of an SSD, read in pg_virt_addr, into
+ * the in-core md and start caching them. A NULL pg_virt_addr, as on read
+ * errors, leaves the sets empty, as do writes to the sets while they were
+ * not loaded.
+ */
+static void
+eio_md_load_sets(struct cache_c *dmc, struct eio_ssd *ssd, index_t first_set,
+		 index_t nr_sets, void **pg_virt_addr)
+{
+	struct flash_cacheblock *md_block;
+	struct cache_set *set;
+	unsigned long flags;
+	index_t offset;
+	index_t index;
+	index_t k, cur;
+	u_int8_t cache_state;
+	unsigned j;
+
+	for (k = 0; k < nr_sets; k++) {
+		cur = eio_ssd_set(dmc, ssd, first_set + k);
+		set = &dmc->cache_sets[cur];
+		spin_lock_irqsave(&set->cs_lock, flags);
+		if (pg_virt_addr && !(set->flags & SETFLAG_MD_STALE)) {
+			index = cur * dmc->assoc;
+			for (j = 0; j < dmc->assoc; j++, index++) {
+				offset = k * dmc->assoc + j;
+				md_block = (struct flash_cacheblock *)
+					pg_virt_addr[offset / MD_BLOCKS_PER_PAGE] +
+					offset % MD_BLOCKS_PER_PAGE;
+				cache_state = (u_int8_t)le64_to_cpu(md_block->
+								    cache_state);
+				/* Only clean blocks exist in these caches */
+				if (cache_state != VALID)
+					continue;
+				EIO_CACHE_STATE_SET(dmc, index, VALID);
+				EIO_DBN_SET(dmc, index, le64_to_cpu(md_block->dbn));
+				atomic64_inc(&dmc->cached_blocks);
+			}
+			/* The set is in core as it is on the SSD */
+			clear_bit(cur, dmc->md_changed);
+		}
+		set->flags &= ~(SETFLAG_MD_UNLOADED | SETFLAG_MD_STALE);
+		spin_unlock_irqrestore(&set->cs_lock, flags);
+	}
+}
+
+/*
+ * Background md load of an active cache. The sets of each SSD are loaded
+ * in ascending order, as many as fit in the md pages per read.
+ */
+static void eio_md_load_background(struct work_struct *work)
+{
+	struct cache_c *dmc;
+	struct eio_io_region where;
+	struct eio_ssd *ssd;
+	struct bio_vec *pages;
+	void **pg_virt_addr = NULL;
+	index_t sets_per_read;
+	index_t ssd_sets;
+	index_t nr_sets;
+	index_t set;
+	u_int32_t m;
+	ktime_t start_time;
+	s64 elapsed_ms;
+	int nr_pages = 0;
+	int page_count;
+	int error;
+	int i;
+
+	dmc = container_of(work, struct cache_c, md_load_work);
+	start_time = ktime_get();
+	ssd_sets = eio_ssd_nr_sets(dmc);
+
+	pages = eio_alloc_pages(max_t(u_int32_t, dmc->bio_nr_pages,
+				      IO_PAGE_COUNT(dmc->assoc *
+						    sizeof(struct flash_cacheblock))),
+				&nr_pages);
+	if (pages)
+		pg_virt_addr = kmalloc(nr_pages * (sizeof(void *)), GFP_KERNEL);
+	sets_per_read = EIO_DIV((u_int64_t)nr_pages * MD_BLOCKS_PER_PAGE,
+				dmc->assoc);
+	if (pg_virt_addr == NULL || sets_per_read == 0) {
+		pr_err("md_load: System memory too low, starting cache \"%s\" empty",
+		       dmc->cache_name);
+		for (m = 0; m < dmc->nr_ssds; m++)
+			eio_md_load_sets(dmc, &dmc->ssds[m], 0, ssd_sets, NULL);
+		goto out;
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		pg_virt_addr[i] = kmap(pages[i].bv_page);
+
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		where.bdev = ssd->ssd_dev->bdev;
+		for (set = 0; set < ssd_sets; set += nr_sets) {
+			nr_sets = min_t(index_t, sets_per_read, ssd_sets - set);
+			where.sector = ssd->ssd_md_start_sect +
+				       INDEX_TO_MD_SECTOR(set * dmc->assoc);
+			where.count = INDEX_TO_MD_SECTOR(nr_sets * dmc->assoc);
+			page_count = IO_PAGE_COUNT(nr_sets * dmc->assoc *
+						   sizeof(struct flash_cacheblock));
+
+			error = eio_io_sync_vm(dmc, &where, REQ_OP_READ, 0,
+					       pages, page_count);
+			if (error)
+				pr_err
+					("md_load: Could not read cache metadata sector %llu of %s error %d",
+					(unsigned long long)where.sector,
+					ssd->ssd_devname, error);
+			eio_md_load_sets(dmc, ssd, set, nr_sets,
+					 error ? NULL : pg_virt_addr);
+		}
+	}
+
+	for (i = 0; i < nr_pages; i++)
+		kunmap(pages[i].bv_page);
+
+out:
+	kfree(pg_virt_addr);
+	if (pages) {
+		for (i = 0; i < nr_pages; i++)
+			put_page(pages[i].bv_page);
+		kfree(pages);
+	}
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
+	dmc->cache_flags &= ~CACHE_FLAGS_MD_LOADING;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock,
+			       dmc->cache_spin_lock_flags);
+
+	elapsed_ms = ktime_ms_delta(ktime_get(), start_time);
+	pr_info("md_load: Cache \"%s\" metadata loaded in the background in %lldms, %lld valid blocks",
+		dmc->cache_name, (long long)elapsed_ms,
+		(long long)atomic64_read(&dmc->cached_blocks));
+}
+
 void eio_policy_free(struct cache_c *dmc)
 {
 
@@ -1380,10 +1912,24 @@ static int eio_clean_thread_init(struct cache_c *dmc)
 	return eio_start_clean_thread(dmc);
 }
 
+/* SSD of a cache by its path, any path names the SSD of a cache of one */
+static struct eio_ssd *eio_ssd_lookup(struct cache_c *dmc, const char *name)
+{
+	u_int32_t m;
+
+	for (m = 0; m < dmc->nr_ssds; m++)
+		if (!strncmp(dmc->ssds[m].ssd_devname, name, DEV_PATHLEN))
+			return &dmc->ssds[m];
+	if (dmc->nr_ssds == 1)
+		return &dmc->ssds[0];
+	return NULL;
+}
+
 int
 eio_handle_ssd_message(char *cache_name, char *ssd_name, enum dev_notifier note)
 {
 	struct cache_c *dmc;
+	struct eio_ssd *ssd;
 
 	dmc = eio_cache_lookup(cache_name);
 	if (NULL == dmc) {
@@ -1396,7 +1942,8 @@ eio_handle_ssd_message(char *cache_name, char *ssd_name, enum dev_notifier note)
 
 	case NOTIFY_SSD_ADD:
 		/* Making sure that CACHE state is not active */
-		if (CACHE_FAILED_IS_SET(dmc) || CACHE_DEGRADED_IS_SET(dmc))
+		if (CACHE_FAILED_IS_SET(dmc) || CACHE_DEGRADED_IS_SET(dmc) ||
+		    dmc->nr_ssds_offline)
 			eio_resume_caching(dmc, ssd_name);
 		else
 			pr_err
@@ -1405,7 +1952,13 @@ eio_handle_ssd_message(char *cache_name, char *ssd_name, enum dev_notifier note)
 		break;
 
 	case NOTIFY_SSD_REMOVED:
-		eio_suspend_caching(dmc, note);
+		ssd = eio_ssd_lookup(dmc, ssd_name);
+		if (ssd == NULL) {
+			pr_err("eio_handle_ssd_message: %s is not an SSD of cache \"%s\"",
+			       ssd_name, dmc->cache_name);
+			return -EINVAL;
+		}
+		eio_suspend_caching(dmc, note, ssd);
 		break;
 
 	default:
@@ -1418,31 +1971,39 @@ eio_handle_ssd_message(char *cache_name, char *ssd_name, enum dev_notifier note)
 static void eio_init_ssddev_props(struct cache_c *dmc)
 {
 	struct request_queue *rq;
+	struct eio_ssd *ssd;
 	uint32_t max_hw_sectors, max_nr_pages;
 	uint32_t nr_pages = 0;
+	u_int32_t m;
+
+	/* The md I/Os of every cache device must fit in bio_nr_pages */
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		rq = bdev_get_queue(ssd->ssd_dev->bdev);
+		max_hw_sectors = to_bytes(queue_max_hw_sectors(rq)) / PAGE_SIZE;
+		max_nr_pages = (u_int32_t)EIO_BIO_GET_NR_VECS(ssd->ssd_dev->bdev);
+		max_nr_pages = min_t(u_int32_t, max_hw_sectors, max_nr_pages);
+		if (m == 0 || max_nr_pages < nr_pages)
+			nr_pages = max_nr_pages;
 
-	rq = bdev_get_queue(dmc->cache_dev->bdev);
-	max_hw_sectors = to_bytes(queue_max_hw_sectors(rq)) / PAGE_SIZE;
-	max_nr_pages = (u_int32_t)EIO_BIO_GET_NR_VECS(dmc->cache_dev->bdev);
-	nr_pages = min_t(u_int32_t, max_hw_sectors, max_nr_pages);
-	dmc->bio_nr_pages = nr_pages;
-
-	/*
-	 * If the cache device is not a physical device (eg: lv), then
-	 * driverfs_dev will be null and we make cache_gendisk_name a null
-	 * string. The eio_notify_ssd_rm() function in this case,
-	 * cannot detect device removal, and therefore, we will have to rely
-	 * on user space udev for the notification.
-	 */
+		/*
+		 * If the cache device is not a physical device (eg: lv), then
+		 * driverfs_dev will be null and we make ssd_gendisk_name a null
+		 * string. The eio_notify_ssd_rm() function in this case,
+		 * cannot detect device removal, and therefore, we will have to rely
+		 * on user space udev for the notification.
+		 */
 
-	if (dmc->cache_dev && dmc->cache_dev->bdev &&
-	    dmc->cache_dev->bdev->bd_disk &&
-	    EIO_DRIVERFS_DEV(dmc->cache_dev->bdev->bd_disk)) {
-		strncpy(dmc->cache_gendisk_name,
-			dev_name(EIO_DRIVERFS_DEV(dmc->cache_dev->bdev->bd_disk)),
-			DEV_PATHLEN);
-	} else
-		dmc->cache_gendisk_name[0] = '\0';
+		if (ssd->ssd_dev && ssd->ssd_dev->bdev &&
+		    ssd->ssd_dev->bdev->bd_disk &&
+		    EIO_DRIVERFS_DEV(ssd->ssd_dev->bdev->bd_disk)) {
+			strncpy(ssd->ssd_gendisk_name,
+				dev_name(EIO_DRIVERFS_DEV(ssd->ssd_dev->bdev->bd_disk)),
+				DEV_PATHLEN);
+		} else
+			ssd->ssd_gendisk_name[0] = '\0';
+	}
+	dmc->bio_nr_pages = nr_pages;
 }
 
 static void eio_init_srcdev_props(struct cache_c *dmc)
@@ -1471,6 +2032,9 @@ int eio_cache_create(struct cache_rec_short *cache)
 	uint32_t persistence = 0;
 	fmode_t mode = (FMODE_READ | FMODE_WRITE);
 	char *strerr = NULL;
+	struct eio_ssd *ssd;
+	char *ssd_name;
+	u_int32_t m, k;
 
 	dmc = kzalloc(sizeof(*dmc), GFP_KERNEL);
 	if (dmc == NULL) {
@@ -1479,6 +2043,20 @@ int eio_cache_create(struct cache_rec_short *cache)
 		goto bad;
 	}
 
+	dmc->eio_stats = alloc_percpu(struct eio_stats);
+	dmc->size_hist = alloc_percpu(struct eio_size_hist);
+	dmc->lat_hist = alloc_percpu(struct eio_lat_hist);
+	dmc->heat_tick = alloc_percpu(unsigned int);
+	dmc->heat_map = vzalloc(EIO_HEAT_BUCKETS *
+				sizeof(struct eio_heat_bucket));
+	if ((dmc->eio_stats == NULL) || (dmc->size_hist == NULL) ||
+	    (dmc->lat_hist == NULL) || (dmc->heat_tick == NULL) ||
+	    (dmc->heat_map == NULL)) {
+		strerr = "Failed to allocate memory for cache stats";
+		error = -ENOMEM;
+		goto bad1;
+	}
+
 	/*
 	 * Source device.
 	 */
@@ -1490,6 +2068,9 @@ int eio_cache_create(struct cache_rec_short *cache)
 	}
 
 	dmc->disk_size = eio_to_sector(eio_get_device_size(dmc->disk_dev));
+	if (dmc->disk_size > EIO_HEAT_BUCKETS)
+		dmc->heat_shift = fls64(dmc->disk_size - 1) -
+				  ilog2(EIO_HEAT_BUCKETS);
 	if (dmc->disk_size >= EIO_MAX_SECTOR) {
 		strerr = "Source device too big to support";
 		error = -EFBIG;
@@ -1498,22 +2079,42 @@ int eio_cache_create(struct cache_rec_short *cache)
 	strncpy(dmc->disk_devname, cache->cr_src_devname, DEV_PATHLEN);
 
 	/*
-	 * Cache device.
+	 * Cache devices, the sets are striped over them.
 	 */
 
-	error =
-		eio_ttc_get_device(cache->cr_ssd_devname, mode | FMODE_EXCL, &dmc->cache_dev);
-	if (error) {
-		strerr = "get_device for cache device failed";
+	dmc->nr_ssds = cache->cr_nr_ssds ? cache->cr_nr_ssds : 1;
+	if (dmc->nr_ssds > EIO_MAX_SSDS) {
+		strerr = "Too many cache devices";
+		error = -EINVAL;
 		goto bad2;
 	}
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		ssd_name = m ? cache->cr_ssd_stripe[m - 1] : cache->cr_ssd_devname;
+		ssd_name[NAME_SZ - 1] = '\0';
+		error = eio_ttc_get_device(ssd_name, mode | FMODE_EXCL,
+					   &ssd->ssd_dev);
+		if (error) {
+			strerr = "get_device for cache device failed";
+			goto bad3;
+		}
 
-	if (dmc->disk_dev == dmc->cache_dev) {
-		error = -EINVAL;
-		strerr = "Same devices specified";
-		goto bad3;
+		if (dmc->disk_dev->bdev == ssd->ssd_dev->bdev) {
+			error = -EINVAL;
+			strerr = "Same devices specified";
+			goto bad3;
+		}
+		for (k = 0; k < m; k++) {
+			if (dmc->ssds[k].ssd_dev->bdev == ssd->ssd_dev->bdev) {
+				error = -EINVAL;
+				strerr = "Same cache device specified twice";
+				goto bad3;
+			}
+		}
+		strncpy(ssd->ssd_devname, ssd_name, DEV_PATHLEN);
+		ssd->ssd_start_sect = eio_get_device_start_sect(ssd->ssd_dev);
+		ssd->ssd_size = eio_to_sector(eio_get_device_size(ssd->ssd_dev));
 	}
-	strncpy(dmc->cache_devname, cache->cr_ssd_devname, DEV_PATHLEN);
 
 	if (cache->cr_name[0] != '\0') {
 		strncpy(dmc->cache_name, cache->cr_name,
@@ -1528,7 +2129,6 @@ int eio_cache_create(struct cache_rec_short *cache)
 
 	strncpy(dmc->ssd_uuid, cache->cr_ssd_uuid, DEV_PATHLEN - 1);
 
-	dmc->cache_dev_start_sect = eio_get_device_start_sect(dmc->cache_dev);
 	error = eio_do_preliminary_checks(dmc);
 	if (error) {
 		if (error == -EINVAL)
@@ -1544,14 +2144,17 @@ int eio_cache_create(struct cache_rec_short *cache)
 	eio_init_srcdev_props(dmc);
 
 	/*
-	 * Initialize the io callback queue.
+	 * Initialize the io callback queues, one per cache device.
 	 */
 
-	dmc->callback_q = create_singlethread_workqueue("eio_callback");
-	if (!dmc->callback_q) {
-		error = -ENOMEM;
-		strerr = "Failed to initialize callback workqueue";
-		goto bad4;
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		dmc->ssds[m].ssd_callback_q =
+			create_singlethread_workqueue("eio_callback");
+		if (!dmc->ssds[m].ssd_callback_q) {
+			error = -ENOMEM;
+			strerr = "Failed to initialize callback workqueue";
+			goto bad4;
+		}
 	}
 	error = eio_kcached_init(dmc);
 	if (error) {
@@ -1651,10 +2254,7 @@ int eio_cache_create(struct cache_rec_short *cache)
 		dmc->mode = CACHE_MODE_DEFAULT;
 		pr_info("Setting mode to default");
 	} else {
-		pr_info("Setting mode to %s ",
-			(dmc->mode == CACHE_MODE_WB) ? "write back" :
-			((dmc->mode == CACHE_MODE_RO) ? "read only" :
-			 "write through"));
+		pr_info("Setting mode to %s ", eio_mode_name(dmc->mode));
 	}
 
 	/* eio_policy_init() is already called from within eio_md_load() */
@@ -1669,12 +2269,25 @@ int eio_cache_create(struct cache_rec_short *cache)
 	if (cache->cr_flags) {
 		int flags;
 		flags = cache->cr_flags;
-		if (flags == 0)
-			dmc->cache_flags &= ~CACHE_FLAGS_INVALIDATE;
-		else if (flags == 1) {
+		if (flags & EIO_CR_INVALIDATE) {
 			dmc->cache_flags |= CACHE_FLAGS_INVALIDATE;
 			pr_info("Enabling invalidate API");
-		} else
+		}
+		/* A reloaded cache keeps the create options of its superblock */
+		if (persistence != CACHE_RELOAD) {
+			if (flags & EIO_CR_LAZY_MD_LOAD)
+				dmc->cache_flags |= CACHE_FLAGS_LAZY_MD_LOAD;
+			if (flags & EIO_CR_MD_MEM_INTERLEAVE)
+				dmc->cache_flags |=
+					CACHE_FLAGS_MD_MEM_INTERLEAVE;
+			else if (flags & EIO_CR_MD_MEM_LOCAL)
+				dmc->cache_flags |= CACHE_FLAGS_MD_MEM_LOCAL;
+			if (flags & EIO_CR_NO_POLICY_RANKS)
+				dmc->cache_flags |= CACHE_FLAGS_NO_POLICY_RANKS;
+			if (flags & EIO_CR_SUB_BLOCK)
+				dmc->cache_flags |= CACHE_FLAGS_SUB_BLOCK;
+		}
+		if (flags & ~EIO_CR_FLAGS)
 			pr_info("Ignoring unknown flags value: %u", flags);
 	}
 
@@ -1682,7 +2295,7 @@ int eio_cache_create(struct cache_rec_short *cache)
 		goto init;      /* Skip reading cache parameters from command line */
 
 	cache->cr_src_sector_size = LOG_BLK_SIZE(dmc->disk_dev->bdev);
-	cache->cr_ssd_sector_size = LOG_BLK_SIZE(dmc->cache_dev->bdev);
+	cache->cr_ssd_sector_size = LOG_BLK_SIZE(dmc->ssds[0].ssd_dev->bdev);
 
 	if (cache->cr_blksize) {
 		dmc->block_size = cache->cr_blksize >> SECTOR_SHIFT;
@@ -1702,11 +2315,14 @@ int eio_cache_create(struct cache_rec_short *cache)
 	/*
 	 * dmc->size is specified in sectors here, and converted to blocks later
 	 */
-	dmc->size = eio_to_sector(eio_get_device_size(dmc->cache_dev));
-	if (dmc->size == 0) {
-		strerr = "Invalid cache size or can't be fetched";
-		error = -EINVAL;
-		goto bad5;
+	dmc->size = 0;
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		if (dmc->ssds[m].ssd_size == 0) {
+			strerr = "Invalid cache size or can't be fetched";
+			error = -EINVAL;
+			goto bad5;
+		}
+		dmc->size += dmc->ssds[m].ssd_size;
 	}
 
 	dmc->cache_size = dmc->size;
@@ -1777,15 +2393,15 @@ init:
 		strerr = "System memory too low"
 			 " for allocating cache set metadata";
 		error = -ENOMEM;
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		goto bad5;
 	}
 
-	dmc->cache_sets = vmalloc((size_t)order);
+	dmc->cache_sets = eio_sets_alloc(dmc, (size_t)order);
 	if (!dmc->cache_sets) {
 		strerr = "Failed to allocate memory";
 		error = -ENOMEM;
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		goto bad5;
 	}
 
@@ -1793,23 +2409,31 @@ init:
 		dmc->cache_sets[i].nr_dirty = 0;
 		spin_lock_init(&dmc->cache_sets[i].cs_lock);
 		init_rwsem(&dmc->cache_sets[i].rw_lock);
+		seqcount_init(&dmc->cache_sets[i].cs_seq);
 		dmc->cache_sets[i].mdreq = NULL;
-		dmc->cache_sets[i].flags = 0;
+		dmc->cache_sets[i].flags =
+			CACHE_MD_LOADING_IS_SET(dmc) ? SETFLAG_MD_UNLOADED : 0;
 	}
 	error = eio_repl_sets_init(dmc->policy_ops);
 	if (error < 0) {
 		strerr = "Failed to allocate memory for cache policy";
 		vfree((void *)dmc->cache_sets);
-		vfree((void *)EIO_CACHE(dmc));
+		eio_md_free(dmc);
 		goto bad5;
 	}
 	eio_policy_lru_pushblks(dmc->policy_ops);
+	/* Sets whose ranks can't be read keep the order of pushblks */
+	if (dmc->rank_restore && dmc->policy_ops->sp_rank_set) {
+		if (eio_rank_io(dmc, REQ_OP_READ) == 0)
+			pr_info("Restored the replacement policy order");
+	}
+	dmc->rank_restore = 0;
 
 	if (dmc->mode == CACHE_MODE_WB) {
 		error = eio_allocate_wb_resources(dmc);
 		if (error) {
 			vfree((void *)dmc->cache_sets);
-			vfree((void *)EIO_CACHE(dmc));
+			eio_md_free(dmc);
 			goto bad5;
 		}
 	}
@@ -1833,6 +2457,15 @@ init:
 
 	dmc->sysctl_active.mem_limit_pct = 75;
 
+	spin_lock_init(&dmc->seq_lock);
+	dmc->sysctl_active.seq_io_threshold_kb = SEQ_IO_THRESHOLD_KB_DEF;
+	dmc->sysctl_active.admit_threshold = ADMIT_THRESHOLD_DEF;
+	dmc->sysctl_active.fast_read = FAST_READ_DEF;
+	dmc->sysctl_active.heat_sample = HEAT_SAMPLE_DEF;
+	dmc->sysctl_active.md_batch_delay_ms = MD_BATCH_DELAY_MS_DEF;
+	dmc->sysctl_active.clean_target_lat_us = CLEAN_TARGET_LAT_US_DEF;
+	dmc->sysctl_active.clean_sort_sets = CLEAN_SORT_SETS_DEF;
+
 	(void)wait_on_bit_lock_action((void *)&eio_control->synch_flags,
 			       EIO_UPDATE_LIST, eio_wait_schedule,
 			       TASK_UNINTERRUPTIBLE);
@@ -1845,7 +2478,7 @@ init:
 	prev_set = -1;
 	for (i = 0; i < dmc->size; i++) {
 		if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
+			atomic64_inc(&dmc->cached_blocks);
 		if (EIO_CACHE_STATE_GET(dmc, i) & DIRTY) {
 			dmc->cache_sets[EIO_DIV(i, dmc->assoc)].nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
@@ -1859,6 +2492,14 @@ init:
 	}
 
 	INIT_WORK(&dmc->readfill_wq, eio_do_readfill);
+	INIT_WORK(&dmc->md_load_work, eio_md_load_background);
+	INIT_WORK(&dmc->prefetch_work, eio_prefetch_work);
+	spin_lock_init(&dmc->discard_lock);
+	bio_list_init(&dmc->discard_bios);
+	INIT_WORK(&dmc->discard_work, eio_do_discard);
+	spin_lock_init(&dmc->flush_lock);
+	bio_list_init(&dmc->flush_bios);
+	INIT_WORK(&dmc->flush_work, eio_flush_work);
 
 	/*
 	 * invalid index, but signifies cache successfully built
@@ -1876,6 +2517,9 @@ init:
 	if (error)
 		goto bad6;
 
+	if (CACHE_MD_LOADING_IS_SET(dmc))
+		queue_work(system_long_wq, &dmc->md_load_work);
+
 	/*
 	 * In future if anyone adds code here and something fails,
 	 * do call eio_ttc_deactivate(dmc) as part of cleanup.
@@ -1890,7 +2534,7 @@ bad6:
 		eio_free_wb_resources(dmc);
 	}
 	vfree((void *)dmc->cache_sets);
-	vfree((void *)EIO_CACHE(dmc));
+	eio_md_free(dmc);
 
 	(void)wait_on_bit_lock_action((void *)&eio_control->synch_flags,
 			       EIO_UPDATE_LIST, eio_wait_schedule,
@@ -1915,6 +2559,12 @@ bad2:
 	eio_ttc_put_device(&dmc->disk_dev);
 bad1:
 	eio_policy_free(dmc);
+	eio_admit_filter_free(dmc);
+	vfree(dmc->heat_map);
+	free_percpu(dmc->heat_tick);
+	free_percpu(dmc->lat_hist);
+	free_percpu(dmc->size_hist);
+	free_percpu(dmc->eio_stats);
 	kfree(dmc);
 bad:
 	if (strerr)
@@ -1993,6 +2643,12 @@ int eio_cache_delete(char *cache_name, int do_delete)
 
 	eio_stop_async_tasks(dmc);
 
+	/*
+	 * The prefetcher ends with its read in flight, which needs the
+	 * ttc lock. Wait for it here where that lock isn't held.
+	 */
+	flush_work(&dmc->prefetch_work);
+
 	/*
 	 * Deactivate Application Transparent Caching.
 	 * For wb cache, finish_nr_dirty may take long time.
@@ -2041,8 +2697,9 @@ force_delete:
 		eio_ttc_deactivate(dmc, 1);
 	}
 
+	eio_kcached_client_destroy(dmc);
 	eio_free_wb_resources(dmc);
-	vfree((void *)EIO_CACHE(dmc));
+	eio_md_free(dmc);
 	vfree((void *)dmc->cache_sets);
 	eio_ttc_put_device(&dmc->disk_dev);
 	eio_put_cache_device(dmc);
@@ -2085,13 +2742,121 @@ out:
 		 * no more accessible via lookup.
 		 */
 
-		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG))
+		if (!(dmc->cache_flags & CACHE_FLAGS_SHUTDOWN_INPROG)) {
+			eio_admit_filter_free(dmc);
+			vfree(dmc->heat_map);
+			free_percpu(dmc->heat_tick);
+			free_percpu(dmc->lat_hist);
+			free_percpu(dmc->size_hist);
+			free_percpu(dmc->eio_stats);
 			kfree(dmc);
+		}
 	}
 
 	return ret;
 }
 
+/*
+ * Start caching again on an SSD of a striped read-only or write-through
+ * cache, whose other SSDs kept caching: the sets of the SSD are emptied
+ * and their md written out.
+ */
+static int eio_ctr_ssd_add_sets(struct cache_c *dmc, struct eio_ssd *ssd)
+{
+	index_t nr_sets = eio_ssd_nr_sets(dmc);
+	struct bio_vec *pages;
+	void **pg_virt_addr;
+	sector_t sectors_written = 0;
+	unsigned long flags;
+	index_t set, cur, i;
+	int page_count = 0;
+	int busy, retry = 0;
+	int r, k;
+
+	/* The I/Os in flight to the sets end with errors, wait for them */
+	do {
+		busy = 0;
+		for (set = 0; set < nr_sets; set++) {
+			cur = eio_ssd_set(dmc, ssd, set);
+			spin_lock_irqsave(&dmc->cache_sets[cur].cs_lock, flags);
+			for (i = cur * dmc->assoc; i < (cur + 1) * dmc->assoc;
+			     i++) {
+				if (EIO_CACHE_STATE_GET(dmc, i) & BLOCK_IO_INPROG) {
+					busy = 1;
+					continue;
+				}
+				if (EIO_CACHE_STATE_GET(dmc, i) == INVALID)
+					continue;
+				if (EIO_CACHE_STATE_GET(dmc, i) & VALID)
+					atomic64_dec_if_positive(&dmc->
+								 cached_blocks);
+				EIO_CACHE_STATE_SET(dmc, i, INVALID);
+			}
+			spin_unlock_irqrestore(&dmc->cache_sets[cur].cs_lock,
+					       flags);
+		}
+		if (busy)
+			msleep(1000);
+	} while (busy && retry++ < 10);
+	if (busy) {
+		pr_err("ctr_ssd_add: Cache \"%s\" is not in quiesce state. Can't proceed to resume.",
+		       dmc->cache_name);
+		return -EBUSY;
+	}
+
+	pages = eio_alloc_pages(dmc->bio_nr_pages, &page_count);
+	if (pages == NULL) {
+		pr_err("ctr_ssd_add: System memory too low.");
+		return -ENOMEM;
+	}
+	pg_virt_addr = kmalloc(page_count * (sizeof(void *)), GFP_KERNEL);
+	if (pg_virt_addr == NULL) {
+		pr_err("ctr_ssd_add: System memory too low.");
+		r = -ENOMEM;
+		goto free_pages;
+	}
+	for (k = 0; k < page_count; k++)
+		pg_virt_addr[k] = kmap(pages[k].bv_page);
+
+	for (set = 0; set < nr_sets; set++)
+		clear_bit(eio_ssd_set(dmc, ssd, set), dmc->md_changed);
+	smp_mb__after_atomic();
+	r = eio_md_store_sets(dmc, ssd, 0, nr_sets, pages, pg_virt_addr,
+			      page_count, &sectors_written);
+	if (r)
+		for (set = 0; set < nr_sets; set++)
+			set_bit(eio_ssd_set(dmc, ssd, set), dmc->md_changed);
+
+	for (k = 0; k < page_count; k++)
+		kunmap(pages[k].bv_page);
+	kfree(pg_virt_addr);
+free_pages:
+	for (k = 0; k < page_count; k++)
+		put_page(pages[k].bv_page);
+	kfree(pages);
+	if (r)
+		return r;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
+	ssd->ssd_offline = 0;
+	dmc->nr_ssds_offline--;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock,
+			       dmc->cache_spin_lock_flags);
+
+	r = eio_sb_store(dmc);
+	if (r) {
+		pr_err("ctr_ssd_add: Could not write the superblock of %s",
+		       ssd->ssd_devname);
+		spin_lock_irqsave(&dmc->cache_spin_lock,
+				  dmc->cache_spin_lock_flags);
+		ssd->ssd_offline = 1;
+		dmc->nr_ssds_offline++;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock,
+				       dmc->cache_spin_lock_flags);
+	}
+	return r;
+}
+
 /*
  * Reconstruct a degraded cache after the SSD is added.
  * This function mimics the constructor eio_ctr() except
@@ -2100,19 +2865,34 @@ out:
 int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 {
 	int r = 0;
+	struct eio_ssd *ssd;
 	struct eio_bdev *prev_cache_dev;
 	u_int32_t prev_persistence = dmc->persistence;
 	fmode_t mode = (FMODE_READ | FMODE_WRITE);
+	u_int32_t m;
 
 	/* verify if source device is present */
 	EIO_ASSERT(dmc->eio_errors.no_source_dev == 0);
 
+	/* The SSD is found by its path, else it is the only one offline */
+	ssd = eio_ssd_lookup(dmc, dev);
+	if (ssd == NULL && dmc->nr_ssds_offline == 1) {
+		for (m = 0; m < dmc->nr_ssds; m++)
+			if (dmc->ssds[m].ssd_offline)
+				ssd = &dmc->ssds[m];
+	}
+	if (ssd == NULL || (dmc->nr_ssds > 1 && !ssd->ssd_offline)) {
+		pr_err("ctr_ssd_add: %s is not an offline SSD of cache \"%s\"",
+		       dev, dmc->cache_name);
+		return -EINVAL;
+	}
+
 	/* mimic relevant portions from eio_ctr() */
 
-	prev_cache_dev = dmc->cache_dev;
-	r = eio_ttc_get_device(dev, mode, &dmc->cache_dev);
+	prev_cache_dev = ssd->ssd_dev;
+	r = eio_ttc_get_device(dev, mode, &ssd->ssd_dev);
 	if (r) {
-		dmc->cache_dev = prev_cache_dev;
+		ssd->ssd_dev = prev_cache_dev;
 		pr_err("ctr_ssd_add: Failed to lookup cache device %s", dev);
 		return -EINVAL;
 	}
@@ -2123,30 +2903,46 @@ int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 	eio_ttc_put_device(&prev_cache_dev);
 
 	/* sanity check */
-	if (dmc->cache_size != eio_to_sector(eio_get_device_size(dmc->cache_dev))) {
+	if (ssd->ssd_size != eio_to_sector(eio_get_device_size(ssd->ssd_dev))) {
 		pr_err("ctr_ssd_add: Cache device size has changed," \
 		       "expected (%llu) found (%llu)" \
 		       "continuing in degraded mode",
-		       (unsigned long long)dmc->cache_size,
+		       (unsigned long long)ssd->ssd_size,
 		       (unsigned long long)eio_to_sector(
-			       eio_get_device_size(dmc->cache_dev)));
-		r = -EINVAL;
-		goto out;
+			       eio_get_device_size(ssd->ssd_dev)));
+		return -EINVAL;
 	}
 
 	/* sanity check for cache device start sector */
-	if (dmc->cache_dev_start_sect !=
-	    eio_get_device_start_sect(dmc->cache_dev)) {
+	if (ssd->ssd_start_sect != eio_get_device_start_sect(ssd->ssd_dev)) {
 		pr_err("ctr_ssd_add: Cache device starting sector changed," \
 		       "expected (%llu) found (%llu) continuing in" \
-		       "degraded mode", (unsigned long long)dmc->cache_dev_start_sect,
-		       (unsigned long long)eio_get_device_start_sect(dmc->cache_dev));
-		r = -EINVAL;
-		goto out;
+		       "degraded mode", (unsigned long long)ssd->ssd_start_sect,
+		       (unsigned long long)eio_get_device_start_sect(ssd->ssd_dev));
+		return -EINVAL;
 	}
 
-	strncpy(dmc->cache_devname, dev, DEV_PATHLEN);
+	strncpy(ssd->ssd_devname, dev, DEV_PATHLEN);
 	eio_init_ssddev_props(dmc);
+
+	/* Only the sets of the SSD are lost for the other modes */
+	if (dmc->mode != CACHE_MODE_WB && dmc->nr_ssds > 1)
+		return eio_ctr_ssd_add_sets(dmc, ssd);
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
+	if (ssd->ssd_offline) {
+		ssd->ssd_offline = 0;
+		dmc->nr_ssds_offline--;
+	}
+	spin_unlock_irqrestore(&dmc->cache_spin_lock,
+			       dmc->cache_spin_lock_flags);
+	/* A write-back cache resumes with all its SSDs */
+	if (dmc->nr_ssds_offline) {
+		pr_info("ctr_ssd_add: Cache \"%s\" waits for its other SSDs",
+			dmc->cache_name);
+		return 0;
+	}
+
 	dmc->size = dmc->cache_size;    /* dmc->size will be recalculated in eio_md_create() */
 
 	/*
@@ -2176,9 +2972,11 @@ int eio_ctr_ssd_add(struct cache_c *dmc, char *dev)
 		goto out;
 	}
 	eio_policy_lru_pushblks(dmc->policy_ops);
-	if (dmc->mode != CACHE_MODE_WB)
+	if (dmc->mode != CACHE_MODE_WB) {
 		/* Cold cache will reset the stats */
-		memset(&dmc->eio_stats, 0, sizeof(dmc->eio_stats));
+		eio_stats_zero(dmc);
+		atomic64_set(&dmc->cached_blocks, 0);
+	}
 
 	return 0;
 out:
@@ -2195,6 +2993,11 @@ void eio_stop_async_tasks(struct cache_c *dmc)
 {
 	unsigned long flags = 0;
 
+	eio_prefetch_stop(dmc);
+	flush_work(&dmc->md_load_work);
+	flush_work(&dmc->discard_work);
+	flush_work(&dmc->flush_work);
+
 	if (dmc->clean_thread) {
 		dmc->sysctl_active.fast_remove = 1;
 		spin_lock_irqsave(&dmc->clean_sl, flags);
@@ -2236,6 +3039,7 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 {
 	int nr_bvecs, nr_pages;
 	unsigned iosize;
+	u_int32_t m;
 	int ret;
 
 	EIO_ASSERT(dmc->clean_dbvecs == NULL);
@@ -2281,6 +3085,18 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 	EIO_ASSERT(dmc->clean_mdpages != NULL);
 	dmc->mdpage_count = nr_pages;
 
+	/* Block list of the multi-set flush */
+	dmc->clean_sort_ents = vmalloc(sizeof(struct eio_clean_ent) *
+				       CLEAN_SORT_SETS_MAX * dmc->assoc);
+	if (dmc->clean_sort_ents == NULL) {
+		pr_err("cache_create: Failed to allocated memory.\n");
+		ret = -ENOMEM;
+		eio_free_wb_pages(dmc->clean_mdpages, dmc->mdpage_count);
+		eio_free_wb_bvecs(dmc->clean_dbvecs, dmc->dbvec_count,
+				  dmc->block_size);
+		goto errout;
+	}
+
 	/*
 	 * For writeback cache:
 	 * 1. Initialize the time based clean work queue
@@ -2305,14 +3121,31 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 		spin_lock_init(&dmc->dirty_set_lru_lock);
 		ret = eio_clean_thread_init(dmc);
 	}
-	EIO_ASSERT(dmc->mdupdate_q == NULL);
-	dmc->mdupdate_q = create_singlethread_workqueue("eio_mdupdate");
-	if (!dmc->mdupdate_q)
-		ret = -ENOMEM;
+	spin_lock_init(&dmc->md_batch_lock);
+	INIT_LIST_HEAD(&dmc->md_batch_list);
+	dmc->md_batch_count = 0;
+	INIT_DELAYED_WORK(&dmc->md_batch_work, eio_do_mdupdate_batch);
+	atomic_set(&dmc->fg_lat_ewma, 0);
+	dmc->clean_depth = CLEAN_DEPTH_MAX;
+	dmc->clean_batch = CLEAN_BATCH_MAX;
+	/* The md updates of the sets of each SSD are queued apart */
+	for (m = 0; m < dmc->nr_ssds && ret >= 0; m++) {
+		EIO_ASSERT(dmc->ssds[m].ssd_mdupdate_q == NULL);
+		dmc->ssds[m].ssd_mdupdate_q =
+			create_singlethread_workqueue("eio_mdupdate");
+		if (!dmc->ssds[m].ssd_mdupdate_q)
+			ret = -ENOMEM;
+	}
 
 	if (ret < 0) {
 		pr_err("cache_create: Failed to initialize dirty lru set or" \
 		       "clean/mdupdate thread for wb cache.\n");
+		for (m = 0; m < dmc->nr_ssds; m++) {
+			if (dmc->ssds[m].ssd_mdupdate_q) {
+				destroy_workqueue(dmc->ssds[m].ssd_mdupdate_q);
+				dmc->ssds[m].ssd_mdupdate_q = NULL;
+			}
+		}
 		if (dmc->dirty_set_lru) {
 			lru_uninit(dmc->dirty_set_lru);
 			dmc->dirty_set_lru = NULL;
@@ -2327,6 +3160,10 @@ int eio_allocate_wb_resources(struct cache_c *dmc)
 	goto out;
 
 errout:
+	if (dmc->clean_sort_ents) {
+		vfree(dmc->clean_sort_ents);
+		dmc->clean_sort_ents = NULL;
+	}
 	if (dmc->clean_mdpages) {
 		kfree(dmc->clean_mdpages);
 		dmc->clean_mdpages = NULL;
@@ -2344,11 +3181,16 @@ out:
 
 void eio_free_wb_resources(struct cache_c *dmc)
 {
-
-	if (dmc->mdupdate_q) {
-		flush_workqueue(dmc->mdupdate_q);
-		destroy_workqueue(dmc->mdupdate_q);
-		dmc->mdupdate_q = NULL;
+	u_int32_t m;
+
+	if (dmc->ssds[0].ssd_mdupdate_q)
+		eio_md_batch_drain(dmc);
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		if (dmc->ssds[m].ssd_mdupdate_q) {
+			flush_workqueue(dmc->ssds[m].ssd_mdupdate_q);
+			destroy_workqueue(dmc->ssds[m].ssd_mdupdate_q);
+			dmc->ssds[m].ssd_mdupdate_q = NULL;
+		}
 	}
 	if (dmc->dirty_set_lru) {
 		lru_uninit(dmc->dirty_set_lru);
@@ -2365,6 +3207,10 @@ void eio_free_wb_resources(struct cache_c *dmc)
 		kfree(dmc->clean_dbvecs);
 		dmc->clean_dbvecs = NULL;
 	}
+	if (dmc->clean_sort_ents) {
+		vfree(dmc->clean_sort_ents);
+		dmc->clean_sort_ents = NULL;
+	}
 
 	dmc->dbvec_count = dmc->mdpage_count = 0;
 	return;
@@ -2457,8 +3303,10 @@ eio_notify_ssd_rm(struct notifier_block *nb, unsigned long action, void *data)
 	size_t len;
 	unsigned long int flags = 0;
 	struct ssd_rm_list *ssd_list_ptr;
+	struct eio_ssd *ssd;
 	unsigned check_src = 0, check_ssd = 0;
 	enum dev_notifier notify = NOTIFY_INITIALIZER;
+	u_int32_t m;
 
 	if (likely(action != BUS_NOTIFY_DEL_DEVICE))
 		return 0;
@@ -2478,19 +3326,24 @@ eio_notify_ssd_rm(struct notifier_block *nb, unsigned long action, void *data)
 	/* push to a list for future processing as we could be in an interrupt context */
 	for (dmc = cache_list_head; dmc != NULL; dmc = dmc->next_cache) {
 		notify = NOTIFY_INITIALIZER;
+		ssd = NULL;
 		check_src = ('\0' == dmc->cache_srcdisk_name[0] ? 0 : 1);
-		check_ssd = ('\0' == dmc->cache_gendisk_name[0] ? 0 : 1);
-
-		if (check_src == 0 && check_ssd == 0)
-			continue;
 
 		/*Check if source dev name or ssd dev name is available or not. */
-		if (check_ssd
-		    && 0 == strncmp(device_name, dmc->cache_gendisk_name,
-				    len)) {
-			pr_info("SSD Removed for cache name %s",
-				dmc->cache_name);
-			notify = NOTIFY_SSD_REMOVED;
+		for (m = 0; m < dmc->nr_ssds; m++) {
+			check_ssd = ('\0' == dmc->ssds[m].ssd_gendisk_name[0] ?
+				     0 : 1);
+			if (check_ssd
+			    && 0 == strncmp(device_name,
+					    dmc->ssds[m].ssd_gendisk_name,
+					    len)) {
+				pr_info("SSD %s Removed for cache name %s",
+					dmc->ssds[m].ssd_devname,
+					dmc->cache_name);
+				ssd = &dmc->ssds[m];
+				notify = NOTIFY_SSD_REMOVED;
+				break;
+			}
 		}
 
 		if (check_src
@@ -2498,6 +3351,7 @@ eio_notify_ssd_rm(struct notifier_block *nb, unsigned long action, void *data)
 				    len)) {
 			pr_info("SRC Removed for cache name %s",
 				dmc->cache_name);
+			ssd = NULL;
 			notify = NOTIFY_SRC_REMOVED;
 		}
 
@@ -2510,6 +3364,7 @@ eio_notify_ssd_rm(struct notifier_block *nb, unsigned long action, void *data)
 			return -ENOMEM;
 		}
 		ssd_list_ptr->dmc = dmc;
+		ssd_list_ptr->ssd = ssd;
 		ssd_list_ptr->action = action;
 		ssd_list_ptr->devt = dev->devt;
 		ssd_list_ptr->note = notify;
@@ -2537,14 +3392,19 @@ static int __init eio_init(void)
 	int r;
 	extern struct bus_type scsi_bus_type;
 
-	eio_ttc_init();
-	r = eio_create_misc_device();
+	r = eio_ttc_init();
 	if (r)
 		return r;
+	r = eio_create_misc_device();
+	if (r) {
+		eio_ttc_exit();
+		return r;
+	}
 
 	r = eio_jobs_init();
 	if (r) {
 		eio_delete_misc_device();
+		eio_ttc_exit();
 		return r;
 	}
 	atomic_set(&nr_cache_jobs, 0);
@@ -2556,6 +3416,7 @@ static int __init eio_init(void)
 	if (eio_control == NULL) {
 		pr_err("init: Cannot allocate memory for eio_control");
 		eio_delete_misc_device();
+		eio_ttc_exit();
 		return -ENOMEM;
 	}
 	eio_control->synch_flags = 0;
@@ -2565,6 +3426,7 @@ static int __init eio_init(void)
 	if (r) {
 		pr_err("init: bus register notifier failed %d", r);
 		eio_delete_misc_device();
+		eio_ttc_exit();
 	}
 	return r;
 }
@@ -2590,6 +3452,7 @@ static void eio_exit(void)
 		eio_control = NULL;
 	}
 	eio_delete_misc_device();
+	eio_ttc_exit();
 }
 
 /*
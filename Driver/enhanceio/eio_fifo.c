@@ -37,6 +37,9 @@ int eio_fifo_cache_sets_init(struct eio_policy *);
 int eio_fifo_cache_blk_init(struct eio_policy *);
 void eio_fifo_find_reclaim_dbn(struct eio_policy *, index_t, index_t *);
 int eio_fifo_clean_set(struct eio_policy *, index_t, int);
+void eio_fifo_rank_get(struct eio_policy *, index_t, u_int8_t *);
+void eio_fifo_rank_set(struct eio_policy *, index_t, const u_int8_t *,
+		       const u_int16_t *);
 
 /* Per policy instance initialization */
 struct eio_policy *eio_fifo_instance_init(void);
@@ -162,6 +165,37 @@ int eio_fifo_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 	return nr_writes;
 }
 
+/*
+ * Rank the blocks of a set by their distance from the FIFO cursor.
+ */
+void eio_fifo_rank_get(struct eio_policy *p_ops, index_t set, u_int8_t *ranks)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_fifo_cache_set *cache_sets;
+	index_t start_index = set * dmc->assoc;
+	index_t next;
+	u_int32_t i;
+
+	cache_sets = (struct eio_fifo_cache_set *)dmc->sp_cache_set;
+	next = cache_sets[set].set_fifo_next - start_index;
+	for (i = 0; i < dmc->assoc; i++)
+		ranks[i] = EIO_RANK((i + dmc->assoc - next) % dmc->assoc,
+				    dmc->assoc);
+}
+
+/*
+ * The FIFO order follows the blocks, restore the cursor only.
+ */
+void eio_fifo_rank_set(struct eio_policy *p_ops, index_t set,
+		       const u_int8_t *ranks, const u_int16_t *order)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_fifo_cache_set *cache_sets;
+
+	cache_sets = (struct eio_fifo_cache_set *)dmc->sp_cache_set;
+	cache_sets[set].set_fifo_next = set * dmc->assoc + order[0];
+}
+
 /*
  * FIFO is per set, so do nothing on a per block init.
  */
@@ -192,6 +226,8 @@ struct eio_policy *eio_fifo_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_fifo_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_fifo_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_fifo_clean_set;
+	new_instance->sp_rank_get = eio_fifo_rank_get;
+	new_instance->sp_rank_set = eio_fifo_rank_set;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
@@ -34,6 +34,7 @@ long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
 {
 	int error = 0;
 	struct cache_rec_short *cache;
+	struct cache_prefetch *prefetch;
 	uint64_t ncaches;
 	enum dev_notifier note;
 	int do_delete = 0;
@@ -141,6 +142,20 @@ long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg)
 	case EIO_IOC_SRC_ADD:
 		break;
 
+	case EIO_IOC_PREFETCH:
+		prefetch = vmalloc(sizeof(struct cache_prefetch));
+		if (!prefetch)
+			return -ENOMEM;
+
+		if (copy_from_user(prefetch, (void __user *)arg,
+				   sizeof(struct cache_prefetch))) {
+			vfree(prefetch);
+			return -EFAULT;
+		}
+		error = eio_cache_prefetch(prefetch);
+		vfree(prefetch);
+		break;
+
 	case EIO_IOC_NOTIFY_REBOOT:
 		eio_reboot_handling();
 		break;
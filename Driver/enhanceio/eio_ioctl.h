@@ -39,13 +39,14 @@
 #define NAME_LEN                127
 #define NAME_SZ                 (NAME_LEN + 1)
 
+#define EIO_MAX_SSDS            4       /* SSDs a cache can be striped over */
+
 #define EIO_IOC_CREATE _IOW('E', 0, struct cache_rec_short)
 #define EIO_IOC_DELETE _IOW('E', 1, struct cache_rec_short)
 #define EIO_IOC_ENABLE _IOW('E', 2, struct cache_rec_short)
 #define EIO_IOC_DISABLE _IOW('E', 3, struct cache_rec_short)
 #define EIO_IOC_EDIT _IOW('E', 4, struct cache_rec_short)
 #define EIO_IOC_NCACHES _IOR('E', 5, uint64_t)
-#define EIO_IOC_CACHE_LIST _IOWR('E', 6, struct cache_list)
 #define EIO_IOC_SSD_ADD _IOW('E', 7, struct cache_rec_short)
 #define EIO_IOC_SSD_REMOVE _IOW('E', 8, struct cache_rec_short)
 #define EIO_IOC_SRC_ADD _IOW('E', 9, struct cache_rec_short)
@@ -53,7 +54,26 @@
 #define EIO_IOC_NOTIFY_REBOOT _IO('E', 11)
 #define EIO_IOC_SET_WARM_BOOT _IO('E', 12)
 #define EIO_IOC_UNUSED _IO('E', 13)
+#define EIO_IOC_PREFETCH _IOW('E', 14, struct cache_prefetch)
+/*
+ * The size of struct cache_list doesn't change with its records, so the
+ * list got a new number when cache_rec_short grew. 6 is the old one.
+ */
+#define EIO_IOC_CACHE_LIST _IOWR('E', 15, struct cache_list)
 
+/*
+ * cr_flags of EIO_IOC_CREATE. The create options are kept in the
+ * superblock, a reload ignores them.
+ */
+#define EIO_CR_INVALIDATE       (1 << 0)        /* invalidate API */
+#define EIO_CR_LAZY_MD_LOAD     (1 << 1)        /* reload clean caches with the md loaded once active */
+#define EIO_CR_MD_MEM_LOCAL     (1 << 2)        /* in-core md in chunks on the local node */
+#define EIO_CR_MD_MEM_INTERLEAVE (1 << 3)       /* in-core md in chunks spread over the nodes */
+#define EIO_CR_NO_POLICY_RANKS  (1 << 4)        /* no space for the policy order on the SSD */
+#define EIO_CR_SUB_BLOCK        (1 << 5)        /* cache partial block writes of write-through caches */
+#define EIO_CR_FLAGS            (EIO_CR_INVALIDATE | EIO_CR_LAZY_MD_LOAD | \
+				 EIO_CR_MD_MEM_LOCAL | EIO_CR_MD_MEM_INTERLEAVE | \
+				 EIO_CR_NO_POLICY_RANKS | EIO_CR_SUB_BLOCK)
 
 struct cache_rec_short {
 	char cr_name[CACHE_NAME_SZ];
@@ -64,13 +84,15 @@ struct cache_rec_short {
 	uint64_t cr_ssd_dev_size;
 	uint32_t cr_src_sector_size;
 	uint32_t cr_ssd_sector_size;
-	uint32_t cr_flags;      /* CACHE_FLAGS_INV* etc. */
+	uint32_t cr_flags;      /* EIO_CR_* */
 	char cr_policy;
 	char cr_mode;
 	char cr_persistence;
 	char cr_cold_boot;
 	uint64_t cr_blksize;
 	uint64_t cr_assoc;
+	uint32_t cr_nr_ssds;            /* SSDs the cache is striped over, 0 => 1 */
+	char cr_ssd_stripe[EIO_MAX_SSDS - 1][NAME_SZ];  /* the SSDs after cr_ssd_devname */
 };
 
 struct cache_list {
@@ -78,6 +100,21 @@ struct cache_list {
 	struct cache_rec_short *cachelist;
 };
 
+#define EIO_PREFETCH_EXTENTS_MAX        64
+
+/* A range of the source device, in 512 byte sectors */
+struct eio_extent {
+	uint64_t ex_start;
+	uint64_t ex_count;
+};
+
+struct cache_prefetch {
+	char cp_name[CACHE_NAME_SZ];
+	uint32_t cp_rate_kb;            /* KB/s read from the source, 0 => no limit */
+	uint32_t cp_nr_extents;         /* 0 => the whole source device */
+	struct eio_extent cp_extents[EIO_PREFETCH_EXTENTS_MAX];
+};
+
 #ifdef __KERNEL__
 long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg);
 long eio_compact_ioctl(struct file *filp, unsigned cmd, unsigned long arg);
@@ -37,6 +37,9 @@ int eio_lru_cache_sets_init(struct eio_policy *);
 int eio_lru_cache_blk_init(struct eio_policy *);
 void eio_lru_find_reclaim_dbn(struct eio_policy *, index_t, index_t *);
 int eio_lru_clean_set(struct eio_policy *, index_t, int);
+void eio_lru_rank_get(struct eio_policy *, index_t, u_int8_t *);
+void eio_lru_rank_set(struct eio_policy *, index_t, const u_int8_t *,
+		      const u_int16_t *);
 /* Per policy instance initialization */
 struct eio_policy *eio_lru_instance_init(void);
 
@@ -144,6 +147,8 @@ struct eio_policy *eio_lru_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_lru_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_lru_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_lru_clean_set;
+	new_instance->sp_rank_get = eio_lru_rank_get;
+	new_instance->sp_rank_set = eio_lru_rank_set;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
@@ -233,6 +238,55 @@ int eio_lru_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 	return nr_writes;
 }
 
+/*
+ * Rank the blocks of a set by their place from the LRU head.
+ */
+void eio_lru_rank_get(struct eio_policy *p_ops, index_t set, u_int8_t *ranks)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_lru_cache_set *lru_sets;
+	struct eio_lru_cache_block *blkptr;
+	index_t start_index = set * dmc->assoc;
+	index_t lru_rel_index;
+	u_int32_t pos = 0;
+
+	lru_sets = (struct eio_lru_cache_set *)dmc->sp_cache_set;
+	blkptr = (struct eio_lru_cache_block *)dmc->sp_cache_blk + start_index;
+
+	memset(ranks, 0, dmc->assoc);
+	lru_rel_index = lru_sets[set].lru_head;
+	while (lru_rel_index != EIO_LRU_NULL) {
+		ranks[lru_rel_index] = EIO_RANK(pos, dmc->assoc);
+		pos++;
+		lru_rel_index = blkptr[lru_rel_index].lru_next;
+	}
+}
+
+/*
+ * Rebuild the LRU of a set, order holds its blocks coldest first.
+ */
+void eio_lru_rank_set(struct eio_policy *p_ops, index_t set,
+		      const u_int8_t *ranks, const u_int16_t *order)
+{
+	struct cache_c *dmc = p_ops->sp_dmc;
+	struct eio_lru_cache_set *lru_sets;
+	struct eio_lru_cache_block *blkptr;
+	index_t start_index = set * dmc->assoc;
+	u_int32_t i;
+
+	lru_sets = (struct eio_lru_cache_set *)dmc->sp_cache_set;
+	blkptr = (struct eio_lru_cache_block *)dmc->sp_cache_blk + start_index;
+
+	lru_sets[set].lru_head = EIO_LRU_NULL;
+	lru_sets[set].lru_tail = EIO_LRU_NULL;
+	for (i = 0; i < dmc->assoc; i++) {
+		blkptr[i].lru_prev = EIO_LRU_NULL;
+		blkptr[i].lru_next = EIO_LRU_NULL;
+	}
+	for (i = 0; i < dmc->assoc; i++)
+		eio_reclaim_lru_movetail(dmc, start_index + order[i], p_ops);
+}
+
 /*
  * LRU specific functions.
  */
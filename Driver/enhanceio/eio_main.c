@@ -65,6 +65,10 @@ static int eio_release_io_resources(struct cache_c *dmc,
 				    struct bio_container *bc);
 static void eio_clean_set(struct cache_c *dmc, index_t set, int whole,
 			  int force);
+static void eio_clean_sets_sorted(struct cache_c *dmc, index_t *sets,
+				  int nr_sets, int force);
+static int eio_clean_set_md(struct cache_c *dmc, index_t set,
+			    struct page **mdpages);
 static void eio_do_mdupdate(struct work_struct *work);
 static void eio_mdupdate_callback(int error, void *context);
 static void eio_enq_mdupdate(struct bio_container *bc);
@@ -74,7 +78,10 @@ static int eio_alloc_mdreqs(struct cache_c *, struct bio_container *);
 static void eio_check_dirty_set_thresholds(struct cache_c *dmc, index_t set);
 static void eio_check_dirty_cache_thresholds(struct cache_c *dmc);
 static void eio_post_mdupdate(struct work_struct *work);
+static void eio_queue_mdupdate(struct cache_c *dmc,
+			       struct mdupdate_request *mdreq);
 static void eio_post_io_callback(struct work_struct *work);
+static void eio_read_fast_done(struct kcached_job *job);
 
 static void bc_addfb(struct bio_container *bc, struct eio_bio *ebio)
 {
@@ -84,6 +91,50 @@ static void bc_addfb(struct bio_container *bc, struct eio_bio *ebio)
 	ebio->eb_bc = bc;
 }
 
+/* Account the latency of bc in the histogram of the class it was served by */
+static void eio_lat_hist_add(struct cache_c *dmc, struct bio_container *bc)
+{
+	s64 usecs;
+	int class;
+	int bucket;
+
+	switch (bc->bc_dir) {
+	case CACHED_READ:
+		class = EIO_LAT_READ_HIT;
+		break;
+	case UNCACHED_READ:
+		class = EIO_LAT_READ_MISS;
+		break;
+	case UNCACHED_READ_AND_READFILL:
+		class = EIO_LAT_READFILL;
+		break;
+	case UNCACHED_WRITE:
+		class = EIO_LAT_WRITE;
+		break;
+	case CACHED_WRITE:
+		class = EIO_LAT_DIRTY_WRITE;
+		break;
+	default:
+		/* forced uncached and sequential bypass I/Os */
+		class = EIO_LAT_UNCACHED;
+		break;
+	}
+
+	usecs = ktime_us_delta(ktime_get(), bc->bc_iostart);
+	bucket = (usecs > 0) ? fls64(usecs) : 0;
+	if (bucket >= EIO_LAT_HIST_BUCKETS)
+		bucket = EIO_LAT_HIST_BUCKETS - 1;
+	this_cpu_inc(dmc->lat_hist->lh_count[class][bucket]);
+
+	/* Lockless EWMA, a lost race only drops one sample's weight */
+	if (CLEAN_ADAPTIVE(dmc)) {
+		usecs = clamp_t(s64, usecs, 0, 10 * CLEAN_TARGET_LAT_US_MAX);
+		atomic_add((int)usecs - (atomic_read(&dmc->fg_lat_ewma) >>
+					 EIO_LAT_EWMA_SHIFT),
+			   &dmc->fg_lat_ewma);
+	}
+}
+
 static void bc_put(struct bio_container *bc)
 {
 	struct cache_c *dmc;
@@ -103,9 +154,11 @@ static void bc_put(struct bio_container *bc)
 		elapsed = (long)jiffies_to_msecs(jiffies - bc->bc_iotime);
 
 		if (data_dir == READ)
-			atomic64_add(elapsed, &dmc->eio_stats.rdtime_ms);
+			this_cpu_add(dmc->eio_stats->rdtime_ms, elapsed);
 		else
-			atomic64_add(elapsed, &dmc->eio_stats.wrtime_ms);
+			this_cpu_add(dmc->eio_stats->wrtime_ms, elapsed);
+		if (!bc->bc_error && !bc->bc_prefetch)
+			eio_lat_hist_add(dmc, bc);
 
 		EIO_BIO_ENDIO(bc->bc_bio, bc->bc_error);
 		atomic64_dec(&bc->bc_dmc->nr_ios);
@@ -130,7 +183,7 @@ static void eb_endio(struct eio_bio *ebio, int error)
 	kfree(ebio);
 }
 
-static int
+int
 eio_io_async_bvec(struct cache_c *dmc, struct eio_io_region *where, unsigned op, unsigned op_flags,
 		  struct bio_vec *pages, unsigned nr_bvecs, eio_notify_fn fn,
 		  void *context, int hddio)
@@ -207,8 +260,7 @@ static inline void eio_flag_abio(struct cache_c *dmc, struct eio_bio *abio,
 			else {
 				EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 				                    INVALID);
-				atomic64_dec_if_positive(&dmc->eio_stats.
-				                         cached_blocks);
+				atomic64_dec_if_positive(&dmc->cached_blocks);
 			}
 		} else {
 			if (cwip_on)
@@ -219,9 +271,7 @@ static inline void eio_flag_abio(struct cache_c *dmc, struct eio_bio *abio,
 					QUEUED) {
 					EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 					                    INVALID);
-					atomic64_dec_if_positive(&dmc->
-					                         eio_stats.
-					                         cached_blocks);
+					atomic64_dec_if_positive(&dmc->cached_blocks);
 				} else {
 					EIO_CACHE_STATE_SET(dmc, abio->eb_index,
 					                    VALID);
@@ -273,7 +323,7 @@ static void eio_disk_io_callback(int error, void *context)
 	spin_lock_irqsave(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
 	/* Invalidate the cache block */
 	EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
 	spin_unlock_irqrestore(&dmc->cache_sets[eb_cacheset].cs_lock, flags);
 
 	if (unlikely(error))
@@ -304,7 +354,7 @@ static inline void eio_uncached_read_done_bio(struct cache_c *dmc,
 
 	if (unlikely(EIO_CACHE_STATE_GET(dmc, iebio->eb_index) & QUEUED)) {
 		EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 	} else if (EIO_CACHE_STATE_GET(dmc, iebio->eb_index) &
 		CACHEREADINPROG) {
 		/*turn off the cache read in prog flag*/
@@ -354,8 +404,13 @@ static void eio_io_callback(int error, void *context)
 	struct cache_c *dmc = job->dmc;
 
 	job->error = error;
+	/* Writes of non-WB caches need an SSD flush only once done */
+	if (!error && (job->action == WRITECACHE || job->action == READFILL))
+		WRITE_ONCE(eio_index_ssd(dmc, job->index)->ssd_written, 1);
 	INIT_WORK(&job->work, eio_post_io_callback);
-	queue_work(dmc->callback_q, &job->work);
+	/* The jobs of the md of a set have no block */
+	queue_work(job->index == -1 ? dmc->ssds[0].ssd_callback_q :
+		   eio_index_ssd(dmc, job->index)->ssd_callback_q, &job->work);
 	return;
 }
 
@@ -392,7 +447,7 @@ static void eio_post_io_callback(struct work_struct *work)
 	switch (job->action) {
 	case WRITEDISK:
 
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		this_cpu_inc(dmc->eio_stats->writedisk);
 		if (unlikely(error))
 			dmc->eio_errors.disk_write_errors++;
 		if (unlikely(error) || (ebio->eb_iotype & EB_INVAL))
@@ -424,8 +479,12 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case READCACHE:
 
-		/*atomic64_inc(&dmc->eio_stats.readcache);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);*/
+		if (ebio->eb_iotype & EB_FAST_READ) {
+			eio_read_fast_done(job);
+			return;
+		}
+		/*this_cpu_inc(dmc->eio_stats->readcache);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_reads, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
@@ -446,7 +505,7 @@ static void eio_post_io_callback(struct work_struct *work)
 						       cs_lock, flags);
 
 				eio_push_ssdread_failures(job);
-				schedule_work(&_kcached_wq);
+				schedule_work(&dmc->disk_read_work);
 
 				return;
 			}
@@ -456,8 +515,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case READFILL:
 
-		/*atomic64_inc(&dmc->eio_stats.readfill);*/
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
+		/*this_cpu_inc(dmc->eio_stats->readfill);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);*/
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) == ebio->eb_sector);
 		if (unlikely(error))
 			dmc->eio_errors.ssd_write_errors++;
@@ -472,8 +531,8 @@ static void eio_post_io_callback(struct work_struct *work)
 
 	case WRITECACHE:
 
-		/*SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);*/
-		/*atomic64_inc(&dmc->eio_stats.writecache);*/
+		/*SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);*/
+		/*this_cpu_inc(dmc->eio_stats->writecache);*/
 		cstate = EIO_CACHE_STATE_GET(dmc, index);
 		EIO_ASSERT(EIO_DBN_GET(dmc, index) ==
 			   EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
@@ -487,7 +546,7 @@ static void eio_post_io_callback(struct work_struct *work)
 			}
 		} else {
 			/* TODO: ask if this if condition is required */
-			if (dmc->mode == CACHE_MODE_WT)
+			if (dmc->mode != CACHE_MODE_WB)
 				dmc->eio_errors.disk_write_errors++;
 			dmc->eio_errors.ssd_write_errors++;
 		}
@@ -532,7 +591,7 @@ static void eio_post_io_callback(struct work_struct *work)
 		/* Error or QUEUED is set: mark block as INVALID for non-DIRTY blocks */
 		if (cstate != ALREADY_DIRTY) {
 			EIO_CACHE_STATE_SET(dmc, index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		}
 	} else if (cstate & VALID) {
 		EIO_CACHE_STATE_OFF(dmc, index, BLOCK_IO_INPROG);
@@ -598,8 +657,8 @@ void eio_ssderror_diskread(struct kcached_job *job)
 
 	EIO_ASSERT(ebio->eb_dir == READ);
 
-	atomic64_inc(&dmc->eio_stats.readdisk);
-	SECTOR_STATS(dmc->eio_stats.disk_reads, ebio->eb_size);
+	this_cpu_inc(dmc->eio_stats->readdisk);
+	SECTOR_STATS(dmc->eio_stats->disk_reads, ebio->eb_size);
 	job->action = READDISK;
 
 	error = eio_io_async_bvec(dmc, &job->job_io_regions.disk, REQ_OP_READ, 0,
@@ -625,7 +684,7 @@ out:
 	spin_unlock_irqrestore(&dmc->cache_sets[index / dmc->assoc].cs_lock,
 			       flags);
 
-	atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+	atomic64_dec_if_positive(&dmc->cached_blocks);
 
 	eb_endio(ebio, error);
 	ebio = NULL;
@@ -659,6 +718,39 @@ static void eio_addto_cleanq(struct cache_c *dmc, index_t set, int whole)
 	return;
 }
 
+/*
+ * Adaptive clean rate, used when clean_target_lat_us is set.
+ * clean_depth (hdd writes in flight per set clean) and clean_batch
+ * (sets cleaned between two adjustments) are halved while the
+ * foreground latency is above target or more than autoclean_threshold
+ * I/Os are in flight. They grow by one while latency is below 3/4 of
+ * target or the foreground is idle. Above target at the minimum rate
+ * the cleaner backs off for CLEAN_BACKOFF_MS.
+ */
+static void eio_clean_rate_adjust(struct cache_c *dmc)
+{
+	int target = dmc->sysctl_active.clean_target_lat_us;
+	int64_t qd = atomic64_read(&dmc->nr_ios);
+	int lat = atomic_read(&dmc->fg_lat_ewma) >> EIO_LAT_EWMA_SHIFT;
+	int depth_max = min_t(int, CLEAN_DEPTH_MAX, dmc->assoc);
+
+	if (qd > 0 && ((lat > target) ||
+		       (qd > (int64_t)dmc->sysctl_active.autoclean_threshold))) {
+		if (dmc->clean_depth == 1) {
+			this_cpu_inc(dmc->eio_stats->clean_backoffs);
+			msleep_interruptible(CLEAN_BACKOFF_MS);
+			return;
+		}
+		dmc->clean_depth = max(dmc->clean_depth >> 1, 1);
+		dmc->clean_batch = max(dmc->clean_batch >> 1, 1);
+	} else if (qd == 0 || lat < target - (target >> 2)) {
+		if (dmc->clean_depth < depth_max)
+			dmc->clean_depth++;
+		if (dmc->clean_batch < CLEAN_BATCH_MAX)
+			dmc->clean_batch++;
+	}
+}
+
 /*
  * Clean thread loops forever in this, waiting for
  * new clean set requests in the clean queue.
@@ -669,6 +761,9 @@ int eio_clean_thread_proc(void *context)
 	unsigned long flags = 0;
 	u_int64_t systime;
 	index_t index;
+	int batch_left;
+	index_t sets[CLEAN_SORT_SETS_MAX];
+	int nr_sets, sort_sets;
 
 	/* Sync makes sense only for writeback cache */
 	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
@@ -735,6 +830,9 @@ int eio_clean_thread_proc(void *context)
 		spin_unlock_irqrestore(&dmc->clean_sl, flags);
 
 		systime = jiffies;
+		batch_left = 0;
+		nr_sets = 0;
+		sort_sets = dmc->sysctl_active.clean_sort_sets;
 		while (!list_empty(&setlist)) {
 			set =
 				list_entry((&setlist)->next, struct cache_set,
@@ -742,6 +840,22 @@ int eio_clean_thread_proc(void *context)
 			list_del(&set->list);
 			index = set - dmc->cache_sets;
 			if (!(dmc->sysctl_active.fast_remove)) {
+				if (CLEAN_ADAPTIVE(dmc) && --batch_left <= 0) {
+					eio_clean_rate_adjust(dmc);
+					batch_left = dmc->clean_batch;
+				}
+				if (sort_sets > 1) {
+					sets[nr_sets++] = index;
+					if ((nr_sets == sort_sets) ||
+					    list_empty(&setlist)) {
+						eio_clean_sets_sorted(dmc, sets,
+								      nr_sets, 0);
+						atomic64_sub(nr_sets,
+							     &dmc->clean_pendings);
+						nr_sets = 0;
+					}
+					continue;
+				}
 				eio_clean_set(dmc, index,
 					      set->flags & SETFLAG_CLEAN_WHOLE,
 					      0);
@@ -770,6 +884,12 @@ int eio_clean_thread_proc(void *context)
 			}
 			atomic64_dec(&dmc->clean_pendings);
 		}
+
+		/* a fast remove left a partial batch */
+		if (nr_sets) {
+			eio_clean_sets_sorted(dmc, sets, nr_sets, 0);
+			atomic64_sub(nr_sets, &dmc->clean_pendings);
+		}
 	}
 
 	/* notifier for cache delete that the clean thread has stopped running */
@@ -784,35 +904,32 @@ int eio_clean_thread_proc(void *context)
 /*
  * Cache miss support. We read the data from disk, write it to the ssd.
  * To avoid doing 1 IO at a time to the ssd, when the IO is kicked off,
- * we enqueue it to a "readfill" queue in the cache in cache sector order.
- * The worker thread can then issue all of these IOs and do 1 unplug to
- * start them all.
+ * we enqueue it to a "readfill" queue in the cache. The worker thread
+ * then sorts the fills of all queued jobs by cache sector and issues
+ * them in batches under one block plug.
  *
  */
 static void eio_enqueue_readfill(struct cache_c *dmc, struct kcached_job *job)
 {
 	unsigned long flags = 0;
-	struct kcached_job **j1, *next;
 	int do_schedule = 0;
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
-	/* Insert job in sorted order of cache sector */
-	j1 = &dmc->readfill_queue;
-	while (*j1 != NULL && (*j1)->job_io_regions.cache.sector <
-		job->job_io_regions.cache.sector)
-		j1 = &(*j1)->next;
-	next = *j1;
-	*j1 = job;
-	job->next = next;
+	job->next = dmc->readfill_queue;
+	dmc->readfill_queue = job;
 	do_schedule = (dmc->readfill_in_prog == 0);
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
 	if (do_schedule)
 		schedule_work(&dmc->readfill_wq);
 }
 
-/* part of eio_do_readfill */
+/*
+ * part of eio_do_readfill
+ * A block to fill is returned in *fill, for eio_readfill_submit().
+ */
 static inline void eio_do_readfill_bio(struct cache_c *dmc,
-				       struct eio_bio *iebio)
+				       struct eio_bio *iebio,
+				       struct kcached_job **fill)
 {
 	int err;
 	unsigned long flags;
@@ -835,7 +952,7 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 		EIO_CACHE_STATE_SET(dmc, index, INVALID);
 		spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].
 		                       cs_lock, flags);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 		eb_endio(iebio, 0);
 		iebio = NULL;
 	} else if ((EIO_CACHE_STATE_GET(dmc, index) &
@@ -852,18 +969,16 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 			err = 0;
 			job->action = READFILL;
 			atomic_inc(&dmc->nr_jobs);
-			SECTOR_STATS(dmc->eio_stats.ssd_readfills,
+			SECTOR_STATS(dmc->eio_stats->ssd_readfills,
 			             iebio->eb_size);
-			SECTOR_STATS(dmc->eio_stats.ssd_writes, iebio->eb_size);
-			atomic64_inc(&dmc->eio_stats.readfill);
-			atomic64_inc(&dmc->eio_stats.writecache);
-			err = eio_io_async_bvec(dmc, &job->job_io_regions.cache,
-			                        REQ_OP_WRITE, 0, iebio->eb_bv,
-			                        iebio->eb_nbvec,
-			                        eio_io_callback, job, 0);
+			SECTOR_STATS(dmc->eio_stats->ssd_writes, iebio->eb_size);
+			this_cpu_inc(dmc->eio_stats->readfill);
+			this_cpu_inc(dmc->eio_stats->writecache);
+			job->next = NULL;
+			*fill = job;
 		}
 		if (err) {
-			pr_err("eio_do_readfill: IO submission failed, block %llu",
+			pr_err("eio_do_readfill: job allocation failed, block %llu",
 			EIO_DBN_GET(dmc, index));
 			spin_lock_irqsave(&dmc->cache_sets[iebio->eb_cacheset].
 			                  cs_lock, flags);
@@ -871,13 +986,8 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 			spin_unlock_irqrestore(&dmc->cache_sets
 			                       [iebio->eb_cacheset].cs_lock,
 			                       flags);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 			eb_endio(iebio, err);
-
-			if (job) {
-				eio_free_cache_job(job);
-				job = NULL;
-			}
 		}
 	} else
 		if (EIO_CACHE_STATE_GET(dmc, index) == ALREADY_DIRTY) {
@@ -895,8 +1005,8 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 			err = -ENOMEM;
 		else {
 			job->action = READCACHE;
-			SECTOR_STATS(dmc->eio_stats.ssd_reads, iebio->eb_size);
-			atomic64_inc(&dmc->eio_stats.readcache);
+			SECTOR_STATS(dmc->eio_stats->ssd_reads, iebio->eb_size);
+			this_cpu_inc(dmc->eio_stats->readcache);
 			err = eio_io_async_bvec(dmc, &job->job_io_regions.cache,
 			                        REQ_OP_READ, 0, iebio->eb_bv,
 			                        iebio->eb_nbvec,
@@ -931,6 +1041,131 @@ static inline void eio_do_readfill_bio(struct cache_c *dmc,
 	}
 }
 
+/*
+ * Fills of consecutive blocks of a bio container, which also follow
+ * each other on the cache device, go out as one SSD write.
+ */
+static inline int eio_readfill_adjacent(struct kcached_job *prev,
+					struct kcached_job *job)
+{
+	struct eio_bio *pebio = prev->ebio;
+	struct eio_bio *ebio = job->ebio;
+
+	/* Split bvecs live in each eio_bio, only whole ones are shared */
+	if (pebio->eb_bv == pebio->eb_rbv || ebio->eb_bv == ebio->eb_rbv)
+		return 0;
+	/* The SSDs of a striped cache have the same sectors */
+	return pebio->eb_bc == ebio->eb_bc &&
+	       pebio->eb_bv + pebio->eb_nbvec == ebio->eb_bv &&
+	       prev->job_io_regions.cache.bdev ==
+	       job->job_io_regions.cache.bdev &&
+	       prev->job_io_regions.cache.sector +
+	       prev->job_io_regions.cache.count ==
+	       job->job_io_regions.cache.sector;
+}
+
+static void eio_readfill_run_callback(int error, void *context)
+{
+	struct kcached_job *job = (struct kcached_job *)context;
+	struct kcached_job *next;
+
+	for (; job != NULL; job = next) {
+		next = job->next;
+		job->next = NULL;
+		eio_io_callback(error, job);
+	}
+}
+
+/* Write a run of adjacent fills chained on job->next */
+static void eio_readfill_submit(struct cache_c *dmc, struct kcached_job *run)
+{
+	struct eio_io_region region = run->job_io_regions.cache;
+	struct kcached_job *job, *next;
+	struct eio_bio *iebio;
+	unsigned long flags;
+	unsigned nbvec = 0;
+	int err;
+
+	for (job = run; job != NULL; job = job->next) {
+		nbvec += job->ebio->eb_nbvec;
+		if (job != run)
+			region.count += job->job_io_regions.cache.count;
+	}
+
+	err = eio_io_async_bvec(dmc, &region, REQ_OP_WRITE, 0,
+				run->ebio->eb_bv, nbvec,
+				run->next ? eio_readfill_run_callback :
+				eio_io_callback, run, 0);
+	if (!err)
+		return;
+
+	for (job = run; job != NULL; job = next) {
+		next = job->next;
+		iebio = job->ebio;
+		pr_err("eio_do_readfill: IO submission failed, block %llu",
+		       EIO_DBN_GET(dmc, iebio->eb_index));
+		spin_lock_irqsave(&dmc->cache_sets[iebio->eb_cacheset].cs_lock,
+				  flags);
+		EIO_CACHE_STATE_SET(dmc, iebio->eb_index, INVALID);
+		spin_unlock_irqrestore(&dmc->cache_sets[iebio->eb_cacheset].
+				       cs_lock, flags);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
+		eb_endio(iebio, err);
+		eio_free_cache_job(job);
+	}
+}
+
+static int
+eio_readfill_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct kcached_job *ja;
+	struct kcached_job *jb;
+	unsigned long bdeva, bdevb;
+
+	ja = list_entry(a, struct kcached_job, list);
+	jb = list_entry(b, struct kcached_job, list);
+	bdeva = (unsigned long)ja->job_io_regions.cache.bdev;
+	bdevb = (unsigned long)jb->job_io_regions.cache.bdev;
+	if (bdeva != bdevb)
+		return bdeva < bdevb ? -1 : 1;
+	if (ja->job_io_regions.cache.sector < jb->job_io_regions.cache.sector)
+		return -1;
+	return ja->job_io_regions.cache.sector >
+	       jb->job_io_regions.cache.sector;
+}
+
+/*
+ * Write out a batch of fills in SSD and cache sector order, merging the
+ * adjacent ones of a bio container. Called under the block plug of the caller.
+ */
+static void eio_readfill_batch(struct cache_c *dmc, struct list_head *fills,
+			       int nr_fills)
+{
+	struct kcached_job *run = NULL;
+	struct kcached_job *tail = NULL;
+	struct kcached_job *fill;
+
+	list_sort(NULL, fills, eio_readfill_cmp);
+	this_cpu_inc(dmc->eio_stats->ssd_readfill_batches);
+	this_cpu_add(dmc->eio_stats->ssd_readfill_batch_fills, nr_fills);
+
+	while (!list_empty(fills)) {
+		fill = list_first_entry(fills, struct kcached_job, list);
+		list_del_init(&fill->list);
+		if (tail && eio_readfill_adjacent(tail, fill)) {
+			tail->next = fill;
+			tail = fill;
+			this_cpu_inc(dmc->eio_stats->ssd_readfill_merges);
+			continue;
+		}
+		if (run)
+			eio_readfill_submit(dmc, run);
+		run = tail = fill;
+	}
+	if (run)
+		eio_readfill_submit(dmc, run);
+}
+
 void eio_do_readfill(struct work_struct *work)
 {
 	struct kcached_job *job, *joblist;
@@ -938,15 +1173,21 @@ void eio_do_readfill(struct work_struct *work)
 	unsigned long flags = 0;
 	struct kcached_job *nextjob = NULL;
 	struct cache_c *dmc = container_of(work, struct cache_c, readfill_wq);
+	struct kcached_job *fill;
+	struct blk_plug plug;
+	LIST_HEAD(fills);
+	int nr_fills;
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	if (dmc->readfill_in_prog)
 		goto out;
 	dmc->readfill_in_prog = 1;
-	while (dmc->readfill_queue != NULL) { /* this loop is going to be run only once, right? */
+	while (dmc->readfill_queue != NULL) {
 		joblist = dmc->readfill_queue;
-		dmc->readfill_queue = NULL; /* <--- we are not going to make another loop spin */
+		dmc->readfill_queue = NULL;
 		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+		blk_start_plug(&plug);
+		nr_fills = 0;
 		for (job = joblist; job != NULL; job = nextjob) {
 			struct eio_bio *iebio;
 			struct eio_bio *next;
@@ -958,23 +1199,36 @@ void eio_do_readfill(struct work_struct *work)
 			iebio = ebio->eb_next;
 			EIO_ASSERT(iebio);
 			/* other iebios are anchored on this bio. Create
-			 * jobs for them and then issue ios
+			 * jobs for them, the fills are issued in batches
 			 */
 			do {
 				next = iebio->eb_next;
-				eio_do_readfill_bio(dmc, iebio);
+				fill = NULL;
+				eio_do_readfill_bio(dmc, iebio, &fill);
+				if (fill) {
+					list_add_tail(&fill->list, &fills);
+					nr_fills++;
+				}
 				iebio = next;
 			} while (iebio);
 			eb_endio(ebio, 0);
 			ebio = NULL;
 			eio_free_cache_job(job);
+
+			if (nr_fills >= EIO_READFILL_BATCH_MAX) {
+				eio_readfill_batch(dmc, &fills, nr_fills);
+				nr_fills = 0;
+			}
 		}
+		if (nr_fills)
+			eio_readfill_batch(dmc, &fills, nr_fills);
+		blk_finish_plug(&plug);
 		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	}
 	dmc->readfill_in_prog = 0;
 out:
 	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
-	atomic64_inc(&dmc->eio_stats.ssd_readfill_unplugs);
+	this_cpu_inc(dmc->eio_stats->ssd_readfill_unplugs);
 	eio_unplug_cache_device(dmc);
 }
 
@@ -995,8 +1249,13 @@ find_valid_dbn(struct cache_c *dmc, sector_t dbn,
 {
 	index_t i;
 	index_t end_index = start_index + dmc->assoc;
+	u_int8_t tag = eio_dbn_tag(dbn);
+	u_int8_t *tags = EIO_TAG(dmc, start_index);
 
+	/* Only decode the md of blocks whose tag matches */
 	for (i = start_index; i < end_index; i++) {
+		if (tags[i - start_index] != tag)
+			continue;
 		if ((EIO_CACHE_STATE_GET(dmc, i) & VALID)
 		    && EIO_DBN_GET(dmc, i) == dbn) {
 			*index = i;
@@ -1013,18 +1272,19 @@ find_valid_dbn(struct cache_c *dmc, sector_t dbn,
 
 static index_t find_invalid_dbn(struct cache_c *dmc, index_t start_index)
 {
+	u_int8_t *tags = EIO_TAG(dmc, start_index);
+	u_int8_t *tag;
 	index_t i;
-	index_t end_index = start_index + dmc->assoc;
 
 	/* Find INVALID slot that we can reuse */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == INVALID) {
-			eio_policy_reclaim_lru_movetail(dmc, i,
-							dmc->policy_ops);
-			return i;
-		}
-	}
-	return -1;
+	tag = memchr(tags, EIO_TAG_INVALID, dmc->assoc);
+	if (tag == NULL)
+		return -1;
+
+	i = start_index + (tag - tags);
+	EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, i) == INVALID);
+	eio_policy_reclaim_lru_movetail(dmc, i, dmc->policy_ops);
+	return i;
 }
 
 /* Search for a slot that we can reclaim */
@@ -1041,24 +1301,65 @@ void eio_set_warm_boot(void)
 }
 
 /*
- * dbn is the starting sector.
+ * Move the blocks of the lockless read hits of a set to the tail, before
+ * the set lock holder picks a block to reclaim.
+ */
+static void eio_read_hits_drain(struct cache_c *dmc, u_int32_t set)
+{
+	unsigned long start_index = (unsigned long)set * dmc->assoc;
+	unsigned long end_index = start_index + dmc->assoc;
+	unsigned long i;
+	u_int8_t cstate;
+
+	if (!test_bit(set, dmc->read_hit_sets))
+		return;
+	clear_bit(set, dmc->read_hit_sets);
+	smp_mb__after_atomic();
+
+	for (i = find_next_bit(dmc->read_hits, end_index, start_index);
+	     i < end_index;
+	     i = find_next_bit(dmc->read_hits, end_index, i + 1)) {
+		clear_bit(i, dmc->read_hits);
+		cstate = EIO_CACHE_STATE_GET(dmc, i);
+		if ((cstate & VALID) && !(cstate & BLOCK_IO_INPROG))
+			eio_policy_reclaim_lru_movetail(dmc, i,
+							dmc->policy_ops);
+	}
+}
+
+/*
+ * Looks the block of ebio up in its set.
+ * Returns VALID with the index of the block if cached, -1 otherwise.
  */
 static int
-eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
+eio_lookup_cached(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
 {
 	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
 	u_int32_t set_number;
-	index_t invalid, oldest_clean = -1;
-	index_t start_index;
 
 	/*ASK it is assumed that the lookup is being done for a single block*/
 	set_number = hash_block(dmc, dbn);
-	start_index = dmc->assoc * set_number;
-	find_valid_dbn(dmc, dbn, start_index, index);
+	eio_read_hits_drain(dmc, set_number);
+	find_valid_dbn(dmc, dbn, dmc->assoc * set_number, index);
 	if (*index >= 0)
 		/* We found the exact range of blocks we are looking for */
 		return VALID;
+	return -1;
+}
+
+/*
+ * Picks the block of the set of ebio to cache it in, on a miss. This
+ * updates the replacement policy, as the block is going to be used.
+ * Returns INVALID or VALID with the index of the block, -1 if none.
+ */
+static int
+eio_lookup_victim(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
+{
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	index_t invalid, oldest_clean = -1;
+	index_t start_index;
 
+	start_index = dmc->assoc * hash_block(dmc, dbn);
 	invalid = find_invalid_dbn(dmc, start_index);
 	if (invalid == -1)
 		/* We didn't find an invalid entry, search for oldest valid entry */
@@ -1079,10 +1380,25 @@ eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
 	return -1;
 }
 
-/* Do metadata update for a set */
-static void eio_do_mdupdate(struct work_struct *work)
+/*
+ * dbn is the starting sector.
+ */
+static int
+eio_lookup(struct cache_c *dmc, struct eio_bio *ebio, index_t *index)
+{
+	if (eio_lookup_cached(dmc, ebio, index) == VALID)
+		return VALID;
+	return eio_lookup_victim(dmc, ebio, index);
+}
+
+/*
+ * Build the on-disk md of a set in the mdreq pages and move its pending
+ * mdlist to the inprog list. sector_bits gets the md sectors, per page,
+ * holding the blocks being dirtied.
+ */
+static void
+eio_mdupdate_prepare(struct mdupdate_request *mdreq, u_int8_t *sector_bits)
 {
-	struct mdupdate_request *mdreq;
 	struct cache_set *set;
 	struct cache_c *dmc;
 	unsigned long flags;
@@ -1092,16 +1408,10 @@ static void eio_do_mdupdate(struct work_struct *work)
 	struct flash_cacheblock *md_blocks;
 	struct eio_bio *ebio;
 	u_int8_t cstate;
-	struct eio_io_region region;
 	unsigned pindex;
-	int error, j;
+	int j;
 	index_t blk_index;
-	int k;
-	void *pg_virt_addr[2] = { NULL };
-	u_int8_t sector_bits[2] = { 0 };
-	int startbit, endbit;
 
-	mdreq = container_of(work, struct mdupdate_request, work);
 	dmc = mdreq->dmc;
 	set = &dmc->cache_sets[mdreq->set];
 
@@ -1109,48 +1419,46 @@ static void eio_do_mdupdate(struct work_struct *work)
 	EIO_ASSERT(mdreq->mdblk_bvecs);
 
 	/*
-	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
+	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock), which
+	 * spans mdbvec_count pages. The pages are mapped one at a time,
+	 * under the set lock.
 	 */
 
-	EIO_ASSERT(mdreq->mdbvec_count && mdreq->mdbvec_count <= 2);
-	EIO_ASSERT((dmc->assoc == 512) || mdreq->mdbvec_count == 1);
-	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
-		pg_virt_addr[k] = kmap(mdreq->mdblk_bvecs[k].bv_page);
+	EIO_ASSERT(mdreq->mdbvec_count &&
+		   mdreq->mdbvec_count <= EIO_MD_PAGES_MAX);
+	EIO_ASSERT(mdreq->mdbvec_count ==
+		   IO_PAGE_COUNT(dmc->assoc * sizeof(struct flash_cacheblock)));
 
 	spin_lock_irqsave(&set->cs_lock, flags);
 
 	start_index = mdreq->set * dmc->assoc;
 	end_index = start_index + dmc->assoc;
 
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-	j = MD_BLOCKS_PER_PAGE;
-
 	/* initialize the md blocks to write */
-	for (i = start_index; i < end_index; i++) {
-		cstate = EIO_CACHE_STATE_GET(dmc, i);
-		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
-		if (cstate == ALREADY_DIRTY)
-			md_blocks->cache_state = cpu_to_le64((VALID | DIRTY));
-		else
-			md_blocks->cache_state = cpu_to_le64(INVALID);
-		md_blocks++;
-		j--;
-
-		if ((j == 0) && (++pindex < mdreq->mdbvec_count)) {
-			md_blocks =
-				(struct flash_cacheblock *)pg_virt_addr[pindex];
-			j = MD_BLOCKS_PER_PAGE;
+	i = start_index;
+	for (pindex = 0; pindex < mdreq->mdbvec_count; pindex++) {
+		md_blocks = (struct flash_cacheblock *)
+			    kmap_atomic(mdreq->mdblk_bvecs[pindex].bv_page);
+		for (j = 0; (j < MD_BLOCKS_PER_PAGE) && (i < end_index);
+		     j++, i++) {
+			cstate = EIO_CACHE_STATE_GET(dmc, i);
+			md_blocks[j].dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+			/*
+			 * Dirty blocks being read, queued or cleaned are still
+			 * dirty on disk, keep them so as a batch may write the
+			 * whole set. Blocks being written are not dirty yet.
+			 */
+			if ((cstate & DIRTY) && !(cstate & CACHEWRITEINPROG))
+				md_blocks[j].cache_state =
+					cpu_to_le64((VALID | DIRTY));
+			else
+				md_blocks[j].cache_state = cpu_to_le64(INVALID);
 		}
-
+		kunmap_atomic(md_blocks);
 	}
 
 	/* Update the md blocks with the pending mdlist */
 
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-
 	ebio = mdreq->pending_mdlist;
 	while (ebio) {
 		EIO_ASSERT(EIO_CACHE_STATE_GET(dmc, ebio->eb_index) ==
@@ -1161,8 +1469,10 @@ static void eio_do_mdupdate(struct work_struct *work)
 		blk_index = INDEX_TO_MD_PAGE_OFFSET(blk_index);
 		sector_bits[pindex] |= (1 << INDEX_TO_MD_SECTOR(blk_index));
 
-		md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
+		md_blocks = (struct flash_cacheblock *)
+			    kmap_atomic(mdreq->mdblk_bvecs[pindex].bv_page);
 		md_blocks[blk_index].cache_state = (VALID | DIRTY);
+		kunmap_atomic(md_blocks);
 
 		ebio = ebio->eb_next;
 	}
@@ -1185,18 +1495,32 @@ static void eio_do_mdupdate(struct work_struct *work)
 	mdreq->pending_mdlist = NULL;
 
 	spin_unlock_irqrestore(&set->cs_lock, flags);
+}
+
+/* Write the md sectors of a set prepared by eio_mdupdate_prepare() */
+static void
+eio_mdupdate_submit(struct mdupdate_request *mdreq, u_int8_t *sector_bits)
+{
+	struct work_struct *work = &mdreq->work;
+	struct cache_c *dmc = mdreq->dmc;
+	struct eio_ssd *ssd = eio_set_ssd(dmc, mdreq->set);
+	struct eio_io_region region;
+	index_t i;
+	index_t start_index;
+	sector_t md_sector;
+	int error;
+	int startbit, endbit;
 
-	for (k = 0; k < (int)mdreq->mdbvec_count; k++)
-		kunmap(mdreq->mdblk_bvecs[k].bv_page);
+	start_index = mdreq->set * dmc->assoc;
+	md_sector = eio_ssd_md_sector(dmc, start_index);
 
 	/*
 	 * Initiate the I/O to SSD for on-disk md update.
 	 * TBD. Optimize to write only the affected blocks
 	 */
 
-	region.bdev = dmc->cache_dev->bdev;
-	/*region.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index) +
-	   (min_cboff << dmc->block_shift); */
+	region.bdev = ssd->ssd_dev->bdev;
+	/*region.sector = md_sector + (min_cboff << dmc->block_shift); */
 
 	atomic_set(&mdreq->holdcount, 1);
 	for (i = 0; i < mdreq->mdbvec_count; i++) {
@@ -1208,23 +1532,21 @@ static void eio_do_mdupdate(struct work_struct *work)
 		EIO_ASSERT(startbit <= endbit && startbit >= 0 && startbit <= 7 &&
 			   endbit >= 0 && endbit <= 7);
 		EIO_ASSERT(dmc->assoc != 128 || endbit <= 3);
-		region.sector =
-			dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index) +
-			i * SECTORS_PER_PAGE + startbit;
+		region.sector = md_sector + i * SECTORS_PER_PAGE + startbit;
 		region.count = endbit - startbit + 1;
 		/* Align IO to HW sectors on SSD device */
 		region.sector =
-			EIO_ALIGN_SECTOR(dmc->cache_dev->bdev, region.sector);
+			EIO_ALIGN_SECTOR(ssd->ssd_dev->bdev, region.sector);
 		region.count =
-			EIO_ALIGN_SCOUNT(dmc->cache_dev->bdev, region.count);
+			EIO_ALIGN_SCOUNT(ssd->ssd_dev->bdev, region.count);
 		mdreq->mdblk_bvecs[i].bv_offset =
-			to_bytes(startbit / LOG_BLK_SSIZE(dmc->cache_dev->bdev));
+			to_bytes(startbit / LOG_BLK_SSIZE(ssd->ssd_dev->bdev));
 		mdreq->mdblk_bvecs[i].bv_len = to_bytes(region.count);
 
 		EIO_ASSERT(region.sector <=
-			   (dmc->md_start_sect + INDEX_TO_MD_SECTOR(end_index)));
-		atomic64_inc(&dmc->eio_stats.md_ssd_writes);
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, to_bytes(region.count));
+			   (md_sector + INDEX_TO_MD_SECTOR(dmc->assoc)));
+		this_cpu_inc(dmc->eio_stats->md_ssd_writes);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, to_bytes(region.count));
 		atomic_inc(&mdreq->holdcount);
 
 		/*
@@ -1239,8 +1561,239 @@ static void eio_do_mdupdate(struct work_struct *work)
 	}
 	if (atomic_dec_and_test(&mdreq->holdcount)) {
 		INIT_WORK(&mdreq->work, eio_post_mdupdate);
-		queue_work(dmc->mdupdate_q, &mdreq->work);
+		queue_work(ssd->ssd_mdupdate_q, &mdreq->work);
+	}
+}
+
+/* Do metadata update for a set */
+static void eio_do_mdupdate(struct work_struct *work)
+{
+	struct mdupdate_request *mdreq;
+	u_int8_t sector_bits[EIO_MD_PAGES_MAX] = { 0 };
+
+	mdreq = container_of(work, struct mdupdate_request, work);
+	eio_mdupdate_prepare(mdreq, sector_bits);
+	eio_mdupdate_submit(mdreq, sector_bits);
+}
+
+/*
+ * A batch of md updates for consecutive sets, written with a single
+ * I/O covering the whole md of the sets.
+ */
+struct eio_md_batch {
+	struct list_head mdreqs;
+};
+
+/* Callback function for a batched ondisk metadata update */
+static void eio_md_batch_callback(int error, void *context)
+{
+	struct eio_md_batch *batch = (struct eio_md_batch *)context;
+	struct mdupdate_request *mdreq;
+	struct mdupdate_request *nmdreq;
+
+	list_for_each_entry_safe(mdreq, nmdreq, &batch->mdreqs, list) {
+		list_del_init(&mdreq->list);
+		mdreq->error = error;
+		INIT_WORK(&mdreq->work, eio_post_mdupdate);
+		queue_work(eio_set_ssd(mdreq->dmc, mdreq->set)->ssd_mdupdate_q,
+			   &mdreq->work);
+	}
+	kfree(batch);
+}
+
+/*
+ * Write the md updates of nr_sets sets consecutive on their SSD, starting
+ * with the first entry of list. The entries are removed from list.
+ */
+static void
+eio_md_batch_write(struct cache_c *dmc, struct list_head *list,
+		   unsigned nr_sets)
+{
+	struct mdupdate_request *mdreq;
+	struct mdupdate_request *last;
+	struct eio_ssd *ssd;
+	struct eio_md_batch *batch = NULL;
+	struct bio_vec *bvecs = NULL;
+	struct eio_io_region region;
+	u_int8_t sector_bits[EIO_MD_PAGES_MAX];
+	unsigned md_bytes;
+	unsigned remaining;
+	unsigned nr_bvecs;
+	unsigned k;
+	int error;
+	int i;
+
+	mdreq = list_first_entry(list, struct mdupdate_request, list);
+	ssd = eio_set_ssd(dmc, mdreq->set);
+	md_bytes = dmc->assoc * sizeof(struct flash_cacheblock);
+
+	/*
+	 * Whole set md is only contiguous in SSD logical blocks when
+	 * its size is a multiple of the logical block size.
+	 */
+	if ((nr_sets > 1) &&
+	    !(md_bytes % bdev_logical_block_size(ssd->ssd_dev->bdev))) {
+		batch = kmalloc(sizeof(*batch), GFP_NOIO);
+		bvecs = kmalloc(nr_sets * mdreq->mdbvec_count *
+				sizeof(struct bio_vec), GFP_NOIO);
+	}
+
+	if (batch == NULL || bvecs == NULL) {
+		kfree(batch);
+		kfree(bvecs);
+		/* Fall back to one md write per set */
+		while (nr_sets--) {
+			mdreq = list_first_entry(list, struct mdupdate_request,
+						 list);
+			list_del_init(&mdreq->list);
+			memset(sector_bits, 0, sizeof(sector_bits));
+			eio_mdupdate_prepare(mdreq, sector_bits);
+			eio_mdupdate_submit(mdreq, sector_bits);
+		}
+		return;
+	}
+
+	last = mdreq;
+	for (k = 1; k < nr_sets; k++)
+		last = list_next_entry(last, list);
+	INIT_LIST_HEAD(&batch->mdreqs);
+	list_cut_position(&batch->mdreqs, list, &last->list);
+
+	nr_bvecs = 0;
+	list_for_each_entry(mdreq, &batch->mdreqs, list) {
+		memset(sector_bits, 0, sizeof(sector_bits));
+		eio_mdupdate_prepare(mdreq, sector_bits);
+		remaining = md_bytes;
+		for (i = 0; i < (int)mdreq->mdbvec_count; i++) {
+			bvecs[nr_bvecs].bv_page = mdreq->mdblk_bvecs[i].bv_page;
+			bvecs[nr_bvecs].bv_offset = 0;
+			bvecs[nr_bvecs].bv_len = min_t(unsigned, remaining,
+						       PAGE_SIZE);
+			remaining -= bvecs[nr_bvecs].bv_len;
+			nr_bvecs++;
+		}
+	}
+
+	mdreq = list_first_entry(&batch->mdreqs, struct mdupdate_request, list);
+	region.bdev = ssd->ssd_dev->bdev;
+	region.sector = eio_ssd_md_sector(dmc, mdreq->set * dmc->assoc);
+	region.count = nr_sets * eio_to_sector(md_bytes);
+
+	this_cpu_inc(dmc->eio_stats->md_ssd_writes);
+	this_cpu_inc(dmc->eio_stats->md_batch_writes);
+	this_cpu_add(dmc->eio_stats->md_batch_sets, nr_sets);
+	SECTOR_STATS(dmc->eio_stats->ssd_writes, to_bytes(region.count));
+
+	error = eio_io_async_bvec(dmc, &region, REQ_OP_WRITE, EIO_REQ_SYNC,
+				  bvecs, nr_bvecs, eio_md_batch_callback,
+				  batch, 0);
+	/* The bvecs are only needed to build the bios */
+	kfree(bvecs);
+	if (error)
+		eio_md_batch_callback(error, batch);
+}
+
+/* Order the md updates by SSD, then by their sets on the SSD */
+static int
+eio_mdreq_cmp(void *priv, struct list_head *a, struct list_head *b)
+{
+	struct cache_c *dmc = priv;
+	struct mdupdate_request *mda;
+	struct mdupdate_request *mdb;
+	u_int32_t ssda, ssdb;
+
+	mda = list_entry(a, struct mdupdate_request, list);
+	mdb = list_entry(b, struct mdupdate_request, list);
+	ssda = (u_int32_t)mda->set % dmc->nr_ssds;
+	ssdb = (u_int32_t)mdb->set % dmc->nr_ssds;
+	if (ssda != ssdb)
+		return ssda < ssdb ? -1 : 1;
+	if (mda->set < mdb->set)
+		return -1;
+	return mda->set > mdb->set;
+}
+
+/*
+ * Write out the md updates gathered on md_batch_list, merging the ones
+ * of sets consecutive on their SSD into single I/Os.
+ */
+void eio_do_mdupdate_batch(struct work_struct *work)
+{
+	struct cache_c *dmc;
+	struct mdupdate_request *mdreq;
+	struct mdupdate_request *nmdreq;
+	unsigned long flags;
+	unsigned nr_sets;
+	LIST_HEAD(list);
+
+	dmc = container_of(work, struct cache_c, md_batch_work.work);
+
+	spin_lock_irqsave(&dmc->md_batch_lock, flags);
+	list_splice_init(&dmc->md_batch_list, &list);
+	dmc->md_batch_count = 0;
+	spin_unlock_irqrestore(&dmc->md_batch_lock, flags);
+
+	list_sort(dmc, &list, eio_mdreq_cmp);
+
+	while (!list_empty(&list)) {
+		mdreq = list_first_entry(&list, struct mdupdate_request, list);
+		nr_sets = 1;
+		while (!list_is_last(&mdreq->list, &list)) {
+			nmdreq = list_next_entry(mdreq, list);
+			if (nmdreq->set != mdreq->set + dmc->nr_ssds)
+				break;
+			mdreq = nmdreq;
+			nr_sets++;
+		}
+		eio_md_batch_write(dmc, &list, nr_sets);
+	}
+}
+
+/*
+ * Get the md update of a set written. With md_batch_delay_ms set, it is
+ * held back for at most that long to be written with others.
+ */
+static void
+eio_queue_mdupdate(struct cache_c *dmc, struct mdupdate_request *mdreq)
+{
+	unsigned long flags;
+	int delay_ms = dmc->sysctl_active.md_batch_delay_ms;
+
+	if (delay_ms == 0) {
+		INIT_WORK(&mdreq->work, eio_do_mdupdate);
+		queue_work(eio_set_ssd(dmc, mdreq->set)->ssd_mdupdate_q,
+			   &mdreq->work);
+		return;
 	}
+
+	/* The batches of all the SSDs are built on the queue of the first */
+	spin_lock_irqsave(&dmc->md_batch_lock, flags);
+	list_add_tail(&mdreq->list, &dmc->md_batch_list);
+	if (++dmc->md_batch_count >= EIO_MD_BATCH_MAX)
+		mod_delayed_work(dmc->ssds[0].ssd_mdupdate_q,
+				 &dmc->md_batch_work, 0);
+	else if (dmc->md_batch_count == 1)
+		queue_delayed_work(dmc->ssds[0].ssd_mdupdate_q,
+				   &dmc->md_batch_work,
+				   msecs_to_jiffies(delay_ms));
+	spin_unlock_irqrestore(&dmc->md_batch_lock, flags);
+}
+
+/* Wait for all md updates, batched or not, to be written */
+void eio_md_batch_drain(struct cache_c *dmc)
+{
+	unsigned long flags;
+	u_int32_t m;
+	int pending;
+
+	do {
+		flush_delayed_work(&dmc->md_batch_work);
+		for (m = 0; m < dmc->nr_ssds; m++)
+			flush_workqueue(dmc->ssds[m].ssd_mdupdate_q);
+		spin_lock_irqsave(&dmc->md_batch_lock, flags);
+		pending = !list_empty(&dmc->md_batch_list);
+		spin_unlock_irqrestore(&dmc->md_batch_lock, flags);
+	} while (pending);
 }
 
 /* Callback function for ondisk metadata update */
@@ -1255,7 +1808,8 @@ static void eio_mdupdate_callback(int error, void *context)
 	if (!atomic_dec_and_test(&mdreq->holdcount))
 		return;
 	INIT_WORK(&mdreq->work, eio_post_mdupdate);
-	queue_work(mdreq->dmc->mdupdate_q, &mdreq->work);
+	queue_work(eio_set_ssd(mdreq->dmc, mdreq->set)->ssd_mdupdate_q,
+		   &mdreq->work);
 }
 
 static void eio_post_mdupdate(struct work_struct *work)
@@ -1293,12 +1847,12 @@ static void eio_post_mdupdate(struct work_struct *work)
 			   DIRTY_INPROG);
 		if (unlikely(error)) {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		} else {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, ALREADY_DIRTY);
 			set->nr_dirty++;
 			atomic64_inc(&dmc->nr_dirty);
-			atomic64_inc(&dmc->eio_stats.md_write_dirty);
+			this_cpu_inc(dmc->eio_stats->md_write_dirty);
 		}
 		ebio = ebio->eb_next;
 	}
@@ -1345,8 +1899,7 @@ static void eio_post_mdupdate(struct work_struct *work)
 		 * Schedule work to process the new
 		 * pending mdupdate requests
 		 */
-		INIT_WORK(&mdreq->work, eio_do_mdupdate);
-		queue_work(dmc->mdupdate_q, &mdreq->work);
+		eio_queue_mdupdate(dmc, mdreq);
 	} else {
 		/*
 		 * No more pending mdupdates.
@@ -1409,8 +1962,7 @@ static void eio_enq_mdupdate(struct bio_container *bc)
 		if (!ebio || ebio->eb_cacheset != set_index) {
 			spin_unlock(&set->cs_lock);
 			if (do_schedule) {
-				INIT_WORK(&mdreq->work, eio_do_mdupdate);
-				queue_work(dmc->mdupdate_q, &mdreq->work);
+				eio_queue_mdupdate(dmc, mdreq);
 				do_schedule = 0;
 			}
 		}
@@ -1514,7 +2066,8 @@ void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set)
 	/*
 	 * 1. Don't trigger new cleanings if
 	 *      - cache is not wb
-	 *      - autoclean threshold is crossed
+	 *      - autoclean threshold is crossed (adaptive cleaning
+	 *        throttles in the clean thread instead)
 	 *      - fast remove in progress is set
 	 *      - cache is in failed mode.
 	 * 2. Initiate set-wide clean, if set level dirty threshold is crossed
@@ -1528,7 +2081,7 @@ void eio_comply_dirty_thresholds(struct cache_c *dmc, index_t set)
 		return;
 	}
 
-	if (AUTOCLEAN_THRESHOLD_CROSSED(dmc) || (dmc->mode != CACHE_MODE_WB))
+	if (AUTOCLEAN_PAUSED(dmc) || (dmc->mode != CACHE_MODE_WB))
 		return;
 
 	if (set != -1)
@@ -1552,9 +2105,9 @@ eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigned
 		job->action = READCACHE;        /* Fetch data from cache */
 		atomic_inc(&dmc->nr_jobs);
 
-		SECTOR_STATS(dmc->eio_stats.read_hits, ebio->eb_size);
-		SECTOR_STATS(dmc->eio_stats.ssd_reads, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.readcache);
+		SECTOR_STATS(dmc->eio_stats->read_hits, ebio->eb_size);
+		SECTOR_STATS(dmc->eio_stats->ssd_reads, ebio->eb_size);
+		this_cpu_inc(dmc->eio_stats->readcache);
 		err =
 			eio_io_async_bvec(dmc, &job->job_io_regions.cache, op, op_flags,
 					  ebio->eb_bv, ebio->eb_nbvec,
@@ -1570,10 +2123,14 @@ eio_cached_read(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigned
 		/*
 		 * For already DIRTY block, invalidation is too costly, skip it.
 		 * For others, mark the block as INVALID and return error.
+		 * The block of a lockless read hit is not ours to change.
 		 */
-		if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) != ALREADY_DIRTY) {
+		if (ebio->eb_iotype & EB_FAST_READ)
+			ebio->eb_iotype &= ~EB_FAST_READ;
+		else if (EIO_CACHE_STATE_GET(dmc, ebio->eb_index) !=
+			 ALREADY_DIRTY) {
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		}
 		spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].
 				       cs_lock, flags);
@@ -1599,6 +2156,10 @@ eio_inval_block_set_range(struct cache_c *dmc, int set, sector_t iosector,
 	int start_index, end_index, i;
 	sector_t endsector = iosector + eio_to_sector(iosize);
 
+	/* The md still to be loaded may hold the range, drop it */
+	if (unlikely(dmc->cache_sets[set].flags & SETFLAG_MD_UNLOADED))
+		dmc->cache_sets[set].flags |= SETFLAG_MD_STALE;
+
 	start_index = dmc->assoc * set;
 	end_index = start_index + dmc->assoc;
 	for (i = start_index; i < end_index; i++) {
@@ -1616,8 +2177,7 @@ eio_inval_block_set_range(struct cache_c *dmc, int set, sector_t iosector,
 			    (EIO_CACHE_STATE_GET(dmc, i) &
 			     (BLOCK_IO_INPROG | DIRTY | QUEUED))) {
 				EIO_CACHE_STATE_SET(dmc, i, INVALID);
-				atomic64_dec_if_positive(&dmc->eio_stats.
-							 cached_blocks);
+				atomic64_dec_if_positive(&dmc->cached_blocks);
 				if (multiblk)
 					continue;
 				return 0;
@@ -1694,18 +2254,195 @@ void eio_inval_range(struct cache_c *dmc, sector_t iosector, unsigned iosize)
 }
 
 /*
- * Invalidates all cached blocks without waiting for them to complete
- * Should be called with incoming IO suspended
+ * Discard of the part of a set in [iosector, iosector + iosize), with
+ * the exclusive set lock held. Clean blocks are dropped as by
+ * eio_inval_block_set_range. Unless mdpages is NULL, dirty blocks that
+ * the discard covers completely are dropped too, once the set md that
+ * says so is written. With ssd_trim set, the freed cache blocks are
+ * then trimmed on the ssd, one discard per run of adjacent blocks.
  */
-int eio_invalidate_cache(struct cache_c *dmc)
+static void
+eio_discard_set(struct cache_c *dmc, index_t set, sector_t iosector,
+		unsigned iosize, struct page **mdpages)
 {
-	u_int64_t i = 0;
-	unsigned long flags = 0;
-	sector_t disk_dev_size = to_bytes(eio_get_device_size(dmc->disk_dev));
-
-	/* invalidate the whole cache */
-	for (i = 0; i < (dmc->size >> dmc->consecutive_shift); i++) {
-		spin_lock_irqsave(&dmc->cache_sets[i].cs_lock, flags);
+	sector_t endsector = iosector + eio_to_sector(iosize);
+	index_t start_index = set * dmc->assoc;
+	index_t end_index = start_index + dmc->assoc;
+	index_t i, j;
+	sector_t dbn;
+	u_int8_t cstate;
+	unsigned long flags;
+	int ndirty = 0;
+	int error;
+
+	spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+	eio_inval_block_set_range(dmc, set, iosector, iosize, 1);
+	if (mdpages) {
+		for (i = start_index; i < end_index; i++) {
+			if (EIO_CACHE_STATE_GET(dmc, i) != ALREADY_DIRTY)
+				continue;
+			dbn = EIO_DBN_GET(dmc, i);
+			if ((dbn >= iosector) &&
+			    (dbn + dmc->block_size <= endsector)) {
+				EIO_CACHE_STATE_SET(dmc, i, CLEAN_INPROG);
+				ndirty++;
+			}
+		}
+	}
+	spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+
+	if (ndirty) {
+		error = eio_clean_set_md(dmc, set, mdpages);
+
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		for (i = start_index; i < end_index; i++) {
+			if (EIO_CACHE_STATE_GET(dmc, i) != CLEAN_INPROG)
+				continue;
+			if (error) {
+				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
+				continue;
+			}
+			EIO_CACHE_STATE_SET(dmc, i, INVALID);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
+			EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
+			dmc->cache_sets[set].nr_dirty--;
+			atomic64_dec(&dmc->nr_dirty);
+		}
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+		if (!error)
+			this_cpu_add(dmc->eio_stats->discard_dirty_inval, ndirty);
+	}
+
+	if (!dmc->sysctl_active.ssd_trim || eio_set_ssd(dmc, set)->ssd_offline)
+		return;
+
+	/*
+	 * No block of the set can be allocated while the set lock is
+	 * held, so invalid blocks of the range can't race new data.
+	 */
+	for (i = start_index; i < end_index; i = j + 1) {
+		for (j = i; j < end_index; j++) {
+			cstate = EIO_CACHE_STATE_GET(dmc, j);
+			dbn = EIO_DBN_GET(dmc, j);
+			if ((cstate != INVALID) ||
+			    (dbn + dmc->block_size <= iosector) ||
+			    (dbn >= endsector))
+				break;
+		}
+		if (j == i)
+			continue;
+		if (!blkdev_issue_discard(eio_index_ssd(dmc, i)->ssd_dev->bdev,
+					  eio_ssd_data_sector(dmc, i),
+					  (j - i) << dmc->block_shift,
+					  GFP_NOIO, 0))
+			this_cpu_inc(dmc->eio_stats->ssd_trims);
+	}
+}
+
+/*
+ * Discard work of writeback caches. Dropping dirty blocks needs their
+ * set md written, which can't be done from eio_map. Each discard is
+ * passed on to the source device once the cache is done with its range.
+ */
+void eio_do_discard(struct work_struct *work)
+{
+	struct cache_c *dmc = container_of(work, struct cache_c, discard_work);
+	struct page **md;
+	struct bio_list bios;
+	struct bio *bio;
+	unsigned long flags;
+	u_int32_t bset;
+	sector_t snum;
+	sector_t snext;
+	unsigned iosize;
+	unsigned ioinset;
+	int totalsshift = dmc->block_shift + dmc->consecutive_shift;
+
+	spin_lock_irqsave(&dmc->discard_lock, flags);
+	bio_list_init(&bios);
+	bio_list_merge(&bios, &dmc->discard_bios);
+	bio_list_init(&dmc->discard_bios);
+	spin_unlock_irqrestore(&dmc->discard_lock, flags);
+
+	/* Without md pages dirty blocks stay, they are cleaned as usual */
+	md = kmalloc(dmc->mdpage_count * sizeof(struct page *), GFP_NOIO);
+	if (md && eio_alloc_wb_pages(md, dmc->mdpage_count)) {
+		kfree(md);
+		md = NULL;
+	}
+
+	while ((bio = bio_list_pop(&bios))) {
+		snum = EIO_BIO_BI_SECTOR(bio);
+		iosize = EIO_BIO_BI_SIZE(bio);
+		while (iosize) {
+			bset = hash_block(dmc, snum);
+			snext = ((snum >> totalsshift) + 1) << totalsshift;
+			ioinset = (unsigned)to_bytes(snext - snum);
+			if (ioinset > iosize)
+				ioinset = iosize;
+			down_write(&dmc->cache_sets[bset].rw_lock);
+			eio_discard_set(dmc, bset, snum, ioinset, md);
+			up_write(&dmc->cache_sets[bset].rw_lock);
+			snum = snext;
+			iosize -= ioinset;
+		}
+		eio_ttc_disk_discard(dmc, bio);
+		atomic64_dec(&dmc->nr_ios);
+	}
+
+	if (md) {
+		eio_free_wb_pages(md, dmc->mdpage_count);
+		kfree(md);
+	}
+}
+
+/*
+ * Discards drop the cached blocks of their range and go on to the source
+ * device. Read-only and write-through caches hold no dirty blocks, the
+ * range is invalidated right away as for an uncached write.
+ */
+static void eio_discard(struct cache_c *dmc, struct bio *bio)
+{
+	unsigned long flags;
+
+	pr_debug("eio_map: Discard IO received. start=%lu totalsectors=%d.\n",
+		 (unsigned long)EIO_BIO_BI_SECTOR(bio),
+		 (int)eio_to_sector(EIO_BIO_BI_SIZE(bio)));
+	this_cpu_inc(dmc->eio_stats->discards);
+
+	if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
+		EIO_BIO_ENDIO(bio, -ENODEV);
+		return;
+	}
+
+	if (dmc->mode != CACHE_MODE_WB) {
+		eio_inval_range(dmc, EIO_BIO_BI_SECTOR(bio),
+				EIO_BIO_BI_SIZE(bio));
+		eio_ttc_disk_discard(dmc, bio);
+		return;
+	}
+
+	/* Deactivation waits for queued discards as for other I/Os */
+	atomic64_inc(&dmc->nr_ios);
+	spin_lock_irqsave(&dmc->discard_lock, flags);
+	bio_list_add(&dmc->discard_bios, bio);
+	spin_unlock_irqrestore(&dmc->discard_lock, flags);
+	queue_work(system_unbound_wq, &dmc->discard_work);
+}
+
+/*
+ * Invalidates all cached blocks without waiting for them to complete
+ * Should be called with incoming IO suspended
+ */
+int eio_invalidate_cache(struct cache_c *dmc)
+{
+	u_int64_t i = 0;
+	unsigned long flags = 0;
+	sector_t disk_dev_size = to_bytes(eio_get_device_size(dmc->disk_dev));
+
+	/* invalidate the whole cache */
+	for (i = 0; i < (dmc->size >> dmc->consecutive_shift); i++) {
+		spin_lock_irqsave(&dmc->cache_sets[i].cs_lock, flags);
 		/* TBD. Apply proper fix for the cast to disk_dev_size */
 		(void)eio_inval_block_set_range(dmc, (int)i, 0,
 						(unsigned)disk_dev_size, 0);
@@ -1780,8 +2517,8 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		err = -ENOMEM;
 	else {
 		job->action = WRITECACHE;
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);
+		this_cpu_inc(dmc->eio_stats->writecache);
 		err = eio_io_async_bvec(dmc, &job->job_io_regions.cache, REQ_OP_WRITE, 0,
 					ebio->eb_bv, ebio->eb_nbvec,
 					eio_io_callback, job, 0);
@@ -1803,7 +2540,7 @@ static int eio_uncached_write(struct cache_c *dmc, struct eio_bio *ebio)
 		else {
 			/* Mark the block as INVALID for non-DIRTY block. */
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 			/* Set the INVAL flag to ensure block is marked invalid at the end */
 			ebio->eb_iotype |= EB_INVAL;
 			ebio->eb_index = -1;
@@ -1860,8 +2597,8 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigne
 	else {
 		job->action = WRITECACHE;
 
-		SECTOR_STATS(dmc->eio_stats.ssd_writes, ebio->eb_size);
-		atomic64_inc(&dmc->eio_stats.writecache);
+		SECTOR_STATS(dmc->eio_stats->ssd_writes, ebio->eb_size);
+		this_cpu_inc(dmc->eio_stats->writecache);
 		EIO_ASSERT(op == REQ_OP_WRITE);
 		err = eio_io_async_bvec(dmc, &job->job_io_regions.cache, op, op_flags,
 					  ebio->eb_bv, ebio->eb_nbvec,
@@ -1878,7 +2615,7 @@ eio_cached_write(struct cache_c *dmc, struct eio_bio *ebio, unsigned op, unsigne
 		if (cstate == DIRTY_INPROG) {
 			/* A DIRTY(inprog) block should be invalidated on error */
 			EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-			atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+			atomic64_dec_if_positive(&dmc->cached_blocks);
 		} else
 			/* An already DIRTY block don't have an option but just return error. */
 			EIO_ASSERT(cstate == ALREADY_DIRTY);
@@ -2045,12 +2782,12 @@ eio_disk_io(struct cache_c *dmc, struct bio *bio,
 	atomic_inc(&dmc->nr_jobs);
 	if (ebio->eb_dir == READ) {
 		job->action = READDISK;
-		SECTOR_STATS(dmc->eio_stats.disk_reads, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.readdisk);
+		SECTOR_STATS(dmc->eio_stats->disk_reads, EIO_BIO_BI_SIZE(bio));
+		this_cpu_inc(dmc->eio_stats->readdisk);
 	} else {
 		job->action = WRITEDISK;
-		SECTOR_STATS(dmc->eio_stats.disk_writes, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.writedisk);
+		SECTOR_STATS(dmc->eio_stats->disk_writes, EIO_BIO_BI_SIZE(bio));
+		this_cpu_inc(dmc->eio_stats->writedisk);
 	}
 
 	/*
@@ -2256,8 +2993,8 @@ static int eio_alloc_mdreqs(struct cache_c *dmc, struct bio_container *bc)
 			mdreq = kzalloc(sizeof(*mdreq), GFP_NOWAIT);
 			if (mdreq) {
 
-				/* nr_bvecs is the number of pages required to fit all 
-				 * flash_cacheblock structures in. Must be 1 or 2 (hardcoded)
+				/* nr_bvecs is the number of pages required to fit all
+				 * flash_cacheblock structures in, EIO_MD_PAGES_MAX at most
 				 */
 				nr_bvecs =
 					IO_PAGE_COUNT(dmc->assoc *
@@ -2360,6 +3097,83 @@ eio_release_io_resources(struct cache_c *dmc, struct bio_container *bc)
 	return 0;
 }
 
+/*
+ * Tracks contiguous I/O streams of the cache. Returns 1, if the bio extends
+ * a stream which has already moved seq_io_threshold_kb or more, i.e. the bio
+ * belongs to a sequential scan and should not be cached.
+ */
+static int eio_seq_detect(struct cache_c *dmc, struct bio *bio)
+{
+	struct eio_seq_stream *ss;
+	struct eio_seq_stream *oldest = NULL;
+	sector_t sector = EIO_BIO_BI_SECTOR(bio);
+	int dir = bio_data_dir(bio);
+	u_int64_t threshold;
+	unsigned long flags;
+	int i;
+	int ret = 0;
+
+	threshold = (u_int64_t)dmc->sysctl_active.seq_io_threshold_kb << 10;
+	if (threshold == 0)
+		return 0;
+
+	spin_lock_irqsave(&dmc->seq_lock, flags);
+	for (i = 0; i < EIO_SEQ_STREAMS; i++) {
+		ss = &dmc->seq_streams[i];
+		if (ss->ss_bytes && (ss->ss_dir == dir) &&
+		    (ss->ss_next == sector))
+			break;
+		if ((oldest == NULL) || (ss->ss_bytes == 0) ||
+		    time_before(ss->ss_jiffies, oldest->ss_jiffies))
+			oldest = ss;
+	}
+
+	if (i == EIO_SEQ_STREAMS) {
+		/* Not contiguous with any stream, recycle the oldest one */
+		ss = oldest;
+		ss->ss_bytes = 0;
+		ss->ss_dir = dir;
+	}
+	ss->ss_bytes += EIO_BIO_BI_SIZE(bio);
+	ss->ss_next = sector + eio_to_sector(EIO_BIO_BI_SIZE(bio));
+	ss->ss_jiffies = jiffies;
+	if (ss->ss_bytes > threshold)
+		ret = 1;
+	spin_unlock_irqrestore(&dmc->seq_lock, flags);
+
+	return ret;
+}
+
+/*
+ * Returns 1 if the md of a set covering the I/O range is still being
+ * loaded in the background, or if the set is on an SSD that is offline.
+ */
+static int
+eio_range_sets_unusable(struct cache_c *dmc, sector_t iosector, unsigned iosize)
+{
+	u_int32_t bset;
+	sector_t snum;
+	sector_t snext;
+	unsigned ioinset;
+	int totalsshift = dmc->block_shift + dmc->consecutive_shift;
+
+	snum = iosector;
+	while (iosize) {
+		bset = hash_block(dmc, snum);
+		if ((READ_ONCE(dmc->cache_sets[bset].flags) &
+		     SETFLAG_MD_UNLOADED) ||
+		    READ_ONCE(eio_set_ssd(dmc, bset)->ssd_offline))
+			return 1;
+		snext = ((snum >> totalsshift) + 1) << totalsshift;
+		ioinset = (unsigned)to_bytes(snext - snum);
+		if (ioinset > iosize)
+			ioinset = iosize;
+		snum = snext;
+		iosize -= ioinset;
+	}
+	return 0;
+}
+
 /*
  * Decide the mapping and perform necessary cache operations for a bio request.
  */
@@ -2374,7 +3188,10 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	unsigned int biosize;
 	unsigned int residual_biovec;
 	unsigned int force_uncached = 0;
+	unsigned int seq_bypass = 0;
+	unsigned int md_unloaded = 0;
 	int data_dir = bio_data_dir(bio);
+	int prefetch = (bio->bi_end_io == eio_prefetch_endio);
 
 	/*bio list*/
 	struct eio_bio *ebegin = NULL;
@@ -2387,17 +3204,6 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	if (EIO_BIO_BI_IDX(bio) != 0)
 		pr_debug("in eio_map bio_idx is %u", EIO_BIO_BI_IDX(bio));
 
-	if (bio_op(bio) == REQ_OP_DISCARD) {
-		pr_debug
-			("eio_map: Discard IO received. Invalidate incore start=%lu totalsectors=%d.\n",
-			(unsigned long)EIO_BIO_BI_SECTOR(bio),
-			(int)eio_to_sector(EIO_BIO_BI_SIZE(bio)));
-		EIO_BIO_ENDIO(bio, 0);
-		pr_err
-			("eio_map: I/O with Discard flag received. Discard flag is not supported.\n");
-		return 0;
-	}
-
 	if (unlikely(dmc->cache_rdonly)) {
 		if (data_dir != READ) {
 			EIO_BIO_ENDIO(bio, -EPERM);
@@ -2407,15 +3213,26 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		}
 	}
 
-	if (sectors < SIZE_HIST)
-		atomic64_inc(&dmc->size_hist[sectors]);
+	/* Discards are not data I/O, keep them out of the I/O stats */
+	if (bio_op(bio) == REQ_OP_DISCARD) {
+		eio_discard(dmc, bio);
+		return DM_MAPIO_SUBMITTED;
+	}
 
-	if (data_dir == READ) {
-		SECTOR_STATS(dmc->eio_stats.reads, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.readcount);
+	/* Reads of the prefetcher are accounted apart from the workload */
+	if (prefetch) {
+		SECTOR_STATS(dmc->eio_stats->prefetch_reads, EIO_BIO_BI_SIZE(bio));
 	} else {
-		SECTOR_STATS(dmc->eio_stats.writes, EIO_BIO_BI_SIZE(bio));
-		atomic64_inc(&dmc->eio_stats.writecount);
+		if (sectors < SIZE_HIST)
+			this_cpu_inc(dmc->size_hist->sh_count[sectors]);
+
+		if (data_dir == READ) {
+			SECTOR_STATS(dmc->eio_stats->reads, EIO_BIO_BI_SIZE(bio));
+			this_cpu_inc(dmc->eio_stats->readcount);
+		} else {
+			SECTOR_STATS(dmc->eio_stats->writes, EIO_BIO_BI_SIZE(bio));
+			this_cpu_inc(dmc->eio_stats->writecount);
+		}
 	}
 
 	/*
@@ -2438,9 +3255,9 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		force_uncached = 1;
 	} else if (data_dir == WRITE && dmc->mode == CACHE_MODE_RO) {
 		if (to_sector(EIO_BIO_BI_SIZE(bio)) != dmc->block_size)
-			atomic64_inc(&dmc->eio_stats.uncached_map_size);
+			this_cpu_inc(dmc->eio_stats->uncached_map_size);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_map_uncacheable);
+			this_cpu_inc(dmc->eio_stats->uncached_map_uncacheable);
 		force_uncached = 1;
 	}
 
@@ -2453,6 +3270,46 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		return DM_MAPIO_SUBMITTED;
 	}
 
+	/*
+	 * Sequential streams bypass the cache, so that a scan doesn't
+	 * evict the working set. Reads are sent to HDD as is. Writes are
+	 * sent to HDD after invalidating the range. For writeback, blocks
+	 * may be dirty, hence reads are still looked up but not filled
+	 * and writes are cached as usual.
+	 */
+	if (!force_uncached && !prefetch && eio_seq_detect(dmc, bio)) {
+		if (data_dir == READ) {
+			this_cpu_inc(dmc->eio_stats->seq_bypass_reads);
+			seq_bypass = 1;
+		} else if (dmc->mode != CACHE_MODE_WB) {
+			this_cpu_inc(dmc->eio_stats->seq_bypass_writes);
+			force_uncached = 1;
+		}
+	}
+
+	/*
+	 * While the md is loaded in the background, or while one of its
+	 * SSDs is offline (read-only and write-through only), I/Os to sets
+	 * not loaded yet or on the offline SSD go to HDD. Writes invalidate
+	 * the range, which drops the md of such sets.
+	 */
+	if ((unlikely(CACHE_MD_LOADING_IS_SET(dmc)) ||
+	     (unlikely(READ_ONCE(dmc->nr_ssds_offline)) &&
+	      dmc->mode != CACHE_MODE_WB)) && !force_uncached &&
+	    !seq_bypass &&
+	    eio_range_sets_unusable(dmc, EIO_BIO_BI_SECTOR(bio),
+				    EIO_BIO_BI_SIZE(bio))) {
+		EIO_ASSERT(dmc->mode != CACHE_MODE_WB);
+		if (CACHE_MD_LOADING_IS_SET(dmc))
+			this_cpu_inc(dmc->eio_stats->md_loading_uncached);
+		else
+			this_cpu_inc(dmc->eio_stats->ssd_offline_uncached);
+		if (data_dir == READ)
+			md_unloaded = 1;
+		else
+			force_uncached = 1;
+	}
+
 	/* Create a bio container */
 
 	bc = kzalloc(sizeof(struct bio_container), GFP_NOWAIT);
@@ -2461,12 +3318,15 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 		return DM_MAPIO_SUBMITTED;
 	}
 	bc->bc_iotime = jiffies;
+	bc->bc_iostart = ktime_get();
 	bc->bc_bio = bio;
 	bc->bio_idx = EIO_BIO_BI_IDX(bio);
 	bc->bc_dmc = dmc;
 	spin_lock_init(&bc->bc_lock);
 	atomic_set(&bc->bc_holdcount, 1);
 	bc->bc_error = 0;
+	bc->bc_seq_bypass = seq_bypass;
+	bc->bc_prefetch = prefetch;
 
 	snum = EIO_BIO_BI_SECTOR(bio);
 	totalio = EIO_BIO_BI_SIZE(bio);
@@ -2500,6 +3360,9 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 
 	if (force_uncached) {
 		eio_inval_range(dmc, snum, totalio);
+	} else if ((seq_bypass && (dmc->mode != CACHE_MODE_WB)) ||
+		   md_unloaded) {
+		/* HDD is always up to date, no cache blocks are involved */
 	} else {
 	/*
 	 * whilst disk bio might be one long contiguous io with huge length, its
@@ -2554,10 +3417,14 @@ int eio_map(struct cache_c *dmc, struct request_queue *rq, struct bio *bio)
 	if (force_uncached) {
 		EIO_ASSERT(dmc->mode != CACHE_MODE_WB);
 		if (data_dir == READ)
-			atomic64_inc(&dmc->eio_stats.uncached_reads);
+			this_cpu_inc(dmc->eio_stats->uncached_reads);
 		else
-			atomic64_inc(&dmc->eio_stats.uncached_writes);
+			this_cpu_inc(dmc->eio_stats->uncached_writes);
 		eio_disk_io(dmc, bio, ebegin, bc, 1);
+	} else if ((seq_bypass && (dmc->mode != CACHE_MODE_WB)) ||
+		   md_unloaded) {
+		this_cpu_inc(dmc->eio_stats->uncached_reads);
+		eio_disk_io(dmc, bio, NULL, bc, 0);
 	} else if (data_dir == READ) {
 
 		/* read io processing */
@@ -2574,157 +3441,458 @@ out:
 	return DM_MAPIO_SUBMITTED;
 }
 
+static void eio_admit_filter_age(struct work_struct *work)
+{
+	struct eio_admit_filter *af;
+	u_int32_t i;
+
+	af = container_of(work, struct eio_admit_filter, af_age_work);
+	for (i = 0; i <= af->af_mask; i++)
+		af->af_counts[i] >>= 1;
+	atomic_set(&af->af_inserts, 0);
+}
+
 /*
- * Checks the cache block state, for deciding cached/uncached read.
- * Also reserves/allocates the cache block, wherever necessary.
- *
- * Return values
- * 1: cache hit
- * 0: cache miss
+ * Allocate the admission filter of a cache, with about one counter
+ * per cache block. Called when admit_threshold is first enabled.
  */
-static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
+int eio_admit_filter_alloc(struct cache_c *dmc)
 {
-	index_t index;
-	int res;
-	int retval = 0;
-	unsigned long flags;
-	u_int8_t cstate;
-
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	struct eio_admit_filter *af;
+	u_int64_t nr_counters;
 
-	res = eio_lookup(dmc, ebio, &index);
-	ebio->eb_index = -1;
+	if (dmc->admit_filter)
+		return 0;
 
-	if (res < 0) {
-		atomic64_inc(&dmc->eio_stats.noroom);
-		goto out;
-	}
+	nr_counters = clamp_t(u_int64_t, dmc->size, EIO_ADMIT_COUNTERS_MIN,
+			      EIO_ADMIT_COUNTERS_MAX);
+	nr_counters = roundup_pow_of_two(nr_counters);
 
-	cstate = EIO_CACHE_STATE_GET(dmc, index);
+	af = vzalloc(sizeof(*af) + nr_counters);
+	if (af == NULL)
+		return -ENOMEM;
+	af->af_mask = (u_int32_t)(nr_counters - 1);
+	atomic_set(&af->af_inserts, 0);
+	INIT_WORK(&af->af_age_work, eio_admit_filter_age);
 
-	if (cstate & (BLOCK_IO_INPROG | QUEUED))
-		/*
-		 * We found a valid or invalid block but an io is on, so we can't
-		 * proceed. Don't invalidate it. This implies that we'll
-		 * have to read from disk.
-		 * Read on a DIRTY | INPROG block (block which is going to be DIRTY)
-		 * is also redirected to read from disk.
-		 */
-		goto out;
+	/* Publish the initialized filter, a racing sysctl write may win */
+	if (cmpxchg(&dmc->admit_filter, NULL, af) != NULL)
+		vfree(af);
+	return 0;
+}
 
-	if (res == VALID) {
-		EIO_ASSERT(cstate & VALID);
-		if ((EIO_DBN_GET(dmc, index) ==
-		     EIO_ROUND_SECTOR(dmc, ebio->eb_sector))) {
-			/*
-			 * Read/write should be done on already DIRTY block
-			 * without any inprog flag.
-			 * Ensure that a failure of DIRTY block read is propagated to app.
-			 * non-DIRTY valid blocks should have inprog flag.
-			 */
-			if (cstate == ALREADY_DIRTY) {
-				ebio->eb_iotype = EB_MAIN_IO;
-				/*
-				 * Set to uncached read and readfill for now.
-				 * It may change to CACHED_READ later, if all
-				 * the blocks are found to be cached
-				 */
-				ebio->eb_bc->bc_dir =
-					UNCACHED_READ_AND_READFILL;
-			} else
-				EIO_CACHE_STATE_ON(dmc, index, CACHEREADINPROG);
-			retval = 1;
-			ebio->eb_index = index;
-			goto out;
-		}
+void eio_admit_filter_free(struct cache_c *dmc)
+{
+	struct eio_admit_filter *af = dmc->admit_filter;
 
-		/* cache is marked readonly or set to wronly mode. */
-		/* Do not allow READFILL on SSD */
-		if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly)
-			goto out;
+	if (af == NULL)
+		return;
+	cancel_work_sync(&af->af_age_work);
+	dmc->admit_filter = NULL;
+	vfree(af);
+}
 
-		/*
-		 * Found a block to be recycled.
-		 * Its guranteed that it will be a non-DIRTY block
-		 */
-		EIO_ASSERT(!(cstate & DIRTY));
-		if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
-			/*We can recycle and then READFILL only if iosize is block size*/
-			atomic64_inc(&dmc->eio_stats.rd_replace);
-			EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-			EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
-			ebio->eb_index = index;
-			ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
-		}
-		goto out;
-	}
-	EIO_ASSERT(res == INVALID);
-	
-	/* cache is marked readonly or set to wronly mode. */
-	/* Do not allow READFILL on SSD */
-	if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly)
-		goto out;
-	/*
-	 * Found an invalid block to be used.
-	 * Can recycle only if iosize is block size
-	 */
-	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
-		EIO_ASSERT(cstate & INVALID);
-		EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
-		atomic64_inc(&dmc->eio_stats.cached_blocks);
-		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
-		ebio->eb_index = index;
-		ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+/*
+ * Count a read miss on a block which could be filled, and tell whether
+ * it is its admit_threshold'th recent miss. The count of a block is
+ * the lower of its two counters, only the counters at that count are
+ * raised so that collisions inflate the counts less.
+ *
+ * Return values
+ * 1: fill the block
+ * 0: leave the block on HDD only
+ */
+static int eio_admit_readfill(struct cache_c *dmc, sector_t dbn)
+{
+	struct eio_admit_filter *af;
+	int threshold = dmc->sysctl_active.admit_threshold;
+	u_int64_t blk;
+	u_int8_t *c1, *c2;
+	u_int8_t count;
+
+	af = smp_load_acquire(&dmc->admit_filter);
+	if (threshold <= 1 || af == NULL)
+		return 1;
+
+	blk = (u_int64_t)dbn >> dmc->block_shift;
+	c1 = &af->af_counts[hash_64(blk, 32) & af->af_mask];
+	c2 = &af->af_counts[hash_64(~blk, 32) & af->af_mask];
+	count = min(READ_ONCE(*c1), READ_ONCE(*c2));
+	if (count < ADMIT_THRESHOLD_MAX)
+		count++;
+	if (*c1 < count)
+		WRITE_ONCE(*c1, count);
+	if (*c2 < count)
+		WRITE_ONCE(*c2, count);
+
+	if (atomic_inc_return(&af->af_inserts) == (int)(af->af_mask + 1))
+		schedule_work(&af->af_age_work);
+
+	if (count >= threshold) {
+		this_cpu_inc(dmc->eio_stats->admit_fills);
+		return 1;
 	}
+	this_cpu_inc(dmc->eio_stats->admit_rejects);
+	return 0;
+}
 
-out:
+/* Mask of the sectors of its block an ebio covers */
+static inline u_int16_t eio_sub_mask(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	unsigned first = ebio->eb_sector & dmc->block_mask;
 
-	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
-			       flags);
+	return (u_int16_t)(((1U << eio_to_sector(ebio->eb_size)) - 1) << first);
+}
 
-	/*
-	 * Enqueue clean set if there is no room in the set
-	 * TBD
-	 * Ensure, a force clean
-	 */
-	if (res < 0)
-		eio_comply_dirty_thresholds(dmc, ebio->eb_cacheset);
+/* Whether the sectors of an ebio are valid in the VALID block index */
+static inline int
+eio_sub_covers(struct cache_c *dmc, index_t index, struct eio_bio *ebio)
+{
+	u_int16_t valid;
 
-	return retval;
+	if (!dmc->sub_valid)
+		return 1;
+	valid = READ_ONCE(dmc->sub_valid[index]);
+	return !valid || !(eio_sub_mask(dmc, ebio) & ~valid);
 }
 
 /*
- * Checks the cache block state, for deciding cached/uncached write.
- * Also reserves/allocates the cache block, wherever necessary.
+ * Lockless lookup of a read hit on a clean block. The block may be
+ * reclaimed or rewritten meanwhile, so the cs_seq sampled here is checked
+ * again once the SSD read is done, see eio_read_fast_done(). The policy
+ * hears of the hit from the next lookup holding the set lock.
  *
  * Return values
- * 1: cache block is available or newly allocated
- * 0: cache block could not be got for the ebio
+ * 1: cache hit, eb_index is the block to read
+ * 0: take the locked path
  */
-static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
+static int eio_read_fast(struct cache_c *dmc, struct eio_bio *ebio)
 {
-	index_t index;
-	int res;
-	int retval;
-	u_int8_t cstate;
-	unsigned long flags;
+	struct cache_set *cset = &dmc->cache_sets[ebio->eb_cacheset];
+	sector_t dbn = EIO_ROUND_SECTOR(dmc, ebio->eb_sector);
+	index_t start_index = (index_t)ebio->eb_cacheset * dmc->assoc;
+	u_int8_t tag = eio_dbn_tag(dbn);
+	u_int8_t *tags;
+	unsigned seq;
+	index_t i;
 
-	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+	if (!READ_ONCE(dmc->sysctl_active.fast_read))
+		return 0;
 
-	res = eio_lookup(dmc, ebio, &index);
-	ebio->eb_index = -1;
-	retval = 0;
+	/* Odd while a clean block of the set changes */
+	seq = raw_read_seqcount(&cset->cs_seq);
+	if (seq & 1)
+		return 0;
 
-	if (res < 0) {
-		/* cache block not found and new block couldn't be allocated */
-		atomic64_inc(&dmc->eio_stats.noroom);
-		ebio->eb_iotype |= EB_INVAL;
-		goto out;
+	tags = EIO_TAG(dmc, start_index);
+	for (i = 0; i < dmc->assoc; i++) {
+		if (READ_ONCE(tags[i]) != tag)
+			continue;
+		if (eio_state_readable(EIO_CACHE_STATE_GET(dmc,
+							   start_index + i)) &&
+		    EIO_DBN_GET(dmc, start_index + i) == dbn)
+			break;
 	}
+	if (i == dmc->assoc ||
+	    !eio_sub_covers(dmc, start_index + i, ebio) ||
+	    read_seqcount_retry(&cset->cs_seq, seq))
+		return 0;
 
-	cstate = EIO_CACHE_STATE_GET(dmc, index);
+	i += start_index;
+	if (eio_sub_partial(dmc, i))
+		this_cpu_inc(dmc->eio_stats->sub_block_read_hits);
+	ebio->eb_index = i;
+	ebio->eb_seq = seq;
+	ebio->eb_iotype |= EB_FAST_READ;
+
+	if (!test_bit(i, dmc->read_hits))
+		set_bit(i, dmc->read_hits);
+	if (!test_bit(ebio->eb_cacheset, dmc->read_hit_sets))
+		set_bit(ebio->eb_cacheset, dmc->read_hit_sets);
+	return 1;
+}
 
-	if (cstate & (BLOCK_IO_INPROG | QUEUED)) {
+static void eio_read_fast_disk_callback(int error, void *context)
+{
+	struct kcached_job *job = (struct kcached_job *)context;
+	struct eio_bio *ebio = job->ebio;
+
+	if (unlikely(error))
+		job->dmc->eio_errors.disk_read_errors++;
+	eb_endio(ebio, error);
+	job->ebio = NULL;
+	eio_free_cache_job(job);
+}
+
+/*
+ * SSD read of a lockless read hit done. Unless the read failed or a clean
+ * block of the set changed since the lookup, the data is that of the
+ * block. Else the read is served again from HDD, the block left as is.
+ */
+static void eio_read_fast_done(struct kcached_job *job)
+{
+	struct cache_c *dmc = job->dmc;
+	struct eio_bio *ebio = job->ebio;
+	struct cache_set *cset = &dmc->cache_sets[ebio->eb_cacheset];
+	int error;
+
+	ebio->eb_iotype &= ~EB_FAST_READ;
+	if (likely(job->error == 0) &&
+	    !read_seqcount_retry(&cset->cs_seq, ebio->eb_seq)) {
+		eb_endio(ebio, 0);
+		job->ebio = NULL;
+		eio_free_cache_job(job);
+		return;
+	}
+
+	if (job->error)
+		dmc->eio_errors.ssd_read_errors++;
+	this_cpu_inc(dmc->eio_stats->read_fast_retries);
+	job->error = 0;
+	job->action = READDISK;
+	this_cpu_inc(dmc->eio_stats->readdisk);
+	SECTOR_STATS(dmc->eio_stats->disk_reads, ebio->eb_size);
+	error = eio_io_async_bvec(dmc, &job->job_io_regions.disk, REQ_OP_READ, 0,
+				  ebio->eb_bv, ebio->eb_nbvec,
+				  eio_read_fast_disk_callback, job, 1);
+	if (error) {
+		eb_endio(ebio, error);
+		job->ebio = NULL;
+		eio_free_cache_job(job);
+	}
+}
+
+/*
+ * Returns the heat map region of the ebio if this lookup is sampled,
+ * NULL otherwise. Prefetch reads aren't part of the workload.
+ */
+static struct eio_heat_bucket *eio_heat_get(struct cache_c *dmc,
+					    struct eio_bio *ebio)
+{
+	int sample = READ_ONCE(dmc->sysctl_active.heat_sample);
+	sector_t region;
+
+	if ((sample <= 0) || ebio->eb_bc->bc_prefetch)
+		return NULL;
+	if (this_cpu_inc_return(*dmc->heat_tick) < sample)
+		return NULL;
+	this_cpu_write(*dmc->heat_tick, 0);
+
+	region = ebio->eb_sector >> dmc->heat_shift;
+	if (region >= EIO_HEAT_BUCKETS)
+		region = EIO_HEAT_BUCKETS - 1;
+	return &dmc->heat_map[region];
+}
+
+/*
+ * Checks the cache block state, for deciding cached/uncached read.
+ * Also reserves/allocates the cache block, wherever necessary.
+ *
+ * Return values
+ * 1: cache hit
+ * 0: cache miss
+ */
+static int eio_read_peek(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	index_t index;
+	int res;
+	int retval = 0;
+	int noroom = 0;
+	unsigned long flags;
+	u_int8_t cstate;
+	struct eio_heat_bucket *hb;
+
+	hb = eio_heat_get(dmc, ebio);
+	if (hb)
+		atomic64_inc(&hb->hb_reads);
+
+	if (eio_read_fast(dmc, ebio)) {
+		if (hb)
+			atomic64_inc(&hb->hb_hits);
+		return 1;
+	}
+
+	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+
+	res = eio_lookup_cached(dmc, ebio, &index);
+	ebio->eb_index = -1;
+
+	if (res == VALID) {
+		cstate = EIO_CACHE_STATE_GET(dmc, index);
+		EIO_ASSERT(cstate & VALID);
+
+		if (cstate & (BLOCK_IO_INPROG | QUEUED))
+			/*
+			 * We found a valid block but an io is on, so we can't
+			 * proceed. Don't invalidate it. This implies that we'll
+			 * have to read from disk.
+			 * Read on a DIRTY | INPROG block (block which is going to be DIRTY)
+			 * is also redirected to read from disk.
+			 */
+			goto out;
+
+		if (!eio_sub_covers(dmc, index, ebio)) {
+			/*
+			 * Some sectors read are not valid in the
+			 * block. A whole block read fills it.
+			 */
+			if ((eio_to_sector(ebio->eb_size) ==
+			     dmc->block_size) && !dmc->cache_rdonly &&
+			    !dmc->sysctl_active.cache_wronly &&
+			    !ebio->eb_bc->bc_seq_bypass) {
+				EIO_CACHE_STATE_SET(dmc, index,
+						    VALID | DISKREADINPROG);
+				eio_sub_valid_set(dmc, index, 0);
+				ebio->eb_index = index;
+				ebio->eb_bc->bc_dir =
+					UNCACHED_READ_AND_READFILL;
+			}
+			goto out;
+		}
+		if (eio_sub_partial(dmc, index))
+			this_cpu_inc(dmc->eio_stats->sub_block_read_hits);
+		/*
+		 * Read/write should be done on already DIRTY block
+		 * without any inprog flag.
+		 * Ensure that a failure of DIRTY block read is propagated to app.
+		 * non-DIRTY valid blocks should have inprog flag.
+		 */
+		if (cstate == ALREADY_DIRTY) {
+			ebio->eb_iotype = EB_MAIN_IO;
+			/*
+			 * Set to uncached read and readfill for now.
+			 * It may change to CACHED_READ later, if all
+			 * the blocks are found to be cached
+			 */
+			ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+		} else
+			EIO_CACHE_STATE_ON(dmc, index, CACHEREADINPROG);
+		retval = 1;
+		ebio->eb_index = index;
+		goto out;
+	}
+
+	/* cache is marked readonly or set to wronly mode. */
+	/* Do not allow READFILL on SSD */
+	if (dmc->cache_rdonly || dmc->sysctl_active.cache_wronly ||
+	    ebio->eb_bc->bc_seq_bypass)
+		goto out;
+
+	/*
+	 * Can fill only if iosize is block size. The admission filter is
+	 * asked before a block is picked, so that the fills it turns down
+	 * leave the replacement order of the set alone.
+	 */
+	if ((eio_to_sector(ebio->eb_size) != dmc->block_size) ||
+	    !(ebio->eb_bc->bc_prefetch ||
+	      eio_admit_readfill(dmc, ebio->eb_sector)))
+		goto out;
+
+	res = eio_lookup_victim(dmc, ebio, &index);
+	if (res < 0) {
+		noroom = 1;
+		this_cpu_inc(dmc->eio_stats->noroom);
+		if (hb)
+			atomic64_inc(&hb->hb_noroom);
+		goto out;
+	}
+
+	cstate = EIO_CACHE_STATE_GET(dmc, index);
+	if (cstate & (BLOCK_IO_INPROG | QUEUED))
+		goto out;
+
+	if (res == VALID) {
+		/*
+		 * Found a block to be recycled.
+		 * Its guranteed that it will be a non-DIRTY block
+		 */
+		EIO_ASSERT(!(cstate & DIRTY));
+		this_cpu_inc(dmc->eio_stats->rd_replace);
+		if (hb)
+			atomic64_inc(&hb->hb_evictions);
+	} else {
+		/* Found an invalid block to be used */
+		EIO_ASSERT(cstate & INVALID);
+		atomic64_inc(&dmc->cached_blocks);
+	}
+	EIO_CACHE_STATE_SET(dmc, index, VALID | DISKREADINPROG);
+	EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
+	ebio->eb_index = index;
+	ebio->eb_bc->bc_dir = UNCACHED_READ_AND_READFILL;
+
+out:
+
+	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
+			       flags);
+
+	if (hb && retval)
+		atomic64_inc(&hb->hb_hits);
+
+	/*
+	 * Enqueue clean set if there is no room in the set
+	 * TBD
+	 * Ensure, a force clean
+	 */
+	if (noroom)
+		eio_comply_dirty_thresholds(dmc, ebio->eb_cacheset);
+
+	return retval;
+}
+
+/*
+ * Checks the cache block state, for deciding cached/uncached write.
+ * Also reserves/allocates the cache block, wherever necessary.
+ *
+ * Return values
+ * 1: cache block is available or newly allocated
+ * 0: cache block could not be got for the ebio
+ */
+static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
+{
+	index_t index;
+	int res;
+	int retval;
+	int noroom = 0;
+	u_int8_t cstate;
+	unsigned long flags;
+	struct eio_heat_bucket *hb;
+
+	hb = eio_heat_get(dmc, ebio);
+	if (hb)
+		atomic64_inc(&hb->hb_writes);
+
+	spin_lock_irqsave(&dmc->cache_sets[ebio->eb_cacheset].cs_lock, flags);
+
+	ebio->eb_index = -1;
+	retval = 0;
+
+	/*
+	 * Update-on-hit caches don't allocate blocks for writes, so a miss
+	 * leaves the replacement order of the set alone.
+	 */
+	if (dmc->mode == CACHE_MODE_UH) {
+		res = eio_lookup_cached(dmc, ebio, &index);
+		if (res < 0) {
+			this_cpu_inc(dmc->eio_stats->uh_write_misses);
+			ebio->eb_iotype |= EB_INVAL;
+			goto out;
+		}
+	} else
+		res = eio_lookup(dmc, ebio, &index);
+
+	if (res < 0) {
+		/* cache block not found and new block couldn't be allocated */
+		noroom = 1;
+		this_cpu_inc(dmc->eio_stats->noroom);
+		if (hb)
+			atomic64_inc(&hb->hb_noroom);
+		ebio->eb_iotype |= EB_INVAL;
+		goto out;
+	}
+
+	cstate = EIO_CACHE_STATE_GET(dmc, index);
+
+	if (cstate & (BLOCK_IO_INPROG | QUEUED)) {
 		ebio->eb_iotype |= EB_INVAL;
 		/* treat as if cache block is not available */
 		goto out;
@@ -2737,11 +3905,17 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 		 * All except an already DIRTY block should have an INPROG flag.
 		 * If it is a cached write, a DIRTY flag would be added later.
 		 */
-		SECTOR_STATS(dmc->eio_stats.write_hits, ebio->eb_size);
+		SECTOR_STATS(dmc->eio_stats->write_hits, ebio->eb_size);
+		if (hb)
+			atomic64_inc(&hb->hb_hits);
 		if (cstate != ALREADY_DIRTY)
 			EIO_CACHE_STATE_ON(dmc, index, CACHEWRITEINPROG);
 		else
-			atomic64_inc(&dmc->eio_stats.dirty_write_hits);
+			this_cpu_inc(dmc->eio_stats->dirty_write_hits);
+		/* The sectors written are valid once the write is done */
+		if (eio_sub_partial(dmc, index))
+			eio_sub_valid_set(dmc, index, dmc->sub_valid[index] |
+					  eio_sub_mask(dmc, ebio));
 		ebio->eb_index = index;
 		/*
 		 * A VALID block should get upgraded to DIRTY, only when we
@@ -2767,14 +3941,33 @@ static int eio_write_peek(struct cache_c *dmc, struct eio_bio *ebio)
 	 */
 	EIO_ASSERT(!(EIO_CACHE_STATE_GET(dmc, index) & DIRTY));
 	if (eio_to_sector(ebio->eb_size) == dmc->block_size) {
-		if (res == VALID)
-			atomic64_inc(&dmc->eio_stats.wr_replace);
-		else
-			atomic64_inc(&dmc->eio_stats.cached_blocks);
+		if (res == VALID) {
+			this_cpu_inc(dmc->eio_stats->wr_replace);
+			if (hb)
+				atomic64_inc(&hb->hb_evictions);
+		} else
+			atomic64_inc(&dmc->cached_blocks);
 		EIO_CACHE_STATE_SET(dmc, index, VALID | CACHEWRITEINPROG);
 		EIO_DBN_SET(dmc, index, (sector_t)ebio->eb_sector);
 		ebio->eb_index = index;
 		retval = 1;
+	} else if (dmc->sub_valid && (dmc->mode == CACHE_MODE_WT)) {
+		/*
+		 * The write goes to HDD too, so the block holds only the
+		 * sectors written.
+		 */
+		if (res == VALID) {
+			this_cpu_inc(dmc->eio_stats->wr_replace);
+			if (hb)
+				atomic64_inc(&hb->hb_evictions);
+		} else
+			atomic64_inc(&dmc->cached_blocks);
+		this_cpu_inc(dmc->eio_stats->sub_block_writes);
+		EIO_CACHE_STATE_SET(dmc, index, VALID | CACHEWRITEINPROG);
+		EIO_DBN_SET(dmc, index, EIO_ROUND_SECTOR(dmc, ebio->eb_sector));
+		eio_sub_valid_set(dmc, index, eio_sub_mask(dmc, ebio));
+		ebio->eb_index = index;
+		retval = 1;
 	} else {
 		/*
 		 * eb iosize smaller than cache block size shouldn't
@@ -2788,6 +3981,8 @@ out:
 	if ((retval == 1) && (dmc->mode == CACHE_MODE_WB) &&
 	    (cstate != ALREADY_DIRTY))
 		ebio->eb_bc->bc_mdwait++;
+	if (hb && (retval == 1) && (dmc->mode == CACHE_MODE_WB))
+		atomic64_inc(&hb->hb_dirty);
 
 	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
 			       flags);
@@ -2797,7 +3992,7 @@ out:
 	 * TBD
 	 * Ensure, a force clean
 	 */
-	if (res < 0)
+	if (noroom)
 		eio_comply_dirty_thresholds(dmc, ebio->eb_cacheset);
 
 	return retval;
@@ -2821,12 +4016,20 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 	}
 
 	if (ucread) {
+		/* The HDD read serves the lockless read hits too */
+		for (ebio = ebegin; ebio; ebio = ebio->eb_next) {
+			if (ebio->eb_iotype & EB_FAST_READ) {
+				ebio->eb_iotype &= ~EB_FAST_READ;
+				ebio->eb_index = -1;
+			}
+		}
+
 		/*
 		 * Uncached read.
 		 * Start HDD I/O. Once that is finished
 		 * readfill or dirty block re-read would start
 		 */
-		atomic64_inc(&dmc->eio_stats.uncached_reads);
+		this_cpu_inc(dmc->eio_stats->uncached_reads);
 		eio_disk_io(dmc, bc->bc_bio, ebegin, bc, 0);
 	} else {
 		/* Cached read. Serve the read from SSD */
@@ -2842,7 +4045,11 @@ eio_read(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 
 		while (ebio) {
 			enext = ebio->eb_next;
-			ebio->eb_iotype = EB_MAIN_IO;
+			if (ebio->eb_iotype & EB_FAST_READ) {
+				this_cpu_inc(dmc->eio_stats->read_fast_hits);
+				ebio->eb_iotype = EB_MAIN_IO | EB_FAST_READ;
+			} else
+				ebio->eb_iotype = EB_MAIN_IO;
 			eio_cached_read(dmc, ebio, REQ_OP_READ, 0);
 			ebio = enext;
 		}
@@ -2865,7 +4072,7 @@ static inline void eio_cached_write_error(struct cache_c *dmc,
 		 */
 
 		EIO_CACHE_STATE_SET(dmc, ebio->eb_index, INVALID);
-		atomic64_dec_if_positive(&dmc->eio_stats.cached_blocks);
+		atomic64_dec_if_positive(&dmc->cached_blocks);
 	}
 	spin_unlock_irqrestore(&dmc->cache_sets[ebio->eb_cacheset].cs_lock,
 	                       flags);
@@ -2897,7 +4104,7 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 		 * Uncached write.
 		 * Start both SSD and HDD writes
 		 */
-		atomic64_inc(&dmc->eio_stats.uncached_writes);
+		this_cpu_inc(dmc->eio_stats->uncached_writes);
 		bc->bc_mdwait = 0;
 		bc->bc_dir = UNCACHED_WRITE;
 		ebio = ebegin;
@@ -2951,6 +4158,10 @@ eio_write(struct cache_c *dmc, struct bio_container *bc, struct eio_bio *ebegin)
 void eio_clean_all(struct cache_c *dmc)
 {
 	unsigned long flags = 0;
+	index_t sets[CLEAN_SORT_SETS_MAX];
+	int nr_sets = 0;
+	int sort_sets = dmc->sysctl_active.clean_sort_sets;
+	index_t set;
 
 	EIO_ASSERT(dmc->mode == CACHE_MODE_WB);
 	for (atomic_set(&dmc->clean_index, 0);
@@ -2968,9 +4179,21 @@ void eio_clean_all(struct cache_c *dmc)
 			break;
 		}
 
-		eio_clean_set(dmc, (index_t)(atomic_read(&dmc->clean_index)),
-				/* whole */ 1, /* force */ 1);
+		set = (index_t)(atomic_read(&dmc->clean_index));
+		if (sort_sets > 1) {
+			if (dmc->cache_sets[set].nr_dirty)
+				sets[nr_sets++] = set;
+			if (nr_sets == sort_sets) {
+				eio_clean_sets_sorted(dmc, sets, nr_sets, 1);
+				nr_sets = 0;
+			}
+			continue;
+		}
+
+		eio_clean_set(dmc, set, /* whole */ 1, /* force */ 1);
 	}
+	if (nr_sets)
+		eio_clean_sets_sorted(dmc, sets, nr_sets, 1);
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
 	dmc->sysctl_active.do_clean &= ~EIO_CLEAN_START;
@@ -2980,13 +4203,19 @@ void eio_clean_all(struct cache_c *dmc)
 /*
  * Do unconditional clean of a cache.
  * Useful for a cold enabled writeback cache.
+ * The md of the cleaned sets is not written set by set but by the
+ * eio_md_store() that follows, which coalesces the writes of the changed
+ * sets. Until then the SSD still has the cleaned blocks dirty, which at
+ * worst cleans them again.
  */
 void eio_clean_for_reboot(struct cache_c *dmc)
 {
 	index_t i;
 
+	dmc->clean_defer_md = 1;
 	for (i = 0; i < (index_t)(dmc->size >> dmc->consecutive_shift); i++)
 		eio_clean_set(dmc, i, /* whole */ 1, /* force */ 1);
+	dmc->clean_defer_md = 0;
 }
 
 /*
@@ -3084,56 +4313,56 @@ struct bio_vec *setup_bio_vecs(struct bio_vec *bvec, index_t block_index,
 
 	return data;
 }
+/* Reset the clean flags of a set, lru touch it while it is still dirty */
+static void eio_clean_set_release(struct cache_c *dmc, index_t set, int force)
+{
+	unsigned long flags;
 
-/* Cleans a given cache set */
-static void
-eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
+	if (!force) {
+		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+		dmc->cache_sets[set].flags &=
+			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE);
+		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+	}
+
+	if (dmc->cache_sets[set].nr_dirty)
+		/*
+		 * Lru touch the set, so that it can be picked
+		 * up for whole set clean by clean thread later
+		 */
+		eio_touch_set_lru(dmc, set);
+}
+
+/*
+ * Steps 1-3 of a set clean. Takes the exclusive set lock and marks the
+ * blocks to clean CLEAN_INPROG. Returns the number of blocks marked, on
+ * 0 the set has already been released.
+ */
+static int
+eio_clean_set_begin(struct cache_c *dmc, index_t set, int whole, int force)
 {
-	struct eio_io_region where;
-	int error;
 	index_t i;
-	index_t j;
 	index_t start_index;
 	index_t end_index;
-	struct sync_io_context sioc;
 	int ncleans = 0;
-	int alloc_size;
-	struct flash_cacheblock *md_blocks = NULL;
-	unsigned long flags;
-
-	int pindex, k;
-	index_t blkindex;
-	struct bio_vec *bvecs;
-	unsigned nr_bvecs = 0, total;
-	void *pg_virt_addr[2] = { NULL };
 
 	/* Cache is failed mode, do nothing. */
 	if (unlikely(CACHE_FAILED_IS_SET(dmc))) {
 		pr_debug("clean_set: CACHE \"%s\" is in FAILED state.",
 			 dmc->cache_name);
-		goto err_out1;
+		goto out;
 	}
 
 	/* Nothing to clean, if there are no dirty blocks */
 	if (dmc->cache_sets[set].nr_dirty == 0)
-		goto err_out1;
+		goto out;
 
 	/* If this is not the suitable time to clean, postpone it */
-	if ((!force) && AUTOCLEAN_THRESHOLD_CROSSED(dmc)) {
+	if ((!force) && AUTOCLEAN_PAUSED(dmc)) {
 		eio_touch_set_lru(dmc, set);
-		goto err_out1;
+		goto out;
 	}
 
-	/*
-	 * 1. Take exclusive lock on the cache set
-	 * 2. Verify that there are dirty blocks to clean
-	 * 3. Identify the cache blocks to clean
-	 * 4. Read the cache blocks data from ssd
-	 * 5. Write the cache blocks data to hdd
-	 * 6. Update on-disk cache metadata
-	 * 7. Update in-core cache metadata
-	 */
-
 	start_index = set * dmc->assoc;
 	end_index = start_index + dmc->assoc;
 
@@ -3144,7 +4373,7 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 
 	/* 2. Return if there are no dirty blocks to clean */
 	if (dmc->cache_sets[set].nr_dirty == 0)
-		goto err_out2;
+		goto out_unlock;
 
 	/* 3. identify and mark cache blocks to clean */
 	if (!whole)
@@ -3158,15 +4387,142 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 		}
 	}
 
-	/* If nothing to clean, return */
-	if (!ncleans)
-		goto err_out2;
+	if (ncleans)
+		return ncleans;
+
+out_unlock:
+	up_write(&dmc->cache_sets[set].rw_lock);
+out:
+	eio_clean_set_release(dmc, set, force);
+	return 0;
+}
+
+/* Step 6 of a set clean, write the set md with the cleaned blocks invalid */
+static int
+eio_clean_set_md(struct cache_c *dmc, index_t set, struct page **mdpages)
+{
+	struct eio_io_region where;
+	index_t i;
+	index_t start_index;
+	index_t end_index;
+	int alloc_size;
+	struct flash_cacheblock *md_blocks = NULL;
+	int pindex, k;
+
+	/* TBD. Do we have to consider sector alignment here ? */
+
+	/*
+	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock), which
+	 * spans mdpage_count pages.
+	 */
+
+	start_index = set * dmc->assoc;
+	end_index = start_index + dmc->assoc;
+	alloc_size = dmc->assoc * sizeof(struct flash_cacheblock);
+
+	i = start_index;
+	for (pindex = 0; pindex < dmc->mdpage_count; pindex++) {
+		md_blocks = (struct flash_cacheblock *)kmap(mdpages[pindex]);
+		for (k = 0; (k < MD_BLOCKS_PER_PAGE) && (i < end_index);
+		     k++, i++) {
+			md_blocks[k].dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+
+			if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
+				md_blocks[k].cache_state = cpu_to_le64(INVALID);
+			else if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY)
+				md_blocks[k].cache_state =
+					cpu_to_le64((VALID | DIRTY));
+			else
+				md_blocks[k].cache_state = cpu_to_le64(INVALID);
+		}
+		kunmap(mdpages[pindex]);
+	}
+
+	where.bdev = eio_index_ssd(dmc, start_index)->ssd_dev->bdev;
+	where.sector = eio_ssd_md_sector(dmc, start_index);
+	where.count = eio_to_sector(alloc_size);
+	return eio_io_sync_pages(dmc, &where, REQ_OP_WRITE, 0,
+				 mdpages, dmc->mdpage_count);
+}
+
+/*
+ * Steps 6 and 7 of a set clean. Unless the data copy failed, write the
+ * set md, then settle the in-core state of the CLEAN_INPROG blocks and
+ * release the set.
+ */
+static void
+eio_clean_set_end(struct cache_c *dmc, index_t set, int error, int force)
+{
+	index_t i;
+	index_t start_index;
+	index_t end_index;
+
+	/* 6. update on-disk cache metadata, unless left to eio_md_store() */
+	if (!error && !dmc->clean_defer_md)
+		error = eio_clean_set_md(dmc, set, dmc->clean_mdpages);
+
+	/*
+	 * 7. update in-core cache metadata for clean_inprog blocks.
+	 * If there was an error, set them back to ALREADY_DIRTY
+	 * If no error, set them to VALID
+	 */
+	start_index = set * dmc->assoc;
+	end_index = start_index + dmc->assoc;
+	for (i = start_index; i < end_index; i++) {
+		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
+			if (error)
+				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
+			else {
+				EIO_CACHE_STATE_SET(dmc, i, VALID);
+				EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
+				dmc->cache_sets[set].nr_dirty--;
+				atomic64_dec(&dmc->nr_dirty);
+			}
+		}
+	}
+
+	up_write(&dmc->cache_sets[set].rw_lock);
+
+	eio_clean_set_release(dmc, set, force);
+}
+
+/* Cleans a given cache set */
+static void
+eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
+{
+	struct eio_io_region where;
+	int error;
+	index_t i;
+	index_t j;
+	index_t start_index;
+	index_t end_index;
+	struct sync_io_context sioc;
+	index_t blkindex;
+	struct bio_vec *bvecs;
+	unsigned nr_bvecs = 0, total;
+	int depth, nr_issued = 0;
+
+	/*
+	 * 1. Take exclusive lock on the cache set
+	 * 2. Verify that there are dirty blocks to clean
+	 * 3. Identify the cache blocks to clean
+	 * 4. Read the cache blocks data from ssd
+	 * 5. Write the cache blocks data to hdd
+	 * 6. Update on-disk cache metadata
+	 * 7. Update in-core cache metadata
+	 */
+
+	if (!eio_clean_set_begin(dmc, set, whole, force))
+		return;
 
 	/*
 	 * From this point onwards, make sure to reset
 	 * the clean inflag on cache blocks before returning
 	 */
 
+	start_index = set * dmc->assoc;
+	end_index = start_index + dmc->assoc;
+
 	/* 4. read cache set data */
 
 	atomic_set(&sioc.pending, 1);
@@ -3195,15 +4551,14 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 					       dmc->block_size, total, &nr_bvecs);
 			EIO_ASSERT(bvecs != NULL);
 			EIO_ASSERT(nr_bvecs > 0);
-			/* This I/O is aligned to block_size, as md_sectors is
-			 * aligned to 8192.
+			/* This I/O is aligned to block_size, as the data of
+			 * each SSD starts 8192 aligned.
 			 */
-			where.bdev = dmc->cache_dev->bdev;
-			where.sector =
-				(i << dmc->block_shift) + dmc->md_sectors;
+			where.bdev = eio_index_ssd(dmc, i)->ssd_dev->bdev;
+			where.sector = eio_ssd_data_sector(dmc, i);
 			where.count = total * dmc->block_size;
 
-			SECTOR_STATS(dmc->eio_stats.ssd_reads,
+			SECTOR_STATS(dmc->eio_stats->ssd_reads,
 				     to_bytes(where.count));
 			atomic_inc(&sioc.pending);
 			error =
@@ -3235,7 +4590,7 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	}
 	error = sioc.sio_error;
 	if (error)
-		goto err_out3;
+		goto out;
 
 	/* 5. write to hdd */
 	/*
@@ -3243,11 +4598,21 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	 * BIO_RW_SYNC flag to hint higher priority for these
 	 * I/Os.
 	 */
+	depth = (!force && CLEAN_ADAPTIVE(dmc)) ? READ_ONCE(dmc->clean_depth) : 0;
 	atomic_set(&sioc.pending, 1);
 	reinit_completion(&sioc.done);
 	for (i = start_index; i < end_index; i++) {
 		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
 
+			/* adaptive clean, issue hdd writes in waves of depth */
+			if (depth && nr_issued++ == depth) {
+				if (!atomic_dec_and_test(&sioc.pending))
+					wait_for_completion_io(&sioc.done);
+				atomic_set(&sioc.pending, 1);
+				reinit_completion(&sioc.done);
+				nr_issued = 1;
+			}
+
 			blkindex = (i - start_index);
 			total = 1;
 
@@ -3261,7 +4626,7 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 			where.sector = EIO_DBN_GET(dmc, i);
 			where.count = dmc->block_size;
 
-			SECTOR_STATS(dmc->eio_stats.disk_writes,
+			SECTOR_STATS(dmc->eio_stats->disk_writes,
 				     to_bytes(where.count));
 			atomic_inc(&sioc.pending);
 			error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE, EIO_REQ_SYNC,
@@ -3281,107 +4646,181 @@ eio_clean_set(struct cache_c *dmc, index_t set, int whole, int force)
 	if (!atomic_dec_and_test(&sioc.pending)) {
 		wait_for_completion_io(&sioc.done);
 	}
-
 	error = sioc.sio_error;
-	if (error)
-		goto err_out3;
-
-	/* 6. update on-disk cache metadata */
 
-	/* TBD. Do we have to consider sector alignment here ? */
-
-	/*
-	 * md_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	 * Currently, md_size is 8192 bytes, mdpage_count is 2 pages maximum.
-	 */
+out:
+	eio_clean_set_end(dmc, set, error, force);
+}
 
-	EIO_ASSERT(dmc->mdpage_count <= 2);
-	for (k = 0; k < dmc->mdpage_count; k++)
-		pg_virt_addr[k] = kmap(dmc->clean_mdpages[k]);
+static int eio_index_cmp(const void *a, const void *b)
+{
+	index_t ia = *(const index_t *)a;
+	index_t ib = *(const index_t *)b;
 
-	alloc_size = dmc->assoc * sizeof(struct flash_cacheblock);
-	pindex = 0;
-	md_blocks = (struct flash_cacheblock *)pg_virt_addr[pindex];
-	k = MD_BLOCKS_PER_PAGE;
+	return (ia > ib) - (ia < ib);
+}
 
-	for (i = start_index; i < end_index; i++) {
+static int eio_clean_ent_cmp(const void *a, const void *b)
+{
+	const struct eio_clean_ent *ea = a;
+	const struct eio_clean_ent *eb = b;
 
-		md_blocks->dbn = cpu_to_le64(EIO_DBN_GET(dmc, i));
+	return (ea->dbn > eb->dbn) - (ea->dbn < eb->dbn);
+}
 
-		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG)
-			md_blocks->cache_state = cpu_to_le64(INVALID);
-		else if (EIO_CACHE_STATE_GET(dmc, i) == ALREADY_DIRTY)
-			md_blocks->cache_state = cpu_to_le64((VALID | DIRTY));
-		else
-			md_blocks->cache_state = cpu_to_le64(INVALID);
+/*
+ * Multi-set flush, used when clean_sort_sets is above 1. The blocks to
+ * clean of all given sets are sorted by source disk sector and copied
+ * in chunks of one set's worth of clean buffers. In a chunk, blocks
+ * contiguous on the source disk go out as a single hdd write, in
+ * ascending sector order. The set mapping scatters neighbouring disk
+ * blocks over many sets, so cleaning set by set turns clustered dirty
+ * data into random hdd writes.
+ * Set locks are taken in ascending set order, like the I/O path does,
+ * and all of them are held until the md of every set is written.
+ */
+static void
+eio_clean_sets_sorted(struct cache_c *dmc, index_t *sets, int nr_sets,
+		      int force)
+{
+	struct eio_clean_ent *ents = dmc->clean_sort_ents;
+	struct eio_io_region where;
+	struct sync_io_context sioc;
+	struct bio_vec *bvecs;
+	unsigned nr_bvecs = 0;
+	index_t i, j, end_index;
+	index_t chunk, chunk_end, nr_ents = 0;
+	int s, nr_locked = 0;
+	int whole, depth, nr_issued;
+	int error = 0;
 
-		/* This was missing earlier. */
-		md_blocks++;
-		k--;
+	EIO_ASSERT(nr_sets <= CLEAN_SORT_SETS_MAX);
+	sort(sets, nr_sets, sizeof(index_t), eio_index_cmp, NULL);
 
-		if (k == 0) {
-			md_blocks =
-				(struct flash_cacheblock *)pg_virt_addr[++pindex];
-			k = MD_BLOCKS_PER_PAGE;
+	/* 1-3. lock the sets, mark and collect their blocks to clean */
+	for (s = 0; s < nr_sets; s++) {
+		whole = force ||
+			(dmc->cache_sets[sets[s]].flags & SETFLAG_CLEAN_WHOLE);
+		if (!eio_clean_set_begin(dmc, sets[s], whole, force))
+			continue;
+		sets[nr_locked++] = sets[s];
+
+		i = sets[s] * dmc->assoc;
+		end_index = i + dmc->assoc;
+		for (; i < end_index; i++) {
+			if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
+				ents[nr_ents].dbn = EIO_DBN_GET(dmc, i);
+				ents[nr_ents].index = i;
+				nr_ents++;
+			}
 		}
 	}
+	if (!nr_locked)
+		return;
 
-	for (k = 0; k < dmc->mdpage_count; k++)
-		kunmap(dmc->clean_mdpages[k]);
+	sort(ents, nr_ents, sizeof(struct eio_clean_ent), eio_clean_ent_cmp,
+	     NULL);
 
-	where.bdev = dmc->cache_dev->bdev;
-	where.sector = dmc->md_start_sect + INDEX_TO_MD_SECTOR(start_index);
-	where.count = eio_to_sector(alloc_size);
-	error =
-		eio_io_sync_pages(dmc, &where, REQ_OP_WRITE, 0, dmc->clean_mdpages,
-				  dmc->mdpage_count);
+	depth = (!force && CLEAN_ADAPTIVE(dmc)) ? READ_ONCE(dmc->clean_depth) : 0;
+	init_completion(&sioc.done);
+	sioc.sio_error = 0;
 
-	if (error)
-		goto err_out3;
+	for (chunk = 0; chunk < nr_ents; chunk += dmc->assoc) {
+		chunk_end = min_t(index_t, chunk + dmc->assoc, nr_ents);
 
-err_out3:
+		/* 4. read the chunk from ssd, block i lands in slot i - chunk */
+		atomic_set(&sioc.pending, 1);
+		reinit_completion(&sioc.done);
+		for (i = chunk; i < chunk_end; i = j) {
+			for (j = i + 1; (j < chunk_end) &&
+			     (ents[j].index == ents[j - 1].index + 1) &&
+			     (dmc->nr_ssds == 1 || ents[j].index % dmc->assoc);
+			     j++);
 
-	/*
-	 * 7. update in-core cache metadata for clean_inprog blocks.
-	 * If there was an error, set them back to ALREADY_DIRTY
-	 * If no error, set them to VALID
-	 */
-	for (i = start_index; i < end_index; i++) {
-		if (EIO_CACHE_STATE_GET(dmc, i) == CLEAN_INPROG) {
-			if (error)
-				EIO_CACHE_STATE_SET(dmc, i, ALREADY_DIRTY);
-			else {
-				EIO_CACHE_STATE_SET(dmc, i, VALID);
-				EIO_ASSERT(dmc->cache_sets[set].nr_dirty > 0);
-				dmc->cache_sets[set].nr_dirty--;
-				atomic64_dec(&dmc->nr_dirty);
+			bvecs =
+				setup_bio_vecs(dmc->clean_dbvecs, i - chunk,
+					       dmc->block_size, j - i, &nr_bvecs);
+			EIO_ASSERT(bvecs != NULL);
+			EIO_ASSERT(nr_bvecs > 0);
+
+			where.bdev = eio_index_ssd(dmc, ents[i].index)->ssd_dev->bdev;
+			where.sector = eio_ssd_data_sector(dmc, ents[i].index);
+			where.count = (j - i) * dmc->block_size;
+
+			SECTOR_STATS(dmc->eio_stats->ssd_reads,
+				     to_bytes(where.count));
+			atomic_inc(&sioc.pending);
+			error =
+				eio_io_async_bvec(dmc, &where, REQ_OP_READ, 0, bvecs,
+						  nr_bvecs, eio_sync_io_callback,
+						  &sioc, 0);
+			if (error) {
+				sioc.sio_error = error;
+				atomic_dec(&sioc.pending);
 			}
 		}
-	}
+		eio_unplug_cache_device(dmc);
 
-err_out2:
+		if (!atomic_dec_and_test(&sioc.pending))
+			wait_for_completion_io(&sioc.done);
+		error = sioc.sio_error;
+		if (error)
+			break;
 
-	up_write(&dmc->cache_sets[set].rw_lock);
+		/* 5. write to hdd in elevator order, merging contiguous blocks */
+		atomic_set(&sioc.pending, 1);
+		reinit_completion(&sioc.done);
+		nr_issued = 0;
+		for (i = chunk; i < chunk_end; i = j) {
+			for (j = i + 1; (j < chunk_end) &&
+			     (ents[j].dbn == ents[j - 1].dbn + dmc->block_size);
+			     j++);
+
+			/* adaptive clean, issue hdd writes in waves of depth */
+			if (depth && nr_issued++ == depth) {
+				if (!atomic_dec_and_test(&sioc.pending))
+					wait_for_completion_io(&sioc.done);
+				atomic_set(&sioc.pending, 1);
+				reinit_completion(&sioc.done);
+				nr_issued = 1;
+			}
 
-err_out1:
+			bvecs =
+				setup_bio_vecs(dmc->clean_dbvecs, i - chunk,
+					       dmc->block_size, j - i, &nr_bvecs);
+			EIO_ASSERT(bvecs != NULL);
+			EIO_ASSERT(nr_bvecs > 0);
 
-	/* Reset clean flags on the set */
+			where.bdev = dmc->disk_dev->bdev;
+			where.sector = ents[i].dbn;
+			where.count = (j - i) * dmc->block_size;
 
-	if (!force) {
-		spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
-		dmc->cache_sets[set].flags &=
-			~(SETFLAG_CLEAN_INPROG | SETFLAG_CLEAN_WHOLE);
-		spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
-	}
+			SECTOR_STATS(dmc->eio_stats->disk_writes,
+				     to_bytes(where.count));
+			this_cpu_inc(dmc->eio_stats->clean_sorted_writes);
+			atomic_inc(&sioc.pending);
+			error = eio_io_async_bvec(dmc, &where, REQ_OP_WRITE, EIO_REQ_SYNC,
+						  bvecs, nr_bvecs,
+						  eio_sync_io_callback, &sioc,
+						  1);
+			if (error) {
+				sioc.sio_error = error;
+				atomic_dec(&sioc.pending);
+			}
+		}
 
-	if (dmc->cache_sets[set].nr_dirty)
-		/*
-		 * Lru touch the set, so that it can be picked
-		 * up for whole set clean by clean thread later
-		 */
-		eio_touch_set_lru(dmc, set);
+		if (!atomic_dec_and_test(&sioc.pending))
+			wait_for_completion_io(&sioc.done);
+		error = sioc.sio_error;
+		if (error)
+			break;
+	}
+	if (!error)
+		this_cpu_add(dmc->eio_stats->clean_sorted_blocks, nr_ents);
 
-	return;
+	/* 6-7. write the md of each set and release it */
+	for (s = 0; s < nr_locked; s++)
+		eio_clean_set_end(dmc, sets[s], error, force);
 }
 
 /*
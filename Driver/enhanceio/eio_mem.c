@@ -42,13 +42,24 @@
 
 /*
  * eio_mem_init
+ *
+ * Returns 0 for the 4-byte md, 1 for the 8-byte md, 2 for the 6-byte md
+ * and -1 on error.
  */
 int eio_mem_init(struct cache_c *dmc)
 {
 	u_int32_t lsb_bits;
 	u_int32_t msb_bits_24;  /* most significant bits in shrunk dbn */
+	u_int32_t msb_bits_40;
 	u_int64_t max_dbn;
 	u_int64_t num_sets_64;
+	u_int64_t src_sectors;
+
+	/*
+	 * The md size is chosen again on every load, the in-core md is
+	 * rebuilt from the on-SSD md.
+	 */
+	dmc->cache_flags &= ~(CACHE_FLAGS_MD8 | CACHE_FLAGS_MD6);
 
 	/*
 	 * Sanity check the number of sets.
@@ -71,31 +82,48 @@ int eio_mem_init(struct cache_c *dmc)
 
 	dmc->num_sets_mask = ULLONG_MAX >> (64 - dmc->num_sets_bits);
 
+	lsb_bits = dmc->consecutive_shift + dmc->block_shift;
+	src_sectors = eio_to_sector(eio_get_device_size(dmc->disk_dev));
+
 	/*
 	 * If we don't have at least 16 bits to save,
 	 * we can't use small metadata.
 	 */
 	if (dmc->num_sets_bits < 16) {
-		dmc->cache_flags |= CACHE_FLAGS_MD8;
 		pr_info("Not enough sets to use small metadata");
-		return 1;
+		goto medium;
 	}
 
 	/*
 	 * Now compute the largest sector number that we can shrink; then see
 	 * if the source volume is smaller.
 	 */
-	lsb_bits = dmc->consecutive_shift + dmc->block_shift;
 	msb_bits_24 = 24 - 1 - lsb_bits;        /* 1 for wrapped bit */
 	max_dbn =
 		((u_int64_t)1) << (msb_bits_24 + dmc->num_sets_bits + lsb_bits);
-	if (eio_to_sector(eio_get_device_size(dmc->disk_dev)) > max_dbn) {
-		dmc->cache_flags |= CACHE_FLAGS_MD8;
+	if (src_sectors > max_dbn) {
 		pr_info("Source volume too big to use small metadata");
-		return 1;
+		goto medium;
 	}
 
 	return 0;
+
+medium:
+	/* Same shrinking, with a 40-bit dbn */
+	msb_bits_40 = EIO_MD6_DBN_BITS - 1 - lsb_bits;
+	if (msb_bits_40 + dmc->num_sets_bits + lsb_bits < 64) {
+		max_dbn = ((u_int64_t)1) <<
+			  (msb_bits_40 + dmc->num_sets_bits + lsb_bits);
+		if (src_sectors > max_dbn) {
+			dmc->cache_flags |= CACHE_FLAGS_MD8;
+			pr_info("Source volume too big to use medium metadata");
+			return 1;
+		}
+	}
+	dmc->cache_flags |= CACHE_FLAGS_MD6;
+	pr_info("Using medium metadata");
+
+	return 2;
 }
 
 /*
@@ -116,11 +144,12 @@ u_int32_t eio_hash_block(struct cache_c *dmc, sector_t dbn)
  * eio_shrink_dbn
  *
  * Shrink a 5-byte "dbn" into a 3-byte "dbn" by eliminating 16 lower bits
- * of the set number this "dbn" belongs to.
+ * of the set number this "dbn" belongs to. The 6-byte md shrinks the
+ * same way into a 5-byte "dbn".
  */
-unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
+u_int64_t eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
 {
-	u_int32_t dbn_24;
+	u_int64_t dbn_24;
 	sector_t lsb;
 	sector_t wrapped;
 	sector_t msb;
@@ -134,8 +163,8 @@ unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
 	EIO_DBN_TO_SET(dmc, dbn, set_number, wrapped);
 	msb = dbn >> (dmc->num_sets_bits + SECTORS_PER_SET_SHIFT);
 	dbn_24 =
-		(unsigned int)(lsb | (wrapped << SECTORS_PER_SET_SHIFT) |
-			       (msb << (SECTORS_PER_SET_SHIFT + 1)));
+		(u_int64_t)(lsb | (wrapped << SECTORS_PER_SET_SHIFT) |
+			    (msb << (SECTORS_PER_SET_SHIFT + 1)));
 
 	return dbn_24;
 }
@@ -148,7 +177,7 @@ unsigned int eio_shrink_dbn(struct cache_c *dmc, sector_t dbn)
  */
 sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index)
 {
-	u_int32_t dbn_24;
+	u_int64_t dbn_24;
 	u_int64_t set_number;
 	sector_t lsb;
 	sector_t msb;
@@ -162,7 +191,11 @@ sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index)
 	    dmc->index_zero < (u_int64_t)dmc->assoc)
 		return 0;
 
-	dbn_24 = dmc->cache[index].md4_u.u_i_md4 & EIO_MD4_DBN_MASK;
+	if (EIO_MD6(dmc))
+		dbn_24 = EIO_MD6_DBN(EIO_MD6_BLK(dmc, index));
+	else
+		dbn_24 = EIO_MD4_BLK(dmc, index)->md4_u.u_i_md4 &
+			 EIO_MD4_DBN_MASK;
 	if (dbn_24 == 0 && EIO_CACHE_STATE_GET(dmc, index) == INVALID)
 		return (sector_t)0;
 
@@ -179,7 +212,7 @@ sector_t eio_expand_dbn(struct cache_c *dmc, u_int64_t index)
 		dbn_40 |= set_number << SECTORS_PER_SET_SHIFT;
 		dbn_40 |= lsb;
 	}
-	EIO_ASSERT(unlikely(dbn_40 < EIO_MAX_SECTOR));
+	EIO_ASSERT(EIO_MD6(dmc) || unlikely(dbn_40 < EIO_MAX_SECTOR));
 
 	return (sector_t)dbn_40;
 }
@@ -191,10 +224,16 @@ EXPORT_SYMBOL(eio_expand_dbn);
 void eio_invalidate_md(struct cache_c *dmc, u_int64_t index)
 {
 
-	if (EIO_MD8(dmc))
-		dmc->cache_md8[index].md8_u.u_i_md8 = EIO_MD8_INVALID;
-	else
-		dmc->cache[index].md4_u.u_i_md4 = EIO_MD4_INVALID;
+	if (EIO_MD8(dmc)) {
+		EIO_MD8_BLK(dmc, index)->md8_u.u_i_md8 = EIO_MD8_INVALID;
+	} else if (EIO_MD6(dmc)) {
+		EIO_MD6_BLK(dmc, index)->dbn_lo = 0;
+		EIO_MD6_BLK(dmc, index)->dbn_hi = 0;
+		EIO_MD6_BLK(dmc, index)->cache_state = INVALID;
+	} else {
+		EIO_MD4_BLK(dmc, index)->md4_u.u_i_md4 = EIO_MD4_INVALID;
+	}
+	*EIO_TAG(dmc, index) = EIO_TAG_INVALID;
 }
 
 /*
@@ -206,8 +245,8 @@ void eio_md4_dbn_set(struct cache_c *dmc, u_int64_t index, u_int32_t dbn_24)
 	EIO_ASSERT((dbn_24 & ~EIO_MD4_DBN_MASK) == 0);
 
 	/* retain "cache_state" */
-	dmc->cache[index].md4_u.u_i_md4 &= ~EIO_MD4_DBN_MASK;
-	dmc->cache[index].md4_u.u_i_md4 |= dbn_24;
+	EIO_MD4_BLK(dmc, index)->md4_u.u_i_md4 &= ~EIO_MD4_DBN_MASK;
+	EIO_MD4_BLK(dmc, index)->md4_u.u_i_md4 |= dbn_24;
 
 	/* XXX excessive debugging */
 	if (dmc->index_zero < (u_int64_t)dmc->assoc &&  /* sector 0 cached */
@@ -216,6 +255,26 @@ void eio_md4_dbn_set(struct cache_c *dmc, u_int64_t index, u_int32_t dbn_24)
 		dmc->index_zero = dmc->assoc;
 }
 
+/*
+ * eio_md6_dbn_set
+ */
+void eio_md6_dbn_set(struct cache_c *dmc, u_int64_t index, u_int64_t dbn_40)
+{
+	struct cacheblock_md6 *md6 = EIO_MD6_BLK(dmc, index);
+
+	EIO_ASSERT((dbn_40 & ~EIO_MD6_DBN_MASK) == 0);
+
+	/* retain "cache_state" */
+	md6->dbn_lo = (u_int32_t)dbn_40;
+	md6->dbn_hi = (u_int8_t)(dbn_40 >> 32);
+
+	/* XXX excessive debugging */
+	if (dmc->index_zero < (u_int64_t)dmc->assoc &&  /* sector 0 cached */
+	    index == dmc->index_zero &&                 /* we're accessing sector 0 */
+	    dbn_40 != 0)                                /* we're replacing sector 0 */
+		dmc->index_zero = dmc->assoc;
+}
+
 /*
  * eio_md8_dbn_set
  */
@@ -225,8 +284,8 @@ void eio_md8_dbn_set(struct cache_c *dmc, u_int64_t index, sector_t dbn)
 	EIO_ASSERT((dbn & ~EIO_MD8_DBN_MASK) == 0);
 
 	/* retain "cache_state" */
-	dmc->cache_md8[index].md8_u.u_i_md8 &= ~EIO_MD8_DBN_MASK;
-	dmc->cache_md8[index].md8_u.u_i_md8 |= dbn;
+	EIO_MD8_BLK(dmc, index)->md8_u.u_i_md8 &= ~EIO_MD8_DBN_MASK;
+	EIO_MD8_BLK(dmc, index)->md8_u.u_i_md8 |= dbn;
 
 	/* XXX excessive debugging */
 	if (dmc->index_zero < (u_int64_t)dmc->assoc &&  /* sector 0 cached */
@@ -234,3 +293,213 @@ void eio_md8_dbn_set(struct cache_c *dmc, u_int64_t index, sector_t dbn)
 	    dbn != 0)                                   /* we're replacing sector 0 */
 		dmc->index_zero = dmc->assoc;
 }
+
+/* In-core md allocation mode of the cache, one of its create options */
+static int eio_md_mem_mode(struct cache_c *dmc)
+{
+	if (dmc->cache_flags & CACHE_FLAGS_MD_MEM_INTERLEAVE)
+		return EIO_MEM_INTERLEAVE;
+	if (dmc->cache_flags & CACHE_FLAGS_MD_MEM_LOCAL)
+		return EIO_MEM_LOCAL;
+	return EIO_MEM_VMALLOC;
+}
+
+/* Node of md chunk k, for the chunked allocation modes */
+static int eio_md_chunk_node(int mode, u_int32_t k)
+{
+	int nid;
+	int nr;
+
+	if (mode != EIO_MEM_INTERLEAVE)
+		return numa_node_id();
+
+	nr = num_node_state(N_CPU);
+	if (nr <= 1)
+		return numa_node_id();
+	k %= nr;
+	for_each_node_state(nid, N_CPU) {
+		if (k-- == 0)
+			break;
+	}
+	return nid;
+}
+
+/*
+ * Chunks up to EIO_MD_CHUNK_SIZE come from the page allocator, falling
+ * back to vmalloc when the node is short of contiguous memory.
+ */
+static void *eio_md_chunk_alloc(size_t size, int mode, int nid)
+{
+	void *addr = NULL;
+
+	if (mode == EIO_MEM_VMALLOC)
+		return vmalloc(size);
+
+	if (size <= EIO_MD_CHUNK_SIZE)
+		addr = alloc_pages_exact_nid(nid, size, GFP_KERNEL |
+					     __GFP_NOWARN | __GFP_NORETRY);
+	if (addr == NULL)
+		addr = vmalloc_node(size, nid);
+	return addr;
+}
+
+static void eio_md_chunk_free(void *addr, size_t size)
+{
+	if (addr == NULL)
+		return;
+	if (is_vmalloc_addr(addr))
+		vfree(addr);
+	else
+		free_pages_exact(addr, size);
+}
+
+/* Blocks in md chunk k */
+static u_int64_t eio_md_chunk_blocks(struct cache_c *dmc, u_int32_t k)
+{
+	u_int64_t first = (u_int64_t)k << dmc->md_chunk_shift;
+
+	return min_t(u_int64_t, dmc->size - first,
+		     1ULL << dmc->md_chunk_shift);
+}
+
+/*
+ * eio_md_size
+ *
+ * Bytes of in-core md eio_md_alloc() allocates for dmc->size blocks: the
+ * md entries and lookup tags, the set and block bitmaps and, with
+ * CACHE_FLAGS_SUB_BLOCK, the valid sectors of the blocks.
+ */
+sector_t eio_md_size(struct cache_c *dmc)
+{
+	sector_t size;
+
+	size = dmc->size * (EIO_MD_ENTRY_SIZE(dmc) + sizeof(u_int8_t));
+	size += 2 * BITS_TO_LONGS(dmc->size >> dmc->consecutive_shift) *
+		sizeof(unsigned long);
+	size += BITS_TO_LONGS(dmc->size) * sizeof(unsigned long);
+	if (dmc->cache_flags & CACHE_FLAGS_SUB_BLOCK)
+		size += dmc->size * sizeof(u_int16_t);
+	return size;
+}
+
+/*
+ * eio_md_alloc
+ *
+ * Allocate the in-core md and lookup tags of dmc->size blocks, as per
+ * the allocation mode of the cache. The chunks hold a whole number of
+ * sets and add up to the same size as a single allocation, so the
+ * mem_limit_pct checks of the callers still hold. The tags are set to
+ * EIO_TAG_INVALID.
+ */
+int eio_md_alloc(struct cache_c *dmc)
+{
+	int mode = eio_md_mem_mode(dmc);
+	u_int64_t blocks;
+	u_int32_t shift;
+	u_int32_t k;
+	int nid;
+
+	if (mode == EIO_MEM_VMALLOC)
+		shift = ilog2(roundup_pow_of_two(dmc->size));
+	else
+		shift = max_t(u_int32_t, dmc->consecutive_shift,
+			      ilog2(EIO_MD_CHUNK_SIZE / EIO_MD_ENTRY_SIZE(dmc)));
+
+	dmc->md_chunk_shift = shift;
+	dmc->md_nr_chunks = (u_int32_t)((dmc->size + (1ULL << shift) - 1) >>
+					shift);
+	dmc->md_chunks = kcalloc(dmc->md_nr_chunks, sizeof(void *),
+				 GFP_KERNEL);
+	dmc->tag_chunks = kcalloc(dmc->md_nr_chunks, sizeof(u_int8_t *),
+				  GFP_KERNEL);
+	if (!dmc->md_chunks || !dmc->tag_chunks)
+		goto nomem;
+
+	for (k = 0; k < dmc->md_nr_chunks; k++) {
+		blocks = eio_md_chunk_blocks(dmc, k);
+		nid = eio_md_chunk_node(mode, k);
+		dmc->md_chunks[k] =
+			eio_md_chunk_alloc(blocks * EIO_MD_ENTRY_SIZE(dmc),
+					   mode, nid);
+		dmc->tag_chunks[k] = eio_md_chunk_alloc(blocks, mode, nid);
+		if (!dmc->md_chunks[k] || !dmc->tag_chunks[k])
+			goto nomem;
+		memset(dmc->tag_chunks[k], EIO_TAG_INVALID, blocks);
+	}
+
+	/* Until the md is written or read, the SSD holds anything */
+	dmc->md_changed = vmalloc(BITS_TO_LONGS(dmc->size >>
+						dmc->consecutive_shift) *
+				  sizeof(unsigned long));
+	if (!dmc->md_changed)
+		goto nomem;
+	bitmap_fill(dmc->md_changed, dmc->size >> dmc->consecutive_shift);
+
+	dmc->read_hits = vzalloc(BITS_TO_LONGS(dmc->size) *
+				 sizeof(unsigned long));
+	dmc->read_hit_sets = vzalloc(BITS_TO_LONGS(dmc->size >>
+						   dmc->consecutive_shift) *
+				     sizeof(unsigned long));
+	if (!dmc->read_hits || !dmc->read_hit_sets)
+		goto nomem;
+
+	if (dmc->cache_flags & CACHE_FLAGS_SUB_BLOCK) {
+		dmc->sub_valid = vzalloc(dmc->size * sizeof(u_int16_t));
+		if (!dmc->sub_valid)
+			goto nomem;
+	}
+
+	if (mode != EIO_MEM_VMALLOC)
+		pr_info("md_alloc: %u md chunks of %llu blocks, %s",
+			dmc->md_nr_chunks, 1ULL << shift,
+			(mode == EIO_MEM_INTERLEAVE) ? "interleaved" : "node local");
+	return 0;
+
+nomem:
+	eio_md_free(dmc);
+	return -ENOMEM;
+}
+
+/*
+ * eio_md_free
+ */
+void eio_md_free(struct cache_c *dmc)
+{
+	u_int64_t blocks;
+	u_int32_t k;
+
+	for (k = 0; k < dmc->md_nr_chunks; k++) {
+		blocks = eio_md_chunk_blocks(dmc, k);
+		if (dmc->md_chunks)
+			eio_md_chunk_free(dmc->md_chunks[k],
+					  blocks * EIO_MD_ENTRY_SIZE(dmc));
+		if (dmc->tag_chunks)
+			eio_md_chunk_free(dmc->tag_chunks[k], blocks);
+	}
+	kfree(dmc->md_chunks);
+	kfree(dmc->tag_chunks);
+	vfree(dmc->md_changed);
+	vfree(dmc->read_hits);
+	vfree(dmc->read_hit_sets);
+	vfree(dmc->sub_valid);
+	dmc->md_chunks = NULL;
+	dmc->tag_chunks = NULL;
+	dmc->md_changed = NULL;
+	dmc->read_hits = NULL;
+	dmc->read_hit_sets = NULL;
+	dmc->sub_valid = NULL;
+	dmc->md_nr_chunks = 0;
+}
+
+/*
+ * eio_sets_alloc
+ *
+ * The cache sets are reached through a flat array, so they are only
+ * placed on the local node in the chunked modes.
+ */
+void *eio_sets_alloc(struct cache_c *dmc, size_t size)
+{
+	if (eio_md_mem_mode(dmc) != EIO_MEM_VMALLOC)
+		return vmalloc_node(size, numa_node_id());
+	return vmalloc(size);
+}
@@ -127,12 +127,58 @@ int eio_policy_clean_set(struct eio_policy *p_ops, index_t set, int to_clean)
 }
 
 /*
- * LRU Specific functions
+ * Rank snapshot of a set, see EIO_RANK_MAX. Policies without an eviction
+ * order have no hooks and return -EINVAL.
+ */
+int eio_policy_rank_get(struct eio_policy *p_ops, index_t set,
+			u_int8_t *ranks)
+{
+
+	if (!p_ops || !p_ops->sp_rank_get)
+		return -EINVAL;
+	p_ops->sp_rank_get(p_ops, set, ranks);
+	return 0;
+}
+
+/*
+ * Restore the order of a set from its ranks. The blocks are handed to
+ * the policy coldest first in order, the scratch of assoc entries, by a
+ * counting sort that keeps blocks of equal rank in index order.
+ */
+int eio_policy_rank_set(struct eio_policy *p_ops, index_t set,
+			const u_int8_t *ranks, u_int16_t *order)
+{
+	u_int32_t count[EIO_RANK_MAX + 1];
+	u_int32_t assoc;
+	u_int32_t sum, n;
+	u_int32_t i;
+
+	if (!p_ops || !p_ops->sp_rank_set)
+		return -EINVAL;
+	assoc = p_ops->sp_dmc->assoc;
+
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < assoc; i++)
+		count[ranks[i]]++;
+	for (i = 0, sum = 0; i <= EIO_RANK_MAX; i++) {
+		n = count[i];
+		count[i] = sum;
+		sum += n;
+	}
+	for (i = 0; i < assoc; i++)
+		order[count[ranks[i]]++] = (u_int16_t)i;
+
+	p_ops->sp_rank_set(p_ops, set, ranks, order);
+	return 0;
+}
+
+/*
+ * Recency hooks, used by LRU and 2Q
  */
 void eio_policy_lru_pushblks(struct eio_policy *p_ops)
 {
 
-	if (p_ops && p_ops->sp_name == CACHE_REPL_LRU)
+	if (p_ops && p_ops->sp_policy.lru)
 		p_ops->sp_policy.lru->sl_lru_pushblks(p_ops);
 }
 
@@ -141,6 +187,6 @@ eio_policy_reclaim_lru_movetail(struct cache_c *dmc, index_t i,
 				struct eio_policy *p_ops)
 {
 
-	if (p_ops && p_ops->sp_name == CACHE_REPL_LRU)
+	if (p_ops && p_ops->sp_policy.lru)
 		p_ops->sp_policy.lru->sl_reclaim_lru_movetail(dmc, i, p_ops);
 }
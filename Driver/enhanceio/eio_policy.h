@@ -35,12 +35,10 @@
  * The LRU pointers are maintained as set-relative offsets, instead of
  * pointers. This enables us to store the LRU pointers per cacheblock
  * using 4 bytes instead of 16 bytes. The upshot of this is that we
- * are required to clamp the associativity at an 8K max.
- *
- * XXX - The above comment is from the original code. Looks like an error,
- * maximum associativity should be 32K (2^15) and not 8K.
+ * are required to clamp the associativity at 32K, the largest power
+ * of two whose offsets fit in 16 bits besides EIO_LRU_NULL.
  */
-#define EIO_MAX_ASSOC   8192
+#define EIO_MAX_ASSOC   32768
 #define EIO_LRU_NULL    0xFFFF
 
 /* Declerations to keep the compiler happy */
@@ -76,9 +74,20 @@ struct eio_policy {
 	void (*sp_find_reclaim_dbn)(struct eio_policy *,
 				    index_t start_index, index_t *index);
 	int (*sp_clean_set)(struct eio_policy *, index_t set, int);
+	void (*sp_rank_get)(struct eio_policy *, index_t set, u_int8_t *ranks);
+	void (*sp_rank_set)(struct eio_policy *, index_t set,
+			    const u_int8_t *ranks, const u_int16_t *order);
 	struct cache_c *sp_dmc;
 };
 
+/*
+ * The rank of a block tells its place in the eviction order of its set,
+ * from 0 for the next victim to EIO_RANK_MAX for the hottest block. The
+ * ranks are saved with the md at shutdown and restored on the next load.
+ */
+#define EIO_RANK_MAX    0xFF
+#define EIO_RANK(pos, n)        ((u_int8_t)(((pos) << 8) / (n)))
+
 /*
  * List of registered policies. There is one instance
  * of this structure per policy type.
@@ -96,6 +105,9 @@ int eio_repl_blk_init(struct eio_policy *);
 void eio_find_reclaim_dbn(struct eio_policy *, index_t start_index,
 			  index_t *index);
 int eio_policy_clean_set(struct eio_policy *, index_t, int);
+int eio_policy_rank_get(struct eio_policy *, index_t, u_int8_t *);
+int eio_policy_rank_set(struct eio_policy *, index_t, const u_int8_t *,
+			u_int16_t *);
 
 int eio_register_policy(struct eio_policy_header *);
 int eio_unregister_policy(struct eio_policy_header *);
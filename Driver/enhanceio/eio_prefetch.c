@@ -0,0 +1,300 @@
+/*
+ *  eio_prefetch.c
+ *
+ *  Background warm-up of a cache from a list of source extents.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; under version 2 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include "eio.h"
+#include "eio_ttc.h"
+
+/*
+ * The prefetcher reads the uncached runs of blocks of each extent, up to
+ * EIO_PREFETCH_PAGES at a time, into its own pages. The reads are sent
+ * to the source device and so go through eio_make_request_fn() and
+ * eio_map() like application reads; eio_map() recognizes them by their
+ * bi_end_io, bypasses the sequential stream detection and the admission
+ * filter for them, and the misses are filled by the readfill path.
+ */
+#define EIO_PREFETCH_PAGES      BIO_MAX_PAGES
+
+struct eio_prefetch {
+	struct cache_c *pf_dmc;
+	struct completion pf_done;      /* the read in flight completed */
+	int pf_error;
+	int pf_stop;
+	u_int32_t pf_rate_kb;
+	u_int32_t pf_nr_extents;
+	struct page *pf_pages[EIO_PREFETCH_PAGES];
+	struct eio_extent pf_extents[0];
+};
+
+/* Whether the block of dbn is wholly cached, or being filled */
+static int eio_prefetch_cached(struct cache_c *dmc, sector_t dbn)
+{
+	u_int32_t set = eio_hash_block(dmc, dbn);
+	index_t start_index = (index_t)set * dmc->assoc;
+	u_int8_t tag = eio_dbn_tag(dbn);
+	u_int8_t *tags;
+	unsigned long flags;
+	int cached = 0;
+	index_t i;
+
+	spin_lock_irqsave(&dmc->cache_sets[set].cs_lock, flags);
+	tags = EIO_TAG(dmc, start_index);
+	for (i = 0; i < dmc->assoc; i++) {
+		if (tags[i] != tag)
+			continue;
+		if ((EIO_CACHE_STATE_GET(dmc, start_index + i) & VALID) &&
+		    EIO_DBN_GET(dmc, start_index + i) == dbn) {
+			cached = !eio_sub_partial(dmc, start_index + i);
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&dmc->cache_sets[set].cs_lock, flags);
+
+	return cached;
+}
+
+void eio_prefetch_endio(struct bio *bio, int error)
+{
+	struct eio_prefetch *pf = bio->bi_private;
+
+	EIO_ENDIO_FN_START;
+
+	pf->pf_error = error;
+	complete(&pf->pf_done);
+}
+
+/*
+ * Read count sectors from sector and wait for them. Returns the number
+ * of sectors read, which is less than count if the bio got full.
+ */
+static long eio_prefetch_read(struct eio_prefetch *pf, sector_t sector,
+			      sector_t count)
+{
+	struct cache_c *dmc = pf->pf_dmc;
+	struct bio *bio;
+	unsigned nr_pages;
+	unsigned len;
+	unsigned i;
+	u_int64_t remaining = to_bytes(count);
+	long done = 0;
+
+	nr_pages = DIV_ROUND_UP(remaining, PAGE_SIZE);
+	EIO_ASSERT(nr_pages <= EIO_PREFETCH_PAGES);
+	bio = bio_alloc(GFP_NOIO, nr_pages);
+	if (bio == NULL)
+		return -ENOMEM;
+	bio->bi_bdev = dmc->disk_dev->bdev;
+	EIO_BIO_BI_SECTOR(bio) = sector;
+	bio_set_op_attrs(bio, REQ_OP_READ, 0);
+	bio->bi_end_io = eio_prefetch_endio;
+	bio->bi_private = pf;
+
+	for (i = 0; i < nr_pages; i++) {
+		len = (unsigned)min_t(u_int64_t, remaining, PAGE_SIZE);
+		if (!bio_add_page(bio, pf->pf_pages[i], len, 0))
+			break;
+		remaining -= len;
+		done += eio_to_sector(len);
+	}
+	if (done == 0) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	reinit_completion(&pf->pf_done);
+	submit_bio(bio);
+	wait_for_completion(&pf->pf_done);
+	bio_put(bio);
+
+	return pf->pf_error ? pf->pf_error : done;
+}
+
+/* Hold the reads of the prefetcher down to pf_rate_kb */
+static void eio_prefetch_throttle(struct eio_prefetch *pf,
+				  unsigned long start, u_int64_t done_kb)
+{
+	unsigned long due;
+
+	if (pf->pf_rate_kb == 0)
+		return;
+	due = start + msecs_to_jiffies((unsigned int)
+				       div_u64(done_kb * 1000,
+					       pf->pf_rate_kb));
+	while (time_before(jiffies, due) && !READ_ONCE(pf->pf_stop))
+		schedule_timeout_interruptible(min_t(long, due - jiffies,
+						     HZ / 10));
+}
+
+static void eio_prefetch_free(struct eio_prefetch *pf)
+{
+	int i;
+
+	for (i = 0; i < EIO_PREFETCH_PAGES; i++)
+		if (pf->pf_pages[i])
+			__free_page(pf->pf_pages[i]);
+	vfree(pf);
+}
+
+void eio_prefetch_work(struct work_struct *work)
+{
+	struct cache_c *dmc = container_of(work, struct cache_c, prefetch_work);
+	struct eio_prefetch *pf;
+	unsigned long start = jiffies;
+	unsigned long flags;
+	u_int64_t done_kb = 0;
+	sector_t max_count;
+	sector_t dbn, end, first;
+	long ret = 0;
+	u_int32_t i;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	pf = dmc->prefetch;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	if (pf == NULL)
+		return;
+
+	max_count = (sector_t)EIO_PREFETCH_PAGES << (PAGE_SHIFT - SECTOR_SHIFT);
+	for (i = 0; i < pf->pf_nr_extents && ret >= 0; i++) {
+		dbn = EIO_ROUND_SECTOR(dmc, pf->pf_extents[i].ex_start);
+		end = pf->pf_extents[i].ex_start + pf->pf_extents[i].ex_count;
+		end = min_t(sector_t, end, dmc->disk_size);
+
+		while (dbn < end && !READ_ONCE(pf->pf_stop)) {
+			if (eio_prefetch_cached(dmc, dbn)) {
+				this_cpu_inc(dmc->eio_stats->prefetch_skipped);
+				dbn += dmc->block_size;
+				continue;
+			}
+
+			/* Read the run of uncached blocks at once */
+			first = dbn;
+			do {
+				dbn += dmc->block_size;
+			} while (dbn < end && dbn - first < max_count &&
+				 !eio_prefetch_cached(dmc, dbn));
+			dbn = min_t(sector_t, dbn, min_t(sector_t, end,
+							 first + max_count));
+
+			ret = eio_prefetch_read(pf, first, dbn - first);
+			if (ret < 0) {
+				pr_err("prefetch: read of sector %llu failed, error %ld",
+				       (unsigned long long)first, ret);
+				break;
+			}
+			dbn = first + ret;
+			done_kb += ret >> 1;
+			eio_prefetch_throttle(pf, start, done_kb);
+		}
+		if (READ_ONCE(pf->pf_stop))
+			break;
+	}
+
+	pr_info("prefetch: cache \"%s\" %s, %llu KB read from source",
+		dmc->cache_name, READ_ONCE(pf->pf_stop) ? "stopped" : "done",
+		(unsigned long long)done_kb);
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	dmc->prefetch = NULL;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	eio_prefetch_free(pf);
+}
+
+/*
+ * Ask a running prefetch to stop. It ends with the read in flight, see
+ * eio_cache_delete() for the wait.
+ */
+void eio_prefetch_stop(struct cache_c *dmc)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (dmc->prefetch)
+		WRITE_ONCE(dmc->prefetch->pf_stop, 1);
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+}
+
+int eio_cache_prefetch(struct cache_prefetch *cp)
+{
+	struct cache_c *dmc;
+	struct eio_prefetch *pf;
+	unsigned long flags;
+	u_int32_t nr;
+	int error = 0;
+	int i;
+
+	cp->cp_name[CACHE_NAME_LEN] = '\0';
+	dmc = eio_cache_lookup(cp->cp_name);
+	if (dmc == NULL) {
+		pr_err("prefetch: cache \"%s\" doesn't exist", cp->cp_name);
+		return -EINVAL;
+	}
+
+	if (cp->cp_nr_extents > EIO_PREFETCH_EXTENTS_MAX)
+		return -EINVAL;
+
+	if (unlikely(CACHE_FAILED_IS_SET(dmc)) ||
+	    unlikely(CACHE_DEGRADED_IS_SET(dmc)) ||
+	    dmc->cache_rdonly || dmc->sysctl_active.cache_wronly) {
+		pr_err("prefetch: cache \"%s\" can't be filled now",
+		       dmc->cache_name);
+		return -EPERM;
+	}
+
+	nr = cp->cp_nr_extents ? cp->cp_nr_extents : 1;
+	pf = vzalloc(sizeof(*pf) + nr * sizeof(struct eio_extent));
+	if (pf == NULL)
+		return -ENOMEM;
+	for (i = 0; i < EIO_PREFETCH_PAGES; i++) {
+		pf->pf_pages[i] = alloc_page(GFP_KERNEL);
+		if (pf->pf_pages[i] == NULL) {
+			eio_prefetch_free(pf);
+			return -ENOMEM;
+		}
+	}
+
+	pf->pf_dmc = dmc;
+	init_completion(&pf->pf_done);
+	pf->pf_rate_kb = cp->cp_rate_kb;
+	pf->pf_nr_extents = nr;
+	if (cp->cp_nr_extents)
+		memcpy(pf->pf_extents, cp->cp_extents,
+		       nr * sizeof(struct eio_extent));
+	else
+		pf->pf_extents[0].ex_count = dmc->disk_size;
+
+	spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+	if (dmc->prefetch ||
+	    (dmc->cache_flags & (CACHE_FLAGS_SHUTDOWN_INPROG |
+				 CACHE_FLAGS_MOD_INPROG)))
+		error = -EBUSY;
+	else
+		dmc->prefetch = pf;
+	spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+
+	if (error) {
+		pr_err("prefetch: cache \"%s\" is busy", dmc->cache_name);
+		eio_prefetch_free(pf);
+		return error;
+	}
+
+	pr_info("prefetch: cache \"%s\", %u extents, rate %u KB/s",
+		dmc->cache_name, nr, pf->pf_rate_kb);
+	queue_work(system_long_wq, &dmc->prefetch_work);
+	return 0;
+}
@@ -63,7 +63,6 @@ eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
 		     size_t *length, loff_t *ppos)
 {
 	struct cache_c *dmc = (struct cache_c *)table->extra1;
-	long long cached_blocks;
 	unsigned long flags = 0;
 
 	/* fetch the new tunable value or post the existing value */
@@ -102,20 +101,13 @@ eio_zerostats_sysctl(struct ctl_table *table, int write, void __user *buffer,
 
 		if (dmc->sysctl_active.zerostats) {
 			/*
-			 * The number of cached blocks should not be zero'd since
-			 * these blocks are already on cache dev. Making this zero
-			 * may lead to -ve count during block invalidate, and also,
+			 * The number of cached blocks is not part of the
+			 * per-cpu stats and is not zero'd, since these blocks
+			 * are already on cache dev. Making this zero may lead
+			 * to -ve count during block invalidate, and also,
 			 * incorrectly indicating how much data is cached.
-			 *
-			 * TODO - should have used an spinlock, but existing spinlocks
-			 * are inadequate to fully protect this
 			 */
-
-			cached_blocks =
-				atomic64_read(&dmc->eio_stats.cached_blocks);
-			memset(&dmc->eio_stats, 0, sizeof(struct eio_stats));
-			atomic64_set(&dmc->eio_stats.cached_blocks,
-				     cached_blocks);
+			eio_stats_zero(dmc);
 			dmc->sysctl_active.zerostats = 0;
 		}
 	}
@@ -171,6 +163,204 @@ eio_mem_limit_pct_sysctl(struct ctl_table *table, int write, void __user *buffer
 	return 0;
 }
 
+/*
+ * eio_admit_threshold_sysctl
+ * - sets the read misses of a block after which it is filled in the cache
+ */
+static int
+eio_admit_threshold_sysctl(struct ctl_table *table, int write,
+			   void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.admit_threshold =
+			dmc->sysctl_active.admit_threshold;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.admit_threshold < 0) ||
+		    (dmc->sysctl_pending.admit_threshold >
+		     ADMIT_THRESHOLD_MAX)) {
+			pr_err("admit_threshold valid range is 0 to %d",
+			       ADMIT_THRESHOLD_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.admit_threshold ==
+		    dmc->sysctl_active.admit_threshold)
+			/* same value. Nothing more to do */
+			return 0;
+
+		if ((dmc->sysctl_pending.admit_threshold > 1) &&
+		    eio_admit_filter_alloc(dmc)) {
+			pr_err("admit_threshold: Failed to allocate the admission filter");
+			return -ENOMEM;
+		}
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.admit_threshold =
+			dmc->sysctl_pending.admit_threshold;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_fast_read_sysctl
+ * - enables the lookup of clean read hits without the set lock
+ */
+static int
+eio_fast_read_sysctl(struct ctl_table *table, int write, void __user *buffer,
+		     size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.fast_read = dmc->sysctl_active.fast_read;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.fast_read != 0) &&
+		    (dmc->sysctl_pending.fast_read != 1)) {
+			pr_err("0 or 1 are the only valid values for fast_read");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.fast_read ==
+		    dmc->sysctl_active.fast_read)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.fast_read = dmc->sysctl_pending.fast_read;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_heat_sample_sysctl
+ * - sets the cache lookups per lookup counted in the heat map
+ */
+static int
+eio_heat_sample_sysctl(struct ctl_table *table, int write, void __user *buffer,
+		       size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.heat_sample =
+			dmc->sysctl_active.heat_sample;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.heat_sample < 0) ||
+		    (dmc->sysctl_pending.heat_sample > HEAT_SAMPLE_MAX)) {
+			pr_err("heat_sample valid range is 0 to %d",
+			       HEAT_SAMPLE_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.heat_sample ==
+		    dmc->sysctl_active.heat_sample)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.heat_sample =
+			dmc->sysctl_pending.heat_sample;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_seq_io_threshold_kb_sysctl
+ * - sets the contiguous KB after which a sequential stream bypasses the cache
+ */
+static int
+eio_seq_io_threshold_kb_sysctl(struct ctl_table *table, int write,
+			       void __user *buffer, size_t *length,
+			       loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.seq_io_threshold_kb =
+			dmc->sysctl_active.seq_io_threshold_kb;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+		if ((dmc->sysctl_pending.seq_io_threshold_kb < 0) ||
+		    (dmc->sysctl_pending.seq_io_threshold_kb >
+		     SEQ_IO_THRESHOLD_KB_MAX)) {
+			pr_err("seq_io_threshold_kb valid range is 0 to %d",
+			       SEQ_IO_THRESHOLD_KB_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.seq_io_threshold_kb ==
+		    dmc->sysctl_active.seq_io_threshold_kb)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.seq_io_threshold_kb =
+			dmc->sysctl_pending.seq_io_threshold_kb;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
 /*
  * eio_clean_sysctl
  */
@@ -664,6 +854,245 @@ eio_cache_wronly_sysctl(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * eio_md_batch_delay_ms_sysctl
+ */
+static int
+eio_md_batch_delay_ms_sysctl(struct ctl_table *table, int write,
+			     void __user *buffer, size_t *length,
+			     loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.md_batch_delay_ms =
+			dmc->sysctl_active.md_batch_delay_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err
+				("md_batch_delay_ms is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.md_batch_delay_ms < 0) ||
+		    (dmc->sysctl_pending.md_batch_delay_ms >
+		     MD_BATCH_DELAY_MS_MAX)) {
+			pr_err("md_batch_delay_ms valid range is 0 to %d",
+			       MD_BATCH_DELAY_MS_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.md_batch_delay_ms ==
+		    dmc->sysctl_active.md_batch_delay_ms)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/*
+		 * Copy to active. Updates already batched are written
+		 * when the pending batch work expires.
+		 */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.md_batch_delay_ms =
+			dmc->sysctl_pending.md_batch_delay_ms;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_clean_target_lat_us_sysctl
+ */
+static int
+eio_clean_target_lat_us_sysctl(struct ctl_table *table, int write,
+			       void __user *buffer, size_t *length,
+			       loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.clean_target_lat_us =
+			dmc->sysctl_active.clean_target_lat_us;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err
+				("clean_target_lat_us is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.clean_target_lat_us < 0) ||
+		    (dmc->sysctl_pending.clean_target_lat_us >
+		     CLEAN_TARGET_LAT_US_MAX)) {
+			pr_err("clean_target_lat_us valid range is 0 to %d",
+			       CLEAN_TARGET_LAT_US_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.clean_target_lat_us ==
+		    dmc->sysctl_active.clean_target_lat_us)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/*
+		 * Copy to active. The latency average restarts, it is
+		 * not maintained while adaptive cleaning is off.
+		 */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		if (dmc->sysctl_active.clean_target_lat_us == 0)
+			atomic_set(&dmc->fg_lat_ewma, 0);
+		dmc->sysctl_active.clean_target_lat_us =
+			dmc->sysctl_pending.clean_target_lat_us;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_clean_sort_sets_sysctl
+ */
+static int
+eio_clean_sort_sets_sysctl(struct ctl_table *table, int write,
+			   void __user *buffer, size_t *length,
+			   loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.clean_sort_sets =
+			dmc->sysctl_active.clean_sort_sets;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err
+				("clean_sort_sets is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.clean_sort_sets < 0) ||
+		    (dmc->sysctl_pending.clean_sort_sets >
+		     CLEAN_SORT_SETS_MAX)) {
+			pr_err("clean_sort_sets valid range is 0 to %d",
+			       CLEAN_SORT_SETS_MAX);
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.clean_sort_sets ==
+		    dmc->sysctl_active.clean_sort_sets)
+			/* same value. Nothing more to do */
+			return 0;
+
+		/* Copy to active. The cleaner picks it up on its next pass */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.clean_sort_sets =
+			dmc->sysctl_pending.clean_sort_sets;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
+
+/*
+ * eio_ssd_trim_sysctl
+ * - trims on the ssd the cache blocks freed by discards
+ */
+static int
+eio_ssd_trim_sysctl(struct ctl_table *table, int write,
+		    void __user *buffer, size_t *length, loff_t *ppos)
+{
+	struct cache_c *dmc = (struct cache_c *)table->extra1;
+	unsigned long flags = 0;
+
+	/* fetch the new tunable value or post the existing value */
+
+	if (!write) {
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_pending.ssd_trim = dmc->sysctl_active.ssd_trim;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	proc_dointvec(table, write, buffer, length, ppos);
+
+	/* do write processing */
+
+	if (write) {
+		/* do sanity check */
+
+		if (dmc->mode != CACHE_MODE_WB) {
+			pr_err("ssd_trim is valid only for writeback cache");
+			return -EINVAL;
+		}
+
+		if ((dmc->sysctl_pending.ssd_trim != 0) &&
+		    (dmc->sysctl_pending.ssd_trim != 1)) {
+			pr_err("ssd_trim should be 0 or 1");
+			return -EINVAL;
+		}
+
+		if (dmc->sysctl_pending.ssd_trim ==
+		    dmc->sysctl_active.ssd_trim)
+			/* same value. Nothing more to do */
+			return 0;
+
+		if (dmc->sysctl_pending.ssd_trim) {
+			u_int32_t m;
+
+			for (m = 0; m < dmc->nr_ssds; m++) {
+				if (blk_queue_discard(bdev_get_queue(
+					    dmc->ssds[m].ssd_dev->bdev)))
+					continue;
+				pr_err("ssd_trim: cache device %s does not support discard",
+				       dmc->ssds[m].ssd_devname);
+				return -EINVAL;
+			}
+		}
+
+		/* Copy to active */
+		spin_lock_irqsave(&dmc->cache_spin_lock, flags);
+		dmc->sysctl_active.ssd_trim = dmc->sysctl_pending.ssd_trim;
+		spin_unlock_irqrestore(&dmc->cache_spin_lock, flags);
+	}
+
+	return 0;
+}
 
 /*
  * eio_autoclean_threshold_sysctl
@@ -998,6 +1427,8 @@ eio_control_sysctl(struct ctl_table *table, int write, void __user *buffer,
 #define PROC_STATS              "stats"
 #define PROC_ERRORS             "errors"
 #define PROC_IOSZ_HIST          "io_hist"
+#define PROC_LAT_HIST           "latency_hist"
+#define PROC_HEAT_MAP           "heat_map"
 #define PROC_CONFIG             "config"
 
 static int eio_invalidate_sysctl(struct ctl_table *table, int write,
@@ -1017,6 +1448,10 @@ static int eio_errors_show(struct seq_file *seq, void *v);
 static int eio_errors_open(struct inode *inode, struct file *file);
 static int eio_iosize_hist_show(struct seq_file *seq, void *v);
 static int eio_iosize_hist_open(struct inode *inode, struct file *file);
+static int eio_lat_hist_show(struct seq_file *seq, void *v);
+static int eio_lat_hist_open(struct inode *inode, struct file *file);
+static int eio_heat_map_show(struct seq_file *seq, void *v);
+static int eio_heat_map_open(struct inode *inode, struct file *file);
 static int eio_version_show(struct seq_file *seq, void *v);
 static int eio_version_open(struct inode *inode, struct file *file);
 static int eio_config_show(struct seq_file *seq, void *v);
@@ -1050,6 +1485,20 @@ static const struct file_operations eio_iosize_hist_operations = {
 	.release	= single_release,
 };
 
+static const struct file_operations eio_lat_hist_operations = {
+	.open		= eio_lat_hist_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static const struct file_operations eio_heat_map_operations = {
+	.open		= eio_heat_map_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
 static const struct file_operations eio_config_operations = {
 	.open		= eio_config_open,
 	.read		= seq_read,
@@ -1112,7 +1561,7 @@ static struct sysctl_table_dir {
 	},
 };
 
-#define NUM_COMMON_SYSCTLS      3
+#define NUM_COMMON_SYSCTLS      7
 
 static struct sysctl_table_common {
 	struct ctl_table_header *sysctl_header;
@@ -1146,6 +1595,38 @@ static struct sysctl_table_common {
 			.maxlen		= sizeof(int),
 			.mode		= 0644,
 			.proc_handler	= &eio_control_sysctl,
+		}, {            /* 4 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "seq_io_threshold_kb",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_seq_io_threshold_kb_sysctl,
+		}, {            /* 5 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "admit_threshold",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_admit_threshold_sysctl,
+		}, {            /* 6 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "fast_read",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_fast_read_sysctl,
+		}, {            /* 7 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "heat_sample",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_heat_sample_sysctl,
 		},
 	}, .dev	= {
 		{
@@ -1180,7 +1661,7 @@ static struct sysctl_table_common {
 	},
 };
 
-#define NUM_WRITEBACK_SYSCTLS   8
+#define NUM_WRITEBACK_SYSCTLS   12
 
 static struct sysctl_table_writeback {
 	struct ctl_table_header *sysctl_header;
@@ -1259,6 +1740,42 @@ static struct sysctl_table_writeback {
 			.mode		= 0644,
 			.proc_handler	= &eio_cache_wronly_sysctl,
 		}
+		, {		/* 9 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "md_batch_delay_ms",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_md_batch_delay_ms_sysctl,
+		}
+		, {		/* 10 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "clean_target_lat_us",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_clean_target_lat_us_sysctl,
+		}
+		, {		/* 11 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "clean_sort_sets",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_clean_sort_sets_sysctl,
+		}
+		, {		/* 12 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,33)
+			.ctl_name       = CTL_UNNUMBERED,
+#endif
+			.procname	= "ssd_trim",
+			.maxlen		= sizeof(int),
+			.mode		= 0644,
+			.proc_handler	= &eio_ssd_trim_sysctl,
+		}
 		,
 	}
 	, .dev = {
@@ -1413,6 +1930,14 @@ void eio_procfs_ctr(struct cache_c *dmc)
 	entry = proc_create_data(s, 0, NULL, &eio_iosize_hist_operations, dmc);
 	kfree(s);
 
+	s = eio_cons_procfs_cachename(dmc, PROC_LAT_HIST);
+	entry = proc_create_data(s, 0, NULL, &eio_lat_hist_operations, dmc);
+	kfree(s);
+
+	s = eio_cons_procfs_cachename(dmc, PROC_HEAT_MAP);
+	entry = proc_create_data(s, 0, NULL, &eio_heat_map_operations, dmc);
+	kfree(s);
+
 	s = eio_cons_procfs_cachename(dmc, PROC_CONFIG);
 	entry = proc_create_data(s, 0, NULL, &eio_config_operations, dmc);
 	kfree(s);
@@ -1443,6 +1968,14 @@ void eio_procfs_dtr(struct cache_c *dmc)
 	remove_proc_entry(s, NULL);
 	kfree(s);
 
+	s = eio_cons_procfs_cachename(dmc, PROC_LAT_HIST);
+	remove_proc_entry(s, NULL);
+	kfree(s);
+
+	s = eio_cons_procfs_cachename(dmc, PROC_HEAT_MAP);
+	remove_proc_entry(s, NULL);
+	kfree(s);
+
 	s = eio_cons_procfs_cachename(dmc, PROC_CONFIG);
 	remove_proc_entry(s, NULL);
 	kfree(s);
@@ -1553,6 +2086,14 @@ static void *eio_find_sysctl_data(struct cache_c *dmc, struct ctl_table *vars)
 		return (void *)&dmc->sysctl_pending.dirty_set_low_threshold;
 	if (strcmp(vars->procname, "cache_wronly") == 0)
 		return (void *)&dmc->sysctl_pending.cache_wronly;
+	if (strcmp(vars->procname, "md_batch_delay_ms") == 0)
+		return (void *)&dmc->sysctl_pending.md_batch_delay_ms;
+	if (strcmp(vars->procname, "clean_target_lat_us") == 0)
+		return (void *)&dmc->sysctl_pending.clean_target_lat_us;
+	if (strcmp(vars->procname, "clean_sort_sets") == 0)
+		return (void *)&dmc->sysctl_pending.clean_sort_sets;
+	if (strcmp(vars->procname, "ssd_trim") == 0)
+		return (void *)&dmc->sysctl_pending.ssd_trim;
 	if (strcmp(vars->procname, "autoclean_threshold") == 0)
 		return (void *)&dmc->sysctl_pending.autoclean_threshold;
 	if (strcmp(vars->procname, "zero_stats") == 0)
@@ -1561,6 +2102,14 @@ static void *eio_find_sysctl_data(struct cache_c *dmc, struct ctl_table *vars)
 		return (void *)&dmc->sysctl_pending.mem_limit_pct;
 	if (strcmp(vars->procname, "control") == 0)
 		return (void *)&dmc->sysctl_pending.control;
+	if (strcmp(vars->procname, "seq_io_threshold_kb") == 0)
+		return (void *)&dmc->sysctl_pending.seq_io_threshold_kb;
+	if (strcmp(vars->procname, "admit_threshold") == 0)
+		return (void *)&dmc->sysctl_pending.admit_threshold;
+	if (strcmp(vars->procname, "fast_read") == 0)
+		return (void *)&dmc->sysctl_pending.fast_read;
+	if (strcmp(vars->procname, "heat_sample") == 0)
+		return (void *)&dmc->sysctl_pending.heat_sample;
 	if (strcmp(vars->procname, "invalidate") == 0)
 		return (void *)&dmc->sysctl_pending.invalidate;
 
@@ -1824,69 +2373,87 @@ static void eio_sysctl_unregister_invalidate(struct cache_c *dmc)
 static int eio_stats_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
-	struct eio_stats *stats = &dmc->eio_stats;
+	struct eio_stats stats_sum;
+	struct eio_stats *stats = &stats_sum;
 	unsigned read_hit_pct, write_hit_pct, dirty_write_hit_pct;
 
-	if (atomic64_read(&stats->reads) > 0)
-		read_hit_pct = EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->read_hits),
-				atomic64_read(&stats->reads));
+	eio_stats_sum(dmc, stats);
+
+	if (stats->reads > 0)
+		read_hit_pct = EIO_CALCULATE_PERCENTAGE(stats->read_hits,
+							stats->reads);
 	else
 		read_hit_pct = 0;
 
-	if (atomic64_read(&stats->writes) > 0) {
-		write_hit_pct =
-		EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->write_hits),
-				atomic64_read(&stats->writes));
+	if (stats->writes > 0) {
+		write_hit_pct = EIO_CALCULATE_PERCENTAGE(stats->write_hits,
+							 stats->writes);
 		dirty_write_hit_pct =
-			EIO_CALCULATE_PERCENTAGE(
-				atomic64_read(&stats->dirty_write_hits),
-				atomic64_read(&stats->writes));
+			EIO_CALCULATE_PERCENTAGE(stats->dirty_write_hits,
+						 stats->writes);
 	} else {
 		write_hit_pct = 0;
 		dirty_write_hit_pct = 0;
 	}
 
 	seq_printf(seq, "%-26s %12lld\n", "reads",
-		   (int64_t)atomic64_read(&stats->reads));
+		   (int64_t)stats->reads);
 	seq_printf(seq, "%-26s %12lld\n", "writes",
-		   (int64_t)atomic64_read(&stats->writes));
+		   (int64_t)stats->writes);
 
 	seq_printf(seq, "%-26s %12lld\n", "read_hits",
-		   (int64_t)atomic64_read(&stats->read_hits));
+		   (int64_t)stats->read_hits);
 	seq_printf(seq, "%-26s %12u\n", "read_hit_pct", read_hit_pct);
 
 	seq_printf(seq, "%-26s %12lld\n", "write_hits",
-		   (int64_t)atomic64_read(&stats->write_hits));
+		   (int64_t)stats->write_hits);
 	seq_printf(seq, "%-26s %12u\n", "write_hit_pct", write_hit_pct);
 
 	seq_printf(seq, "%-26s %12lld\n", "dirty_write_hits",
-		   (int64_t)atomic64_read(&stats->dirty_write_hits));
+		   (int64_t)stats->dirty_write_hits);
 	seq_printf(seq, "%-26s %12u\n", "dirty_write_hit_pct",
 		   dirty_write_hit_pct);
 
-	if ((int64_t)(atomic64_read(&stats->cached_blocks)) < 0)
-		atomic64_set(&stats->cached_blocks, 0);
+	if ((int64_t)(atomic64_read(&dmc->cached_blocks)) < 0)
+		atomic64_set(&dmc->cached_blocks, 0);
 	seq_printf(seq, "%-26s %12lld\n", "cached_blocks",
-		   (int64_t)atomic64_read(&stats->cached_blocks));
+		   (int64_t)atomic64_read(&dmc->cached_blocks));
 
 	seq_printf(seq, "%-26s %12lld\n", "rd_replace",
-		   (int64_t)atomic64_read(&stats->rd_replace));
+		   (int64_t)stats->rd_replace);
 	seq_printf(seq, "%-26s %12lld\n", "wr_replace",
-		   (int64_t)atomic64_read(&stats->wr_replace));
+		   (int64_t)stats->wr_replace);
 
 	seq_printf(seq, "%-26s %12lld\n", "noroom",
-		   (int64_t)atomic64_read(&stats->noroom));
+		   (int64_t)stats->noroom);
 
 	seq_printf(seq, "%-26s %12lld\n", "cleanings",
-		   (int64_t)atomic64_read(&stats->cleanings));
+		   (int64_t)stats->cleanings);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_dirty",
-		   (int64_t)atomic64_read(&stats->md_write_dirty));
+		   (int64_t)stats->md_write_dirty);
 	seq_printf(seq, "%-26s %12lld\n", "md_write_clean",
-		   (int64_t)atomic64_read(&stats->md_write_clean));
+		   (int64_t)stats->md_write_clean);
 	seq_printf(seq, "%-26s %12lld\n", "md_ssd_writes",
-		   (int64_t)atomic64_read(&stats->md_ssd_writes));
+		   (int64_t)stats->md_ssd_writes);
+	seq_printf(seq, "%-26s %12lld\n", "md_batch_writes",
+		   (int64_t)stats->md_batch_writes);
+	seq_printf(seq, "%-26s %12lld\n", "md_batch_sets",
+		   (int64_t)stats->md_batch_sets);
+	if (dmc->mode == CACHE_MODE_WB) {
+		seq_printf(seq, "%-26s %12lld\n", "clean_backoffs",
+			   (int64_t)stats->clean_backoffs);
+		seq_printf(seq, "%-26s %12lld\n", "clean_sorted_writes",
+			   (int64_t)stats->clean_sorted_writes);
+		seq_printf(seq, "%-26s %12lld\n", "clean_sorted_blocks",
+			   (int64_t)stats->clean_sorted_blocks);
+		seq_printf(seq, "%-26s %12d\n", "clean_depth",
+			   dmc->clean_depth);
+		seq_printf(seq, "%-26s %12d\n", "clean_batch",
+			   dmc->clean_batch);
+		seq_printf(seq, "%-26s %12d\n", "fg_lat_ewma_us",
+			   atomic_read(&dmc->fg_lat_ewma) >>
+			   EIO_LAT_EWMA_SHIFT);
+	}
 	seq_printf(seq, "%-26s %12d\n", "do_clean",
 		   dmc->sysctl_active.do_clean);
 	seq_printf(seq, "%-26s %12lld\n", "nr_blocks", dmc->size);
@@ -1897,52 +2464,98 @@ static int eio_stats_show(struct seq_file *seq, void *v)
 		   (uint32_t)atomic_read(&dmc->clean_index));
 
 	seq_printf(seq, "%-26s %12lld\n", "uncached_reads",
-		   (int64_t)atomic64_read(&stats->uncached_reads));
+		   (int64_t)stats->uncached_reads);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_writes",
-		   (int64_t)atomic64_read(&stats->uncached_writes));
+		   (int64_t)stats->uncached_writes);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_size",
-		   (int64_t)atomic64_read(&stats->uncached_map_size));
+		   (int64_t)stats->uncached_map_size);
 	seq_printf(seq, "%-26s %12lld\n", "uncached_map_uncacheable",
-		   (int64_t)atomic64_read(&stats->uncached_map_uncacheable));
+		   (int64_t)stats->uncached_map_uncacheable);
 
 	seq_printf(seq, "%-26s %12lld\n", "disk_reads",
-		   (int64_t)atomic64_read(&stats->disk_reads));
+		   (int64_t)stats->disk_reads);
 	seq_printf(seq, "%-26s %12lld\n", "disk_writes",
-		   (int64_t)atomic64_read(&stats->disk_writes));
+		   (int64_t)stats->disk_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_reads",
-		   (int64_t)atomic64_read(&stats->ssd_reads));
+		   (int64_t)stats->ssd_reads);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_writes",
-		   (int64_t)atomic64_read(&stats->ssd_writes));
+		   (int64_t)stats->ssd_writes);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfills",
-		   (int64_t)atomic64_read(&stats->ssd_readfills));
+		   (int64_t)stats->ssd_readfills);
 	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_unplugs",
-		   (int64_t)atomic64_read(&stats->ssd_readfill_unplugs));
+		   (int64_t)stats->ssd_readfill_unplugs);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_merges",
+		   (int64_t)stats->ssd_readfill_merges);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_batches",
+		   (int64_t)stats->ssd_readfill_batches);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_readfill_batch_avg",
+		   stats->ssd_readfill_batches ?
+		   (int64_t)div64_u64(stats->ssd_readfill_batch_fills,
+				      stats->ssd_readfill_batches) : 0LL);
+	seq_printf(seq, "%-26s %12lld\n", "kb_prefetched",
+		   (int64_t)stats->prefetch_reads / 2);
+	seq_printf(seq, "%-26s %12lld\n", "prefetch_skipped",
+		   (int64_t)stats->prefetch_skipped);
 
 	seq_printf(seq, "%-26s %12lld\n", "readdisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   (int64_t)stats->readdisk);
 	seq_printf(seq, "%-26s %12lld\n", "writedisk",
-		   (int64_t)atomic64_read(&stats->readdisk));
+		   (int64_t)stats->readdisk);
 	seq_printf(seq, "%-26s %12lld\n", "readcache",
-		   (int64_t)atomic64_read(&stats->readcache));
+		   (int64_t)stats->readcache);
 	seq_printf(seq, "%-26s %12lld\n", "readfill",
-		   (int64_t)atomic64_read(&stats->readfill));
+		   (int64_t)stats->readfill);
 	seq_printf(seq, "%-26s %12lld\n", "writecache",
-		   (int64_t)atomic64_read(&stats->writecache));
+		   (int64_t)stats->writecache);
 
 	seq_printf(seq, "%-26s %12lld\n", "readcount",
-		   (int64_t)atomic64_read(&stats->readcount));
+		   (int64_t)stats->readcount);
 	seq_printf(seq, "%-26s %12lld\n", "writecount",
-		   (int64_t)atomic64_read(&stats->writecount));
+		   (int64_t)stats->writecount);
 	seq_printf(seq, "%-26s %12lld\n", "kb_reads",
-		   (int64_t)atomic64_read(&stats->reads) / 2);
+		   (int64_t)stats->reads / 2);
 	seq_printf(seq, "%-26s %12lld\n", "kb_writes",
-		   (int64_t)atomic64_read(&stats->writes) / 2);
+		   (int64_t)stats->writes / 2);
 	seq_printf(seq, "%-26s %12lld\n", "rdtime_ms",
-		   (int64_t)atomic64_read(&stats->rdtime_ms));
+		   (int64_t)stats->rdtime_ms);
 	seq_printf(seq, "%-26s %12lld\n", "wrtime_ms",
-		   (int64_t)atomic64_read(&stats->wrtime_ms));
+		   (int64_t)stats->wrtime_ms);
 	seq_printf(seq, "%-26s %12lld\n", "unaligned_ios",
-		   (int64_t)atomic64_read(&stats->unaligned_ios));
+		   (int64_t)stats->unaligned_ios);
+	seq_printf(seq, "%-26s %12lld\n", "seq_bypass_reads",
+		   (int64_t)stats->seq_bypass_reads);
+	seq_printf(seq, "%-26s %12lld\n", "seq_bypass_writes",
+		   (int64_t)stats->seq_bypass_writes);
+	seq_printf(seq, "%-26s %12lld\n", "md_loading_uncached",
+		   (int64_t)stats->md_loading_uncached);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_offline_uncached",
+		   (int64_t)stats->ssd_offline_uncached);
+	seq_printf(seq, "%-26s %12lld\n", "read_fast_hits",
+		   (int64_t)stats->read_fast_hits);
+	seq_printf(seq, "%-26s %12lld\n", "read_fast_retries",
+		   (int64_t)stats->read_fast_retries);
+	seq_printf(seq, "%-26s %12lld\n", "sub_block_writes",
+		   (int64_t)stats->sub_block_writes);
+	seq_printf(seq, "%-26s %12lld\n", "sub_block_read_hits",
+		   (int64_t)stats->sub_block_read_hits);
+	seq_printf(seq, "%-26s %12lld\n", "uh_write_misses",
+		   (int64_t)stats->uh_write_misses);
+	seq_printf(seq, "%-26s %12lld\n", "discards",
+		   (int64_t)stats->discards);
+	seq_printf(seq, "%-26s %12lld\n", "flushes",
+		   (int64_t)stats->flushes);
+	seq_printf(seq, "%-26s %12lld\n", "flush_rounds",
+		   (int64_t)stats->flush_rounds);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_flushes_skipped",
+		   (int64_t)stats->ssd_flushes_skipped);
+	seq_printf(seq, "%-26s %12lld\n", "discard_dirty_inval",
+		   (int64_t)stats->discard_dirty_inval);
+	seq_printf(seq, "%-26s %12lld\n", "ssd_trims",
+		   (int64_t)stats->ssd_trims);
+	seq_printf(seq, "%-26s %12lld\n", "admit_fills",
+		   (int64_t)stats->admit_fills);
+	seq_printf(seq, "%-26s %12lld\n", "admit_rejects",
+		   (int64_t)stats->admit_rejects);
 	return 0;
 }
 
@@ -1993,21 +2606,23 @@ static int eio_errors_open(struct inode *inode, struct file *file)
 static int eio_iosize_hist_show(struct seq_file *seq, void *v)
 {
 	int i;
+	u_int64_t count;
 	struct cache_c *dmc = seq->private;
 
 	for (i = 1; i <= SIZE_HIST - 1; i++) {
-		if (atomic64_read(&dmc->size_hist[i]) == 0)
+		count = eio_size_hist_sum(dmc, i);
+		if (count == 0)
 			continue;
 
 		if (i == 1)
 			seq_printf(seq, "%u   %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   (int64_t)count);
 		else if (i < 20)
 			seq_printf(seq, "%u  %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   (int64_t)count);
 		else
 			seq_printf(seq, "%u %12lld\n", i * 512,
-				   (int64_t)atomic64_read(&dmc->size_hist[i]));
+				   (int64_t)count);
 	}
 
 	return 0;
@@ -2022,6 +2637,153 @@ static int eio_iosize_hist_open(struct inode *inode, struct file *file)
 	return single_open(file, &eio_iosize_hist_show, KPDE_DATA(inode));
 }
 
+static const char *eio_lat_class_names[EIO_LAT_NR_CLASSES] = {
+	"read_hit",
+	"read_miss",
+	"readfill",
+	"uncached",
+	"write",
+	"dirty_write",
+};
+
+/*
+ * Returns the upper bound in usecs of the bucket holding the
+ * permille'th latency of the class, 0 if there were no I/Os.
+ */
+static u_int64_t
+eio_lat_hist_percentile(struct eio_lat_hist *hist, int class, int permille)
+{
+	u_int64_t total = 0;
+	u_int64_t count = 0;
+	int i;
+
+	for (i = 0; i < EIO_LAT_HIST_BUCKETS; i++)
+		total += hist->lh_count[class][i];
+	if (total == 0)
+		return 0;
+
+	for (i = 0; i < EIO_LAT_HIST_BUCKETS - 1; i++) {
+		count += hist->lh_count[class][i];
+		if (count * 1000 >= total * permille)
+			break;
+	}
+
+	return ((u_int64_t)1) << i;
+}
+
+/*
+ * eio_lat_hist_show
+ */
+static int eio_lat_hist_show(struct seq_file *seq, void *v)
+{
+	struct cache_c *dmc = seq->private;
+	struct eio_lat_hist *hist;
+	u_int64_t sum;
+	int class;
+	int i;
+
+	hist = kmalloc(sizeof(*hist), GFP_KERNEL);
+	if (hist == NULL)
+		return -ENOMEM;
+	eio_lat_hist_sum(dmc, hist);
+
+	seq_printf(seq, "%-12s", "usecs");
+	for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+		seq_printf(seq, " %12s", eio_lat_class_names[class]);
+	seq_printf(seq, "\n");
+
+	for (i = 0; i < EIO_LAT_HIST_BUCKETS; i++) {
+		sum = 0;
+		for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+			sum += hist->lh_count[class][i];
+		if (sum == 0)
+			continue;
+
+		if (i == EIO_LAT_HIST_BUCKETS - 1)
+			seq_printf(seq, ">=%-10llu",
+				   (unsigned long long)1 << (i - 1));
+		else
+			seq_printf(seq, "<%-11llu", (unsigned long long)1 << i);
+		for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+			seq_printf(seq, " %12lld",
+				   (int64_t)hist->lh_count[class][i]);
+		seq_printf(seq, "\n");
+	}
+
+	seq_printf(seq, "%-12s", "p50");
+	for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+		seq_printf(seq, " %12llu", (unsigned long long)
+			   eio_lat_hist_percentile(hist, class, 500));
+	seq_printf(seq, "\n%-12s", "p99");
+	for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+		seq_printf(seq, " %12llu", (unsigned long long)
+			   eio_lat_hist_percentile(hist, class, 990));
+	seq_printf(seq, "\n%-12s", "p999");
+	for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+		seq_printf(seq, " %12llu", (unsigned long long)
+			   eio_lat_hist_percentile(hist, class, 999));
+	seq_printf(seq, "\n");
+
+	kfree(hist);
+	return 0;
+}
+
+/*
+ * eio_lat_hist_open
+ */
+static int eio_lat_hist_open(struct inode *inode, struct file *file)
+{
+
+	return single_open(file, &eio_lat_hist_show, KPDE_DATA(inode));
+}
+
+/*
+ * eio_heat_map_show
+ *
+ * CSV, one line per region of the source device. The counts are of the
+ * sampled lookups only.
+ */
+static int eio_heat_map_show(struct seq_file *seq, void *v)
+{
+	struct cache_c *dmc = seq->private;
+	struct eio_heat_bucket *hb;
+	sector_t nr_regions;
+	sector_t i;
+
+	nr_regions = ((dmc->disk_size - 1) >> dmc->heat_shift) + 1;
+	if (nr_regions > EIO_HEAT_BUCKETS)
+		nr_regions = EIO_HEAT_BUCKETS;
+
+	seq_printf(seq, "# sample %d region_sectors %llu\n",
+		   dmc->sysctl_active.heat_sample,
+		   (unsigned long long)1 << dmc->heat_shift);
+	seq_printf(seq, "region,start_sector,reads,writes,hits,evictions,"
+		   "noroom,dirty_writes\n");
+	for (i = 0; i < nr_regions; i++) {
+		hb = &dmc->heat_map[i];
+		seq_printf(seq, "%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+			   (unsigned long long)i,
+			   (unsigned long long)i << dmc->heat_shift,
+			   (unsigned long long)atomic64_read(&hb->hb_reads),
+			   (unsigned long long)atomic64_read(&hb->hb_writes),
+			   (unsigned long long)atomic64_read(&hb->hb_hits),
+			   (unsigned long long)
+			   atomic64_read(&hb->hb_evictions),
+			   (unsigned long long)atomic64_read(&hb->hb_noroom),
+			   (unsigned long long)atomic64_read(&hb->hb_dirty));
+	}
+
+	return 0;
+}
+
+/*
+ * eio_heat_map_open
+ */
+static int eio_heat_map_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, &eio_heat_map_show, KPDE_DATA(inode));
+}
+
 /*
  * eio_version_show
  */
@@ -2050,9 +2812,15 @@ static int eio_version_open(struct inode *inode, struct file *file)
 static int eio_config_show(struct seq_file *seq, void *v)
 {
 	struct cache_c *dmc = seq->private;
+	u_int32_t m;
 
 	seq_printf(seq, "src_name   %s\n", dmc->disk_devname);
-	seq_printf(seq, "ssd_name   %s\n", dmc->cache_devname);
+	seq_printf(seq, "ssd_name   %s\n", dmc->ssds[0].ssd_devname);
+	for (m = 1; m < dmc->nr_ssds; m++)
+		seq_printf(seq, "ssd_name%u  %s\n", m, dmc->ssds[m].ssd_devname);
+	for (m = 0; m < dmc->nr_ssds; m++)
+		if (dmc->ssds[m].ssd_offline)
+			seq_printf(seq, "ssd%u       offline\n", m);
 	seq_printf(seq, "src_size   %lu\n", (long unsigned int)dmc->disk_size);
 	seq_printf(seq, "ssd_size   %lu\n", (long unsigned int)dmc->size);
 
@@ -2063,7 +2831,9 @@ static int eio_config_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "num_sets   %10u\n", dmc->num_sets);
 	seq_printf(seq, "num_blocks %10lu\n", (long unsigned int)dmc->size);
 	seq_printf(seq, "metadata        %s\n",
-		   CACHE_MD8_IS_SET(dmc) ? "large" : "small");
+		   CACHE_MD8_IS_SET(dmc) ? "large" :
+		   (CACHE_MD6_IS_SET(dmc) ? "medium" : "small"));
+	seq_printf(seq, "sub_block  %10u\n", dmc->sub_valid ? 1 : 0);
 	seq_printf(seq, "state        %s\n",
 		   CACHE_DEGRADED_IS_SET(dmc) ? "degraded"
 		   : (CACHE_FAILED_IS_SET(dmc) ? "failed" : "normal"));
@@ -154,6 +154,8 @@ struct eio_policy *eio_rand_instance_init(void)
 	new_instance->sp_repl_blk_init = eio_rand_cache_blk_init;
 	new_instance->sp_find_reclaim_dbn = eio_rand_find_reclaim_dbn;
 	new_instance->sp_clean_set = eio_rand_clean_set;
+	new_instance->sp_rank_get = NULL;
+	new_instance->sp_rank_set = NULL;
 	new_instance->sp_dmc = NULL;
 
 	try_module_get(THIS_MODULE);
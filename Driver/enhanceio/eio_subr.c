@@ -30,9 +30,7 @@
 #include "eio.h"
 #include "eio_ttc.h"
 
-static DEFINE_SPINLOCK(_job_lock);
 static LIST_HEAD(_io_jobs);
-static LIST_HEAD(_disk_read_jobs);
 
 int eio_io_empty(void)
 {
@@ -59,42 +57,50 @@ void eio_free_cache_job(struct kcached_job *job)
 
 /*
  * Functions to push and pop a job onto the head of a given job list.
+ * The job lists are per cache and protected by the cache's job_lock.
  */
-static struct kcached_job *eio_pop(struct list_head *jobs)
+static struct kcached_job *eio_pop(struct cache_c *dmc, struct list_head *jobs)
 {
 	struct kcached_job *job = NULL;
 	unsigned long flags = 0;
 
-	spin_lock_irqsave(&_job_lock, flags);
+	spin_lock_irqsave(&dmc->job_lock, flags);
 	if (!list_empty(jobs)) {
 		job = list_entry(jobs->next, struct kcached_job, list);
 		list_del(&job->list);
 	}
-	spin_unlock_irqrestore(&_job_lock, flags);
+	spin_unlock_irqrestore(&dmc->job_lock, flags);
 	return job;
 }
 
-static void eio_push(struct list_head *jobs, struct kcached_job *job)
+static void eio_push(struct cache_c *dmc, struct list_head *jobs,
+		     struct kcached_job *job)
 {
 	unsigned long flags = 0;
 
-	spin_lock_irqsave(&_job_lock, flags);
+	spin_lock_irqsave(&dmc->job_lock, flags);
 	list_add_tail(&job->list, jobs);
-	spin_unlock_irqrestore(&_job_lock, flags);
+	spin_unlock_irqrestore(&dmc->job_lock, flags);
 }
 
+/*
+ * Queue the job for a disk read after an ssd read failure.
+ * The caller should schedule dmc->disk_read_work.
+ */
 void eio_push_ssdread_failures(struct kcached_job *job)
 {
+	struct cache_c *dmc = job->dmc;
 
-	eio_push(&_disk_read_jobs, job);
+	eio_push(dmc, &dmc->disk_read_jobs, job);
 }
 
 static void
-eio_process_jobs(struct list_head *jobs, void (*fn) (struct kcached_job *))
+eio_process_jobs(struct cache_c *dmc, struct list_head *jobs,
+		 void (*fn) (struct kcached_job *))
 {
 	struct kcached_job *job;
 
-	while ((job = eio_pop(jobs)) != NULL)
+	while ((job = eio_pop(dmc, jobs)) != NULL)
 		(void)fn(job);
 }
 
@@ -117,7 +123,8 @@ static void eio_process_ssd_rm_list(void)
 		    list_entry(ssd_rm_list.next, struct ssd_rm_list, list);
 		if (ssd_list_ptr->action == BUS_NOTIFY_DEL_DEVICE)
 			eio_suspend_caching(ssd_list_ptr->dmc,
-					    ssd_list_ptr->note);
+					    ssd_list_ptr->note,
+					    ssd_list_ptr->ssd);
 		else
 			pr_err("eio_process_ssd_rm_list:"
 			       "Unknown status (0x%x)\n", ssd_list_ptr->action);
@@ -137,7 +144,17 @@ void eio_do_work(struct work_struct *unused)
 
 	if (unlikely(ssd_rm_list_not_empty))
 		eio_process_ssd_rm_list();
-	eio_process_jobs(&_disk_read_jobs, eio_ssderror_diskread);
+}
+
+/*
+ * Per cache work item, reissues the ssd read failures on disk.
+ */
+void eio_do_disk_read_jobs(struct work_struct *work)
+{
+	struct cache_c *dmc;
+
+	dmc = container_of(work, struct cache_c, disk_read_work);
+	eio_process_jobs(dmc, &dmc->disk_read_jobs, eio_ssderror_diskread);
 }
 
 struct kcached_job *eio_new_job(struct cache_c *dmc, struct eio_bio *bio,
@@ -161,10 +178,11 @@ struct kcached_job *eio_new_job(struct cache_c *dmc, struct eio_bio *bio,
 	job->error = 0;
 	job->ebio = bio;
 	if (index != -1) {
-		job->job_io_regions.cache.bdev = dmc->cache_dev->bdev;
+		job->job_io_regions.cache.bdev =
+		    eio_index_ssd(dmc, index)->ssd_dev->bdev;
 		if (bio) {
 			job->job_io_regions.cache.sector =
-			    (index << dmc->block_shift) + dmc->md_sectors +
+			    eio_ssd_data_sector(dmc, index) +
 			    (bio->eb_sector -
 			     EIO_ROUND_SECTOR(dmc, bio->eb_sector));
 			EIO_ASSERT(eio_to_sector(bio->eb_size) <=
@@ -173,7 +191,7 @@ struct kcached_job *eio_new_job(struct cache_c *dmc, struct eio_bio *bio,
 			    eio_to_sector(bio->eb_size);
 		} else {
 			job->job_io_regions.cache.sector =
-			    (index << dmc->block_shift) + dmc->md_sectors;
+			    eio_ssd_data_sector(dmc, index);
 			job->job_io_regions.cache.count = dmc->block_size;
 		}
 	}
@@ -250,12 +268,15 @@ void eio_unplug_cache_device(struct cache_c *dmc)
 {
 	struct request_queue *q;
 	struct block_device *bdev;
+	u_int32_t m;
 
 	if (unlikely(CACHE_FAILED_IS_SET(dmc)) ||
 	    unlikely(CACHE_DEGRADED_IS_SET(dmc)))
 		return;
-	bdev = dmc->cache_dev->bdev;
-	q = bdev_get_queue(bdev);
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		bdev = dmc->ssds[m].ssd_dev->bdev;
+		q = bdev_get_queue(bdev);
+	}
 }
 
 void eio_unplug_disk_device(struct cache_c *dmc)
@@ -273,12 +294,15 @@ void eio_plug_cache_device(struct cache_c *dmc)
 {
 	struct block_device *bdev;
 	struct request_queue *q;
+	u_int32_t m;
 
 	if (unlikely(CACHE_FAILED_IS_SET(dmc)) ||
 	    unlikely(CACHE_DEGRADED_IS_SET(dmc)))
 		return;
-	bdev = dmc->cache_dev->bdev;
-	q = bdev_get_queue(bdev);
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		bdev = dmc->ssds[m].ssd_dev->bdev;
+		q = bdev_get_queue(bdev);
+	}
 }
 
 void eio_plug_disk_device(struct cache_c *dmc)
@@ -298,7 +322,8 @@ void eio_plug_disk_device(struct cache_c *dmc)
  * by the kernel proper. We will get an IO error if an IO is done on a
  * device that does not exist.
  */
-void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
+void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note,
+			 struct eio_ssd *ssd)
 {
 
 	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
@@ -317,11 +342,15 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 			dmc->cache_flags &= ~CACHE_FLAGS_DEGRADED;
 		dmc->cache_flags |= CACHE_FLAGS_FAILED;
 		dmc->eio_errors.no_source_dev = 1;
-		atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+		atomic64_set(&dmc->cached_blocks, 0);
 		pr_info("suspend_caching: Source Device Removed."
 			"Cache \"%s\" is in Failed mode.\n", dmc->cache_name);
 		break;
 	case NOTIFY_SSD_REMOVED:
+		if (ssd && !ssd->ssd_offline) {
+			ssd->ssd_offline = 1;
+			dmc->nr_ssds_offline++;
+		}
 		if (dmc->mode == CACHE_MODE_WB) {
 			/*
 			 * For writeback
@@ -333,6 +362,14 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 			dmc->cache_flags |= CACHE_FLAGS_FAILED;
 			pr_info("suspend caching: SSD Device Removed.\
 				 Cache \"%s\" is in Failed mode.\n", dmc->cache_name);
+		} else if (dmc->nr_ssds_offline < dmc->nr_ssds) {
+			/*
+			 * The other SSDs of a striped cache keep caching,
+			 * eio_map() sends the I/Os to the sets of this one
+			 * to the source device.
+			 */
+			pr_info("suspend caching: SSD %s of cache \"%s\" removed, its sets are not cached.\n",
+				ssd->ssd_devname, dmc->cache_name);
 		} else {
 			if (CACHE_DEGRADED_IS_SET(dmc) ||
 			    CACHE_SSD_ADD_INPROG_IS_SET(dmc)) {
@@ -345,7 +382,9 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 				return;
 			}
 			dmc->cache_flags |= CACHE_FLAGS_DEGRADED;
-			atomic64_set(&dmc->eio_stats.cached_blocks, 0);
+			/* The blocks of a striped cache are dropped per SSD */
+			if (dmc->nr_ssds == 1)
+				atomic64_set(&dmc->cached_blocks, 0);
 			pr_info("suspend caching: Cache \"%s\" \
 				is in Degraded mode.\n", dmc->cache_name);
 		}
@@ -360,10 +399,22 @@ void eio_suspend_caching(struct cache_c *dmc, enum dev_notifier note)
 			       dmc->cache_spin_lock_flags);
 }
 
+/* Release the cache devices and their io callback queues */
 void eio_put_cache_device(struct cache_c *dmc)
 {
-
-	eio_ttc_put_device(&dmc->cache_dev);
+	struct eio_ssd *ssd;
+	u_int32_t m;
+
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd = &dmc->ssds[m];
+		if (ssd->ssd_callback_q) {
+			flush_workqueue(ssd->ssd_callback_q);
+			destroy_workqueue(ssd->ssd_callback_q);
+			ssd->ssd_callback_q = NULL;
+		}
+		if (ssd->ssd_dev)
+			eio_ttc_put_device(&ssd->ssd_dev);
+	}
 }
 
 void eio_resume_caching(struct cache_c *dmc, char *dev)
@@ -403,7 +454,8 @@ void eio_resume_caching(struct cache_c *dmc, char *dev)
 		}
 	} else {
 		/* sanity check for WT or RO cache. */
-		if (CACHE_FAILED_IS_SET(dmc) || !CACHE_DEGRADED_IS_SET(dmc) ||
+		if (CACHE_FAILED_IS_SET(dmc) ||
+		    (!CACHE_DEGRADED_IS_SET(dmc) && !dmc->nr_ssds_offline) ||
 		    CACHE_SSD_ADD_INPROG_IS_SET(dmc)) {
 			pr_err("resume_caching: Cache \"%s\" "
 			       "is either in failed mode or "
@@ -430,15 +482,83 @@ void eio_resume_caching(struct cache_c *dmc, char *dev)
 		return;
 	}
 
+	/* A write-back cache waits for all its SSDs */
 	spin_lock_irqsave(&dmc->cache_spin_lock, dmc->cache_spin_lock_flags);
-	dmc->eio_errors.no_cache_dev = 0;
+	if (dmc->nr_ssds_offline == 0)
+		dmc->eio_errors.no_cache_dev = 0;
 	if (dmc->mode != CACHE_MODE_WB)
 		dmc->cache_flags &= ~CACHE_FLAGS_DEGRADED;
-	else
+	else if (dmc->nr_ssds_offline == 0)
 		dmc->cache_flags &= ~CACHE_FLAGS_FAILED;
 	dmc->cache_flags &= ~CACHE_FLAGS_SSD_ADD_INPROG;
 	spin_unlock_irqrestore(&dmc->cache_spin_lock,
 			       dmc->cache_spin_lock_flags);
-	pr_info(" resume_caching:cache %s is restored to ACTIVE mode.\n",
-		dmc->cache_name);
+	if (dmc->nr_ssds_offline)
+		pr_info(" resume_caching:cache %s has %u of %u SSDs offline.\n",
+			dmc->cache_name, dmc->nr_ssds_offline, dmc->nr_ssds);
+	else
+		pr_info(" resume_caching:cache %s is restored to ACTIVE mode.\n",
+			dmc->cache_name);
+}
+
+/*
+ * Sum up the per-cpu stats of the cache into "stats".
+ * The counters are read without synchronisation, the result
+ * is only as accurate as a snapshot of a running cache can be.
+ */
+void eio_stats_sum(struct cache_c *dmc, struct eio_stats *stats)
+{
+	u_int64_t *src;
+	u_int64_t *dst = (u_int64_t *)stats;
+	unsigned int i;
+	int cpu;
+
+	memset(stats, 0, sizeof(*stats));
+	for_each_possible_cpu(cpu) {
+		src = (u_int64_t *)per_cpu_ptr(dmc->eio_stats, cpu);
+		for (i = 0; i < sizeof(*stats) / sizeof(u_int64_t); i++)
+			dst[i] += src[i];
+	}
+}
+
+u_int64_t eio_size_hist_sum(struct cache_c *dmc, int index)
+{
+	u_int64_t count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu_ptr(dmc->size_hist, cpu)->sh_count[index];
+
+	return count;
+}
+
+void eio_lat_hist_sum(struct cache_c *dmc, struct eio_lat_hist *hist)
+{
+	struct eio_lat_hist *src;
+	int class, i, cpu;
+
+	memset(hist, 0, sizeof(*hist));
+	for_each_possible_cpu(cpu) {
+		src = per_cpu_ptr(dmc->lat_hist, cpu);
+		for (class = 0; class < EIO_LAT_NR_CLASSES; class++)
+			for (i = 0; i < EIO_LAT_HIST_BUCKETS; i++)
+				hist->lh_count[class][i] +=
+					src->lh_count[class][i];
+	}
+}
+
+/*
+ * Reset the per-cpu stats and latency histograms.
+ * Updates racing with the reset may survive it.
+ */
+void eio_stats_zero(struct cache_c *dmc)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(dmc->eio_stats, cpu), 0,
+		       sizeof(struct eio_stats));
+		memset(per_cpu_ptr(dmc->lat_hist, cpu), 0,
+		       sizeof(struct eio_lat_hist));
+	}
 }
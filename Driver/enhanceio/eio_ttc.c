@@ -27,12 +27,39 @@
 
 #include <linux/fs.h>
 #include <linux/miscdevice.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/rcupdate.h>
 #include "eio.h"
 #include "eio_ttc.h"
 
-static struct rw_semaphore eio_ttc_lock[EIO_HASHTBL_SIZE];
+/*
+ * Every bio on a hashed source device takes its bucket lock for read,
+ * per-cpu rwsems keep that off a shared cache line. Writers are rare
+ * (cache create, delete, edit and shutdown) and pay an RCU grace period.
+ */
+static struct percpu_rw_semaphore eio_ttc_lock[EIO_HASHTBL_SIZE];
 static struct list_head eio_ttc_list[EIO_HASHTBL_SIZE];
 
+/*
+ * The caches of a bucket as a table of source ranges, sorted by disk and
+ * start sector, for the lookup in eio_make_request_fn(). It is rebuilt
+ * from eio_ttc_list under the bucket write lock and published with RCU.
+ */
+struct eio_ttc_range {
+	struct block_device *disk;      /* bd_contains of the source */
+	sector_t start;
+	sector_t end;
+	struct cache_c *dmc;
+};
+
+struct eio_ttc_table {
+	struct rcu_head rcu;
+	int nr;
+	struct eio_ttc_range range[0];
+};
+
+static struct eio_ttc_table __rcu *eio_ttc_table[EIO_HASHTBL_SIZE];
+
 int eio_reboot_notified;
 
 static MAKE_REQUEST_FN_TYPE eio_make_request_fn(struct request_queue *, struct bio *);
@@ -148,20 +175,122 @@ void eio_ttc_put_device(struct eio_bdev **d)
 	return;
 }
 
+static int eio_ttc_range_cmp(const void *a, const void *b)
+{
+	const struct eio_ttc_range *ra = a;
+	const struct eio_ttc_range *rb = b;
+
+	if (ra->disk != rb->disk)
+		return ((unsigned long)ra->disk < (unsigned long)rb->disk) ?
+		       -1 : 1;
+	if (ra->start != rb->start)
+		return (ra->start < rb->start) ? -1 : 1;
+	return 0;
+}
+
+/* Rebuild the range table of a bucket, with the bucket write locked */
+static int eio_ttc_table_update(int index, gfp_t gfp)
+{
+	struct eio_ttc_table *table = NULL;
+	struct eio_ttc_table *old;
+	struct eio_ttc_range *r;
+	struct cache_c *dmc;
+	int nr = 0;
+
+	list_for_each_entry(dmc, &eio_ttc_list[index], cachelist)
+		nr++;
+
+	if (nr) {
+		table = kmalloc(sizeof(*table) + nr * sizeof(table->range[0]),
+				gfp);
+		if (table == NULL)
+			return -ENOMEM;
+		table->nr = 0;
+		list_for_each_entry(dmc, &eio_ttc_list[index], cachelist) {
+			r = &table->range[table->nr++];
+			r->disk = dmc->disk_dev->bdev->bd_contains;
+			r->start = dmc->dev_start_sect;
+			r->end = dmc->dev_end_sect;
+			r->dmc = dmc;
+		}
+		sort(table->range, nr, sizeof(table->range[0]),
+		     eio_ttc_range_cmp, NULL);
+	}
+
+	old = rcu_dereference_protected(eio_ttc_table[index], 1);
+	rcu_assign_pointer(eio_ttc_table[index], table);
+	if (old)
+		kfree_rcu(old, rcu);
+	return 0;
+}
+
+/*
+ * Binary search of the cache holding sectors [start, end] of a disk.
+ * Sets *overlap if these straddle the boundary of a cached partition,
+ * and *origmfn if any partition of the disk is cached.
+ */
+static struct cache_c *eio_ttc_table_lookup(struct eio_ttc_table *table,
+					    struct block_device *disk,
+					    sector_t start, sector_t end,
+					    int *overlap,
+					    make_request_fn **origmfn)
+{
+	struct eio_ttc_range *r;
+	int lo = 0;
+	int hi = table->nr - 1;
+	int mid;
+	int i = -1;
+
+	/* The last range of the disk starting at or before start */
+	while (lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+		r = &table->range[mid];
+		if ((unsigned long)r->disk < (unsigned long)disk ||
+		    (r->disk == disk && r->start <= start)) {
+			i = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+
+	if (i >= 0 && table->range[i].disk == disk) {
+		r = &table->range[i];
+		*origmfn = r->dmc->origmfn;
+		if (r->dmc->dev_info == EIO_DEV_WHOLE_DISK)
+			return r->dmc;
+		if (start <= r->end) {
+			if (end > r->end)
+				*overlap = 1;
+			return r->dmc;
+		}
+	}
+
+	/* The I/O may still run into the next partition */
+	if (i + 1 < table->nr && table->range[i + 1].disk == disk) {
+		r = &table->range[i + 1];
+		*origmfn = r->dmc->origmfn;
+		if (r->start <= end) {
+			*overlap = 1;
+			return r->dmc;
+		}
+	}
+	return NULL;
+}
+
 struct cache_c *eio_cache_lookup(char *name)
 {
 	struct cache_c *dmc = NULL;
 	int i;
 
 	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
-		down_read(&eio_ttc_lock[i]);
+		percpu_down_read(&eio_ttc_lock[i]);
 		list_for_each_entry(dmc, &eio_ttc_list[i], cachelist) {
 			if (!strcmp(name, dmc->cache_name)) {
-				up_read(&eio_ttc_lock[i]);
+				percpu_up_read(&eio_ttc_lock[i]);
 				return dmc;
 			}
 		}
-		up_read(&eio_ttc_lock[i]);
+		percpu_up_read(&eio_ttc_lock[i]);
 	}
 	return NULL;
 }
@@ -199,7 +328,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 	origmfn = NULL;
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 
-	down_write(&eio_ttc_lock[index]);
+	percpu_down_write(&eio_ttc_lock[index]);
 	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
 		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
 			continue;
@@ -207,7 +336,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 		if ((wholedisk) || (dmc1->dev_info == EIO_DEV_WHOLE_DISK) ||
 		    (dmc1->disk_dev->bdev == bdev)) {
 			error = -EINVAL;
-			up_write(&eio_ttc_lock[index]);
+			percpu_up_write(&eio_ttc_lock[index]);
 			goto out;
 		}
 
@@ -233,6 +362,14 @@ int eio_ttc_activate(struct cache_c *dmc)
 	}
 
 	list_add_tail(&dmc->cachelist, &eio_ttc_list[index]);
+	if (eio_ttc_table_update(index, GFP_KERNEL)) {
+		list_del_init(&dmc->cachelist);
+		if (!origmfn)
+			rq->make_request_fn = dmc->origmfn;
+		percpu_up_write(&eio_ttc_lock[index]);
+		pr_err("cache_create: Cannot allocate the cache range table\n");
+		return -ENOMEM;
+	}
 
 	/*
 	 * Sleep for sometime, to allow previous I/Os to hit
@@ -242,7 +379,7 @@ int eio_ttc_activate(struct cache_c *dmc)
 	msleep(1);
 	eio_issue_empty_barrier_flush(dmc->disk_dev->bdev, NULL, EIO_HDD_DEVICE,
 	                              dmc->origmfn, REQ_OP_FLUSH, WRITE_FLUSH);
-	up_write(&eio_ttc_lock[index]);
+	percpu_up_write(&eio_ttc_lock[index]);
 
 out:
 	if (error == -EINVAL) {
@@ -297,7 +434,7 @@ deactivate:
 	found_partitions = 0;
 
 	/* check if barrier QUEUE is empty or not */
-	down_write(&eio_ttc_lock[index]);
+	percpu_down_write(&eio_ttc_lock[index]);
 
 	if (dmc->dev_info != EIO_DEV_WHOLE_DISK)
 		list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
@@ -324,7 +461,8 @@ deactivate:
 			rq->make_request_fn = dmc->origmfn;
 
 	list_del_init(&dmc->cachelist);
-	up_write(&eio_ttc_lock[index]);
+	eio_ttc_table_update(index, GFP_KERNEL | __GFP_NOFAIL);
+	percpu_up_write(&eio_ttc_lock[index]);
 
 	/* wait for nr_ios to drain-out */
 	while (atomic64_read(&dmc->nr_ios) != 0)
@@ -333,14 +471,32 @@ deactivate:
 	return ret;
 }
 
-void eio_ttc_init(void)
+int eio_ttc_init(void)
 {
 	int i;
 
 	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
-		init_rwsem(&eio_ttc_lock[i]);
+		if (percpu_init_rwsem(&eio_ttc_lock[i])) {
+			while (--i >= 0)
+				percpu_free_rwsem(&eio_ttc_lock[i]);
+			pr_err("ttc_init: Cannot allocate the cache list locks");
+			return -ENOMEM;
+		}
 		INIT_LIST_HEAD(&eio_ttc_list[i]);
 	}
+	return 0;
+}
+
+void eio_ttc_exit(void)
+{
+	int i;
+
+	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
+		kfree(rcu_dereference_protected(eio_ttc_table[i], 1));
+		RCU_INIT_POINTER(eio_ttc_table[i], NULL);
+		percpu_free_rwsem(&eio_ttc_lock[i]);
+	}
+	rcu_barrier();
 }
 
 /*
@@ -363,6 +519,41 @@ void eio_ttc_init(void)
  * 4. Race condition:
  */
 
+/*
+ * A discard overlapping cached partitions. Clean blocks of the overlapped
+ * part of each cache are dropped. Dirty ones stay, the discard contents
+ * being undefined anyway. Called with eio_ttc_lock held.
+ */
+static void eio_overlap_discard(int index, struct bio *bio)
+{
+	struct cache_c *dmc;
+	sector_t start = EIO_BIO_BI_SECTOR(bio);
+	sector_t end = start + eio_to_sector(EIO_BIO_BI_SIZE(bio));
+	sector_t s, e;
+
+	list_for_each_entry(dmc, &eio_ttc_list[index], cachelist) {
+		if (dmc->disk_dev->bdev->bd_contains !=
+		    bio->bi_bdev->bd_contains)
+			continue;
+
+		s = max_t(sector_t, start, dmc->dev_start_sect);
+		e = min_t(sector_t, end, dmc->dev_end_sect + 1);
+		if (s >= e)
+			continue;
+
+		this_cpu_inc(dmc->eio_stats->discards);
+		eio_inval_range(dmc, s - dmc->dev_start_sect,
+				(unsigned)to_bytes(e - s));
+	}
+}
+
+/* Pass a discard, with its sector relative to the cache, to the source device */
+void eio_ttc_disk_discard(struct cache_c *dmc, struct bio *bio)
+{
+	EIO_BIO_BI_SECTOR(bio) += dmc->dev_start_sect;
+	hdd_make_request(dmc->origmfn, bio);
+}
+
 static MAKE_REQUEST_FN_TYPE eio_make_request_fn(struct request_queue *q,
                                                 struct bio *bio)
 {
@@ -370,8 +561,10 @@ static MAKE_REQUEST_FN_TYPE eio_make_request_fn(struct request_queue *q,
 	int overlap;
 	int index;
 	make_request_fn *origmfn;
-	struct cache_c *dmc, *dmc1;
+	struct cache_c *dmc;
 	struct block_device *bdev;
+	struct eio_ttc_table *table;
+	sector_t start, end;
 
 	bdev = bio->bi_bdev;
 
@@ -381,58 +574,35 @@ re_lookup:
 	overlap = ret = 0;
 
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
+	start = EIO_BIO_BI_SECTOR(bio);
+	end = start;
+	if (EIO_BIO_BI_SIZE(bio))
+		end += eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1;
 
-	down_read(&eio_ttc_lock[index]);
-
-	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
-		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
-			continue;
-
-		if (dmc1->dev_info == EIO_DEV_WHOLE_DISK) {
-			dmc = dmc1;     /* found cached device */
-			break;
-		}
-
-		/* Handle partitions */
-		if (!origmfn)
-			origmfn = dmc1->origmfn;
-
-		/* I/O perfectly fit within cached partition */
-		if ((EIO_BIO_BI_SECTOR(bio) >= dmc1->dev_start_sect) &&
-		    ((EIO_BIO_BI_SECTOR(bio) +
-		      eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1) <=
-		     dmc1->dev_end_sect)) {
-			EIO_ASSERT(overlap == 0);
-			dmc = dmc1;     /* found cached partition */
-			break;
-		}
+	percpu_down_read(&eio_ttc_lock[index]);
 
-		/* Check if I/O is overlapping with cached partitions */
-		if (((EIO_BIO_BI_SECTOR(bio) >= dmc1->dev_start_sect) &&
-		     (EIO_BIO_BI_SECTOR(bio) <= dmc1->dev_end_sect)) ||
-		    ((EIO_BIO_BI_SECTOR(bio) + eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1 >=
-		      dmc1->dev_start_sect) &&
-		     (EIO_BIO_BI_SECTOR(bio) + eio_to_sector(EIO_BIO_BI_SIZE(bio)) - 1 <=
-		      dmc1->dev_end_sect))) {
-			overlap = 1;
-			pr_err
-				("Overlapping I/O detected on %s cache at sector: %llu, size: %u\n",
-				dmc1->cache_name, (uint64_t)EIO_BIO_BI_SECTOR(bio),
-				EIO_BIO_BI_SIZE(bio));
-			break;
-		}
-	}
+	/* The read lock keeps the caches found listed until released */
+	rcu_read_lock();
+	table = rcu_dereference(eio_ttc_table[index]);
+	if (table)
+		dmc = eio_ttc_table_lookup(table, bdev->bd_contains, start,
+					   end, &overlap, &origmfn);
+	rcu_read_unlock();
 
 	if (unlikely(overlap)) {
-		up_read(&eio_ttc_lock[index]);
-
+		pr_err
+			("Overlapping I/O detected on %s cache at sector: %llu, size: %u\n",
+			dmc->cache_name, (uint64_t)EIO_BIO_BI_SECTOR(bio),
+			EIO_BIO_BI_SIZE(bio));
+		dmc = NULL;
 		if (bio_op(bio) == REQ_OP_DISCARD) {
-			pr_err
-				("eio_mfn: Overlap I/O with Discard flag." \
-				" Discard flag is not supported.\n");
-			EIO_BIO_ENDIO(bio, -EOPNOTSUPP);
-		} else
+			/* Drop what the caches hold, pass the discard on below */
+			eio_overlap_discard(index, bio);
+			overlap = 0;
+		} else {
+			percpu_up_read(&eio_ttc_lock[index]);
 			ret = eio_overlap_split_bio(q, bio);
+		}
 	} else if (dmc) {       /* found cached partition or device */
 		/*
 		 * Start sector of cached partition may or may not be
@@ -451,7 +621,7 @@ re_lookup:
 	}
 
 	if (!overlap)
-		up_read(&eio_ttc_lock[index]);
+		percpu_up_read(&eio_ttc_lock[index]);
 
 	if (overlap || dmc)
 		MAKE_REQUEST_FN_RETURN_0;
@@ -485,11 +655,11 @@ uint64_t eio_get_cache_count(void)
 	int i;
 
 	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
-		down_read(&eio_ttc_lock[i]);
+		percpu_down_read(&eio_ttc_lock[i]);
 		list_for_each_entry(dmc, &eio_ttc_list[i], cachelist) {
 			cnt++;
 		}
-		up_read(&eio_ttc_lock[i]);
+		percpu_up_read(&eio_ttc_lock[i]);
 	}
 	return cnt;
 }
@@ -518,7 +688,7 @@ int eio_get_cache_list(unsigned long *arg)
 
 	i = 0;
 	for (j = 0; j < EIO_HASHTBL_SIZE; j++) {
-		down_read(&eio_ttc_lock[j]);
+		percpu_down_read(&eio_ttc_lock[j]);
 		list_for_each_entry(dmc, &eio_ttc_list[j], cachelist) {
 			eio_cache_rec_fill(dmc, &cache_recs[i]);
 			i++;
@@ -526,7 +696,7 @@ int eio_get_cache_list(unsigned long *arg)
 			if (i == reclist.ncaches)
 				break;
 		}
-		up_read(&eio_ttc_lock[j]);
+		percpu_up_read(&eio_ttc_lock[j]);
 
 		if (i == reclist.ncaches)
 			break;
@@ -550,15 +720,25 @@ out:
 
 static void eio_cache_rec_fill(struct cache_c *dmc, struct cache_rec_short *rec)
 {
+	u_int32_t m;
+
 	strncpy(rec->cr_name, dmc->cache_name, sizeof(rec->cr_name) - 1);
 	strncpy(rec->cr_src_devname, dmc->disk_devname,
 		sizeof(rec->cr_src_devname) - 1);
-	strncpy(rec->cr_ssd_devname, dmc->cache_devname,
+	strncpy(rec->cr_ssd_devname, dmc->ssds[0].ssd_devname,
 		sizeof(rec->cr_ssd_devname) - 1);
+	rec->cr_nr_ssds = dmc->nr_ssds;
+	for (m = 1; m < dmc->nr_ssds; m++)
+		strncpy(rec->cr_ssd_stripe[m - 1], dmc->ssds[m].ssd_devname,
+			sizeof(rec->cr_ssd_stripe[m - 1]) - 1);
 	rec->cr_src_dev_size = eio_get_device_size(dmc->disk_dev);
-	rec->cr_ssd_dev_size = eio_get_device_size(dmc->cache_dev);
+	/* The size of all the SSDs of the cache */
+	rec->cr_ssd_dev_size = 0;
+	for (m = 0; m < dmc->nr_ssds; m++)
+		rec->cr_ssd_dev_size +=
+			eio_get_device_size(dmc->ssds[m].ssd_dev);
 	rec->cr_src_sector_size = LOG_BLK_SIZE(dmc->disk_dev->bdev);
-	rec->cr_ssd_sector_size = LOG_BLK_SIZE(dmc->cache_dev->bdev);
+	rec->cr_ssd_sector_size = LOG_BLK_SIZE(dmc->ssds[0].ssd_dev->bdev);
 	rec->cr_flags = dmc->cache_flags;
 	rec->cr_policy = dmc->req_policy;
 	rec->cr_mode = dmc->mode;
@@ -579,18 +759,21 @@ int eio_do_preliminary_checks(struct cache_c *dmc)
 	int error;
 	int wholedisk;
 	int index;
+	u_int32_t m;
 
 	error = wholedisk = 0;
 	bdev = dmc->disk_dev->bdev;
-	ssd_bdev = dmc->cache_dev->bdev;
 
 	/*
 	 * Disallow cache creation if source and cache device
 	 * belong to same device.
 	 */
 
-	if (bdev->bd_contains == ssd_bdev->bd_contains)
-		return -EINVAL;
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		ssd_bdev = dmc->ssds[m].ssd_dev->bdev;
+		if (bdev->bd_contains == ssd_bdev->bd_contains)
+			return -EINVAL;
+	}
 
 	/*
 	 * Check if cache with same name exists.
@@ -604,7 +787,7 @@ int eio_do_preliminary_checks(struct cache_c *dmc)
 
 	index = EIO_HASH_BDEV(bdev->bd_contains->bd_dev);
 
-	down_read(&eio_ttc_lock[index]);
+	percpu_down_read(&eio_ttc_lock[index]);
 	list_for_each_entry(dmc1, &eio_ttc_list[index], cachelist) {
 		if (dmc1->disk_dev->bdev->bd_contains != bdev->bd_contains)
 			continue;
@@ -615,7 +798,7 @@ int eio_do_preliminary_checks(struct cache_c *dmc)
 			break;
 		}
 	}
-	up_read(&eio_ttc_lock[index]);
+	percpu_up_read(&eio_ttc_lock[index]);
 	return error;
 }
 
@@ -944,7 +1127,7 @@ static int eio_dispatch_io(struct cache_c *dmc, struct eio_io_region *where,
 			pr_debug("dispatch_io: processing unaligned I/O: sector %lu, count %lu",
 	                         (where->sector + where->count - remaining),
 			         remaining);
-			atomic64_inc(&dmc->eio_stats.unaligned_ios);
+			this_cpu_inc(dmc->eio_stats->unaligned_ios);
 			r = do_unaligned_io(un_bio, (where->sector +
 				            where->count - remaining),
 				            remaining, where->bdev, &vecs,
@@ -1153,23 +1336,183 @@ int eio_do_io(struct cache_c *dmc, struct eio_io_region *where, unsigned op,
 	return eio_async_io(dmc, where, op, op_flags, io_req);
 }
 
-void eio_process_zero_size_bio(struct cache_c *dmc, struct bio *origbio)
+/*
+ * Empty flushes are merged: the flushes arriving while device flushes are
+ * in flight wait for them and are all served by the next device flushes,
+ * one per device. They complete together once the HDD and SSD flushes of
+ * their round are done. Only write-back caches fail them on an SSD flush
+ * error, the HDD of the other modes already has all the data.
+ */
+struct eio_flush_round {
+	struct cache_c *fr_dmc;
+	struct bio_list fr_bios;
+	atomic_t fr_pending;    /* device flushes in flight, plus the issuer */
+	int fr_error;
+};
+
+static void eio_flush_round_put(struct eio_flush_round *fr, int error)
+{
+	struct cache_c *dmc = fr->fr_dmc;
+	unsigned long flags;
+	struct bio *bio;
+
+	if (error)
+		fr->fr_error = error;
+	if (!atomic_dec_and_test(&fr->fr_pending))
+		return;
+
+	spin_lock_irqsave(&dmc->flush_lock, flags);
+	if (bio_list_empty(&dmc->flush_bios))
+		dmc->flush_inprog = 0;
+	else
+		queue_work(system_unbound_wq, &dmc->flush_work);
+	spin_unlock_irqrestore(&dmc->flush_lock, flags);
+
+	/* The cache may go once the last of its I/Os is done */
+	while ((bio = bio_list_pop(&fr->fr_bios))) {
+		EIO_BIO_ENDIO(bio, fr->fr_error);
+		atomic64_dec(&dmc->nr_ios);
+	}
+	kfree(fr);
+}
+
+static int eio_flush_round_ssd_error(struct eio_flush_round *fr, int error)
+{
+	struct cache_c *dmc = fr->fr_dmc;
+
+	if (!error || (dmc->mode == CACHE_MODE_WB))
+		return error;
+	dmc->eio_errors.ssd_write_errors++;
+	return 0;
+}
+
+static void eio_flush_round_endio(struct bio *bio, int error)
+{
+	struct eio_flush_round *fr = bio->bi_private;
+
+	EIO_ENDIO_FN_START;
+
+	bio_put(bio);
+	eio_flush_round_put(fr, error);
+}
+
+static void eio_flush_round_ssd_endio(struct bio *bio, int error)
+{
+	struct eio_flush_round *fr = bio->bi_private;
+
+	EIO_ENDIO_FN_START;
+
+	bio_put(bio);
+	eio_flush_round_put(fr, eio_flush_round_ssd_error(fr, error));
+}
+
+/* origmfn is set for the HDD flush, NULL for the SSD ones */
+static void eio_flush_round_issue(struct eio_flush_round *fr,
+				  struct block_device *bdev,
+				  make_request_fn *origmfn)
+{
+	struct bio *bio;
+	int error;
+
+	bio = bio_alloc(GFP_NOIO, 0);
+	if (!bio) {
+		error = origmfn ? -ENOMEM :
+			eio_flush_round_ssd_error(fr, -ENOMEM);
+		if (error)
+			fr->fr_error = error;
+		return;
+	}
+	bio->bi_end_io = origmfn ? eio_flush_round_endio :
+			 eio_flush_round_ssd_endio;
+	bio->bi_private = fr;
+	bio->bi_bdev = bdev;
+	bio_set_op_attrs(bio, REQ_OP_FLUSH, WRITE_FLUSH);
+
+	atomic_inc(&fr->fr_pending);
+	if (origmfn)
+		hdd_make_request(origmfn, bio);
+	else
+		submit_bio(bio);
+}
+
+/*
+ * Flush the devices for the empty flushes queued so far. The SSDs of
+ * read-only and write-through caches hold no data not on the HDD, they
+ * are flushed only if written since their last flush.
+ */
+static void eio_flush_submit(struct cache_c *dmc)
+{
+	struct eio_flush_round *fr;
+	struct bio_list bios;
+	unsigned long flags;
+	struct bio *bio;
+	u_int32_t m;
+
+	fr = kzalloc(sizeof(*fr), GFP_NOIO);
+
+	bio_list_init(&bios);
+	spin_lock_irqsave(&dmc->flush_lock, flags);
+	bio_list_merge(fr ? &fr->fr_bios : &bios, &dmc->flush_bios);
+	bio_list_init(&dmc->flush_bios);
+	if (!fr)
+		dmc->flush_inprog = 0;
+	spin_unlock_irqrestore(&dmc->flush_lock, flags);
+
+	if (!fr) {
+		pr_err("flush: Unable to allocate flush round.\n");
+		while ((bio = bio_list_pop(&bios))) {
+			EIO_BIO_ENDIO(bio, -ENOMEM);
+			atomic64_dec(&dmc->nr_ios);
+		}
+		return;
+	}
+
+	fr->fr_dmc = dmc;
+	atomic_set(&fr->fr_pending, 1);
+	this_cpu_inc(dmc->eio_stats->flush_rounds);
+
+	for (m = 0; m < dmc->nr_ssds; m++) {
+		if (READ_ONCE(dmc->ssds[m].ssd_offline))
+			continue;
+		if (dmc->mode != CACHE_MODE_WB &&
+		    !xchg(&dmc->ssds[m].ssd_written, 0)) {
+			this_cpu_inc(dmc->eio_stats->ssd_flushes_skipped);
+			continue;
+		}
+		eio_flush_round_issue(fr, dmc->ssds[m].ssd_dev->bdev, NULL);
+	}
+	eio_flush_round_issue(fr, dmc->disk_dev->bdev, dmc->origmfn);
+
+	eio_flush_round_put(fr, 0);
+}
+
+void eio_flush_work(struct work_struct *work)
 {
-	unsigned op_flags = 0;
-	unsigned op = 0;
+	struct cache_c *dmc = container_of(work, struct cache_c, flush_work);
+
+	eio_flush_submit(dmc);
+}
 
-	/* Extract bio flags from original bio */
-	op_flags = bio_flags(origbio);
-	op = bio_op(origbio);
+void eio_process_zero_size_bio(struct cache_c *dmc, struct bio *origbio)
+{
+	unsigned long flags;
+	int submit;
 
 	EIO_ASSERT(EIO_BIO_BI_SIZE(origbio) == 0);
-	EIO_ASSERT(op != REQ_OP_READ);
+	EIO_ASSERT(bio_op(origbio) != REQ_OP_READ);
 
-	eio_issue_empty_barrier_flush(dmc->cache_dev->bdev, NULL,
-				      EIO_SSD_DEVICE, NULL, op, op_flags);
-	eio_issue_empty_barrier_flush(dmc->disk_dev->bdev, origbio,
-				      EIO_HDD_DEVICE, dmc->origmfn, op,
-				      op_flags);
+	this_cpu_inc(dmc->eio_stats->flushes);
+
+	/* Deactivation waits for queued flushes as for other I/Os */
+	atomic64_inc(&dmc->nr_ios);
+	spin_lock_irqsave(&dmc->flush_lock, flags);
+	bio_list_add(&dmc->flush_bios, origbio);
+	submit = !dmc->flush_inprog;
+	dmc->flush_inprog = 1;
+	spin_unlock_irqrestore(&dmc->flush_lock, flags);
+
+	if (submit)
+		eio_flush_submit(dmc);
 }
 
 static void eio_bio_end_empty_barrier(struct bio *bio, int error)
@@ -1222,7 +1565,7 @@ static int eio_finish_nrdirty(struct cache_c *dmc)
 	retry_count = FINISH_NRDIRTY_RETRY_COUNT;
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
-	down_write(&eio_ttc_lock[index]);
+	percpu_down_write(&eio_ttc_lock[index]);
 
 	/* Wait for the in-flight I/Os to drain out */
 	while (atomic64_read(&dmc->nr_ios) != 0) {
@@ -1232,7 +1575,7 @@ static int eio_finish_nrdirty(struct cache_c *dmc)
 	EIO_ASSERT(!(dmc->sysctl_active.do_clean & EIO_CLEAN_START));
 
 	dmc->sysctl_active.do_clean |= EIO_CLEAN_KEEP | EIO_CLEAN_START;
-	up_write(&eio_ttc_lock[index]);
+	percpu_up_write(&eio_ttc_lock[index]);
 
 	/*
 	 * In the process of cleaning CACHE if CACHE turns to FAILED state,
@@ -1280,6 +1623,11 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 
 	EIO_ASSERT((mode != 0) || (policy != 0));
 
+	if (mode > CACHE_MODE_LAST) {
+		pr_err("cache_edit: invalid cache mode %u", mode);
+		return -EINVAL;
+	}
+
 	dmc = eio_cache_lookup(cache_name);
 	if (NULL == dmc) {
 		pr_err("cache_edit: cache %s do not exist", cache_name);
@@ -1354,7 +1702,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	}
 
 	index = EIO_HASH_BDEV(dmc->disk_dev->bdev->bd_contains->bd_dev);
-	down_write(&eio_ttc_lock[index]);
+	percpu_down_write(&eio_ttc_lock[index]);
 
 	/* Wait for the in-flight I/Os to drain out */
 	while (atomic64_read(&dmc->nr_ios) != 0) {
@@ -1370,7 +1718,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	if ((policy != 0) && (policy != dmc->req_policy)) {
 		error = eio_policy_switch(dmc, policy);
 		if (error) {
-			up_write(&eio_ttc_lock[index]);
+			percpu_up_write(&eio_ttc_lock[index]);
 			goto out;
 		}
 	}
@@ -1379,7 +1727,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	if ((mode != 0) && (mode != dmc->mode)) {
 		error = eio_mode_switch(dmc, mode);
 		if (error) {
-			up_write(&eio_ttc_lock[index]);
+			percpu_up_write(&eio_ttc_lock[index]);
 			goto out;
 		}
 	}
@@ -1397,7 +1745,7 @@ int eio_cache_edit(char *cache_name, u_int32_t mode, u_int32_t policy)
 	eio_procfs_dtr(dmc);
 	eio_procfs_ctr(dmc);
 
-	up_write(&eio_ttc_lock[index]);
+	percpu_up_write(&eio_ttc_lock[index]);
 
 out:
 	dmc->sysctl_active.time_based_clean_interval = old_time_thresh;
@@ -1459,11 +1807,8 @@ static int eio_mode_switch(struct cache_c *dmc, u_int32_t mode)
 	} else if (dmc->mode == CACHE_MODE_WB) {
 		eio_free_wb_resources(dmc);
 		dmc->mode = mode;
-	} else {                /* (RO -> WT) or (WT -> RO) */
-		EIO_ASSERT(((dmc->mode == CACHE_MODE_RO) &&
-			    (mode == CACHE_MODE_WT)) ||
-			   ((dmc->mode == CACHE_MODE_WT) &&
-			    (mode == CACHE_MODE_RO)));
+	} else {                /* between RO, WT and UH */
+		EIO_ASSERT(mode != CACHE_MODE_WB);
 		dmc->mode = mode;
 	}
 
@@ -1762,7 +2107,7 @@ int eio_reboot_handling(void)
 	eio_reboot_notified = EIO_REBOOT_HANDLING_INPROG;
 
 	for (i = 0; i < EIO_HASHTBL_SIZE; i++) {
-		down_write(&eio_ttc_lock[i]);
+		percpu_down_write(&eio_ttc_lock[i]);
 		list_for_each_entry(dmc, &eio_ttc_list[i], cachelist) {
 
 			kfree(tempdmc);
@@ -1803,9 +2148,9 @@ int eio_reboot_handling(void)
 			 */
 
 			while (dmc->cache_flags & CACHE_FLAGS_MOD_INPROG) {
-				up_write(&eio_ttc_lock[i]);
+				percpu_up_write(&eio_ttc_lock[i]);
 				schedule_timeout(msecs_to_jiffies(1));
-				down_write(&eio_ttc_lock[i]);
+				percpu_down_write(&eio_ttc_lock[i]);
 			}
 			if (dmc->cache_flags & CACHE_FLAGS_DELETED) {
 				/*
@@ -1824,7 +2169,7 @@ int eio_reboot_handling(void)
 			dmc->cache_rdonly = 1;
 			pr_info("Cache \"%s\" marked read only\n",
 				dmc->cache_name);
-			up_write(&eio_ttc_lock[i]);
+			percpu_up_write(&eio_ttc_lock[i]);
 
 			if (dmc->cold_boot && atomic64_read(&dmc->nr_dirty) &&
 			    !eio_force_warm_boot) {
@@ -1846,11 +2191,11 @@ int eio_reboot_handling(void)
 			spin_unlock_irqrestore(&dmc->cache_spin_lock,
 					       dmc->cache_spin_lock_flags);
 
-			down_write(&eio_ttc_lock[i]);
+			percpu_down_write(&eio_ttc_lock[i]);
 		}
 		kfree(tempdmc);
 		tempdmc = NULL;
-		up_write(&eio_ttc_lock[i]);
+		percpu_up_write(&eio_ttc_lock[i]);
 	}
 
 	eio_reboot_notified = EIO_REBOOT_HANDLING_DONE;
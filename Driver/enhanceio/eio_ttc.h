@@ -109,7 +109,9 @@ extern void eio_ttc_put_device(struct eio_bdev **);
 extern struct cache_c *eio_cache_lookup(char *);
 extern int eio_ttc_activate(struct cache_c *);
 extern int eio_ttc_deactivate(struct cache_c *, int);
-extern void eio_ttc_init(void);
+extern int eio_ttc_init(void);
+extern void eio_ttc_exit(void);
+extern void eio_ttc_disk_discard(struct cache_c *, struct bio *);
 
 extern int eio_cache_create(struct cache_rec_short *);
 extern int eio_cache_delete(char *, int);
@@ -127,6 +129,8 @@ extern void eio_free_wb_resources(struct cache_c *);
 extern int eio_cache_edit(char *, u_int32_t, u_int32_t);
 
 extern void eio_stop_async_tasks(struct cache_c *dmc);
+extern int eio_cache_prefetch(struct cache_prefetch *);
+extern void eio_prefetch_stop(struct cache_c *dmc);
 extern int eio_start_clean_thread(struct cache_c *dmc);
 
 extern int eio_policy_init(struct cache_c *);
@@ -139,6 +143,7 @@ extern struct bio_vec *eio_alloc_pages(u_int32_t max_pages, int *page_count);
 extern int eio_md_store(struct cache_c *);
 extern int eio_reboot_handling(void);
 extern void eio_process_zero_size_bio(struct cache_c *dmc, struct bio *origbio);
+extern void eio_flush_work(struct work_struct *work);
 extern long eio_ioctl(struct file *filp, unsigned cmd, unsigned long arg);
 extern long eio_compact_ioctl(struct file *filp, unsigned cmd,
 			      unsigned long arg);
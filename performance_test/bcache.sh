@@ -86,13 +86,13 @@ bcache_create
 
 echo "running fio on: $filename"
 # Warm up the cache
-echo "${hit} % Hit_Warm_Up_${fio_blocksize}"
-fio --direct=1 --size=${hit}% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=rw --rwmixread=100 --rwmixwrite=0 --iodepth=${iodepth} --filename=${filename} --name=${hit}_Hit_${fio_blocksize}_WarmUp --output=${output_path}/${hit}_Hit_${fio_blocksize}_WarmUp.txt
+echo "${hits} % Hit_Warm_Up_${fio_blocksize}"
+fio --direct=1 --size=${hits}% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=rw --rwmixread=100 --rwmixwrite=0 --iodepth=${iodepth} --filename=${filename} --name=${hits}_Hit_${fio_blocksize}_WarmUp --output=${output_path}/${hits}_Hit_${fio_blocksize}_WarmUp.txt
 
 # Run the test
-echo "$hit % Hit_${fio_blocksize} ${iodev}"
+echo "$hits % Hit_${fio_blocksize} ${iodev}"
 #--runtime=${runtime}
-fio --direct=1 --size=100% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --rwmixwrite=${rwrite} --iodepth=${iodepth} --numjob=${numjob} --group_reporting --filename=${filename} --name=${hit}_Hit_${fio_blocksize} --random_distribution=zipf:1.2 --output=${output_path}/${hit}_Hit_${fio_blocksize}.txt
+fio --direct=1 --size=100% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --rwmixwrite=${rwrite} --iodepth=${iodepth} --numjob=${numjob} --group_reporting --filename=${filename} --name=${hits}_Hit_${fio_blocksize} --random_distribution=zipf:1.2 --output=${output_path}/${hits}_Hit_${fio_blocksize}.txt
 
 # Delete the cache
 bcache_delete 
@@ -0,0 +1,236 @@
+#!/bin/bash
+#
+# Runs a matrix of fio workloads against EnhanceIO, bcache or dm-cache and
+# summarizes all the runs in summary.json and summary.csv of the output
+# path, with bench_summary.py.
+#
+# Every variable below can be set from the environment. The *_list
+# variables are space separated and every combination of them is run,
+# e.g.
+#
+#	backends="eio bcache" mode_list="wt wb" rwmixread_list="100 70" \
+#	    source_device=/dev/sdb1 cache_device=/dev/sdc1 ./bench.sh
+#
+# Combinations a backend doesn't support are skipped. dm-cache runs its
+# own dm_policy, once for the first policy of policy_list.
+#
+# Each run keeps the fio JSON output and the cache stats taken before and
+# after the measured run in its own directory.
+
+# Cache Variables
+source_device=${source_device:-"/dev/sdb1"}
+cache_device=${cache_device:-"/dev/sdc1"}
+cache_block_size=${cache_block_size:-"4096"}
+cache_name=${cache_name:-"cache1"}
+dm_metadata_device=${dm_metadata_device:-"/dev/sdc2"}
+dm_block_sectors=${dm_block_sectors:-"512"}
+dm_policy=${dm_policy:-"default"}
+
+# Matrix
+backends=${backends:-"eio"}
+mode_list=${mode_list:-"wt"}
+policy_list=${policy_list:-"lru"}
+blocksize_list=${blocksize_list:-"4K"}
+rwmixread_list=${rwmixread_list:-"90"}
+iodepth_list=${iodepth_list:-"8"}
+zipf_list=${zipf_list:-"1.2"}
+
+# FIO Variables
+file_size=${file_size:-"10G"}
+numjob=${numjob:-"4"}
+runtime=${runtime:-"300"}
+hits=${hits:-"90"}		# percentage of file_size read during warm up
+
+output_path=${output_path:-"/root/eio_perf/bench/`date +%Y%m%d_%H%M%S`"}
+
+# DON'T SET
+filename=""
+bcache_dev=""
+
+bench_dir=`cd \`dirname $0\` && pwd`
+
+eio_create()
+{
+    # mode policy
+    case $1 in
+        wb|wt|ro|wa|uh) ;;
+        *) return 1 ;;
+    esac
+    case $2 in
+        rand|fifo|lru|2q) ;;
+        *) return 1 ;;
+    esac
+    eio_cli create -d ${source_device} -s ${cache_device} -p $2 -m $1 \
+        -b ${cache_block_size} -c ${cache_name} || return 1
+    filename=${source_device}
+    return 0
+}
+
+eio_delete()
+{
+    eio_cli delete -c ${cache_name}
+}
+
+eio_snapshot()
+{
+    # dir
+    local f
+
+    for f in stats latency_hist io_hist heat_map; do
+        cat /proc/enhanceio/${cache_name}/$f > $1/$f 2>/dev/null
+    done
+}
+
+bcache_create()
+{
+    local bcache_mode
+    local uuid
+    local cdev
+
+    case $1 in
+        wt) bcache_mode="writethrough" ;;
+        wb) bcache_mode="writeback" ;;
+        wa|ro) bcache_mode="writearound" ;;
+        *) return 1 ;;
+    esac
+    case $2 in
+        rand) bcache_policy="random" ;;
+        fifo|lru) bcache_policy=$2 ;;
+        *) return 1 ;;
+    esac
+    make-bcache -B ${source_device} || return 1
+    make-bcache -C ${cache_device} --block ${cache_block_size} || return 1
+    echo ${source_device} > /sys/fs/bcache/register
+    echo ${cache_device} > /sys/fs/bcache/register
+    uuid=`bcache-super-show -f ${cache_device} | grep cset.uuid | awk '{ print $2 }'`
+    bcache_dev=`ls /sys/class/block/\`basename ${source_device}\`/holders | grep bcache | head -1`
+    echo $uuid > /sys/block/${bcache_dev}/bcache/attach
+    echo 1 > /sys/class/block/`basename ${source_device}`/bcache/running
+    cdev=/sys/class/block/`basename ${cache_device}`/bcache
+    echo ${bcache_policy} > $cdev/cache_replacement_policy
+    echo ${bcache_mode} > /sys/block/${bcache_dev}/bcache/cache_mode
+    echo 0 > /sys/block/${bcache_dev}/bcache/sequential_cutoff
+    filename="/dev/${bcache_dev}"
+    return 0
+}
+
+bcache_delete()
+{
+    local uuid
+
+    uuid=`bcache-super-show -f ${cache_device} | grep cset.uuid | awk '{ print $2 }'`
+    echo 1 > /sys/fs/bcache/$uuid/unregister
+    echo 1 > /sys/class/block/`basename ${source_device}`/bcache/stop
+    echo 1 > /sys/fs/bcache/$uuid/stop
+    sleep 10
+    wipefs -a ${source_device} ${cache_device} > /dev/null
+}
+
+bcache_snapshot()
+{
+    # dir
+    local f
+
+    for f in cache_hits cache_misses cache_bypass_hits cache_bypass_misses; do
+        echo "$f `cat /sys/block/${bcache_dev}/bcache/stats_total/$f`"
+    done > $1/stats
+}
+
+dmcache_create()
+{
+    local dm_mode
+
+    case $1 in
+        wt) dm_mode="writethrough" ;;
+        wb) dm_mode="writeback" ;;
+        *) return 1 ;;
+    esac
+    # dm-cache has its own policies, run them once
+    [ "$2" = "`echo ${policy_list} | awk '{ print $1 }'`" ] || return 1
+    dmsetup create ${cache_name} --table "0 `blockdev --getsz ${source_device}` \
+        cache ${dm_metadata_device} ${cache_device} ${source_device} \
+        ${dm_block_sectors} 1 ${dm_mode} ${dm_policy} 0" || return 1
+    filename="/dev/mapper/${cache_name}"
+    return 0
+}
+
+dmcache_delete()
+{
+    dmsetup remove ${cache_name}
+    # Stale metadata would give hits during the warm up of the next run
+    dd if=/dev/zero of=${dm_metadata_device} oflag=direct bs=1M count=1
+    dd if=/dev/zero of=${cache_device} oflag=direct bs=1M count=1
+}
+
+dmcache_snapshot()
+{
+    # dir
+    dmsetup status ${cache_name} | awk '{ print "read_hits " $8; \
+        print "read_misses " $9; print "write_hits " $10; \
+        print "write_misses " $11 }' > $1/stats
+}
+
+run_one()
+{
+    # backend mode policy blocksize rwmixread iodepth zipf
+    local run=$1_$2_$3_$4_r$5_qd$6_z$7
+    local run_dir=${output_path}/${run}
+
+    if ! $1_create $2 $3; then
+        echo "Skipping ${run}"
+        return 0
+    fi
+
+    mkdir -p ${run_dir}/before ${run_dir}/after
+    cat > ${run_dir}/params <<EOF
+backend=$1
+mode=$2
+policy=$3
+blocksize=$4
+rwmixread=$5
+iodepth=$6
+zipf=$7
+numjob=${numjob}
+file_size=${file_size}
+runtime=${runtime}
+hits=${hits}
+EOF
+
+    echo "${hits} % Hit_Warm_Up_$4 ${run}"
+    fio --direct=1 --size=${hits}% --filesize=${file_size} --blocksize=$4 \
+        --ioengine=libaio --rw=read --iodepth=$6 --filename=${filename} \
+        --name=${run}_WarmUp --output=${run_dir}/warmup.txt
+
+    $1_snapshot ${run_dir}/before
+    echo "$5 % read ${run} on ${filename}"
+    fio --direct=1 --size=100% --filesize=${file_size} --blocksize=$4 \
+        --ioengine=libaio --rw=randrw --rwmixread=$5 --iodepth=$6 \
+        --numjob=${numjob} --group_reporting --filename=${filename} \
+        --time_based --runtime=${runtime} --random_distribution=zipf:$7 \
+        --name=${run} --output-format=json --output=${run_dir}/fio.json
+    $1_snapshot ${run_dir}/after
+
+    $1_delete
+}
+
+mkdir -p ${output_path}
+echo "Output path '${output_path}' is created"
+
+for backend in ${backends}; do
+for mode in ${mode_list}; do
+for policy in ${policy_list}; do
+for blocksize in ${blocksize_list}; do
+for rwmixread in ${rwmixread_list}; do
+for iodepth in ${iodepth_list}; do
+for zipf in ${zipf_list}; do
+    run_one ${backend} ${mode} ${policy} ${blocksize} ${rwmixread} \
+        ${iodepth} ${zipf}
+done
+done
+done
+done
+done
+done
+done
+
+python ${bench_dir}/bench_summary.py ${output_path}
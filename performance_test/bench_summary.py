@@ -0,0 +1,191 @@
+#!/usr/bin/python
+#
+# Summarizes the runs of bench.sh: reads the params, fio.json and the
+# stats snapshots of every run directory under the output path, and
+# writes summary.json and summary.csv there.
+#
+# The hit rate and the cache latency percentile are of the measured run
+# only, from the difference of the after and before snapshots.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; under version 2 of the License.
+
+import csv
+import json
+import os
+import sys
+
+PARAMS = ["backend", "mode", "policy", "blocksize", "rwmixread", "iodepth",
+	  "zipf", "numjob", "file_size", "runtime", "hits"]
+RESULTS = ["read_iops", "write_iops", "iops", "read_p99_us", "write_p99_us",
+	   "hit_pct", "read_hit_pct", "cache_p99_us"]
+
+
+def read_params(run_dir):
+	params = {}
+	for line in open(os.path.join(run_dir, "params")):
+		if "=" in line:
+			key, value = line.strip().split("=", 1)
+			params[key] = value
+	return params
+
+
+def read_stats(path):
+	# "name value" lines, as in /proc/enhanceio/<cache>/stats
+	stats = {}
+	if not os.path.exists(path):
+		return stats
+	for line in open(path):
+		fields = line.split()
+		if len(fields) == 2:
+			try:
+				stats[fields[0]] = int(fields[1])
+			except ValueError:
+				pass
+	return stats
+
+
+def read_lat_hist(path):
+	# Buckets of /proc/enhanceio/<cache>/latency_hist summed over the
+	# I/O classes, keyed by their label: "<N" up to N usecs, and the
+	# last one ">=N"
+	hist = {}
+	if not os.path.exists(path):
+		return hist
+	for line in open(path):
+		fields = line.split()
+		if not fields or fields[0][0] not in "<>":
+			continue
+		hist[fields[0]] = sum(map(int, fields[1:]))
+	return hist
+
+
+def lat_bucket_order(label):
+	# ">=N" comes after "<N"
+	return (label.startswith(">="), int(label.lstrip("<>=")))
+
+
+def lat_bucket_value(label):
+	# Upper bound in usecs, the overflow bucket stays as ">=N"
+	if label.startswith(">="):
+		return label
+	return int(label.lstrip("<"))
+
+
+def percent(part, total):
+	if total <= 0:
+		return None
+	return round(100.0 * part / total, 2)
+
+
+def hit_pcts(before, after):
+	delta = dict((k, after[k] - before.get(k, 0)) for k in after)
+	if "read_hits" in delta and "reads" in delta:
+		# EnhanceIO, in sectors
+		return (percent(delta["read_hits"] + delta.get("write_hits", 0),
+				delta["reads"] + delta.get("writes", 0)),
+			percent(delta["read_hits"], delta["reads"]))
+	if "cache_hits" in delta:
+		# bcache, in requests
+		return (percent(delta["cache_hits"],
+				delta["cache_hits"] + delta["cache_misses"]), None)
+	if "read_misses" in delta:
+		# dm-cache, in requests
+		hits = delta["read_hits"] + delta["write_hits"]
+		return (percent(hits, hits + delta["read_misses"] +
+				delta["write_misses"]),
+			percent(delta["read_hits"],
+				delta["read_hits"] + delta["read_misses"]))
+	return (None, None)
+
+
+def hist_p99(before, after):
+	buckets = sorted(after, key=lat_bucket_order)
+	counts = [after[b] - before.get(b, 0) for b in buckets]
+	total = sum(counts)
+	if total == 0:
+		return None
+	count = 0
+	for bucket, n in zip(buckets, counts):
+		count += n
+		if count * 100 >= total * 99:
+			return lat_bucket_value(bucket)
+	return lat_bucket_value(buckets[-1])
+
+
+def fio_p99_us(io):
+	# fio 3.x reports clat_ns, older releases clat in usecs
+	if "clat_ns" in io:
+		pct = io["clat_ns"].get("percentile", {})
+		scale = 1000.0
+	else:
+		pct = io.get("clat", {}).get("percentile", {})
+		scale = 1.0
+	for key in pct:
+		if float(key) == 99.0:
+			return round(pct[key] / scale, 1)
+	return None
+
+
+def summarize(run_dir):
+	row = read_params(run_dir)
+	try:
+		job = json.load(open(os.path.join(run_dir, "fio.json")))["jobs"][0]
+	except (IOError, ValueError, KeyError, IndexError):
+		sys.stderr.write("No fio results in %s\n" % run_dir)
+		return None
+
+	row["read_iops"] = round(job["read"]["iops"], 1)
+	row["write_iops"] = round(job["write"]["iops"], 1)
+	row["iops"] = round(row["read_iops"] + row["write_iops"], 1)
+	row["read_p99_us"] = fio_p99_us(job["read"])
+	row["write_p99_us"] = fio_p99_us(job["write"])
+
+	before = os.path.join(run_dir, "before")
+	after = os.path.join(run_dir, "after")
+	row["hit_pct"], row["read_hit_pct"] = \
+		hit_pcts(read_stats(os.path.join(before, "stats")),
+			 read_stats(os.path.join(after, "stats")))
+	row["cache_p99_us"] = \
+		hist_p99(read_lat_hist(os.path.join(before, "latency_hist")),
+			 read_lat_hist(os.path.join(after, "latency_hist")))
+	return row
+
+
+def main():
+	if len(sys.argv) != 2:
+		sys.stderr.write("usage: %s <bench output path>\n" % sys.argv[0])
+		return 1
+
+	path = sys.argv[1]
+	rows = []
+	for name in sorted(os.listdir(path)):
+		run_dir = os.path.join(path, name)
+		if not os.path.exists(os.path.join(run_dir, "params")):
+			continue
+		row = summarize(run_dir)
+		if row is not None:
+			row["run"] = name
+			rows.append(row)
+
+	out = open(os.path.join(path, "summary.json"), "w")
+	json.dump(rows, out, indent=1, sort_keys=True)
+	out.write("\n")
+	out.close()
+
+	out = open(os.path.join(path, "summary.csv"), "w")
+	writer = csv.DictWriter(out, ["run"] + PARAMS + RESULTS,
+				extrasaction="ignore")
+	writer.writerow(dict((f, f) for f in writer.fieldnames))
+	for row in rows:
+		writer.writerow(row)
+	out.close()
+
+	print("%d runs summarized in %s" % (len(rows),
+					    os.path.join(path, "summary.csv")))
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
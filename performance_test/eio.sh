@@ -30,12 +30,12 @@ echo "Creating a cache"
 eio_cli create -d ${source_device} -s ${cache_device} -p ${cache_policy} -m ${cache_mode} -b ${cache_block_size} -c ${cache_name}
 
 # Warm up the cache
-echo "${hit} % Hit_Warm_Up_${fio_blocksize}"
-fio --direct=1 --size=${hit}% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=rw --rwmixread=100 --rwmixwrite=0 --iodepth=${iodepth} --filename=${source_device} --name=${hit}_Hit_${fio_blocksize}_WarmUp --output=${output_path}/${hit}_Hit_${fio_blocksize}_WarmUp.txt
+echo "${hits} % Hit_Warm_Up_${fio_blocksize}"
+fio --direct=1 --size=${hits}% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=rw --rwmixread=100 --rwmixwrite=0 --iodepth=${iodepth} --filename=${source_device} --name=${hits}_Hit_${fio_blocksize}_WarmUp --output=${output_path}/${hits}_Hit_${fio_blocksize}_WarmUp.txt
 
 # Run the test
-echo "$hit % Hit_${fio_blocksize} ${source_device}"
-fio --direct=1 --size=100% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --rwmixwrite=${rwrite} --iodepth=${iodepth} --numjob=${numjob} --group_reporting --filename=${source_device} --name=${hit}_Hit_${fio_blocksize} --random_distribution=zipf:1.2 --output=${output_path}/${hit}_Hit_${fio_blocksize}.txt
+echo "$hits % Hit_${fio_blocksize} ${source_device}"
+fio --direct=1 --size=100% --filesize=${file_size} --blocksize=${fio_blocksize} --ioengine=libaio --rw=randrw --rwmixread=${rread} --rwmixwrite=${rwrite} --iodepth=${iodepth} --numjob=${numjob} --group_reporting --filename=${source_device} --name=${hits}_Hit_${fio_blocksize} --random_distribution=zipf:1.2 --output=${output_path}/${hits}_Hit_${fio_blocksize}.txt
 
 
 # Delete the cache